@@ -7,7 +7,7 @@
 // fprintf
 #include <stdio.h>
 
-// getenv, calloc, reallocarray, qsort, bsearch, exit
+// getenv, calloc, reallocarray, qsort, exit
 #include <stdlib.h>
 
 // strdupa, strlen, strrchr, strcmp, memrchr, strcasestr
@@ -22,6 +22,9 @@
 // write buffering functions
 #include "sbuffer.h"
 
+// stype_guess
+#include "stype.h"
+
 // Starting size of filename string list
 #define NUM_FILENAMES 256
 
@@ -35,46 +38,6 @@ static int compare_strings(const void* pa, const void* pb)
 	return strcmp(*((const char**)pa), *((const char**)pb));
 }
 
-// Mapping of extension to selector type
-// Not comprehensive but at least an assortment of common and period-accurate stuff
-// This must be pre-sorted according to strcmp rules for bsearch
-// Default for a non-executable, non-directory file is 9 so anything of that type should not be here
-struct ext_entry_t
-{
-	const char* ext;
-	const char type;
-};
-
-static const struct ext_entry_t ext_table[] =
-{
-	{"bmp", 'I'},
-	{"c", '0'},
-	{"cpp", '0'},
-	{"gif", 'g'},
-	{"h", '0'},
-	{"htm", 'h'},
-	{"html", 'h'},
-	{"jpeg", 'I'},
-	{"jpg", 'I'},
-	{"mp3", 's'},
-	{"ogg", 's'},
-	{"pcx", 'I'},
-	{"png", 'I'},
-	{"tif", 'I'},
-	{"tiff", 'I'},
-	{"txt", '0'},
-	{"wav", 's'}
-};
-
-// Comparison function for the file extension list
-static int compare_ext_entry(const void* pa, const void* pb)
-{
-	const struct ext_entry_t* entry1 = pa;
-	const struct ext_entry_t* entry2 = pb;
-	
-	return strcmp(entry1->ext, entry2->ext);
-}
-
 // Main function
 int main()
 {
@@ -226,55 +189,11 @@ int main()
 			exit(EXIT_FAILURE);
 		}
 		
-		char type;
+		// Work out its menu type, skipping anything that couldn't be served anyway
+		char type = stype_guess(filename, statbuf.st_mode);
 		
-		// Make sure it's a regular file, or a directory
-		if (S_ISREG(statbuf.st_mode))
-		{
-			// Determine if it's executable or not
-			if (statbuf.st_mode & S_IXOTH)
-			{
-				// Treat executables as a query menu
-				// This is probably as good a guess as any, but if it's meant to be downloaded it shouldn't be +x
-				type = '7';
-			}
-			else
-			{
-				// Default behavior for regular non-executable files with no or an unknown extension is to download as a binary file
-				type = '9';
-				
-				// If the file has an extension, inspect it for further context
-				char* extension = strrchr(filename, '.');
-				
-				if (extension != NULL)
-				{
-					// Advance past the period
-					extension++;
-					
-					// Search the table for a match
-					const struct ext_entry_t key =
-					{
-						.ext = extension
-					};
-					
-					const struct ext_entry_t* found = bsearch(&key, ext_table, sizeof(ext_table)/sizeof(struct ext_entry_t), sizeof(struct ext_entry_t), compare_ext_entry);
-					
-					if (found != NULL)
-					{
-						type = found->type;
-					}
-				}
-			}
-		}
-		else if (S_ISDIR(statbuf.st_mode))
-		{
-			// Treat directories as being submenus
-			// You did put a gophermap in it, right?
-			type = '1';
-		}
-		else
+		if (type == 0)
 		{
-			// Skip other types of files
 			continue;
 		}
 		
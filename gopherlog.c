@@ -0,0 +1,618 @@
+// For memmem, reallocarray
+#define _GNU_SOURCE
+
+// Argument handling
+#include <argp.h>
+
+// Internet shit
+#include <arpa/inet.h>
+
+// open
+#include <fcntl.h>
+
+// bool
+#include <stdbool.h>
+
+// sscanf, printf, fprintf, putchar
+#include <stdio.h>
+
+// reallocarray, calloc, qsort, free, exit
+#include <stdlib.h>
+
+// memcpy, memmem, memchr, strlen
+#include <string.h>
+
+// mmap, munmap
+#include <sys/mman.h>
+
+// AF_UNIX, struct ucred
+#include <sys/socket.h>
+
+// fstat
+#include <sys/stat.h>
+
+// gmtime_r, strftime
+#include <time.h>
+
+// close
+#include <unistd.h>
+
+// access log format
+#include "slog.h"
+
+// Starting size of the record list
+#define NUM_RECORDS 4096
+
+// *********************************************************************
+// argp stuff for option parsing
+// *********************************************************************
+
+// argp globals (these must have these names)
+const char* argp_program_version = "gopherlog 0.1";
+const char* argp_program_bug_address = "<contact@sarahwatt.ca>";
+
+// argp documentation strings
+static char argp_doc[] = "Decoder for sgopher access logs. Merges the logs from all workers given on the command line in time order.";
+static char argp_args_doc[] = "FILE...";
+
+// Constants for arguments
+enum arg_keys_t
+{
+	KEY_ADDRESS = 'a',
+	KEY_CSV = 'c',
+	KEY_SELECTOR = 'g',
+	KEY_MANIFEST = 'm',
+	KEY_STATUS = 's',
+	KEY_SINCE = 'f',
+	KEY_TOP = 't',
+	KEY_UNTIL = 'u'
+};
+
+// argp options vector
+static struct argp_option argp_options[] =
+{
+	{"address",		KEY_ADDRESS,	"STRING",		0,		"Only show requests from this client address"},
+	{"csv",			KEY_CSV,		0,				0,		"Output CSV instead of text"},
+	{"manifest",	KEY_MANIFEST,	0,				0,		"With --top, show just the selectors, one per line, as a warm-up list for sgopher --warmup"},
+	{"selector",	KEY_SELECTOR,	"STRING",		0,		"Only show requests with selectors containing this string"},
+	{"status",		KEY_STATUS,		"NUMBER",		0,		"Only show requests with this status code, where 0 is a request the client abandoned"},
+	{"since",		KEY_SINCE,		"NUMBER",		0,		"Only show requests from this time on, in seconds since the epoch"},
+	{"top",			KEY_TOP,		"NUMBER",		0,		"Instead of listing requests, show this many of the most requested selectors"},
+	{"until",		KEY_UNTIL,		"NUMBER",		0,		"Only show requests from before this time, in seconds since the epoch"},
+	{0}
+};
+
+// Program arguments
+struct args_t
+{
+	char** files;
+	unsigned int numFiles;
+	const char* address;
+	bool csv;
+	bool manifest;
+	const char* selector;
+	int status;
+	unsigned long since;
+	unsigned long until;
+	unsigned int top;
+};
+
+// Argp option parser
+static error_t argp_parse_options(int key, char* arg, struct argp_state* state)
+{
+	struct args_t* args = state->input;
+	
+	switch (key)
+	{
+	case KEY_ADDRESS:
+		args->address = arg;
+		break;
+	case KEY_CSV:
+		args->csv = true;
+		break;
+	case KEY_MANIFEST:
+		args->manifest = true;
+		break;
+	case KEY_SELECTOR:
+		args->selector = arg;
+		break;
+	case KEY_STATUS:
+		sscanf(arg, "%i", &args->status);
+		break;
+	case KEY_SINCE:
+		sscanf(arg, "%lu", &args->since);
+		break;
+	case KEY_TOP:
+		sscanf(arg, "%u", &args->top);
+		break;
+	case KEY_UNTIL:
+		sscanf(arg, "%lu", &args->until);
+		break;
+	case ARGP_KEY_ARGS:
+		args->files = state->argv + state->next;
+		args->numFiles = (unsigned int)(state->argc - state->next);
+		break;
+	case ARGP_KEY_NO_ARGS:
+		argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	
+	return 0;
+}
+
+// *********************************************************************
+// Record collection
+// *********************************************************************
+
+// A record copied out of a log along with the worker it came from
+struct entry_t
+{
+	struct slog_record_t record;
+	unsigned int worker;
+};
+
+struct entries_t
+{
+	struct entry_t* list;
+	size_t count;
+	size_t size;
+};
+
+static int entries_add(struct entries_t* entries, const struct slog_record_t* record, unsigned int worker)
+{
+	if (entries->count == entries->size)
+	{
+		size_t size = entries->size * 2;
+		
+		struct entry_t* list = reallocarray(entries->list, size, sizeof(struct entry_t));
+		
+		if (list == NULL)
+		{
+			return -1;
+		}
+		
+		entries->list = list;
+		entries->size = size;
+	}
+	
+	memcpy(&entries->list[entries->count].record, record, sizeof(struct slog_record_t));
+	entries->list[entries->count].worker = worker;
+	entries->count++;
+	
+	return 0;
+}
+
+// Comparison function for putting records in time order
+static int compare_timestamps(const void* pa, const void* pb)
+{
+	const struct entry_t* a = pa;
+	const struct entry_t* b = pb;
+	
+	if (a->record.timestamp != b->record.timestamp)
+	{
+		return a->record.timestamp < b->record.timestamp ? -1 : 1;
+	}
+	
+	return 0;
+}
+
+// Copy all the finished records out of one log file
+static int read_log(const char* path, struct entries_t* entries)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	
+	if (fd < 0)
+	{
+		fprintf(stderr, "gopherlog - Error: Cannot open %s: %m\n", path);
+		return -1;
+	}
+	
+	struct stat statbuf;
+	
+	if (fstat(fd, &statbuf) < 0)
+	{
+		fprintf(stderr, "gopherlog - Error: Cannot fstat %s: %m\n", path);
+		close(fd);
+		return -1;
+	}
+	
+	size_t length = (size_t)statbuf.st_size;
+	
+	if (length < sizeof(struct slog_header_t))
+	{
+		fprintf(stderr, "gopherlog - Error: %s is not an access log\n", path);
+		close(fd);
+		return -1;
+	}
+	
+	void* ptr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	
+	close(fd);
+	
+	if (ptr == MAP_FAILED)
+	{
+		fprintf(stderr, "gopherlog - Error: Cannot mmap %s: %m\n", path);
+		return -1;
+	}
+	
+	const struct slog_header_t* header = ptr;
+	const struct slog_record_t* records = (const struct slog_record_t*)(header + 1);
+	
+	if (header->magic != SLOG_MAGIC || header->version != SLOG_VERSION || header->recordSize != sizeof(struct slog_record_t) || header->capacity == 0 || length < sizeof(struct slog_header_t) + header->capacity * sizeof(struct slog_record_t))
+	{
+		fprintf(stderr, "gopherlog - Error: %s is not an access log this version understands\n", path);
+		munmap(ptr, length);
+		return -1;
+	}
+	
+	// The server may still be writing, so take a snapshot of where it's up to and only go by that
+	uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = head > header->capacity ? head - header->capacity : 0;
+	
+	int retval = 0;
+	
+	for (uint64_t i = tail; i < head; i++)
+	{
+		const struct slog_record_t* record = &records[i % header->capacity];
+		
+		// Skip connections that are still open
+		if (!(__atomic_load_n(&record->flags, __ATOMIC_ACQUIRE) & SLOG_COMPLETE))
+		{
+			continue;
+		}
+		
+		if (entries_add(entries, record, header->worker) < 0)
+		{
+			fprintf(stderr, "gopherlog - Error: Cannot allocate memory for records: %m\n");
+			retval = -1;
+			break;
+		}
+	}
+	
+	munmap(ptr, length);
+	
+	return retval;
+}
+
+// *********************************************************************
+// Filtering and output
+// *********************************************************************
+
+static void format_address(const struct slog_record_t* record, char* buffer, size_t size)
+{
+	// Clients on a Unix socket are known by their process instead, the same way CGI programs see them
+	if (record->family == AF_UNIX)
+	{
+		struct ucred cred;
+		
+		memcpy(&cred, record->address, sizeof(cred));
+		snprintf(buffer, size, "unix:pid=%i/uid=%u", cred.pid, cred.uid);
+		
+		return;
+	}
+	
+	if (inet_ntop(record->family, record->address, buffer, (socklen_t)size) == NULL)
+	{
+		snprintf(buffer, size, "unknown");
+	}
+}
+
+static bool matches(const struct args_t* args, const struct entry_t* entry)
+{
+	const struct slog_record_t* record = &entry->record;
+	
+	if (args->status >= 0 && record->status != args->status)
+	{
+		return false;
+	}
+	
+	if (args->since > 0 && record->timestamp / 1000000000 < args->since)
+	{
+		return false;
+	}
+	
+	if (args->until > 0 && record->timestamp / 1000000000 >= args->until)
+	{
+		return false;
+	}
+	
+	if (args->address != NULL)
+	{
+		char address[INET6_ADDRSTRLEN];
+		
+		format_address(record, address, sizeof(address));
+		
+		if (strcmp(address, args->address) != 0)
+		{
+			return false;
+		}
+	}
+	
+	if (args->selector != NULL)
+	{
+		size_t length = record->selectorLength < SLOG_SELECTOR_SIZE ? record->selectorLength : SLOG_SELECTOR_SIZE;
+		
+		if (memmem(record->selector, length, args->selector, strlen(args->selector)) == NULL)
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+// Print the stored part of the selector, marking where it was cut off and keeping control characters out of the output
+static void print_selector(const struct slog_record_t* record, bool csv)
+{
+	size_t length = record->selectorLength < SLOG_SELECTOR_SIZE ? record->selectorLength : SLOG_SELECTOR_SIZE;
+	
+	if (csv)
+	{
+		putchar('"');
+	}
+	
+	for (size_t i = 0; i < length; i++)
+	{
+		char c = record->selector[i];
+		
+		if ((unsigned char)c < 0x20 || c == 0x7f)
+		{
+			c = '?';
+		}
+		else if (csv && c == '"')
+		{
+			putchar('"');
+		}
+		
+		putchar(c);
+	}
+	
+	if (record->selectorLength > SLOG_SELECTOR_SIZE)
+	{
+		fputs("...", stdout);
+	}
+	
+	if (csv)
+	{
+		putchar('"');
+	}
+}
+
+static void print_entry(const struct args_t* args, const struct entry_t* entry)
+{
+	const struct slog_record_t* record = &entry->record;
+	
+	char address[INET6_ADDRSTRLEN];
+	
+	format_address(record, address, sizeof(address));
+	
+	time_t seconds = (time_t)(record->timestamp / 1000000000);
+	unsigned long micros = (unsigned long)(record->timestamp % 1000000000 / 1000);
+	
+	struct tm tm;
+	char timestamp[32];
+	
+	strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", gmtime_r(&seconds, &tm));
+	
+	char flags[8] =
+	{
+		record->flags & SLOG_CGI ? 'X' : '-',
+		record->flags & SLOG_CACHED ? 'C' : '-',
+		record->flags & SLOG_ZEROCOPY ? 'Z' : '-',
+		record->flags & SLOG_STREAMED ? 'S' : '-',
+		record->flags & SLOG_SHAPED ? 'R' : '-',
+		record->flags & SLOG_KTLS ? 'K' : record->flags & SLOG_TLS ? 'T' : '-',
+		record->flags & SLOG_PROXIED ? 'P' : '-',
+		'\0'
+	};
+	
+	const char* format = args->csv ? "%s.%06luZ,%u,%s,%u,%lu,%u,%u,%u,%u,%s," : "%s.%06luZ %u %s %u %lu %u %u %u %u %s ";
+	
+	printf(format, timestamp, micros, entry->worker, address, record->status, (unsigned long)record->bytes, record->requestTime, record->openTime, record->firstByteTime, record->closeTime, flags);
+	
+	print_selector(record, args->csv);
+	
+	putchar('\n');
+}
+
+// *********************************************************************
+// Most requested selectors
+// *********************************************************************
+
+struct selector_t
+{
+	const struct slog_record_t* record;
+	unsigned long count;
+	unsigned long bytes;
+};
+
+static int compare_hashes(const void* pa, const void* pb)
+{
+	const struct entry_t* a = pa;
+	const struct entry_t* b = pb;
+	
+	if (a->record.selectorHash != b->record.selectorHash)
+	{
+		return a->record.selectorHash < b->record.selectorHash ? -1 : 1;
+	}
+	
+	return 0;
+}
+
+static int compare_counts(const void* pa, const void* pb)
+{
+	const struct selector_t* a = pa;
+	const struct selector_t* b = pb;
+	
+	if (a->count != b->count)
+	{
+		return a->count > b->count ? -1 : 1;
+	}
+	
+	return 0;
+}
+
+// Group matching records by selector hash and print the biggest groups
+static int print_top(const struct args_t* args, struct entry_t* list, size_t count)
+{
+	qsort(list, count, sizeof(struct entry_t), compare_hashes);
+	
+	struct selector_t* selectors = calloc(count, sizeof(struct selector_t));
+	
+	if (selectors == NULL)
+	{
+		fprintf(stderr, "gopherlog - Error: Cannot allocate memory for selectors: %m\n");
+		return -1;
+	}
+	
+	size_t numSelectors = 0;
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		if (numSelectors == 0 || selectors[numSelectors - 1].record->selectorHash != list[i].record.selectorHash)
+		{
+			selectors[numSelectors++].record = &list[i].record;
+		}
+		
+		selectors[numSelectors - 1].count++;
+		selectors[numSelectors - 1].bytes += list[i].record.bytes;
+	}
+	
+	qsort(selectors, numSelectors, sizeof(struct selector_t), compare_counts);
+	
+	size_t shown = 0;
+	
+	for (size_t i = 0; i < numSelectors && shown < args->top; i++)
+	{
+		const struct slog_record_t* record = selectors[i].record;
+		
+		// A warm-up list needs selectors exactly as they were asked for, so any that were cut short, can't go on a
+		// line of their own or would be taken for a comment are left out
+		if (args->manifest)
+		{
+			if (record->selectorLength > SLOG_SELECTOR_SIZE || memchr(record->selector, '\n', record->selectorLength) != NULL || memchr(record->selector, '\r', record->selectorLength) != NULL || (record->selectorLength > 0 && record->selector[0] == '#'))
+			{
+				continue;
+			}
+			
+			// The root menu is asked for with an empty selector, which would be skipped as a blank line, but / is the
+			// same thing
+			if (record->selectorLength == 0)
+			{
+				printf("/\n");
+			}
+			else
+			{
+				printf("%.*s\n", (int)record->selectorLength, record->selector);
+			}
+		}
+		else
+		{
+			printf(args->csv ? "%lu,%lu," : "%lu %lu ", selectors[i].count, selectors[i].bytes);
+			
+			print_selector(record, args->csv);
+			
+			putchar('\n');
+		}
+		
+		shown++;
+	}
+	
+	free(selectors);
+	
+	return 0;
+}
+
+// *********************************************************************
+// Main function
+// *********************************************************************
+int main(int argc, char** argv)
+{
+	// argp parser options
+	struct argp argp_parser = {argp_options, argp_parse_options, argp_args_doc, argp_doc};
+	
+	// Default argument values
+	struct args_t args =
+	{
+		.files = NULL,
+		.numFiles = 0,
+		.address = NULL,
+		.csv = false,
+		.manifest = false,
+		.selector = NULL,
+		.status = -1,
+		.since = 0,
+		.until = 0,
+		.top = 0
+	};
+	
+	// Parse arguments
+	argp_parse(&argp_parser, argc, argv, 0, 0, &args);
+	
+	// Gather up the records from every log
+	struct entries_t entries =
+	{
+		.list = calloc(NUM_RECORDS, sizeof(struct entry_t)),
+		.count = 0,
+		.size = NUM_RECORDS
+	};
+	
+	if (entries.list == NULL)
+	{
+		fprintf(stderr, "gopherlog - Error: Cannot allocate memory for records: %m\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	for (unsigned int i = 0; i < args.numFiles; i++)
+	{
+		if (read_log(args.files[i], &entries) < 0)
+		{
+			free(entries.list);
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	// Filter them in place
+	size_t count = 0;
+	
+	for (size_t i = 0; i < entries.count; i++)
+	{
+		if (matches(&args, &entries.list[i]))
+		{
+			entries.list[count++] = entries.list[i];
+		}
+	}
+	
+	int retval = 0;
+	
+	if (args.top > 0)
+	{
+		if (args.csv && !args.manifest)
+		{
+			printf("count,bytes,selector\n");
+		}
+		
+		retval = print_top(&args, entries.list, count);
+	}
+	else
+	{
+		// Put the records from all the workers in the order the connections arrived
+		qsort(entries.list, count, sizeof(struct entry_t), compare_timestamps);
+		
+		if (args.csv)
+		{
+			printf("time,worker,address,status,bytes,request_us,open_us,first_byte_us,close_us,flags,selector\n");
+		}
+		
+		for (size_t i = 0; i < count; i++)
+		{
+			print_entry(&args, &entries.list[i]);
+		}
+	}
+	
+	free(entries.list);
+	
+	exit(retval < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -7,6 +7,7 @@
 // Internet shit
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 
 // errno
 #include <errno.h>
@@ -14,6 +15,9 @@
 // integer types and format specifiers
 #include <inttypes.h>
 
+// offsetof
+#include <stddef.h>
+
 // poll
 #include <poll.h>
 
@@ -26,7 +30,7 @@
 // on_exit, exit
 #include <stdlib.h>
 
-// strlen, mempcpy
+// strlen, mempcpy, memcpy
 #include <string.h>
 
 // socket, connect
@@ -35,6 +39,9 @@
 // timerfd API
 #include <sys/timerfd.h>
 
+// clock_gettime
+#include <time.h>
+
 // wait
 #include <sys/wait.h>
 
@@ -65,6 +72,7 @@ enum arg_keys_t
 	KEY_REQUEST = 'r',
 	KEY_SIZE = 's',
 	KEY_TIMEOUT = 't',
+	KEY_UNIX = 'u',
 	KEY_WORKERS = 'w'
 };
 
@@ -78,6 +86,7 @@ static struct argp_option argp_options[] =
 	{"request",		KEY_REQUEST,	"STRING",		0,		"Request string without trailing CRLF sequence (default /)"},
 	{"size",		KEY_SIZE,		"NUMBER",		0,		"Expected size of response in bytes, or 0 for no size check (default 0 bytes - do not check size)"},
 	{"timeout",		KEY_TIMEOUT,	"NUMBER",		0,		"Time to wait for socket state change before giving up in milliseconds, or a negative number for no timeout (default 1000 milliseconds)"},
+	{"unix",		KEY_UNIX,		"STRING",		0,		"Connect to this Unix socket path instead, or in the abstract namespace with a leading @ (default none)"},
 	{"workers",		KEY_WORKERS,	"NUMBER",		0,		"Number of worker processes (default 1 worker)"},
 	{0}
 };
@@ -92,6 +101,7 @@ struct args_t
 	char* request;
 	unsigned int size;
 	int timeout;
+	char* unixPath;
 	unsigned int numWorkers;
 };
 
@@ -123,6 +133,9 @@ static error_t argp_parse_options(int key, char* arg, struct argp_state* state)
 	case KEY_TIMEOUT:
 		sscanf(arg, "%i", &args->timeout);
 		break;
+	case KEY_UNIX:
+		args->unixPath = arg;
+		break;
 	case KEY_WORKERS:
 		sscanf(arg, "%u", &args->numWorkers);
 		break;
@@ -133,6 +146,77 @@ static error_t argp_parse_options(int key, char* arg, struct argp_state* state)
 	return 0;
 }
 
+// *********************************************************************
+// Latency histogram
+//
+// Latencies of successful requests are counted in microseconds, in
+// buckets that are exact up to 16 and then split each power of two into
+// 16, so a bucket is never more than about 6% wide. That's plenty for
+// percentiles, and a worker's whole histogram is a few KB of shared
+// memory and counting a request is a couple of shifts.
+// *********************************************************************
+
+#define LATENCY_SUB 16
+
+// Enough powers of two to go past half an hour, with anything longer in the last bucket
+#define LATENCY_BUCKETS (LATENCY_SUB * 28)
+
+static unsigned int latency_bucket(uint64_t usecs)
+{
+	if (usecs < LATENCY_SUB)
+	{
+		return (unsigned int)usecs;
+	}
+	
+	unsigned int exponent = 63 - (unsigned int)__builtin_clzll(usecs);
+	unsigned int bucket = (exponent - 3) * LATENCY_SUB + (unsigned int)(usecs >> (exponent - 4)) - LATENCY_SUB;
+	
+	return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// Middle of the range of latencies a bucket holds
+static double latency_value(unsigned int bucket)
+{
+	if (bucket < LATENCY_SUB)
+	{
+		return bucket;
+	}
+	
+	unsigned int exponent = bucket / LATENCY_SUB + 3;
+	uint64_t width = 1ULL << (exponent - 4);
+	uint64_t low = (bucket % LATENCY_SUB + LATENCY_SUB) * width;
+	
+	return (double)low + (double)(width - 1) / 2;
+}
+
+// Latency that a fraction of the requests came in under
+static double latency_percentile(const uint64_t* latency, uint64_t count, double fraction)
+{
+	uint64_t rank = (uint64_t)((double)count * fraction);
+	uint64_t seen = 0;
+	
+	for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		seen += latency[i];
+		
+		if (seen > rank)
+		{
+			return latency_value(i);
+		}
+	}
+	
+	return latency_value(LATENCY_BUCKETS - 1);
+}
+
+static inline uint64_t monotonic_usecs()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
 // *********************************************************************
 // Combined worker information and results
 // *********************************************************************
@@ -143,6 +227,11 @@ struct results_t
 	uint64_t successful;
 	uint64_t timeout;
 	uint64_t mismatch;
+	
+	// Time from starting to connect to the end of the response for successful requests, in microseconds
+	uint64_t latency[LATENCY_BUCKETS];
+	uint64_t latencySum;
+	uint64_t latencyMax;
 };
 
 struct worker_t
@@ -193,6 +282,34 @@ __attribute__((noreturn)) static void worker_process(unsigned int id, struct res
 	
 	inet_pton(AF_INET, args->address, &addr.sin_addr.s_addr);
 	
+	struct sockaddr* target = (struct sockaddr*)&addr;
+	socklen_t targetLength = sizeof(addr);
+	
+	// Or a Unix socket, where a leading @ stands for the null byte that starts a name in the abstract namespace
+	struct sockaddr_un unixAddr =
+	{
+		.sun_family = AF_UNIX
+	};
+	
+	if (args->unixPath != NULL)
+	{
+		size_t size = strlen(args->unixPath);
+		
+		memcpy(unixAddr.sun_path, args->unixPath, size);
+		
+		if (args->unixPath[0] == '@')
+		{
+			unixAddr.sun_path[0] = '\0';
+			targetLength = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + size);
+		}
+		else
+		{
+			targetLength = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + size + 1);
+		}
+		
+		target = (struct sockaddr*)&unixAddr;
+	}
+	
 	// Set up timerfd, which is used to figure out when the test needs to stop
 	int timerfd = timerfd_create(CLOCK_REALTIME, 0);
 	
@@ -233,8 +350,10 @@ __attribute__((noreturn)) static void worker_process(unsigned int id, struct res
 		// Accumulator for received file size
 		ssize_t received = 0;
 		
+		uint64_t start = monotonic_usecs();
+		
 		// Open socket
-		int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+		int sockfd = socket(target->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
 		
 		if (sockfd < 0)
 		{
@@ -244,8 +363,29 @@ __attribute__((noreturn)) static void worker_process(unsigned int id, struct res
 		}
 		
 		// Connect to the host
-		if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		if (connect(sockfd, target, targetLength) < 0)
 		{
+			// A Unix socket with a full queue refuses straight away instead of making us wait, which scores the same
+			if (errno == EAGAIN && args->unixPath != NULL)
+			{
+				if (results->timeout == 0)
+				{
+					fprintf(stderr, "Warning: Worker #%u found the server's queue full\n", id);
+				}
+				
+				results->timeout++;
+				
+				close(sockfd);
+				
+				// Nothing else is going to notice the test being over while this keeps happening
+				if (poll(poll_list, 1, 0) > 0)
+				{
+					running = false;
+				}
+				
+				continue;
+			}
+			
 			// The socket is nonblocking so it should return EINPROGRESS
 			if (errno != EINPROGRESS)
 			{
@@ -359,6 +499,16 @@ __attribute__((noreturn)) static void worker_process(unsigned int id, struct res
 						{
 							// Score a successful result
 							results->successful++;
+							
+							uint64_t latency = monotonic_usecs() - start;
+							
+							results->latency[latency_bucket(latency)]++;
+							results->latencySum += latency;
+							
+							if (latency > results->latencyMax)
+							{
+								results->latencyMax = latency;
+							}
 						}
 						
 						// Exit connection loop because we reached EOF
@@ -398,6 +548,7 @@ int main(int argc, char* argv[])
 		.request = "/",
 		.size = 0,
 		.timeout = 1000,
+		.unixPath = NULL,
 		.numWorkers = 1
 	};
 	
@@ -405,6 +556,18 @@ int main(int argc, char* argv[])
 	argp_parse(&argp_parser, argc, argv, 0, 0, &args);
 	
 	// Report argument values
+	// A path has to fit in the address, with room for the terminator
+	if (args.unixPath != NULL && (args.unixPath[0] == '\0' || strlen(args.unixPath) >= sizeof(((struct sockaddr_un*)0)->sun_path)))
+	{
+		fprintf(stderr, "Error: Unix socket path is not valid\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	if (args.unixPath != NULL)
+	{
+		fprintf(stderr, "Unix socket: %s\n", args.unixPath);
+	}
+	
 	fprintf(stderr, "Address: %s\n", args.address);
 	fprintf(stderr, "Buffer size:: %u bytes\n", args.buffersize);
 	fprintf(stderr, "Port: %hu\n", args.port);
@@ -432,6 +595,13 @@ int main(int argc, char* argv[])
 		workers[i].results.successful = 0;
 		workers[i].results.timeout = 0;
 		workers[i].results.mismatch = 0;
+		workers[i].results.latencySum = 0;
+		workers[i].results.latencyMax = 0;
+		
+		for (unsigned int j = 0; j < LATENCY_BUCKETS; j++)
+		{
+			workers[i].results.latency[j] = 0;
+		}
 	}
 	
 	on_exit(cleanup_smalloc, workers);
@@ -442,7 +612,7 @@ int main(int argc, char* argv[])
 	for (unsigned int i = 0; i < args.numWorkers; i++)
 	{
 		pid_t pid = fork();
-	
+		
 		if (pid == 0) // Worker
 		{
 			// This does not return
@@ -505,7 +675,10 @@ int main(int argc, char* argv[])
 		.total = 0,
 		.successful = 0,
 		.timeout = 0,
-		.mismatch = 0
+		.mismatch = 0,
+		.latency = {0},
+		.latencySum = 0,
+		.latencyMax = 0
 	};
 	
 	unsigned int successes = 0;
@@ -518,7 +691,19 @@ int main(int argc, char* argv[])
 			results.successful += workers[i].results.successful;
 			results.timeout += workers[i].results.timeout;
 			results.mismatch += workers[i].results.mismatch;
-	
+			
+			for (unsigned int j = 0; j < LATENCY_BUCKETS; j++)
+			{
+				results.latency[j] += workers[i].results.latency[j];
+			}
+			
+			results.latencySum += workers[i].results.latencySum;
+			
+			if (workers[i].results.latencyMax > results.latencyMax)
+			{
+				results.latencyMax = workers[i].results.latencyMax;
+			}
+			
 			successes++;
 		}
 	}
@@ -538,6 +723,17 @@ int main(int argc, char* argv[])
 	printf("Number of successful requests: %" PRIu64 "\n", results.successful);
 	printf("Rate of successful requests: %" PRIu64 " per second\n", results.successful / args.duration);
 	
+	if (results.successful > 0)
+	{
+		printf("Mean latency: %.1f microseconds\n", (double)results.latencySum / (double)results.successful);
+		printf("Latency percentiles: 50%% %.0f, 90%% %.0f, 99%% %.0f, 99.9%% %.0f microseconds\n",
+			latency_percentile(results.latency, results.successful, 0.5),
+			latency_percentile(results.latency, results.successful, 0.9),
+			latency_percentile(results.latency, results.successful, 0.99),
+			latency_percentile(results.latency, results.successful, 0.999));
+		printf("Maximum latency: %" PRIu64 " microseconds\n", results.latencyMax);
+	}
+	
 	if (results.timeout > 0)
 	{
 		printf("Number of timeouts: %" PRIu64 "\n", results.timeout);
@@ -1,34 +1,73 @@
+// For accept4
+#define _GNU_SOURCE
+
 // Argument handling
 #include <argp.h>
 
+// All the internet shit
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+// Classic BPF for steering connections between the listening sockets
+#include <linux/filter.h>
+
+// getaddrinfo, freeaddrinfo, gai_strerror
+#include <netdb.h>
+
 // errno
 #include <errno.h>
 
-// open
+// open, fcntl
 #include <fcntl.h>
 
+// INT_MAX, UINT_MAX
+#include <limits.h>
+
+// offsetof
+#include <stddef.h>
+
 // sigemptyset, sigaddset, sigprocmask
 #include <signal.h>
 
 // bool
 #include <stdbool.h>
 
-// sscanf, fprintf
+// sscanf, fprintf, fopen, getline, fclose
 #include <stdio.h>
 
-// exit, on_exit, malloc, calloc, free
+// exit, on_exit, malloc, calloc, realloc, free, realpath, setenv, getenv, unsetenv, strtol, strtoul, qsort
 #include <stdlib.h>
 
-// pidfd_send_signal
+// memcpy, memset, memcmp, strlen, strchr, strrchr, strndup, strcspn
+#include <string.h>
+
+// pidfd_open, pidfd_send_signal
 #include <sys/pidfd.h>
 
 // signalfd
 #include <sys/signalfd.h>
 
+// timerfd_create, timerfd_settime
+#include <sys/timerfd.h>
+
+// memfd_create
+#include <sys/mman.h>
+
+// sendfile
+#include <sys/sendfile.h>
+
+// socket, socketpair, setsockopt, getsockopt, getsockname, bind, listen, connect, accept4
+#include <sys/socket.h>
+
+// lstat
+#include <sys/stat.h>
+
 // waitid
 #include <sys/wait.h>
 
-// close, read, dup2
+// close, close_range, read, dup2, execv, unlink
 #include <unistd.h>
 
 // event loop functions
@@ -40,6 +79,21 @@
 // sfork
 #include "sfork.h"
 
+// smalloc, scalloc, sfree
+#include "smalloc.h"
+
+// smetrics_worker_t, smetrics_write
+#include "smetrics.h"
+
+// sproxy_route_t
+#include "sproxy.h"
+
+// ssearch_builder_create, ssearch_builder_destroy, ssearch_builder_fd, ssearch_builder_notify, ssearch_builder_work
+#include "ssearch.h"
+
+// stls_available, stls_context_create, stls_context_destroy, stls_error
+#include "stls.h"
+
 // *********************************************************************
 // Command line arguments
 // *********************************************************************
@@ -53,19 +107,116 @@ enum arg_keys_t
 	KEY_MAXCLIENTS = 'm',
 	KEY_PORT = 'p',
 	KEY_TIMEOUT = 't',
-	KEY_WORKERS = 'w'
+	KEY_WORKERS = 'w',
+	
+	// Long options only
+	KEY_RATELIMIT = 0x100,
+	KEY_WORKERRATELIMIT,
+	KEY_PRIORITY,
+	KEY_REQUESTTIMEOUT,
+	KEY_DEADLINE,
+	KEY_DEADLINERATE,
+	KEY_MINRATE,
+	KEY_LARGEFILE,
+	KEY_DROPBEHIND,
+	KEY_NOTSENTLOWAT,
+	KEY_CORK,
+	KEY_CACHESIZE,
+	KEY_CACHEFILESIZE,
+	KEY_ZEROCOPY,
+	KEY_ACCESSLOG,
+	KEY_ACCESSLOGSIZE,
+	KEY_METRICSPORT,
+	KEY_LOOPSTATS,
+	KEY_DRAINTIME,
+	KEY_STALLTIME,
+	KEY_MINWORKERS,
+	KEY_MAXWORKERS,
+	KEY_TLSPORT,
+	KEY_TLSCERT,
+	KEY_TLSKEY,
+	KEY_TLSZEROCOPY,
+	KEY_UNIX,
+	KEY_TEMPLATES,
+	KEY_RFC1436,
+	KEY_TEXTCACHE,
+	KEY_SEARCH,
+	KEY_SEARCHINDEX,
+	KEY_PROXY,
+	KEY_PROXYTTL,
+	KEY_PROXYCACHESIZE,
+	KEY_PROXYFILESIZE,
+	KEY_WARMUP,
+	KEY_WARMUPTIME,
+	KEY_CACHEADMIT,
+	KEY_CGIWORKERS,
+	KEY_OUTSIDELINKS,
+	KEY_BUSYPOLL
 };
 
+// Most Unix sockets that can be listened on
+#define UNIX_LISTENERS_MAX 8
+
+// Slowest rate limit in bytes per second, below which a connection would take minutes to get a single segment out
+#define RATE_LIMIT_MIN 100
+
+// Most upstream servers that can be proxied
+#define PROXY_ROUTES_MAX 8
+
 // Program arguments
 struct args_t
 {
 	const char* directory;
 	const char* hostname;
 	const char* indexfile;
+	int outsideLinks;
+	int templates;
+	int rfc1436;
+	const char* textCache;
+	const char* search;
+	const char* searchIndex;
 	unsigned int maxClients;
 	unsigned short port;
 	unsigned int timeout;
 	unsigned int numWorkers;
+	unsigned int minWorkers;
+	unsigned int maxWorkers;
+	unsigned int numCgiWorkers;
+	unsigned int rateLimit;
+	unsigned int workerRateLimit;
+	unsigned int priorityThreshold;
+	unsigned int requestTimeout;
+	unsigned int deadline;
+	unsigned int deadlineRate;
+	unsigned int minRate;
+	unsigned long largeFile;
+	unsigned long dropBehind;
+	unsigned int notsentLowat;
+	int cork;
+	unsigned long cacheSize;
+	unsigned int cacheFileSize;
+	unsigned int cacheAdmit;
+	unsigned int zerocopy;
+	const char* accessLog;
+	unsigned long accessLogSize;
+	unsigned short metricsPort;
+	int loopStats;
+	unsigned int busyPoll;
+	unsigned int drainTime;
+	unsigned int stallTime;
+	unsigned short tlsPort;
+	const char* tlsCert;
+	const char* tlsKey;
+	int tlsZerocopy;
+	const char* unixPaths[UNIX_LISTENERS_MAX];
+	unsigned int numUnixPaths;
+	const char* proxies[PROXY_ROUTES_MAX];
+	unsigned int numProxies;
+	unsigned int proxyTtl;
+	unsigned long proxyCacheSize;
+	unsigned long proxyFileSize;
+	const char* warmup;
+	unsigned int warmupTime;
 };
 
 // options vector
@@ -74,10 +225,52 @@ static struct argp_option argp_options[] =
 	{"directory",	KEY_DIRECTORY,	"STRING",	0,	"Location to serve files from (default ./gopherroot)"},
 	{"hostname",	KEY_HOSTNAME,	"STRING",	0,	"Externally-accessible hostname of server, used for generation of gophermaps (default localhost)"},
 	{"indexfile",	KEY_INDEXFILE,	"STRING",	0,	"Default file to serve from a blank path or path referencing a directory (default .gophermap)"},
+	{"outsidelinks",	KEY_OUTSIDELINKS,	0,	0,	"Follow symlinks that lead out of the content directory instead of refusing them"},
+	{"templates",	KEY_TEMPLATES,	0,			0,	"Fill in index files as templates, with the hostname and port, relative selectors, includes and directory listings"},
+	{"rfc1436",		KEY_RFC1436,	0,			0,	"End gophermaps with a period if they don't already, as RFC 1436 says"},
+	{"textcache",	KEY_TEXTCACHE,	"STRING",	0,	"With --rfc1436, also send text files dot-escaped with CRLF line endings and a period at the end, converted into copies kept in this directory (default none)"},
+	{"search",		KEY_SEARCH,		"STRING",	0,	"Answer type 7 searches of the names and text of the files being served at this selector (default none)"},
+	{"searchindex",	KEY_SEARCHINDEX,	"STRING",	0,	"File to keep the search index in, which workers read it from (default none)"},
 	{"maxclients",	KEY_MAXCLIENTS,	"NUMBER",	0,	"Maximum simultaneous clients per worker process (default 1000 clients)"},
 	{"port",		KEY_PORT,		"NUMBER",	0,	"Network port (default port 70)"},
 	{"timeout",		KEY_TIMEOUT,	"NUMBER",	0,	"Time in seconds before booting inactive client (default 10 seconds)"},
 	{"workers",		KEY_WORKERS,	"NUMBER",	0,	"Number of worker processes (default 1 worker)"},
+	{"minworkers",	KEY_MINWORKERS,	"NUMBER",	0,	"Fewest worker processes to scale down to under light load (default the same as --workers)"},
+	{"maxworkers",	KEY_MAXWORKERS,	"NUMBER",	0,	"Most worker processes to scale up to under heavy load (default the same as --workers)"},
+	{"cgiworkers",	KEY_CGIWORKERS,	"NUMBER",	0,	"Run CGI programs in a pool of this many worker processes of their own, which the others hand clients off to, or 0 to run them in whichever worker the client is on (default 0)"},
+	{"ratelimit",	KEY_RATELIMIT,	"NUMBER",	0,	"Maximum transfer rate per client in bytes per second, or 0 for no limit (default 0)"},
+	{"workerratelimit",	KEY_WORKERRATELIMIT,	"NUMBER",	0,	"Maximum total transfer rate per worker process in bytes per second, or 0 for no limit (default 0)"},
+	{"priority",	KEY_PRIORITY,	"NUMBER",	0,	"Files up to this size in bytes are exempt from rate limits, as are gophermaps (default 65536 bytes)"},
+	{"requesttimeout",	KEY_REQUESTTIMEOUT,	"NUMBER",	0,	"Time in seconds for a client to finish sending its request, or 0 for no limit (default 5 seconds)"},
+	{"deadline",	KEY_DEADLINE,	"NUMBER",	0,	"Time in seconds for a whole file transfer to finish, or 0 for no limit (default 0)"},
+	{"deadlinerate",	KEY_DEADLINERATE,	"NUMBER",	0,	"Extend the transfer deadline by one second per this many bytes of file, or 0 for a flat deadline (default 0)"},
+	{"minrate",		KEY_MINRATE,	"NUMBER",	0,	"Minimum average transfer rate in bytes per second, or 0 for no minimum (default 0)"},
+	{"largefile",	KEY_LARGEFILE,	"NUMBER",	0,	"Files of at least this size in bytes are streamed with managed readahead, or 0 to disable (default 8388608 bytes)"},
+	{"dropbehind",	KEY_DROPBEHIND,	"NUMBER",	0,	"Streamed files of at least this size in bytes are dropped from the page cache as they are sent, or 0 to disable (default 0)"},
+	{"notsentlowat",	KEY_NOTSENTLOWAT,	"NUMBER",	0,	"Limit on unsent data in the socket for streamed files in bytes, or 0 for the system default (default 131072 bytes)"},
+	{"cork",		KEY_CORK,		0,			0,	"Cork the socket for the tail end of streamed files"},
+	{"cachesize",	KEY_CACHESIZE,	"NUMBER",	0,	"Size of each worker's in-memory response cache in bytes, or 0 to disable (default 0)"},
+	{"cachefilesize",	KEY_CACHEFILESIZE,	"NUMBER",	0,	"Largest file to serve from the response cache in bytes (default 65536 bytes)"},
+	{"cacheadmit",	KEY_CACHEADMIT,	"NUMBER",	0,	"Only put a file in the response cache once it's been asked for this many times lately, going by the hot selector counts (default 1)"},
+	{"zerocopy",	KEY_ZEROCOPY,	"NUMBER",	0,	"Send responses from memory of at least this size in bytes with MSG_ZEROCOPY, or 0 to disable (default 0)"},
+	{"accesslog",	KEY_ACCESSLOG,	"STRING",	0,	"Write a binary access log for each worker to this path with the worker number appended (default none)"},
+	{"accesslogsize",	KEY_ACCESSLOGSIZE,	"NUMBER",	0,	"Number of records kept in each worker's access log before it wraps around (default 65536 records)"},
+	{"metricsport",	KEY_METRICSPORT,	"NUMBER",	0,	"Serve metrics on this port on the loopback interface, or 0 to disable (default 0)"},
+	{"loopstats",	KEY_LOOPSTATS,	0,			0,	"Collect event loop statistics for the metrics"},
+	{"busypoll",	KEY_BUSYPOLL,	"NUMBER",	0,	"Spin for up to this many microseconds waiting for events before blocking, adapting to how often they turn up, or 0 to always block (default 0)"},
+	{"stalltime",	KEY_STALLTIME,	"NUMBER",	0,	"Time in seconds a worker can go without getting around its event loop before it's replaced, or 0 to never replace stuck workers (default 10 seconds)"},
+	{"draintime",	KEY_DRAINTIME,	"NUMBER",	0,	"Time in seconds for workers to finish up with their clients on SIGQUIT or an upgrade, or 0 for no limit (default 30 seconds)"},
+	{"tlsport",		KEY_TLSPORT,	"NUMBER",	0,	"Also serve Gopher over TLS on this port, or 0 to disable (default 0)"},
+	{"tlscert",		KEY_TLSCERT,	"STRING",	0,	"PEM file with the TLS certificate and any intermediate certificates after it (default none)"},
+	{"tlskey",		KEY_TLSKEY,		"STRING",	0,	"PEM file with the TLS private key (default the same file as --tlscert)"},
+	{"tlszerocopy",	KEY_TLSZEROCOPY,	0,			0,	"Have kernel TLS encrypt files straight from the page cache, which is only safe if they aren't modified while being sent"},
+	{"proxy",		KEY_PROXY,		"STRING",	0,	"Pass requests for selectors under a prefix on to another Gopher server, given as PREFIX=HOST:PORT, up to 8 times (default none)"},
+	{"proxyttl",	KEY_PROXYTTL,	"NUMBER",	0,	"Time in seconds to keep responses from upstream servers, or 0 to fetch every time (default 60 seconds)"},
+	{"proxycachesize",	KEY_PROXYCACHESIZE,	"NUMBER",	0,	"Size of each worker's cache of responses from upstream servers in bytes (default 16777216 bytes)"},
+	{"proxyfilesize",	KEY_PROXYFILESIZE,	"NUMBER",	0,	"Largest response to take from an upstream server in bytes (default 1048576 bytes)"},
+	{"warmup",		KEY_WARMUP,		"STRING",	0,	"File listing selectors, one per line, for each worker to warm its caches up with before accepting connections (default none)"},
+	{"warmuptime",	KEY_WARMUPTIME,	"NUMBER",	0,	"Most time in seconds each worker spends warming up, or 0 for no limit (default 5 seconds)"},
+	{"unix",		KEY_UNIX,		"STRING",	0,	"Also listen on a Unix socket at this path, or in the abstract namespace with a leading @, up to 8 times (default none)"},
 	{0}
 };
 
@@ -104,6 +297,24 @@ static error_t argp_parse_options(int key, char* arg, struct argp_state* state)
 	case KEY_INDEXFILE:
 		args->indexfile = arg;
 		break;
+	case KEY_OUTSIDELINKS:
+		args->outsideLinks = 1;
+		break;
+	case KEY_TEMPLATES:
+		args->templates = 1;
+		break;
+	case KEY_RFC1436:
+		args->rfc1436 = 1;
+		break;
+	case KEY_TEXTCACHE:
+		args->textCache = arg;
+		break;
+	case KEY_SEARCH:
+		args->search = arg;
+		break;
+	case KEY_SEARCHINDEX:
+		args->searchIndex = arg;
+		break;
 	case KEY_MAXCLIENTS:
 		sscanf(arg, "%u", &args->maxClients);
 		break;
@@ -116,6 +327,124 @@ static error_t argp_parse_options(int key, char* arg, struct argp_state* state)
 	case KEY_WORKERS:
 		sscanf(arg, "%u", &args->numWorkers);
 		break;
+	case KEY_RATELIMIT:
+		sscanf(arg, "%u", &args->rateLimit);
+		break;
+	case KEY_WORKERRATELIMIT:
+		sscanf(arg, "%u", &args->workerRateLimit);
+		break;
+	case KEY_PRIORITY:
+		sscanf(arg, "%u", &args->priorityThreshold);
+		break;
+	case KEY_REQUESTTIMEOUT:
+		sscanf(arg, "%u", &args->requestTimeout);
+		break;
+	case KEY_DEADLINE:
+		sscanf(arg, "%u", &args->deadline);
+		break;
+	case KEY_DEADLINERATE:
+		sscanf(arg, "%u", &args->deadlineRate);
+		break;
+	case KEY_MINRATE:
+		sscanf(arg, "%u", &args->minRate);
+		break;
+	case KEY_LARGEFILE:
+		sscanf(arg, "%lu", &args->largeFile);
+		break;
+	case KEY_DROPBEHIND:
+		sscanf(arg, "%lu", &args->dropBehind);
+		break;
+	case KEY_NOTSENTLOWAT:
+		sscanf(arg, "%u", &args->notsentLowat);
+		break;
+	case KEY_CORK:
+		args->cork = 1;
+		break;
+	case KEY_CACHESIZE:
+		sscanf(arg, "%lu", &args->cacheSize);
+		break;
+	case KEY_CACHEFILESIZE:
+		sscanf(arg, "%u", &args->cacheFileSize);
+		break;
+	case KEY_ZEROCOPY:
+		sscanf(arg, "%u", &args->zerocopy);
+		break;
+	case KEY_ACCESSLOG:
+		args->accessLog = arg;
+		break;
+	case KEY_ACCESSLOGSIZE:
+		sscanf(arg, "%lu", &args->accessLogSize);
+		break;
+	case KEY_METRICSPORT:
+		sscanf(arg, "%hu", &args->metricsPort);
+		break;
+	case KEY_LOOPSTATS:
+		args->loopStats = 1;
+		break;
+	case KEY_BUSYPOLL:
+		sscanf(arg, "%u", &args->busyPoll);
+		break;
+	case KEY_DRAINTIME:
+		sscanf(arg, "%u", &args->drainTime);
+		break;
+	case KEY_STALLTIME:
+		sscanf(arg, "%u", &args->stallTime);
+		break;
+	case KEY_MINWORKERS:
+		sscanf(arg, "%u", &args->minWorkers);
+		break;
+	case KEY_MAXWORKERS:
+		sscanf(arg, "%u", &args->maxWorkers);
+		break;
+	case KEY_CGIWORKERS:
+		sscanf(arg, "%u", &args->numCgiWorkers);
+		break;
+	case KEY_TLSPORT:
+		sscanf(arg, "%hu", &args->tlsPort);
+		break;
+	case KEY_TLSCERT:
+		args->tlsCert = arg;
+		break;
+	case KEY_TLSKEY:
+		args->tlsKey = arg;
+		break;
+	case KEY_TLSZEROCOPY:
+		args->tlsZerocopy = 1;
+		break;
+	case KEY_UNIX:
+		if (args->numUnixPaths == UNIX_LISTENERS_MAX)
+		{
+			argp_error(state, "Too many Unix sockets");
+		}
+		
+		args->unixPaths[args->numUnixPaths++] = arg;
+		break;
+	case KEY_PROXY:
+		if (args->numProxies == PROXY_ROUTES_MAX)
+		{
+			argp_error(state, "Too many upstream servers");
+		}
+		
+		args->proxies[args->numProxies++] = arg;
+		break;
+	case KEY_PROXYTTL:
+		sscanf(arg, "%u", &args->proxyTtl);
+		break;
+	case KEY_PROXYCACHESIZE:
+		sscanf(arg, "%lu", &args->proxyCacheSize);
+		break;
+	case KEY_PROXYFILESIZE:
+		sscanf(arg, "%lu", &args->proxyFileSize);
+		break;
+	case KEY_WARMUP:
+		args->warmup = arg;
+		break;
+	case KEY_WARMUPTIME:
+		sscanf(arg, "%u", &args->warmupTime);
+		break;
+	case KEY_CACHEADMIT:
+		sscanf(arg, "%u", &args->cacheAdmit);
+		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -127,152 +456,1958 @@ static error_t argp_parse_options(int key, char* arg, struct argp_state* state)
 // Worker and supervisor state definitions
 // *********************************************************************
 
+// A worker that dies is replaced straight away the first time, then after 1, 2, 4 and so on seconds up to this many if
+// its replacements keep dying too
+#define RESPAWN_BACKOFF_MAX 60
+
+// Seconds a worker has to stay up for its replacement to be started straight away again
+#define RESPAWN_RESET 60
+
+// The workers are checked on once a second, so anything due within half a second of a check is done then rather than
+// waiting for the next one, in nanoseconds
+#define MONITOR_SLACK 500000000
+
+// Scaling decisions are made on the load over this many seconds
+#define SCALE_WINDOW 5
+
+// Add a worker when the workers are busy this many percent of the time on average or are using this many percent of
+// their client slots, or when connections were found waiting to be accepted on most of the checks in a window
+#define SCALE_UP_BUSY 75
+#define SCALE_UP_CLIENTS 75
+
+// Retire one when the workers are busy less than this many percent of the time, the rest would be using less than this
+// many percent of their client slots, and nothing was found waiting, for this many windows in a row
+#define SCALE_DOWN_BUSY 25
+#define SCALE_DOWN_CLIENTS 50
+#define SCALE_DOWN_WINDOWS 6
+
+// Seconds on top of the warm-up time to wait for workers to get ready, for them to start up beforehand and get their
+// listening sockets into their event loops afterwards
+#define WARMUP_SLACK 2
+
+// Connections to the metrics port that can be open at once, and seconds one can go without sending a request or taking
+// any of its report before it's closed
+#define METRICS_CLIENTS_MAX 16
+#define METRICS_IDLE_TIMEOUT 5
+
+// Listening sockets bound to one port, with one for each worker slot, or more if they were handed down by an upgrade
+// from a binary that had more workers. A Unix socket can't be bound more than once, so one at a path is shared by every
+// worker instead.
+struct listener_t
+{
+	unsigned short port;
+	const char* path;
+	bool tls;
+	int* sockets;
+	unsigned int numSockets;
+};
+
 struct worker_t
 {
 	unsigned int number;
 	pid_t pid;
 	int pidfd;
+	
+	// Left over from before an upgrade and finishing up with its clients
+	bool draining;
+	
+	// Respawning, with times on the monotonic clock in nanoseconds: when the current process was started, how many of
+	// the processes in this slot have died in quick succession, when to start the next one or 0 if it isn't waiting to,
+	// and whether the current one has already been killed for getting stuck
+	uint64_t spawned;
+	unsigned int failures;
+	uint64_t respawnAt;
+	bool killed;
+	
+	// Busy time reported by the worker in this slot at the start of the scaling window
+	uint64_t lastBusy;
+	
+	// In the CGI pool rather than accepting connections
+	bool cgi;
+};
+
+// A connection to the metrics port: its socket or -1 for a free slot, the report it's being sent once it's asked for
+// one or -1 before then, how far through the report it is, and when to give up on it on the monotonic clock in
+// nanoseconds
+struct metrics_client_t
+{
+	int fd;
+	int report;
+	off_t offset;
+	off_t size;
+	uint64_t deadline;
 };
 
 struct supervisor_t
 {
+	// Slots for the workers accepting connections come first, followed by the ones for the CGI pool
 	struct worker_t* workers;
 	unsigned int numWorkers;
+	unsigned int numCgiWorkers;
 	unsigned int activeWorkers;
 	int sigfd;
 	struct sepoll_t* loop;
+	
+	// Who we are, what to start workers with, and whether we're shutting down and shouldn't replace them anymore
+	pid_t pid;
+	struct server_params_t* params;
+	bool stopping;
+	
+	// Timer for checking on the workers, and how long one can go without a heartbeat in seconds or 0 to never check
+	int monitorfd;
+	unsigned int stallTime;
+	
+	// Scaling. There's a slot for as many workers as there could ever be, and the ones below wantedWorkers are meant to
+	// be running, while any above it that are still running are retiring. The rest tracks the current window: ticks
+	// into it, how many of those found connections waiting to be accepted and the most that were, and how many windows
+	// in a row have been quiet.
+	bool scaling;
+	unsigned int minWorkers;
+	unsigned int wantedWorkers;
+	unsigned int ticks;
+	unsigned int queueTicks;
+	unsigned int queuePeak;
+	unsigned int quietWindows;
+	uint64_t windowStart;
+	
+	// Workers getting ready to accept connections, on the monotonic clock in nanoseconds: when the supervisor started
+	// waiting for them, and when to stop or 0 if it isn't. Once they're ready, connections are steered to one that was
+	// added and the old workers from before an upgrade are told to finish up, if that's what's waiting on them.
+	uint64_t readySince;
+	uint64_t readyDeadline;
+	bool steerWhenReady;
+	bool drainWhenReady;
+	
+	// Counters shared with the workers, the socket they're reported on, and the connections to it
+	struct smetrics_worker_t* metrics;
+	int metricsfd;
+	struct metrics_client_t metricsClients[METRICS_CLIENTS_MAX];
+	
+	// The search index being kept up to date, and the timer for when to work on it next
+	struct ssearch_builder_t* search;
+	int searchfd;
+	
+	// Listening sockets, which are shared out between the workers and handed down to the new binary on an upgrade
+	struct listener_t* listeners;
+	unsigned int numListeners;
+	
+	// The two ends of the socket the workers hand clients off to the CGI pool over, the first for the workers accepting
+	// connections and the second for the pool, or -1 without a pool
+	int cgiSockets[2];
+	
+	// Workers handed down from the old binary on an upgrade
+	struct worker_t* drainers;
+	unsigned int numDrainers;
+	unsigned int activeDrainers;
+	
+	// What to execute on an upgrade
+	char* exe;
+	char** argv;
 };
 
 // *********************************************************************
 // Send a signal to all workers via pidfds, optionally closing the pidfd
 // *********************************************************************
-static void signal_all_workers(struct supervisor_t* supervisor, int sig, bool close_pidfd)
+static void signal_workers(struct worker_t* workers, unsigned int numWorkers, int sig, bool close_pidfd)
 {
-	for (unsigned int i = 0; i < supervisor->numWorkers; i++)
+	for (unsigned int i = 0; i < numWorkers; i++)
 	{
-		if (supervisor->workers[i].pidfd >= 0)
+		if (workers[i].pidfd >= 0)
 		{
-			if (pidfd_send_signal(supervisor->workers[i].pidfd, sig, NULL, 0) < 0)
+			if (pidfd_send_signal(workers[i].pidfd, sig, NULL, 0) < 0)
 			{
 				fprintf(stderr, "S - Error: Cannot send signal to child via pidfd: %m\n");
 			}
 			
 			if (close_pidfd)
 			{
-				close(supervisor->workers[i].pidfd);
+				close(workers[i].pidfd);
 			}
 		}
 	}
 }
 
+static void signal_all_workers(struct supervisor_t* supervisor, int sig, bool close_pidfd)
+{
+	signal_workers(supervisor->workers, supervisor->numWorkers + supervisor->numCgiWorkers, sig, close_pidfd);
+	signal_workers(supervisor->drainers, supervisor->numDrainers, sig, close_pidfd);
+}
+
 // *********************************************************************
-// Handle event on a signalfd
+// Worker processes
 // *********************************************************************
-static void sigfd_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+static inline uint64_t monotonic_time()
 {
-	struct supervisor_t* supervisor = userdata1.ptr;
+	struct timespec ts;
 	
-	while (1)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_fds(const void* a, const void* b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+// Gather up a worker's share of the plain, TLS or Unix listening sockets, where every worker gets every Unix one
+static unsigned int worker_listeners(struct supervisor_t* supervisor, struct worker_t* worker, bool tls, bool local, int* sockets)
+{
+	unsigned int count = 0;
+	
+	for (unsigned int i = 0; i < supervisor->numListeners; i++)
 	{
-		struct signalfd_siginfo siginfo;
+		struct listener_t* listener = &supervisor->listeners[i];
 		
-		if (read(supervisor->sigfd, &siginfo, sizeof(struct signalfd_siginfo)) != sizeof(struct signalfd_siginfo))
+		if (listener->tls != tls || (listener->path != NULL) != local)
 		{
-			if (errno == EAGAIN)
-			{
-				break;
-			}
-			else
-			{
-				fprintf(stderr, "S - Error: Cannot read from signalfd: %m\n");
-				return;
-			}
+			continue;
 		}
 		
-		switch (siginfo.ssi_signo)
+		for (unsigned int j = 0; j < listener->numSockets; j++)
 		{
-		case SIGTERM:
-			fprintf(stderr, "S - Received SIGTERM, sending SIGTERM to children\n");
-			
-			signal_all_workers(supervisor, SIGTERM, false);
-			
-			break;
+			if (local || j % supervisor->numWorkers == worker->number)
+			{
+				sockets[count++] = listener->sockets[j];
+			}
 		}
 	}
+	
+	return count;
 }
 
-// *********************************************************************
-// Handle event on a pidfd
-// *********************************************************************
-static void pidfd_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+static void pidfd_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2);
+static void scale_workers(struct supervisor_t* supervisor, uint64_t now);
+static void check_ready(struct supervisor_t* supervisor, uint64_t now);
+static void wait_until_ready(struct supervisor_t* supervisor, uint64_t now);
+static void metrics_check_idle(struct supervisor_t* supervisor, uint64_t now);
+
+// Start a worker process in the given slot
+static int spawn_worker(struct supervisor_t* supervisor, struct worker_t* worker)
 {
-	struct supervisor_t* supervisor = userdata1.ptr;
-	struct worker_t* worker = userdata2.ptr;
+	struct smetrics_worker_t* metrics = &supervisor->metrics[worker->number];
 	
-	// Get the exit code and reap the child process
-	siginfo_t siginfo;
+	// Start the clock before the fork so a worker can't look stuck before it's had a chance to get going
+	uint64_t now = monotonic_time();
 	
-	if (waitid(P_PIDFD, (id_t)worker->pidfd, &siginfo, WEXITED) < 0)
+	metrics->started = now;
+	__atomic_store_n(&metrics->ready, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&metrics->heartbeat, now, __ATOMIC_RELAXED);
+	
+	int pidfd;
+	
+	// This custom fork returns both a pid and a pidfd to the parent
+	pid_t pid = sfork(&pidfd, 0);
+	
+	if (pid == 0) // Worker
 	{
-		fprintf(stderr, "S - Worker PID %i exited but waitid failed: %m\n", worker->pid);
+		unsigned int total = 0;
+		
+		for (unsigned int i = 0; i < supervisor->numListeners; i++)
+		{
+			total += supervisor->listeners[i].numSockets;
+		}
+		
+		// Keep this worker's share of the listening sockets, plain ones first then TLS then Unix, with room for a sorted
+		// copy after along with the CGI pool's socket
+		int* sockets = malloc((2 * total + 1) * sizeof(int));
+		
+		if (sockets == NULL)
+		{
+			fprintf(stderr, "%i - Error: Cannot allocate memory for listening sockets: %m\n", getpid());
+			_exit(EXIT_FAILURE);
+		}
+		
+		// The CGI pool doesn't accept connections, it only gets them from the rest over its end of the socket
+		unsigned int numSockets = 0;
+		unsigned int numTlsSockets = 0;
+		unsigned int numUnixSockets = 0;
+		
+		if (!worker->cgi)
+		{
+			numSockets = worker_listeners(supervisor, worker, false, false, sockets);
+			numTlsSockets = worker_listeners(supervisor, worker, true, false, sockets + numSockets);
+			numUnixSockets = worker_listeners(supervisor, worker, false, true, sockets + numSockets + numTlsSockets);
+		}
+		
+		unsigned int numKept = numSockets + numTlsSockets + numUnixSockets;
+		
+		// Close everything else the supervisor has open, which might be anything by the time a worker is replaced,
+		// by closing the gaps between the sockets we're keeping, which include our end of the CGI pool's socket
+		int* kept = sockets + numKept;
+		int cgiSocket = supervisor->cgiSockets[worker->cgi ? 1 : 0];
+		
+		memcpy(kept, sockets, numKept * sizeof(int));
+		
+		if (cgiSocket >= 0)
+		{
+			kept[numKept++] = cgiSocket;
+		}
+		
+		qsort(kept, numKept, sizeof(int), compare_fds);
+		
+		unsigned int low = STDERR_FILENO + 1;
+		
+		for (unsigned int i = 0; i < numKept; i++)
+		{
+			if ((unsigned int)kept[i] > low)
+			{
+				close_range(low, (unsigned int)kept[i] - 1, 0);
+			}
+			
+			low = (unsigned int)kept[i] + 1;
+		}
+		
+		close_range(low, ~0U, 0);
+		
+		struct server_params_t params = *supervisor->params;
+		
+		params.sockets = sockets;
+		params.numSockets = numSockets;
+		params.tlsSockets = sockets + numSockets;
+		params.numTlsSockets = numTlsSockets;
+		params.unixSockets = sockets + numSockets + numTlsSockets;
+		params.numUnixSockets = numUnixSockets;
+		params.cgiSocket = cgiSocket;
+		params.cgiPool = worker->cgi;
+		
+		// The pool has nothing to warm up, and what it does is already in the access log of the worker that handed it off,
+		// and shaving microseconds off starting a CGI program isn't worth a core
+		if (worker->cgi)
+		{
+			params.numWarmup = 0;
+			params.accessLog = NULL;
+			params.busyPoll = 0;
+		}
+		
+		// This does not return
+		server_process(&params, worker->number, metrics);
 	}
-	else
+	else if (pid < 0) // Error
 	{
-		fprintf(stderr, "S - Worker PID %i exited with status %i\n", worker->pid, siginfo.si_status);
+		fprintf(stderr, "S - Error: Cannot fork worker process %u - %m\n", worker->number);
+		
+		metrics->started = 0;
+		
+		return -1;
 	}
 	
-	// Deal with the file descriptor
-	sepoll_remove(supervisor->loop, worker->pidfd);
-	close(worker->pidfd);
+	fprintf(stderr, "S - Spawned %s process %u (PID %i)\n", worker->cgi ? "CGI worker" : "worker", worker->number, pid);
 	
-	worker->pidfd = -1;
+	// Keep track of the forked worker
+	worker->pid = pid;
+	worker->pidfd = pidfd;
+	worker->spawned = now;
+	worker->killed = false;
 	
-	// Exit the event loop if there are no more active workers
-	supervisor->activeWorkers--;
+	supervisor->activeWorkers++;
 	
-	if (supervisor->activeWorkers == 0)
+	// Replacements need watching straight away, while the first batch is added once the event loop is set up
+	if (supervisor->loop != NULL)
 	{
-		sepoll_exit(supervisor->loop);
+		sepoll_add(supervisor->loop, pidfd, EPOLLIN, pidfd_event, supervisor, worker);
 	}
+	
+	return 0;
 }
 
-// *********************************************************************
-// Supervisor cleanup function for on_exit
-// *********************************************************************
-static void supervisor_cleanup(int code, void* arg)
+// Replace a worker that died, backing off if they keep dying
+static void respawn_worker(struct supervisor_t* supervisor, struct worker_t* worker)
 {
-	struct supervisor_t* supervisor = arg;
+	uint64_t now = monotonic_time();
 	
-	if (supervisor->workers != NULL)
+	if (now - worker->spawned >= (uint64_t)RESPAWN_RESET * 1000000000)
 	{
-		// On a successful exit the children should have exited already
-		if (code == EXIT_FAILURE)
+		worker->failures = 0;
+	}
+	
+	unsigned int delay = 0;
+	
+	if (worker->failures > 0)
+	{
+		delay = worker->failures > 6 ? RESPAWN_BACKOFF_MAX : 1U << (worker->failures - 1);
+		
+		if (delay > RESPAWN_BACKOFF_MAX)
 		{
-			signal_all_workers(supervisor, SIGKILL, true);
+			delay = RESPAWN_BACKOFF_MAX;
+		}
+	}
+	
+	worker->failures++;
+	
+	if (delay == 0)
+	{
+		if (spawn_worker(supervisor, worker) == 0)
+		{
+			supervisor->metrics[worker->number].respawns++;
+			return;
 		}
 		
-		free(supervisor->workers);
+		// Don't hammer fork if it's failing
+		delay = 1;
 	}
 	
-	if (supervisor->sigfd >= 0)
+	fprintf(stderr, "S - Respawning worker %u in %u seconds\n", worker->number, delay);
+	
+	worker->respawnAt = now + (uint64_t)delay * 1000000000;
+}
+
+// Periodic check for stuck workers and ones that are due to be replaced
+static void monitor_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct supervisor_t* supervisor = userdata1.ptr;
+	
+	// Have to read 8 bytes from the timer to reset it even if I don't care about the contents
+	uint64_t buffer;
+	
+	if (read(supervisor->monitorfd, &buffer, sizeof(uint64_t)) != sizeof(uint64_t))
 	{
-		close(supervisor->sigfd);
+		fprintf(stderr, "S - Error: Cannot read from timerfd: %m\n");
 	}
 	
-	if (supervisor->loop != NULL)
+	uint64_t now = monotonic_time();
+	
+	for (unsigned int i = 0; i < supervisor->numWorkers + supervisor->numCgiWorkers; i++)
 	{
-		sepoll_destroy(supervisor->loop);
+		struct worker_t* worker = &supervisor->workers[i];
+		
+		if (worker->pidfd >= 0)
+		{
+			uint64_t heartbeat = __atomic_load_n(&supervisor->metrics[i].heartbeat, __ATOMIC_RELAXED);
+			
+			// It's replaced once the kill goes through and the pidfd reports it
+			if (supervisor->stallTime > 0 && !worker->killed && now > heartbeat && now - heartbeat >= (uint64_t)supervisor->stallTime * 1000000000)
+			{
+				fprintf(stderr, "S - Worker %u (PID %i) has been stuck for %lu seconds, killing it\n", i, worker->pid, (unsigned long)((now - heartbeat) / 1000000000));
+				
+				if (pidfd_send_signal(worker->pidfd, SIGKILL, NULL, 0) < 0)
+				{
+					fprintf(stderr, "S - Error: Cannot send signal to child via pidfd: %m\n");
+				}
+				
+				worker->killed = true;
+			}
+		}
+		else if (worker->respawnAt > 0 && now + MONITOR_SLACK >= worker->respawnAt)
+		{
+			worker->respawnAt = 0;
+			
+			if (spawn_worker(supervisor, worker) == 0)
+			{
+				supervisor->metrics[i].respawns++;
+			}
+			else
+			{
+				// Back off some more
+				respawn_worker(supervisor, worker);
+			}
+		}
 	}
 	
-	free(supervisor);
+	if (supervisor->readyDeadline > 0)
+	{
+		check_ready(supervisor, now);
+	}
+	
+	metrics_check_idle(supervisor, now);
+	
+	if (supervisor->scaling && !supervisor->stopping)
+	{
+		scale_workers(supervisor, now);
+	}
 }
 
 // *********************************************************************
-// Main
+// Listening sockets
+//
+// The supervisor opens the listening sockets rather than the workers so
+// that they outlive any one worker. There's one per worker for each
+// port, all bound to it with SO_REUSEPORT so the kernel spreads
+// connections between them. On an upgrade they're inherited by the new
+// binary, whose name for them comes through SGOPHER_LISTEN_FDS and who
+// sorts them back out by port, so the same sockets carry on accepting
+// connections the whole way through and nothing that's waiting in a
+// queue is lost. Unix sockets have nothing like SO_REUSEPORT, so
+// there's just the one at each path, shared by all the workers, which
+// take turns being woken up for it.
 // *********************************************************************
-int main(int argc, char* argv[])
+static int open_listener(unsigned short port)
 {
-	// argp parser options
+	// Create socket
+	int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	
+	if (sockfd < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot create socket: %m\n");
+		return -1;
+	}
+	
+	// Allow for address reuse
+	int optval = 1;
+	
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot enable address reuse on socket: %m\n");
+		close(sockfd);
+		return -1;
+	}
+	
+	// Allow for port reuse
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot enable port reuse on socket: %m\n");
+		close(sockfd);
+		return -1;
+	}
+	
+	// Bind address to socket
+	struct sockaddr_in addr = 
+	{
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr =
+		{
+			.s_addr = htonl(INADDR_ANY)
+		}
+	};
+	
+	if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot bind address to socket: %m\n");
+		close(sockfd);
+		return -1;
+	}
+	
+	// Set up socket to listen
+	if (listen(sockfd, 256) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot listen on socket: %m\n");
+		close(sockfd);
+		return -1;
+	}
+	
+	return sockfd;
+}
+
+// Fill in the address for a Unix socket path, where a leading @ stands for the null byte that starts a name in the
+// abstract namespace, which isn't null-terminated and so is only as long as the length says
+static int unix_address(const char* path, struct sockaddr_un* addr, socklen_t* length)
+{
+	size_t size = strlen(path);
+	
+	if (size == 0 || size >= sizeof(addr->sun_path))
+	{
+		return -1;
+	}
+	
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, size);
+	
+	if (path[0] == '@')
+	{
+		addr->sun_path[0] = '\0';
+		*length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + size);
+	}
+	else
+	{
+		*length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + size + 1);
+	}
+	
+	return 0;
+}
+
+// A socket file left behind by a server that isn't running anymore refuses connections, but then so does anything else
+// that isn't a socket, which is why the path is checked first
+static bool unix_stale(const char* path, const struct sockaddr_un* addr, socklen_t length)
+{
+	struct stat statbuf;
+	
+	if (lstat(path, &statbuf) < 0 || !S_ISSOCK(statbuf.st_mode))
+	{
+		errno = ENOTSOCK;
+		return false;
+	}
+	
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	
+	if (sockfd < 0)
+	{
+		return false;
+	}
+	
+	bool stale = connect(sockfd, (const struct sockaddr*)addr, length) < 0 && errno == ECONNREFUSED;
+	
+	close(sockfd);
+	
+	return stale;
+}
+
+static int open_unix_listener(const char* path)
+{
+	struct sockaddr_un addr;
+	socklen_t length;
+	
+	if (unix_address(path, &addr, &length) < 0)
+	{
+		fprintf(stderr, "S - Error: Unix socket path %s is not valid\n", path);
+		return -1;
+	}
+	
+	// Create socket
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	
+	if (sockfd < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot create Unix socket: %m\n");
+		return -1;
+	}
+	
+	// Bind address to socket, replacing a stale socket file if there is one but not one that's still in use
+	int retval = bind(sockfd, (struct sockaddr*)&addr, length);
+	
+	if (retval < 0 && errno == EADDRINUSE && path[0] != '@')
+	{
+		if (unix_stale(path, &addr, length))
+		{
+			unlink(path);
+			retval = bind(sockfd, (struct sockaddr*)&addr, length);
+		}
+		else if (errno == ENOTSOCK)
+		{
+			fprintf(stderr, "S - Error: Cannot bind Unix socket to %s: Something that isn't a socket is already there\n", path);
+			close(sockfd);
+			return -1;
+		}
+		else
+		{
+			errno = EADDRINUSE;
+		}
+	}
+	
+	if (retval < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot bind Unix socket to %s: %m\n", path);
+		close(sockfd);
+		return -1;
+	}
+	
+	// Set up socket to listen, with as long a queue as the system allows since every worker shares this one
+	if (listen(sockfd, SOMAXCONN) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot listen on Unix socket %s: %m\n", path);
+		close(sockfd);
+		return -1;
+	}
+	
+	return sockfd;
+}
+
+// Check that an inherited file descriptor is a listening socket on the right port or path
+static bool check_listener(int fd, const struct listener_t* listener)
+{
+	int listening;
+	socklen_t length = sizeof(listening);
+	
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) < 0 || !listening)
+	{
+		return false;
+	}
+	
+	if (listener->path != NULL)
+	{
+		struct sockaddr_un expected;
+		socklen_t expectedLength;
+		
+		if (unix_address(listener->path, &expected, &expectedLength) < 0)
+		{
+			return false;
+		}
+		
+		struct sockaddr_un addr;
+		
+		length = sizeof(addr);
+		
+		if (getsockname(fd, (struct sockaddr*)&addr, &length) < 0 || length != expectedLength || memcmp(&addr, &expected, length) != 0)
+		{
+			return false;
+		}
+		
+		return true;
+	}
+	
+	struct sockaddr_in addr;
+	
+	length = sizeof(addr);
+	
+	if (getsockname(fd, (struct sockaddr*)&addr, &length) < 0 || addr.sin_family != AF_INET || ntohs(addr.sin_port) != listener->port)
+	{
+		return false;
+	}
+	
+	return true;
+}
+
+static void close_listeners(struct supervisor_t* supervisor)
+{
+	for (unsigned int i = 0; i < supervisor->numListeners; i++)
+	{
+		struct listener_t* listener = &supervisor->listeners[i];
+		
+		for (unsigned int j = 0; j < listener->numSockets; j++)
+		{
+			close(listener->sockets[j]);
+		}
+		
+		// A socket file would otherwise be left behind, although the workers can still accept anything already queued
+		if (listener->path != NULL && listener->path[0] != '@' && listener->numSockets > 0)
+		{
+			unlink(listener->path);
+		}
+		
+		listener->numSockets = 0;
+	}
+}
+
+static void free_listeners(struct supervisor_t* supervisor)
+{
+	for (unsigned int i = 0; i < supervisor->numListeners; i++)
+	{
+		free(supervisor->listeners[i].sockets);
+	}
+	
+	free(supervisor->listeners);
+}
+
+static unsigned int count_listeners(struct supervisor_t* supervisor)
+{
+	unsigned int count = 0;
+	
+	for (unsigned int i = 0; i < supervisor->numListeners; i++)
+	{
+		count += supervisor->listeners[i].numSockets;
+	}
+	
+	return count;
+}
+
+static int open_listeners(struct supervisor_t* supervisor)
+{
+	const char* inherited = getenv("SGOPHER_LISTEN_FDS");
+	unsigned int numInherited = 0;
+	
+	// Count the inherited sockets first so there's room for all of them even if there are fewer workers now
+	if (inherited != NULL)
+	{
+		numInherited = 1;
+		
+		for (const char* c = inherited; *c != '\0'; c++)
+		{
+			if (*c == ',')
+			{
+				numInherited++;
+			}
+		}
+	}
+	
+	// There's no telling which port the inherited sockets are for until they've been looked at
+	for (unsigned int i = 0; i < supervisor->numListeners; i++)
+	{
+		supervisor->listeners[i].sockets = calloc(numInherited + supervisor->numWorkers, sizeof(int));
+		
+		if (supervisor->listeners[i].sockets == NULL)
+		{
+			fprintf(stderr, "S - Error: Cannot allocate memory for listening sockets: %m\n");
+			return -1;
+		}
+	}
+	
+	// Take over the sockets from the previous binary
+	if (inherited != NULL)
+	{
+		const char* c = inherited;
+		
+		while (*c != '\0')
+		{
+			char* end;
+			long fd = strtol(c, &end, 10);
+			
+			if (end == c || fd < 0 || fd > INT_MAX)
+			{
+				fprintf(stderr, "S - Error: Malformed SGOPHER_LISTEN_FDS\n");
+				break;
+			}
+			
+			struct listener_t* listener = NULL;
+			
+			for (unsigned int i = 0; i < supervisor->numListeners && listener == NULL; i++)
+			{
+				if (check_listener((int)fd, &supervisor->listeners[i]))
+				{
+					listener = &supervisor->listeners[i];
+				}
+			}
+			
+			if (listener != NULL)
+			{
+				// Don't let CGI programs inherit it
+				fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+				
+				listener->sockets[listener->numSockets++] = (int)fd;
+			}
+			else
+			{
+				fprintf(stderr, "S - Inherited file descriptor %li is not listening on any of our ports or paths, closing it\n", fd);
+				close((int)fd);
+			}
+			
+			c = *end == ',' ? end + 1 : end;
+		}
+		
+		fprintf(stderr, "S - Inherited %u listening sockets\n", count_listeners(supervisor));
+		
+		// Nothing else we run should see this
+		unsetenv("SGOPHER_LISTEN_FDS");
+	}
+	
+	// Open enough new ones for every worker to have at least one on each port, and one for each path
+	for (unsigned int i = 0; i < supervisor->numListeners; i++)
+	{
+		struct listener_t* listener = &supervisor->listeners[i];
+		
+		while (listener->numSockets < (listener->path != NULL ? 1 : supervisor->numWorkers))
+		{
+			int fd = listener->path != NULL ? open_unix_listener(listener->path) : open_listener(listener->port);
+			
+			if (fd < 0)
+			{
+				close_listeners(supervisor);
+				return -1;
+			}
+			
+			listener->sockets[listener->numSockets++] = fd;
+		}
+	}
+	
+	return 0;
+}
+
+// Steer new connections to the first count listening sockets on each port, leaving the rest to drain into workers that
+// are retiring or sit idle for workers that aren't running. The sockets were all bound in order, so their places in the
+// SO_REUSEPORT group match their places in the array and classic BPF can pick one from the connection's hash.
+// A count of UINT_MAX spreads them over all of each port's sockets. Unix sockets are shared, so there's nothing to steer.
+static int steer_listeners(struct supervisor_t* supervisor, unsigned int count)
+{
+	for (unsigned int i = 0; i < supervisor->numListeners; i++)
+	{
+		struct listener_t* listener = &supervisor->listeners[i];
+		
+		if (listener->numSockets == 0 || listener->path != NULL)
+		{
+			continue;
+		}
+		
+		struct sock_filter code[] =
+		{
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_RXHASH)),
+			BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count < listener->numSockets ? count : listener->numSockets),
+			BPF_STMT(BPF_RET | BPF_A, 0)
+		};
+		
+		struct sock_fprog program =
+		{
+			.len = sizeof(code) / sizeof(code[0]),
+			.filter = code
+		};
+		
+		if (setsockopt(listener->sockets[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0)
+		{
+			fprintf(stderr, "S - Error: Cannot attach connection steering program to listening sockets on port %hu: %m\n", listener->port);
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+// Number of connections waiting to be accepted on the sockets that are getting new connections, across all the ports.
+// There's no TCP_INFO for a Unix socket, so those aren't counted.
+static unsigned int listen_queue(struct supervisor_t* supervisor)
+{
+	unsigned int total = 0;
+	
+	for (unsigned int i = 0; i < supervisor->numListeners; i++)
+	{
+		struct listener_t* listener = &supervisor->listeners[i];
+		
+		if (listener->path != NULL)
+		{
+			continue;
+		}
+		
+		for (unsigned int j = 0; j < listener->numSockets && j < supervisor->wantedWorkers; j++)
+		{
+			struct tcp_info info;
+			socklen_t length = sizeof(info);
+			
+			// For a listening socket this is the length of the accept queue
+			if (getsockopt(listener->sockets[j], SOL_TCP, TCP_INFO, &info, &length) == 0)
+			{
+				total += info.tcpi_unacked;
+			}
+		}
+	}
+	
+	return total;
+}
+
+// *********************************************************************
+// Scale the number of workers with the load
+//
+// The load is judged over a window of a few seconds, on how much of the
+// time the workers spend handling events, how full they are, and
+// whether connections are piling up waiting to be accepted. One worker
+// is added at a time as soon as a window looks busy, but one is only
+// retired after a good while of quiet, so it doesn't flap. Retiring a
+// worker steers new connections away from its socket and then sends it
+// SIGQUIT so it finishes up with the clients it has.
+// *********************************************************************
+static void scale_workers(struct supervisor_t* supervisor, uint64_t now)
+{
+	unsigned int queue = listen_queue(supervisor);
+	
+	if (queue > 0)
+	{
+		supervisor->queueTicks++;
+	}
+	
+	if (queue > supervisor->queuePeak)
+	{
+		supervisor->queuePeak = queue;
+	}
+	
+	if (++supervisor->ticks < SCALE_WINDOW)
+	{
+		return;
+	}
+	
+	// Take stock of the running workers over the window
+	uint64_t elapsed = now - supervisor->windowStart;
+	uint64_t busy = 0;
+	uint64_t connections = 0;
+	unsigned int running = 0;
+	
+	for (unsigned int i = 0; i < supervisor->wantedWorkers; i++)
+	{
+		struct worker_t* worker = &supervisor->workers[i];
+		uint64_t workerBusy = __atomic_load_n(&supervisor->metrics[i].busy, __ATOMIC_RELAXED);
+		
+		if (worker->pidfd >= 0)
+		{
+			busy += workerBusy - worker->lastBusy;
+			connections += supervisor->metrics[i].connections;
+			running++;
+		}
+		
+		worker->lastBusy = workerBusy;
+	}
+	
+	unsigned int queueTicks = supervisor->queueTicks;
+	unsigned int queuePeak = supervisor->queuePeak;
+	
+	supervisor->ticks = 0;
+	supervisor->queueTicks = 0;
+	supervisor->queuePeak = 0;
+	supervisor->windowStart = now;
+	
+	if (running == 0 || elapsed == 0)
+	{
+		return;
+	}
+	
+	uint64_t slots = (uint64_t)supervisor->params->maxClients;
+	unsigned int percentBusy = (unsigned int)(busy * 100 / (elapsed * running));
+	
+	bool up = percentBusy >= SCALE_UP_BUSY || connections * 100 >= slots * running * SCALE_UP_CLIENTS || queueTicks * 2 > SCALE_WINDOW;
+	bool down = percentBusy < SCALE_DOWN_BUSY && connections * 100 < slots * (running - 1) * SCALE_DOWN_CLIENTS && queuePeak == 0;
+	
+	supervisor->quietWindows = down ? supervisor->quietWindows + 1 : 0;
+	
+	if (up && supervisor->wantedWorkers < supervisor->numWorkers)
+	{
+		struct worker_t* worker = &supervisor->workers[supervisor->wantedWorkers];
+		
+		// The slot's last worker is still finishing up after being retired, so this will have to wait
+		if (worker->pidfd >= 0)
+		{
+			return;
+		}
+		
+		fprintf(stderr, "S - Workers are %u%% busy with %lu connections and up to %u waiting, adding worker %u\n", percentBusy, (unsigned long)connections, queuePeak, worker->number);
+		
+		supervisor->wantedWorkers++;
+		worker->failures = 0;
+		worker->lastBusy = __atomic_load_n(&supervisor->metrics[worker->number].busy, __ATOMIC_RELAXED);
+		
+		if (spawn_worker(supervisor, worker) < 0)
+		{
+			respawn_worker(supervisor, worker);
+		}
+		
+		// A worker that's warming up would only leave its share of the connections sitting in the queue
+		if (supervisor->params->numWarmup > 0)
+		{
+			supervisor->steerWhenReady = true;
+			wait_until_ready(supervisor, now);
+		}
+		else
+		{
+			steer_listeners(supervisor, supervisor->wantedWorkers);
+		}
+	}
+	else if (supervisor->quietWindows >= SCALE_DOWN_WINDOWS && supervisor->wantedWorkers > supervisor->minWorkers)
+	{
+		struct worker_t* worker = &supervisor->workers[supervisor->wantedWorkers - 1];
+		
+		fprintf(stderr, "S - Workers are %u%% busy with %lu connections, retiring worker %u\n", percentBusy, (unsigned long)connections, worker->number);
+		
+		// Steer connections away first so none land on its socket after it stops accepting
+		supervisor->wantedWorkers--;
+		supervisor->quietWindows = 0;
+		
+		steer_listeners(supervisor, supervisor->wantedWorkers);
+		
+		worker->respawnAt = 0;
+		
+		if (worker->pidfd >= 0 && pidfd_send_signal(worker->pidfd, SIGQUIT, NULL, 0) < 0)
+		{
+			fprintf(stderr, "S - Error: Cannot send signal to child via pidfd: %m\n");
+		}
+	}
+}
+
+// Tell the old workers to stop accepting connections and finish up
+static void retire_drainers(struct supervisor_t* supervisor)
+{
+	for (unsigned int i = 0; i < supervisor->numDrainers; i++)
+	{
+		struct worker_t* worker = &supervisor->drainers[i];
+		
+		if (worker->pidfd >= 0 && pidfd_send_signal(worker->pidfd, SIGQUIT, NULL, 0) < 0)
+		{
+			fprintf(stderr, "S - Error: Cannot tell old worker PID %i to finish up: %m\n", worker->pid);
+		}
+	}
+	
+	fprintf(stderr, "S - Told %u old workers to finish up\n", supervisor->activeDrainers);
+}
+
+// *********************************************************************
+// Take over the workers from the previous binary and tell them to stop
+// accepting connections and finish up, which leaves the listening
+// sockets to the new workers
+// *********************************************************************
+static int adopt_drainers(struct supervisor_t* supervisor)
+{
+	const char* inherited = getenv("SGOPHER_DRAIN_PIDS");
+	
+	if (inherited == NULL)
+	{
+		return 0;
+	}
+	
+	unsigned int count = 1;
+	
+	for (const char* c = inherited; *c != '\0'; c++)
+	{
+		if (*c == ',')
+		{
+			count++;
+		}
+	}
+	
+	supervisor->drainers = calloc(count, sizeof(struct worker_t));
+	
+	if (supervisor->drainers == NULL)
+	{
+		fprintf(stderr, "S - Error: Cannot allocate memory for old workers: %m\n");
+		return -1;
+	}
+	
+	const char* c = inherited;
+	
+	while (*c != '\0' && supervisor->numDrainers < count)
+	{
+		char* end;
+		long pid = strtol(c, &end, 10);
+		
+		if (end == c || pid <= 0 || pid > INT_MAX)
+		{
+			fprintf(stderr, "S - Error: Malformed SGOPHER_DRAIN_PIDS\n");
+			break;
+		}
+		
+		c = *end == ',' ? end + 1 : end;
+		
+		// They're still our children since the PID didn't change with the exec, so this also lets us reap them
+		int pidfd = pidfd_open((pid_t)pid, 0);
+		
+		if (pidfd < 0)
+		{
+			if (errno != ESRCH)
+			{
+				fprintf(stderr, "S - Error: Cannot open pidfd for old worker PID %li: %m\n", pid);
+			}
+			
+			continue;
+		}
+		
+		struct worker_t* worker = &supervisor->drainers[supervisor->numDrainers++];
+		
+		worker->number = supervisor->numDrainers - 1;
+		worker->pid = (pid_t)pid;
+		worker->pidfd = pidfd;
+		worker->draining = true;
+		
+		supervisor->activeDrainers++;
+	}
+	
+	unsetenv("SGOPHER_DRAIN_PIDS");
+	
+	// The new workers don't accept any connections until they've warmed up, so the old ones carry on until then
+	if (supervisor->params->numWarmup > 0)
+	{
+		supervisor->drainWhenReady = true;
+	}
+	else
+	{
+		retire_drainers(supervisor);
+	}
+	
+	return 0;
+}
+
+// *********************************************************************
+// Wait for the workers to warm up their caches and start accepting
+// connections, which each of them reports in the shared metrics, before
+// sending connections their way. They only spend so long warming up, so
+// if they still aren't ready a little while after that, something's
+// gone wrong and there's no point waiting any longer.
+// *********************************************************************
+static void wait_until_ready(struct supervisor_t* supervisor, uint64_t now)
+{
+	unsigned int warmupTime = supervisor->params->warmupTime;
+	
+	if (supervisor->readyDeadline == 0)
+	{
+		supervisor->readySince = now;
+	}
+	
+	supervisor->readyDeadline = warmupTime > 0 ? now + (uint64_t)(warmupTime + WARMUP_SLACK) * 1000000000 : UINT64_MAX;
+}
+
+static void check_ready(struct supervisor_t* supervisor, uint64_t now)
+{
+	if (supervisor->stopping)
+	{
+		supervisor->readyDeadline = 0;
+		return;
+	}
+	
+	unsigned int ready = 0;
+	unsigned int warming = 0;
+	uint64_t last = supervisor->readySince;
+	
+	for (unsigned int i = 0; i < supervisor->wantedWorkers; i++)
+	{
+		if (supervisor->workers[i].pidfd < 0)
+		{
+			continue;
+		}
+		
+		uint64_t readyAt = __atomic_load_n(&supervisor->metrics[i].ready, __ATOMIC_RELAXED);
+		
+		if (readyAt > 0)
+		{
+			ready++;
+			
+			if (readyAt > last)
+			{
+				last = readyAt;
+			}
+		}
+		else
+		{
+			warming++;
+		}
+	}
+	
+	// The workers say when they were ready, which is a better measure than when the supervisor noticed
+	if (warming == 0 && ready > 0)
+	{
+		fprintf(stderr, "S - All %u workers ready after %lu ms\n", ready, (unsigned long)((last - supervisor->readySince) / 1000000));
+	}
+	else if (now + MONITOR_SLACK >= supervisor->readyDeadline)
+	{
+		fprintf(stderr, "S - Gave up waiting for %u workers to warm up after %lu ms\n", warming, (unsigned long)((now - supervisor->readySince) / 1000000));
+	}
+	else
+	{
+		return;
+	}
+	
+	supervisor->readyDeadline = 0;
+	
+	if (supervisor->steerWhenReady)
+	{
+		supervisor->steerWhenReady = false;
+		steer_listeners(supervisor, supervisor->wantedWorkers);
+	}
+	
+	if (supervisor->drainWhenReady)
+	{
+		supervisor->drainWhenReady = false;
+		retire_drainers(supervisor);
+	}
+}
+
+// *********************************************************************
+// Replace this process with a fresh copy of the executable, which takes
+// over the listening sockets and the current workers
+// *********************************************************************
+
+// Append a number to a comma-separated list
+static size_t append_number(char* list, size_t length, long value)
+{
+	return length + (size_t)sprintf(list + length, length > 0 ? ",%li" : "%li", value);
+}
+
+static void supervisor_upgrade(struct supervisor_t* supervisor)
+{
+	if (supervisor->exe == NULL)
+	{
+		fprintf(stderr, "S - Error: Cannot upgrade without knowing where the executable is\n");
+		return;
+	}
+	
+	unsigned int numSockets = count_listeners(supervisor);
+	
+	if (numSockets == 0)
+	{
+		fprintf(stderr, "S - Error: Cannot upgrade while shutting down\n");
+		return;
+	}
+	
+	// Enough room for every number to be as long as an int can get, plus a comma
+	char* fds = malloc(numSockets * 12 + 1);
+	char* pids = malloc((supervisor->numWorkers + supervisor->numCgiWorkers + supervisor->numDrainers) * 12 + 1);
+	
+	if (fds == NULL || pids == NULL)
+	{
+		fprintf(stderr, "S - Error: Cannot allocate memory for upgrade: %m\n");
+		free(fds);
+		free(pids);
+		return;
+	}
+	
+	size_t length = 0;
+	
+	fds[0] = '\0';
+	
+	for (unsigned int i = 0; i < supervisor->numListeners; i++)
+	{
+		for (unsigned int j = 0; j < supervisor->listeners[i].numSockets; j++)
+		{
+			length = append_number(fds, length, supervisor->listeners[i].sockets[j]);
+		}
+	}
+	
+	length = 0;
+	pids[0] = '\0';
+	
+	for (unsigned int i = 0; i < supervisor->numWorkers + supervisor->numCgiWorkers; i++)
+	{
+		if (supervisor->workers[i].pidfd >= 0)
+		{
+			length = append_number(pids, length, supervisor->workers[i].pid);
+		}
+	}
+	
+	for (unsigned int i = 0; i < supervisor->numDrainers; i++)
+	{
+		if (supervisor->drainers[i].pidfd >= 0)
+		{
+			length = append_number(pids, length, supervisor->drainers[i].pid);
+		}
+	}
+	
+	if (setenv("SGOPHER_LISTEN_FDS", fds, 1) < 0 || (length > 0 && setenv("SGOPHER_DRAIN_PIDS", pids, 1) < 0))
+	{
+		fprintf(stderr, "S - Error: Cannot set environment for upgrade: %m\n");
+	}
+	else
+	{
+		// Everything else is close-on-exec, so the listening sockets are the only thing that carries over
+		for (unsigned int i = 0; i < supervisor->numListeners; i++)
+		{
+			for (unsigned int j = 0; j < supervisor->listeners[i].numSockets; j++)
+			{
+				fcntl(supervisor->listeners[i].sockets[j], F_SETFD, 0);
+			}
+		}
+		
+		fprintf(stderr, "S - Upgrading to %s\n", supervisor->exe);
+		
+		execv(supervisor->exe, supervisor->argv);
+		
+		// Only reached if it failed, in which case carry on as before
+		fprintf(stderr, "S - Error: Cannot execute %s: %m\n", supervisor->exe);
+		
+		for (unsigned int i = 0; i < supervisor->numListeners; i++)
+		{
+			for (unsigned int j = 0; j < supervisor->listeners[i].numSockets; j++)
+			{
+				fcntl(supervisor->listeners[i].sockets[j], F_SETFD, FD_CLOEXEC);
+			}
+		}
+	}
+	
+	unsetenv("SGOPHER_LISTEN_FDS");
+	unsetenv("SGOPHER_DRAIN_PIDS");
+	
+	free(fds);
+	free(pids);
+}
+
+// *********************************************************************
+// Stop replacing workers, and exit straight away if there aren't any
+// *********************************************************************
+static void supervisor_stop(struct supervisor_t* supervisor)
+{
+	supervisor->stopping = true;
+	
+	for (unsigned int i = 0; i < supervisor->numWorkers + supervisor->numCgiWorkers; i++)
+	{
+		supervisor->workers[i].respawnAt = 0;
+	}
+	
+	// The CGI pool finishes up once every worker that could hand it something has hung up, and nothing else will be
+	// spawned that needs our end
+	if (supervisor->cgiSockets[0] >= 0)
+	{
+		close(supervisor->cgiSockets[0]);
+		supervisor->cgiSockets[0] = -1;
+	}
+	
+	if (supervisor->activeWorkers == 0 && supervisor->activeDrainers == 0)
+	{
+		sepoll_exit(supervisor->loop);
+	}
+}
+
+// *********************************************************************
+// Handle event on a signalfd
+// *********************************************************************
+static void sigfd_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct supervisor_t* supervisor = userdata1.ptr;
+	
+	while (1)
+	{
+		struct signalfd_siginfo siginfo;
+		
+		if (read(supervisor->sigfd, &siginfo, sizeof(struct signalfd_siginfo)) != sizeof(struct signalfd_siginfo))
+		{
+			if (errno == EAGAIN)
+			{
+				break;
+			}
+			else
+			{
+				fprintf(stderr, "S - Error: Cannot read from signalfd: %m\n");
+				return;
+			}
+		}
+		
+		switch (siginfo.ssi_signo)
+		{
+		case SIGTERM:
+			fprintf(stderr, "S - Received SIGTERM, sending SIGTERM to children\n");
+			
+			supervisor_stop(supervisor);
+			signal_all_workers(supervisor, SIGTERM, false);
+			
+			break;
+		case SIGQUIT:
+			fprintf(stderr, "S - Received SIGQUIT, telling children to finish up\n");
+			
+			// Our copies have to go too for the port to actually close
+			supervisor_stop(supervisor);
+			close_listeners(supervisor);
+			signal_all_workers(supervisor, SIGQUIT, false);
+			
+			break;
+		case SIGUSR2:
+			fprintf(stderr, "S - Received SIGUSR2\n");
+			
+			supervisor_upgrade(supervisor);
+			
+			break;
+		}
+	}
+}
+
+// *********************************************************************
+// Handle event on a pidfd
+// *********************************************************************
+static void pidfd_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct supervisor_t* supervisor = userdata1.ptr;
+	struct worker_t* worker = userdata2.ptr;
+	
+	// Get the exit code and reap the child process
+	siginfo_t siginfo;
+	
+	if (waitid(P_PIDFD, (id_t)worker->pidfd, &siginfo, WEXITED) < 0)
+	{
+		fprintf(stderr, "S - Worker PID %i exited but waitid failed: %m\n", worker->pid);
+	}
+	else
+	{
+		fprintf(stderr, "S - Worker PID %i exited with status %i\n", worker->pid, siginfo.si_status);
+	}
+	
+	// Deal with the file descriptor
+	sepoll_remove(supervisor->loop, worker->pidfd);
+	close(worker->pidfd);
+	
+	worker->pidfd = -1;
+	
+	if (worker->draining)
+	{
+		supervisor->activeDrainers--;
+	}
+	else
+	{
+		supervisor->activeWorkers--;
+		
+		// It can't clear these itself anymore
+		supervisor->metrics[worker->number].connections = 0;
+		supervisor->metrics[worker->number].started = 0;
+		
+		// Replace it unless we're on our way out or it was retired, which the CGI pool never is
+		if (!supervisor->stopping && (worker->cgi || worker->number < supervisor->wantedWorkers))
+		{
+			respawn_worker(supervisor, worker);
+		}
+	}
+	
+	// Exit the event loop if there are no more active workers and no more coming
+	if (supervisor->stopping && supervisor->activeWorkers == 0 && supervisor->activeDrainers == 0)
+	{
+		sepoll_exit(supervisor->loop);
+	}
+}
+
+// *********************************************************************
+// Metrics reporting
+//
+// Anything that connects to the metrics port gets a report as soon as
+// it sends something, wrapped in just enough HTTP for a Prometheus
+// scraper or curl to be happy with it. The report is written out to a
+// memfd in one go, which never blocks, and then trickled out to the
+// connection with sendfile from the event loop as it has room for it,
+// so a slow scraper can't hold up looking after the workers. A
+// connection that doesn't send a request or take any of its report for
+// METRICS_IDLE_TIMEOUT seconds is closed by the monitor timer.
+// *********************************************************************
+
+// Size of the buffer the report is put together in before it's written to the memfd
+#define METRICS_BUFFER_SIZE 16384
+
+static void metrics_client_close(struct supervisor_t* supervisor, struct metrics_client_t* client)
+{
+	if (client->fd >= 0)
+	{
+		sepoll_remove(supervisor->loop, client->fd);
+		close(client->fd);
+		client->fd = -1;
+	}
+	
+	if (client->report >= 0)
+	{
+		close(client->report);
+		client->report = -1;
+	}
+}
+
+// Write out the report to a memfd to be sent from, returning 0 on success or a negative errno
+static int metrics_client_report(struct supervisor_t* supervisor, struct metrics_client_t* client)
+{
+	client->report = memfd_create("sgopher-metrics", MFD_CLOEXEC);
+	
+	if (client->report < 0)
+	{
+		return -errno;
+	}
+	
+	char buffer[METRICS_BUFFER_SIZE];
+	struct sbuffer_t sbuffer;
+	
+	// Writing to a memfd never blocks, so the timeout never comes into it
+	sbuffer_init(&sbuffer, client->report, 0, buffer, sizeof(buffer));
+	sbuffer_push(&sbuffer, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+	
+	int retval = smetrics_write(&sbuffer, supervisor->metrics, supervisor->numWorkers + supervisor->numCgiWorkers);
+	
+	if (retval < 0)
+	{
+		return retval;
+	}
+	
+	client->offset = 0;
+	client->size = (off_t)sbuffer.written;
+	
+	return 0;
+}
+
+static void metrics_client_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct supervisor_t* supervisor = userdata1.ptr;
+	struct metrics_client_t* client = userdata2.ptr;
+	
+	if (client->report < 0)
+	{
+		if (!(events & EPOLLIN))
+		{
+			// Hung up or errored before asking for anything
+			metrics_client_close(supervisor, client);
+			return;
+		}
+		
+		// Every request gets the same answer, so there's no need to look at it
+		char request[1024];
+		
+		while (read(client->fd, request, sizeof(request)) > 0);
+		
+		int retval = metrics_client_report(supervisor, client);
+		
+		if (retval < 0)
+		{
+			errno = -retval;
+			fprintf(stderr, "S - Error: Cannot write metrics report: %m\n");
+			metrics_client_close(supervisor, client);
+			return;
+		}
+		
+		// Nothing more is read from it, so it's only waiting to be able to send from here on
+		sepoll_mod_events(supervisor->loop, client->fd, EPOLLOUT);
+	}
+	
+	while (client->offset < client->size)
+	{
+		ssize_t n = sendfile(client->fd, client->report, &client->offset, (size_t)(client->size - client->offset));
+		
+		if (n < 0)
+		{
+			if (errno == EAGAIN)
+			{
+				// Wait for room, and start the clock again since it's taken some
+				client->deadline = monotonic_time() + (uint64_t)METRICS_IDLE_TIMEOUT * 1000000000;
+				return;
+			}
+			
+			if (errno != EPIPE && errno != ECONNRESET)
+			{
+				fprintf(stderr, "S - Error: Cannot send metrics: %m\n");
+			}
+			
+			break;
+		}
+	}
+	
+	metrics_client_close(supervisor, client);
+}
+
+static void metrics_listen_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct supervisor_t* supervisor = userdata1.ptr;
+	
+	while (1)
+	{
+		int fd = accept4(supervisor->metricsfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		
+		if (fd < 0)
+		{
+			if (errno != EAGAIN)
+			{
+				fprintf(stderr, "S - Error: Cannot accept metrics connection: %m\n");
+			}
+			
+			break;
+		}
+		
+		struct metrics_client_t* client = NULL;
+		
+		for (unsigned int i = 0; i < METRICS_CLIENTS_MAX; i++)
+		{
+			if (supervisor->metricsClients[i].fd < 0)
+			{
+				client = &supervisor->metricsClients[i];
+				break;
+			}
+		}
+		
+		if (client == NULL)
+		{
+			// Nothing should need this many at once, so whoever it is can try again later
+			close(fd);
+			continue;
+		}
+		
+		client->fd = fd;
+		client->deadline = monotonic_time() + (uint64_t)METRICS_IDLE_TIMEOUT * 1000000000;
+		
+		sepoll_add(supervisor->loop, fd, EPOLLIN | EPOLLRDHUP, metrics_client_event, supervisor, client);
+	}
+}
+
+// Close connections to the metrics port that have gone quiet, from the monitor timer
+static void metrics_check_idle(struct supervisor_t* supervisor, uint64_t now)
+{
+	for (unsigned int i = 0; i < METRICS_CLIENTS_MAX; i++)
+	{
+		struct metrics_client_t* client = &supervisor->metricsClients[i];
+		
+		if (client->fd >= 0 && now >= client->deadline)
+		{
+			metrics_client_close(supervisor, client);
+		}
+	}
+}
+
+static int open_metrics_socket(unsigned short port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	
+	if (fd < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot open metrics socket: %m\n");
+		return -1;
+	}
+	
+	int optval = 1;
+	
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot set SO_REUSEADDR on metrics socket: %m\n");
+		close(fd);
+		return -1;
+	}
+	
+	// Loopback only, since the numbers are nobody else's business
+	struct sockaddr_in addr =
+	{
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+	
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot bind metrics socket to port %hu: %m\n", port);
+		close(fd);
+		return -1;
+	}
+	
+	if (listen(fd, SOMAXCONN) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot listen on metrics socket: %m\n");
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+// *********************************************************************
+// Search index
+//
+// Building the index is broken up into slices small enough that the
+// supervisor doesn't keep the workers waiting on it for long, and a
+// one-shot timer says when the next one is due. Anything inotify has to
+// say brings that forward, and the builder decides how long to let
+// things settle before writing out a new snapshot.
+// *********************************************************************
+
+// How long to work on the index at a time, in nanoseconds
+#define SEARCH_SLICE 20000000
+
+static void search_schedule(struct supervisor_t* supervisor, int delay)
+{
+	// A zero timer disarms it, so nothing is ever due sooner than a millisecond from now
+	struct itimerspec timer = {0};
+	
+	if (delay >= 0)
+	{
+		if (delay == 0)
+		{
+			delay = 1;
+		}
+		
+		timer.it_value.tv_sec = delay / 1000;
+		timer.it_value.tv_nsec = (delay % 1000) * 1000000;
+	}
+	
+	if (timerfd_settime(supervisor->searchfd, 0, &timer, NULL) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot set search timerfd: %m\n");
+	}
+}
+
+static void search_timer_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct supervisor_t* supervisor = userdata1.ptr;
+	
+	uint64_t expirations;
+	
+	if (read(supervisor->searchfd, &expirations, sizeof(expirations)) < 0)
+	{
+		return;
+	}
+	
+	search_schedule(supervisor, ssearch_builder_work(supervisor->search, SEARCH_SLICE));
+}
+
+static void search_notify_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct supervisor_t* supervisor = userdata1.ptr;
+	
+	ssearch_builder_notify(supervisor->search);
+	search_schedule(supervisor, 0);
+}
+
+// *********************************************************************
+// Turn PREFIX=HOST:PORT into a route for the workers, with the port
+// defaulting to 70, and look up the host's address
+// *********************************************************************
+static int parse_proxy(const char* spec, struct sproxy_route_t* route)
+{
+	const char* equals = strchr(spec, '=');
+	
+	if (equals == NULL || equals[1] == '\0')
+	{
+		fprintf(stderr, "S - Error: Upstream server %s isn't of the form PREFIX=HOST:PORT\n", spec);
+		return -1;
+	}
+	
+	route->prefixLength = (size_t)(equals - spec);
+	
+	// Same rules as the search selector, since the prefix is matched against requests much the same way
+	if (spec[0] != '/' || route->prefixLength < 2 || spec[route->prefixLength - 1] == '/')
+	{
+		fprintf(stderr, "S - Error: Upstream prefix for %s must start with a slash and not end with one\n", spec);
+		return -1;
+	}
+	
+	const char* host = equals + 1;
+	const char* colon = strrchr(host, ':');
+	unsigned long port = 70;
+	
+	if (colon != NULL)
+	{
+		char* end;
+		
+		port = strtoul(colon + 1, &end, 10);
+		
+		if (colon[1] == '\0' || *end != '\0' || port == 0 || port > 65535)
+		{
+			fprintf(stderr, "S - Error: Upstream port for %s isn't valid\n", spec);
+			return -1;
+		}
+	}
+	
+	route->prefix = strndup(spec, route->prefixLength);
+	route->host = colon != NULL ? strndup(host, (size_t)(colon - host)) : host;
+	route->port = (unsigned short)port;
+	
+	if (route->prefix == NULL || route->host == NULL)
+	{
+		fprintf(stderr, "S - Error: Cannot allocate memory for upstream server: %m\n");
+		return -1;
+	}
+	
+	struct addrinfo hints =
+	{
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM
+	};
+	
+	struct addrinfo* result;
+	
+	int retval = getaddrinfo(route->host, NULL, &hints, &result);
+	
+	if (retval != 0)
+	{
+		fprintf(stderr, "S - Error: Cannot look up upstream server %s: %s\n", route->host, gai_strerror(retval));
+		return -1;
+	}
+	
+	memcpy(&route->address, result->ai_addr, sizeof(route->address));
+	route->address.sin_port = htons(route->port);
+	
+	freeaddrinfo(result);
+	
+	return 0;
+}
+
+// *********************************************************************
+// Read the list of selectors to warm up with, one per line, skipping
+// blank lines and comments starting with #. Anything after a tab is
+// left off, so a line can be copied straight out of a gophermap.
+// *********************************************************************
+static int read_warmup(const char* path, struct server_params_t* params)
+{
+	FILE* file = fopen(path, "re");
+	
+	if (file == NULL)
+	{
+		fprintf(stderr, "S - Error: Cannot open warm-up list %s: %m\n", path);
+		return -1;
+	}
+	
+	char* line = NULL;
+	size_t size = 0;
+	unsigned int capacity = 0;
+	
+	while (getline(&line, &size, file) >= 0)
+	{
+		line[strcspn(line, "\t\r\n")] = '\0';
+		
+		if (line[0] == '\0' || line[0] == '#')
+		{
+			continue;
+		}
+		
+		if (params->numWarmup == capacity)
+		{
+			capacity = capacity > 0 ? 2 * capacity : 64;
+			
+			char** warmup = realloc(params->warmup, capacity * sizeof(char*));
+			
+			if (warmup == NULL)
+			{
+				fprintf(stderr, "S - Error: Cannot allocate memory for warm-up list: %m\n");
+				free(line);
+				fclose(file);
+				return -1;
+			}
+			
+			params->warmup = warmup;
+		}
+		
+		// The line becomes the entry and getline allocates another
+		params->warmup[params->numWarmup++] = line;
+		
+		line = NULL;
+		size = 0;
+	}
+	
+	free(line);
+	fclose(file);
+	
+	return 0;
+}
+
+// *********************************************************************
+// Supervisor cleanup function for on_exit
+// *********************************************************************
+static void supervisor_cleanup(int code, void* arg)
+{
+	struct supervisor_t* supervisor = arg;
+	
+	// Workers that are replaced after this was registered inherit it, but it's none of their business
+	if (getpid() != supervisor->pid)
+	{
+		return;
+	}
+	
+	if (supervisor->workers != NULL)
+	{
+		// On a successful exit the children should have exited already
+		if (code == EXIT_FAILURE)
+		{
+			signal_all_workers(supervisor, SIGKILL, true);
+		}
+		
+		free(supervisor->workers);
+	}
+	
+	// Any old workers were taken care of along with the rest
+	if (supervisor->drainers != NULL)
+	{
+		free(supervisor->drainers);
+	}
+	
+	close_listeners(supervisor);
+	free_listeners(supervisor);
+	free(supervisor->exe);
+	stls_context_destroy(supervisor->params->tls);
+	
+	if (supervisor->sigfd >= 0)
+	{
+		close(supervisor->sigfd);
+	}
+	
+	for (unsigned int i = 0; i < 2; i++)
+	{
+		if (supervisor->cgiSockets[i] >= 0)
+		{
+			close(supervisor->cgiSockets[i]);
+		}
+	}
+	
+	if (supervisor->metricsfd >= 0)
+	{
+		close(supervisor->metricsfd);
+	}
+	
+	for (unsigned int i = 0; i < METRICS_CLIENTS_MAX; i++)
+	{
+		metrics_client_close(supervisor, &supervisor->metricsClients[i]);
+	}
+	
+	if (supervisor->monitorfd >= 0)
+	{
+		close(supervisor->monitorfd);
+	}
+	
+	if (supervisor->searchfd >= 0)
+	{
+		close(supervisor->searchfd);
+	}
+	
+	if (supervisor->search != NULL)
+	{
+		ssearch_builder_destroy(supervisor->search);
+	}
+	
+	if (supervisor->loop != NULL)
+	{
+		sepoll_destroy(supervisor->loop);
+	}
+	
+	sfree(supervisor->metrics);
+	
+	free(supervisor);
+}
+
+// *********************************************************************
+// Main
+// *********************************************************************
+int main(int argc, char* argv[])
+{
+	// argp parser options
 	struct argp argp_parser = {argp_options, argp_parse_options, 0, argp_doc};
 	
 	// Default argument values
@@ -281,10 +2416,52 @@ int main(int argc, char* argv[])
 		.directory = "./gopherroot",
 		.hostname = "localhost",
 		.indexfile = ".gophermap",
+		.outsideLinks = 0,
+		.templates = 0,
+		.rfc1436 = 0,
+		.textCache = NULL,
+		.search = NULL,
+		.searchIndex = NULL,
 		.maxClients = 1000,
 		.port = 70,
 		.timeout = 10,
-		.numWorkers = 1
+		.numWorkers = 1,
+		.minWorkers = 0,
+		.maxWorkers = 0,
+		.numCgiWorkers = 0,
+		.rateLimit = 0,
+		.workerRateLimit = 0,
+		.priorityThreshold = 65536,
+		.requestTimeout = 5,
+		.deadline = 0,
+		.deadlineRate = 0,
+		.minRate = 0,
+		.largeFile = 8388608,
+		.dropBehind = 0,
+		.notsentLowat = 131072,
+		.cork = 0,
+		.cacheSize = 0,
+		.cacheFileSize = 65536,
+		.cacheAdmit = 1,
+		.zerocopy = 0,
+		.accessLog = NULL,
+		.accessLogSize = 65536,
+		.metricsPort = 0,
+		.loopStats = 0,
+		.busyPoll = 0,
+		.drainTime = 30,
+		.stallTime = 10,
+		.tlsPort = 0,
+		.tlsCert = NULL,
+		.tlsKey = NULL,
+		.tlsZerocopy = 0,
+		.numUnixPaths = 0,
+		.numProxies = 0,
+		.proxyTtl = 60,
+		.proxyCacheSize = 16777216,
+		.proxyFileSize = 1048576,
+		.warmup = NULL,
+		.warmupTime = 5
 	};
 	
 	// Parse arguments
@@ -294,11 +2471,161 @@ int main(int argc, char* argv[])
 	fprintf(stderr, "S - Serving files from %s\n", args.directory);
 	fprintf(stderr, "S - Hostname is %s\n", args.hostname);
 	fprintf(stderr, "S - Index filename is %s\n", args.indexfile);
+	
+	if (args.templates)
+	{
+		fprintf(stderr, "S - Index files are templates\n");
+	}
+	
+	if (args.rfc1436)
+	{
+		fprintf(stderr, "S - Gophermaps end with a period\n");
+		
+		if (args.textCache != NULL)
+		{
+			fprintf(stderr, "S - Text files are converted into %s\n", args.textCache);
+		}
+	}
+	else if (args.textCache != NULL)
+	{
+		fprintf(stderr, "S - Error: Text files are only converted in RFC 1436 mode\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	if (args.search != NULL)
+	{
+		size_t length = strlen(args.search);
+		
+		// Requests are matched against it as they come in, with the query split off
+		if (args.search[0] != '/' || length < 2 || args.search[length - 1] == '/')
+		{
+			fprintf(stderr, "S - Error: The search selector must start with a slash and not end with one\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		if (args.searchIndex == NULL)
+		{
+			fprintf(stderr, "S - Error: Search needs somewhere to keep its index\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		fprintf(stderr, "S - Answering searches at %s with the index kept in %s\n", args.search, args.searchIndex);
+	}
+	else if (args.searchIndex != NULL)
+	{
+		fprintf(stderr, "S - Error: The search index is only kept with a search selector\n");
+		exit(EXIT_FAILURE);
+	}
+	
 	fprintf(stderr, "S - Maximum number of clients is %u\n", args.maxClients);
 	fprintf(stderr, "S - Listening on port %hu\n", args.port);
 	fprintf(stderr, "S - Timeout is %u seconds\n", args.timeout);
 	fprintf(stderr, "S - Spawning %u workers\n", args.numWorkers);
 	
+	if (args.minWorkers == 0)
+	{
+		args.minWorkers = args.numWorkers;
+	}
+	
+	if (args.maxWorkers == 0)
+	{
+		args.maxWorkers = args.numWorkers;
+	}
+	
+	if (args.minWorkers > args.numWorkers || args.maxWorkers < args.numWorkers)
+	{
+		fprintf(stderr, "S - Error: The number of workers must be between the minimum and maximum\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	if (args.minWorkers < args.maxWorkers)
+	{
+		fprintf(stderr, "S - Scaling between %u and %u workers with the load\n", args.minWorkers, args.maxWorkers);
+	}
+	
+	if (args.numCgiWorkers > 0)
+	{
+		fprintf(stderr, "S - Running CGI programs in a pool of %u workers\n", args.numCgiWorkers);
+	}
+	
+	fprintf(stderr, "S - Request timeout is %u seconds\n", args.requestTimeout);
+	
+	if (args.deadline > 0)
+	{
+		fprintf(stderr, "S - Transfer deadline is %u seconds plus one second per %u bytes\n", args.deadline, args.deadlineRate);
+	}
+	
+	if (args.minRate > 0)
+	{
+		fprintf(stderr, "S - Minimum transfer rate is %u bytes/s\n", args.minRate);
+	}
+	
+	if (args.largeFile > 0)
+	{
+		fprintf(stderr, "S - Streaming files of %lu bytes or more\n", args.largeFile);
+	}
+	
+	if (args.cacheSize > 0)
+	{
+		fprintf(stderr, "S - Response cache is %lu bytes per worker for files up to %u bytes\n", args.cacheSize, args.cacheFileSize);
+		
+		if (args.cacheAdmit > 1)
+		{
+			fprintf(stderr, "S - Files are cached once they've been asked for %u times lately\n", args.cacheAdmit);
+		}
+	}
+	
+	if (args.zerocopy > 0)
+	{
+		fprintf(stderr, "S - Zero-copy sends for responses of %u bytes or more\n", args.zerocopy);
+	}
+	
+	if (args.accessLog != NULL)
+	{
+		if (args.accessLogSize == 0)
+		{
+			fprintf(stderr, "S - Error: Access log must hold at least one record\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		fprintf(stderr, "S - Access log is %s.N with %lu records per worker\n", args.accessLog, args.accessLogSize);
+	}
+	
+	if (args.stallTime == 1)
+	{
+		fprintf(stderr, "S - Error: Workers only check in once a second, so the stall time must be at least 2 seconds\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	if ((args.rateLimit > 0 && args.rateLimit < RATE_LIMIT_MIN) || (args.workerRateLimit > 0 && args.workerRateLimit < RATE_LIMIT_MIN))
+	{
+		fprintf(stderr, "S - Error: Rate limits must be at least %u bytes/s\n", RATE_LIMIT_MIN);
+		exit(EXIT_FAILURE);
+	}
+	
+	if (args.rateLimit > 0 || args.workerRateLimit > 0)
+	{
+		fprintf(stderr, "S - Rate limit is %u bytes/s per client and %u bytes/s per worker for files over %u bytes\n", args.rateLimit, args.workerRateLimit, args.priorityThreshold);
+	}
+	
+	// Upstream addresses are looked up once, here, so the workers never have to block on DNS
+	struct sproxy_route_t proxyRoutes[PROXY_ROUTES_MAX];
+	
+	for (unsigned int i = 0; i < args.numProxies; i++)
+	{
+		if (parse_proxy(args.proxies[i], &proxyRoutes[i]) < 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+		
+		fprintf(stderr, "S - Passing %s on to %s port %hu\n", proxyRoutes[i].prefix, proxyRoutes[i].host, proxyRoutes[i].port);
+	}
+	
+	if (args.numProxies > 0)
+	{
+		fprintf(stderr, "S - Keeping upstream responses of up to %lu bytes for %u seconds in %lu bytes per worker\n", args.proxyFileSize, args.proxyTtl, args.proxyCacheSize);
+	}
+	
 	// Copy arguments to server parameters
 	// In the future these could potentially also come from config files
 	struct server_params_t params =
@@ -308,9 +2635,102 @@ int main(int argc, char* argv[])
 		.port = args.port,
 		.maxClients = args.maxClients,
 		.indexfile = args.indexfile,
-		.timeout = args.timeout
+		.outsideLinks = args.outsideLinks,
+		.templates = args.templates,
+		.rfc1436 = args.rfc1436,
+		.textCache = args.textCache,
+		.search = args.search,
+		.searchIndex = args.searchIndex,
+		.timeout = args.timeout,
+		.rateLimit = args.rateLimit,
+		.workerRateLimit = args.workerRateLimit,
+		.priorityThreshold = args.priorityThreshold,
+		.requestTimeout = args.requestTimeout,
+		.deadline = args.deadline,
+		.deadlineRate = args.deadlineRate,
+		.minRate = args.minRate,
+		.largeFile = args.largeFile,
+		.dropBehind = args.dropBehind,
+		.notsentLowat = args.notsentLowat,
+		.cork = args.cork,
+		.cacheSize = args.cacheSize,
+		.cacheFileSize = args.cacheFileSize,
+		.cacheAdmit = args.cacheAdmit,
+		.zerocopy = args.zerocopy,
+		.accessLog = args.accessLog,
+		.accessLogSize = args.accessLogSize,
+		.loopStats = args.loopStats,
+		.busyPoll = args.busyPoll,
+		.drainTime = args.drainTime,
+		.tlsPort = args.tlsPort,
+		.tls = NULL,
+		.cgiSocket = -1,
+		.cgiPool = 0,
+		.proxyRoutes = proxyRoutes,
+		.numProxyRoutes = args.numProxies,
+		.proxyTtl = args.proxyTtl,
+		.proxyCacheSize = args.proxyCacheSize,
+		.proxyFileSize = args.proxyFileSize,
+		.warmup = NULL,
+		.numWarmup = 0,
+		.warmupTime = args.warmupTime
 	};
 	
+	// The list is read once here and every worker gets a copy with the fork
+	if (args.warmup != NULL)
+	{
+		if (read_warmup(args.warmup, &params) < 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+		
+		if (args.warmupTime > 0)
+		{
+			fprintf(stderr, "S - Warming up with %u selectors from %s for up to %u seconds\n", params.numWarmup, args.warmup, args.warmupTime);
+		}
+		else
+		{
+			fprintf(stderr, "S - Warming up with %u selectors from %s\n", params.numWarmup, args.warmup);
+		}
+	}
+	
+	// Load the certificate once up front, so a bad one is caught straight away and the workers all share the context
+	if (args.tlsPort > 0)
+	{
+		if (!stls_available())
+		{
+			fprintf(stderr, "S - Error: TLS support was not built in, rebuild with make TLS=1\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		if (args.tlsCert == NULL)
+		{
+			fprintf(stderr, "S - Error: TLS needs a certificate\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		if (args.tlsPort == args.port)
+		{
+			fprintf(stderr, "S - Error: TLS needs a port of its own\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		params.tls = stls_context_create(args.tlsCert, args.tlsKey != NULL ? args.tlsKey : args.tlsCert, args.tlsZerocopy);
+		
+		if (params.tls == NULL)
+		{
+			fprintf(stderr, "S - Error: Cannot load TLS certificate from %s: %s\n", args.tlsCert, stls_error());
+			exit(EXIT_FAILURE);
+		}
+		
+		fprintf(stderr, "S - Listening for TLS on port %hu\n", args.tlsPort);
+	}
+	
+	for (unsigned int i = 0; i < args.numUnixPaths; i++)
+	{
+		fprintf(stderr, "S - Listening on Unix socket %s\n", args.unixPaths[i]);
+	}
+	
 	// Where we're going we only need stderr
 	int devnull = open("/dev/null", O_RDWR);
 	
@@ -345,64 +2765,171 @@ int main(int argc, char* argv[])
 		exit(EXIT_FAILURE);
 	}
 	
-	supervisor->numWorkers = args.numWorkers;
+	supervisor->numWorkers = args.maxWorkers;
+	supervisor->numCgiWorkers = args.numCgiWorkers;
+	supervisor->wantedWorkers = args.numWorkers;
+	supervisor->minWorkers = args.minWorkers;
+	supervisor->scaling = args.minWorkers < args.maxWorkers;
+	supervisor->ticks = 0;
+	supervisor->queueTicks = 0;
+	supervisor->queuePeak = 0;
+	supervisor->quietWindows = 0;
+	supervisor->windowStart = monotonic_time();
+	supervisor->readySince = 0;
+	supervisor->readyDeadline = 0;
+	supervisor->steerWhenReady = false;
+	supervisor->drainWhenReady = false;
 	supervisor->activeWorkers = 0;
 	supervisor->sigfd = -1;
 	supervisor->loop = NULL;
+	supervisor->metricsfd = -1;
+	supervisor->monitorfd = -1;
+	
+	for (unsigned int i = 0; i < METRICS_CLIENTS_MAX; i++)
+	{
+		supervisor->metricsClients[i].fd = -1;
+		supervisor->metricsClients[i].report = -1;
+	}
+	
+	supervisor->search = NULL;
+	supervisor->searchfd = -1;
+	supervisor->pid = getpid();
+	supervisor->params = &params;
+	supervisor->stopping = false;
+	supervisor->stallTime = args.stallTime;
+	supervisor->listeners = NULL;
+	supervisor->numListeners = 0;
+	supervisor->cgiSockets[0] = -1;
+	supervisor->cgiSockets[1] = -1;
+	supervisor->drainers = NULL;
+	supervisor->numDrainers = 0;
+	supervisor->activeDrainers = 0;
+	supervisor->argv = argv;
+	
+	// Remember where the executable is now, since an upgrade may well have replaced it by the time it's needed
+	supervisor->exe = realpath("/proc/self/exe", NULL);
+	
+	if (supervisor->exe == NULL)
+	{
+		fprintf(stderr, "S - Error: Cannot find the executable, upgrades will not be possible: %m\n");
+	}
+	
+	// Plain Gopher always has a port, TLS gets one of its own if it's turned on, and then there are any Unix sockets
+	supervisor->listeners = calloc(2 + args.numUnixPaths, sizeof(struct listener_t));
+	
+	if (supervisor->listeners == NULL)
+	{
+		fprintf(stderr, "S - Error: Cannot allocate memory for listening sockets: %m\n");
+		free(supervisor->exe);
+		free(supervisor);
+		exit(EXIT_FAILURE);
+	}
+	
+	supervisor->listeners[supervisor->numListeners++].port = args.port;
+	
+	if (params.tls != NULL)
+	{
+		supervisor->listeners[supervisor->numListeners].port = args.tlsPort;
+		supervisor->listeners[supervisor->numListeners].tls = true;
+		supervisor->numListeners++;
+	}
+	
+	for (unsigned int i = 0; i < args.numUnixPaths; i++)
+	{
+		supervisor->listeners[supervisor->numListeners++].path = args.unixPaths[i];
+	}
+	
+	// Open or inherit the listening sockets before anything else so they're ready for the workers
+	bool upgrading = getenv("SGOPHER_LISTEN_FDS") != NULL;
+	
+	if (open_listeners(supervisor) < 0)
+	{
+		free_listeners(supervisor);
+		free(supervisor->exe);
+		free(supervisor);
+		exit(EXIT_FAILURE);
+	}
+	
+	// With room for more workers than are running, connections have to be kept off the spare sockets, and sockets
+	// handed down by an upgrade may still be steered however the old binary left them
+	if (supervisor->scaling)
+	{
+		if (steer_listeners(supervisor, supervisor->wantedWorkers) < 0)
+		{
+			close_listeners(supervisor);
+			free_listeners(supervisor);
+			free(supervisor->exe);
+			free(supervisor);
+			exit(EXIT_FAILURE);
+		}
+	}
+	else if (upgrading)
+	{
+		steer_listeners(supervisor, UINT_MAX);
+	}
+	
+	// Allocate the metrics in shared memory so the workers can write to them and the supervisor can read them
+	supervisor->metrics = scalloc(supervisor->numWorkers + supervisor->numCgiWorkers, sizeof(struct smetrics_worker_t));
+	
+	if (supervisor->metrics == NULL)
+	{
+		fprintf(stderr, "S - Error: Cannot allocate shared memory for metrics: %m\n");
+		close_listeners(supervisor);
+		free_listeners(supervisor);
+		free(supervisor->exe);
+		free(supervisor);
+		exit(EXIT_FAILURE);
+	}
 	
 	// Allocate and set up workers
-	supervisor->workers = calloc(supervisor->numWorkers, sizeof(struct worker_t));
+	supervisor->workers = calloc(supervisor->numWorkers + supervisor->numCgiWorkers, sizeof(struct worker_t));
 	
 	if (supervisor->workers == NULL)
 	{
 		fprintf(stderr, "S - Error: Cannot allocate memory for workers: %m\n");
+		sfree(supervisor->metrics);
+		close_listeners(supervisor);
+		free_listeners(supervisor);
+		free(supervisor->exe);
 		free(supervisor);
 		exit(EXIT_FAILURE);
 	}
 	
-	for (unsigned int i = 0; i < supervisor->numWorkers; i++)
+	for (unsigned int i = 0; i < supervisor->numWorkers + supervisor->numCgiWorkers; i++)
 	{
+		supervisor->workers[i].number = i;
 		supervisor->workers[i].pidfd = -1;
+		supervisor->workers[i].cgi = i >= supervisor->numWorkers;
+	}
+	
+	// The pool's socket keeps message boundaries, so each handoff arrives whole, and it's left to the kernel to queue
+	// them up until a worker in the pool gets to them
+	if (supervisor->numCgiWorkers > 0 && socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, supervisor->cgiSockets) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot create socket for the CGI pool: %m\n");
+		free(supervisor->workers);
+		sfree(supervisor->metrics);
+		close_listeners(supervisor);
+		free_listeners(supervisor);
+		free(supervisor->exe);
+		free(supervisor);
+		exit(EXIT_FAILURE);
 	}
 	
 	// Spawn worker processes
-	for (unsigned int i = 0; i < supervisor->numWorkers; i++)
+	for (unsigned int i = 0; i < supervisor->wantedWorkers; i++)
 	{
-		int pidfd;
-		
-		// This custom fork returns both a pid and a pidfd to the parent
-		pid_t pid = sfork(&pidfd, 0);
-		
-		if (pid == 0) // Worker
-		{
-			// Close pidfds
-			for (unsigned int j = 0; j < i; j++)
-			{
-				close(supervisor->workers[j].pidfd);
-			}
-			
-			// No point keeping these around in the worker process
-			free(supervisor->workers);
-			free(supervisor);
-			
-			// This does not return
-			server_process(&params);
-		}
-		else if (pid < 0) // Error
-		{
-			fprintf(stderr, "S - Error: Cannot fork worker process %u - %m\n", i);
-		}
-		else // Parent
-		{
-			fprintf(stderr, "S - Spawned worker process %u (PID %i)\n", i, pid);
-			
-			// Keep track of the forked worker
-			supervisor->workers[i].number = i;
-			supervisor->workers[i].pid = pid;
-			supervisor->workers[i].pidfd = pidfd;
-			
-			supervisor->activeWorkers++;
-		}
+		spawn_worker(supervisor, &supervisor->workers[i]);
+	}
+	
+	for (unsigned int i = 0; i < supervisor->numCgiWorkers; i++)
+	{
+		spawn_worker(supervisor, &supervisor->workers[supervisor->numWorkers + i]);
+	}
+	
+	if (params.numWarmup > 0)
+	{
+		wait_until_ready(supervisor, monotonic_time());
 	}
 	
 	// Supervisor task begins here
@@ -414,20 +2941,38 @@ int main(int argc, char* argv[])
 		fprintf(stderr, "S - Could not spawn any workers!\n");
 		exit(EXIT_FAILURE);
 	}
-	else if (supervisor->activeWorkers < supervisor->numWorkers)
+	else if (supervisor->activeWorkers < supervisor->wantedWorkers + supervisor->numCgiWorkers)
 	{
-		fprintf(stderr, "S - Could only spawn %u workers instead of the requested %u\n", supervisor->activeWorkers, supervisor->numWorkers);
+		fprintf(stderr, "S - Could only spawn %u workers instead of the requested %u, trying again shortly\n", supervisor->activeWorkers, supervisor->wantedWorkers + supervisor->numCgiWorkers);
+		
+		for (unsigned int i = 0; i < supervisor->numWorkers + supervisor->numCgiWorkers; i++)
+		{
+			if (supervisor->workers[i].pidfd < 0 && (supervisor->workers[i].cgi || i < supervisor->wantedWorkers))
+			{
+				supervisor->workers[i].failures = 1;
+				supervisor->workers[i].respawnAt = monotonic_time() + 1000000000;
+			}
+		}
 	}
 	else
 	{
 		fprintf(stderr, "S - All workers spawned\n");
 	}
 	
+	// Now that the new workers are on their way, the old ones can stop accepting connections, or will once the new ones
+	// have warmed up
+	if (adopt_drainers(supervisor) < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+	
 	// Set up signals and the signalfd
 	sigset_t mask;
 	
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGQUIT);
+	sigaddset(&mask, SIGUSR2);
 	
 	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
 	{
@@ -435,7 +2980,7 @@ int main(int argc, char* argv[])
 		exit(EXIT_FAILURE);
 	}
 	
-	supervisor->sigfd = signalfd(-1, &mask, SFD_NONBLOCK);
+	supervisor->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
 	
 	if (supervisor->sigfd < 0)
 	{
@@ -443,8 +2988,35 @@ int main(int argc, char* argv[])
 		exit(EXIT_FAILURE);
 	}
 	
-	// Create event loop with enough room for responses from each worker and the signalfd in one loop
-	supervisor->loop = sepoll_create((int)supervisor->numWorkers + 1, 0);
+	// Timer for checking on the workers every second
+	supervisor->monitorfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	
+	if (supervisor->monitorfd < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot open timerfd: %m\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	struct itimerspec timer =
+	{
+		.it_interval =
+		{
+			.tv_sec = 1
+		},
+		.it_value =
+		{
+			.tv_sec = 1
+		}
+	};
+	
+	if (timerfd_settime(supervisor->monitorfd, 0, &timer, NULL) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot set timerfd: %m\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	// Create event loop with enough room for responses from each worker old and new, the signalfd, the timer, the metrics socket and its connections, and the search index's inotify and timer in one loop
+	supervisor->loop = sepoll_create((int)(supervisor->numWorkers + supervisor->numCgiWorkers + supervisor->numDrainers) + 5 + METRICS_CLIENTS_MAX, EPOLL_CLOEXEC);
 	
 	if (supervisor->loop == NULL)
 	{
@@ -453,8 +3025,48 @@ int main(int argc, char* argv[])
 	}
 	
 	sepoll_add(supervisor->loop, supervisor->sigfd, EPOLLIN | EPOLLET, sigfd_event, supervisor, NULL);
+	sepoll_add(supervisor->loop, supervisor->monitorfd, EPOLLIN, monitor_event, supervisor, NULL);
+	
+	// Open the metrics socket now, so the workers don't inherit it
+	if (args.metricsPort > 0)
+	{
+		supervisor->metricsfd = open_metrics_socket(args.metricsPort);
+		
+		if (supervisor->metricsfd < 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+		
+		sepoll_add(supervisor->loop, supervisor->metricsfd, EPOLLIN | EPOLLET, metrics_listen_event, supervisor, NULL);
+		
+		fprintf(stderr, "S - Serving metrics on 127.0.0.1 port %hu\n", args.metricsPort);
+	}
+	
+	// Likewise for the search index, which starts being built as soon as the loop is entered
+	if (args.search != NULL)
+	{
+		supervisor->search = ssearch_builder_create(args.directory, args.searchIndex, args.outsideLinks);
+		
+		if (supervisor->search == NULL)
+		{
+			exit(EXIT_FAILURE);
+		}
+		
+		supervisor->searchfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		
+		if (supervisor->searchfd < 0)
+		{
+			fprintf(stderr, "S - Error: Cannot open search timerfd: %m\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		sepoll_add(supervisor->loop, ssearch_builder_fd(supervisor->search), EPOLLIN, search_notify_event, supervisor, NULL);
+		sepoll_add(supervisor->loop, supervisor->searchfd, EPOLLIN, search_timer_event, supervisor, NULL);
+		
+		search_schedule(supervisor, 0);
+	}
 	
-	for (unsigned int i = 0; i < supervisor->numWorkers; i++)
+	for (unsigned int i = 0; i < supervisor->numWorkers + supervisor->numCgiWorkers; i++)
 	{
 		if (supervisor->workers[i].pidfd > -1)
 		{
@@ -462,6 +3074,11 @@ int main(int argc, char* argv[])
 		}
 	}
 	
+	for (unsigned int i = 0; i < supervisor->numDrainers; i++)
+	{
+		sepoll_add(supervisor->loop, supervisor->drainers[i].pidfd, EPOLLIN, pidfd_event, supervisor, &supervisor->drainers[i]);
+	}
+	
 	// Event loop doesn't exit until all children exit
 	sepoll_enter(supervisor->loop, -1, NULL, NULL);
 	
@@ -0,0 +1,117 @@
+// printf, sscanf
+#include <stdio.h>
+
+// strlen
+#include <string.h>
+
+// clock_gettime
+#include <time.h>
+
+// srequest_parse, srequest_path
+#include "srequest.h"
+
+// *********************************************************************
+// Microbenchmark for the request parser
+//
+// Times splitting up each of a set of requests and turning the selector
+// into a path, which is everything the server does with a request
+// before it goes near the filesystem. There are typical ones and ones
+// meant to make the parser work as hard as it can, like requests right
+// up against the size limit that are nothing but slashes or CRs.
+// *********************************************************************
+
+// Same as the server's biggest request
+#define MAX_REQUEST_SIZE (2*255 + 2 + 1)
+
+struct benchmark_t
+{
+	const char* name;
+	char request[MAX_REQUEST_SIZE + 1];
+	size_t length;
+};
+
+static void fill(struct benchmark_t* benchmark, const char* name, const char* start, char c, const char* end)
+{
+	size_t startLength = strlen(start);
+	size_t endLength = strlen(end);
+	
+	benchmark->name = name;
+	benchmark->length = MAX_REQUEST_SIZE;
+	
+	memcpy(benchmark->request, start, startLength);
+	memset(benchmark->request + startLength, c, MAX_REQUEST_SIZE - startLength - endLength);
+	memcpy(benchmark->request + MAX_REQUEST_SIZE - endLength, end, endLength);
+}
+
+static void literal(struct benchmark_t* benchmark, const char* name, const char* request)
+{
+	benchmark->name = name;
+	benchmark->length = strlen(request);
+	
+	memcpy(benchmark->request, request, benchmark->length);
+}
+
+static inline unsigned long long monotonic_time()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (unsigned long long)ts.tv_sec * 1000000000 + (unsigned long long)ts.tv_nsec;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned long iterations = 1000000;
+	
+	if (argc > 1)
+	{
+		sscanf(argv[1], "%lu", &iterations);
+	}
+	
+	static struct benchmark_t benchmarks[10];
+	unsigned int numBenchmarks = 0;
+	
+	literal(&benchmarks[numBenchmarks++], "root", "\r\n");
+	literal(&benchmarks[numBenchmarks++], "file", "/docs/gopher/rfc1436.txt\r\n");
+	literal(&benchmarks[numBenchmarks++], "query", "/search\tsmall internet\r\n");
+	literal(&benchmarks[numBenchmarks++], "deep", "/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t/u/v/w/x/y/z/index.txt\r\n");
+	literal(&benchmarks[numBenchmarks++], "dotfile", "/phlog/2024/.secret\r\n");
+	fill(&benchmarks[numBenchmarks++], "longname", "/", 'a', "\r\n");
+	fill(&benchmarks[numBenchmarks++], "slashes", "", '/', "x\r\n");
+	fill(&benchmarks[numBenchmarks++], "crs", "/", '\r', "\r\n");
+	fill(&benchmarks[numBenchmarks++], "longquery", "/cgi\t", 'q', "\r\n");
+	fill(&benchmarks[numBenchmarks++], "incomplete", "/", 'a', "\r");
+	
+	printf("%-12s %6s %10s\n", "request", "bytes", "ns/request");
+	
+	for (unsigned int i = 0; i < numBenchmarks; i++)
+	{
+		struct benchmark_t* benchmark = &benchmarks[i];
+		
+		char path[MAX_REQUEST_SIZE + 3];
+		
+		// Keeps the compiler from deciding none of it matters
+		volatile size_t sink = 0;
+		
+		unsigned long long start = monotonic_time();
+		
+		for (unsigned long n = 0; n < iterations; n++)
+		{
+			struct srequest_t request;
+			
+			if (srequest_parse(benchmark->request, benchmark->length, &request))
+			{
+				char* end = srequest_path(benchmark->request, request.selectorSize, path);
+				
+				sink += end != NULL ? (size_t)(end - path) : request.querySize;
+			}
+		}
+		
+		unsigned long long elapsed = monotonic_time() - start;
+		
+		printf("%-12s %6zu %10.1f\n", benchmark->name, benchmark->length, (double)elapsed / (double)iterations);
+	}
+	
+	return 0;
+}
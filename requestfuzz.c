@@ -0,0 +1,245 @@
+// For memmem, mempcpy
+#define _GNU_SOURCE
+
+// bool
+#include <stdbool.h>
+
+// uint64_t
+#include <stdint.h>
+
+// printf, fprintf, sscanf
+#include <stdio.h>
+
+// exit
+#include <stdlib.h>
+
+// memchr, memmem, stpcpy, mempcpy, memcmp
+#include <string.h>
+
+// time
+#include <time.h>
+
+// srequest_parse, srequest_path
+#include "srequest.h"
+
+// *********************************************************************
+// Fuzzer for the request parser
+//
+// Throws random requests at the parser and checks that it splits them
+// up and turns them into paths exactly the way the server used to,
+// which is kept here as the reference. The requests are mostly made of
+// the characters the parser cares about, so the odd cases come up all
+// the time rather than once in a blue moon.
+// *********************************************************************
+
+// Same as the server's biggest request
+#define MAX_REQUEST_SIZE (2*255 + 2 + 1)
+
+// What the server did before the parser had a module of its own
+struct reference_t
+{
+	bool complete;
+	size_t selectorSize;
+	const char* query;
+	size_t querySize;
+	size_t length;
+};
+
+static void reference_parse(const char* buffer, size_t count, struct reference_t* request)
+{
+	const char* crlf = memmem(buffer, count, "\r\n", 2);
+	
+	request->complete = crlf != NULL;
+	
+	if (crlf == NULL)
+	{
+		return;
+	}
+	
+	const char* tab = memchr(buffer, '\t', count);
+	
+	if (tab != NULL && tab < crlf)
+	{
+		request->selectorSize = (size_t)(tab - buffer);
+		request->querySize = (size_t)(crlf - tab - 1);
+	}
+	else
+	{
+		request->selectorSize = (size_t)(crlf - buffer);
+		request->querySize = 0;
+	}
+	
+	request->query = request->querySize > 0 ? tab + 1 : NULL;
+	request->length = (size_t)(crlf - buffer);
+}
+
+static char* reference_path(const char* selector, size_t length, char* filename)
+{
+	char* filename_end = stpcpy(filename, ".");
+	
+	if (length > 0)
+	{
+		const char* str_pos = selector;
+		
+		do
+		{
+			size_t str_len = length - (size_t)(str_pos - selector);
+			
+			const char* str_slash = memchr(str_pos, '/', str_len);
+			
+			size_t substr_len;
+			
+			if (str_slash == NULL)
+			{
+				substr_len = str_len;
+			}
+			else
+			{
+				substr_len = (size_t)(str_slash - str_pos);
+			}
+			
+			if (substr_len > 0)
+			{
+				if (*str_pos == '.')
+				{
+					return NULL;
+				}
+				
+				filename_end = stpcpy(filename_end, "/");
+				filename_end = mempcpy(filename_end, str_pos, substr_len);
+			}
+			
+			if (str_slash == NULL)
+			{
+				break;
+			}
+			
+			str_pos = str_slash + 1;
+		}
+		while (1);
+		
+		*filename_end = '\0';
+	}
+	
+	return filename_end;
+}
+
+// *********************************************************************
+// Random requests
+// *********************************************************************
+static uint64_t state;
+
+static inline uint64_t next_random()
+{
+	// xorshift64*
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t make_request(char* buffer)
+{
+	static const char alphabet[] = "/./\t\r\n\r/a.b\0";
+	
+	// Mostly short ones, like real requests, with the occasional one right up against the limit
+	size_t length = next_random() % 8 == 0 ? MAX_REQUEST_SIZE - next_random() % 4 : next_random() % 64;
+	
+	for (size_t i = 0; i < length; i++)
+	{
+		uint64_t r = next_random();
+		
+		buffer[i] = r % 4 == 0 ? (char)(r >> 8) : alphabet[(r >> 8) % (sizeof(alphabet) - 1)];
+	}
+	
+	return length;
+}
+
+static void fail(const char* what, const char* buffer, size_t count)
+{
+	fprintf(stderr, "Mismatch in %s for request of %zu bytes:", what, count);
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		fprintf(stderr, " %02x", (unsigned char)buffer[i]);
+	}
+	
+	fprintf(stderr, "\n");
+	
+	exit(EXIT_FAILURE);
+}
+
+// *********************************************************************
+// Main
+// *********************************************************************
+int main(int argc, char* argv[])
+{
+	// Number of requests and the seed, which is printed so a failure can be reproduced
+	unsigned long iterations = 1000000;
+	unsigned long seed = (unsigned long)time(NULL);
+	
+	if (argc > 1)
+	{
+		sscanf(argv[1], "%lu", &iterations);
+	}
+	
+	if (argc > 2)
+	{
+		sscanf(argv[2], "%lu", &seed);
+	}
+	
+	printf("Fuzzing the request parser with %lu requests from seed %lu\n", iterations, seed);
+	
+	// xorshift gets stuck on 0
+	state = seed != 0 ? seed : 1;
+	
+	char buffer[MAX_REQUEST_SIZE];
+	
+	for (unsigned long n = 0; n < iterations; n++)
+	{
+		size_t count = make_request(buffer);
+		
+		struct reference_t expected;
+		struct srequest_t request;
+		
+		reference_parse(buffer, count, &expected);
+		
+		int complete = srequest_parse(buffer, count, &request);
+		
+		if (complete != expected.complete)
+		{
+			fail("completeness", buffer, count);
+		}
+		
+		if (!complete)
+		{
+			continue;
+		}
+		
+		if (request.selectorSize != expected.selectorSize || request.query != expected.query || request.querySize != expected.querySize || request.length != expected.length)
+		{
+			fail("splitting", buffer, count);
+		}
+		
+		char expectedPath[MAX_REQUEST_SIZE + 3];
+		char path[MAX_REQUEST_SIZE + 3];
+		
+		char* expectedEnd = reference_path(buffer, request.selectorSize, expectedPath);
+		char* end = srequest_path(buffer, request.selectorSize, path);
+		
+		if ((end == NULL) != (expectedEnd == NULL))
+		{
+			fail("path rules", buffer, count);
+		}
+		
+		if (end != NULL && (end - path != expectedEnd - expectedPath || memcmp(path, expectedPath, (size_t)(end - path) + 1) != 0))
+		{
+			fail("path", buffer, count);
+		}
+	}
+	
+	printf("All %lu requests matched\n", iterations);
+	
+	return 0;
+}
@@ -0,0 +1,268 @@
+// for tdestroy
+#define _GNU_SOURCE
+
+// tsearch, tdelete, tfind, tdestroy
+#include <search.h>
+
+// malloc, free
+#include <stdlib.h>
+
+// Linked list macros
+#include <sys/queue.h>
+
+// scache_entry_t
+#include "scache.h"
+
+// *********************************************************************
+// Core definitions
+// *********************************************************************
+
+TAILQ_HEAD(scache_lru_t, scache_entry_t);
+
+struct scache_t
+{
+	// Tree for cached entries, sorted by device and inode
+	void* entries_tree;
+	
+	// Entries in order of use, so the least recently used can be evicted first
+	struct scache_lru_t lru;
+	
+	// Total size of cached data and the limit on it
+	size_t size;
+	size_t capacity;
+};
+
+// *********************************************************************
+// Functions for tree searching
+// *********************************************************************
+
+static int compare_entry_key(const void* pa, const void* pb)
+{
+	const struct scache_entry_t* a = pa;
+	const struct scache_entry_t* b = pb;
+	
+	if (a->dev != b->dev)
+	{
+		return a->dev < b->dev ? -1 : 1;
+	}
+	
+	if (a->ino != b->ino)
+	{
+		return a->ino < b->ino ? -1 : 1;
+	}
+	
+	return 0;
+}
+
+static struct scache_entry_t* scache_find(struct scache_t* cache, dev_t dev, ino_t ino)
+{
+	struct scache_entry_t search =
+	{
+		.dev = dev,
+		.ino = ino
+	};
+	
+	struct scache_entry_t** found = tfind(&search, &cache->entries_tree, compare_entry_key);
+	
+	if (found == NULL)
+	{
+		return NULL;
+	}
+	
+	return *found;
+}
+
+// *********************************************************************
+// Reference counting and eviction
+// *********************************************************************
+
+static void scache_free(struct scache_entry_t* entry)
+{
+	free(entry->data);
+	free(entry->deps);
+	free(entry);
+}
+
+struct scache_entry_t* scache_retain(struct scache_entry_t* entry)
+{
+	entry->refs++;
+	
+	return entry;
+}
+
+void scache_release(struct scache_entry_t* entry)
+{
+	if (entry == NULL)
+	{
+		return;
+	}
+	
+	entry->refs--;
+	
+	if (entry->refs == 0)
+	{
+		scache_free(entry);
+	}
+}
+
+// Take an entry out of the cache. It's only freed once nothing else is using it either
+static void scache_evict(struct scache_t* cache, struct scache_entry_t* entry)
+{
+	tdelete(entry, &cache->entries_tree, compare_entry_key);
+	TAILQ_REMOVE(&cache->lru, entry, lru);
+	
+	cache->size -= entry->length;
+	entry->cached = false;
+	
+	scache_release(entry);
+}
+
+// *********************************************************************
+// Creation and destruction functions
+// *********************************************************************
+
+struct scache_t* scache_create(size_t capacity)
+{
+	struct scache_t* cache = malloc(sizeof(struct scache_t));
+	
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+	
+	cache->entries_tree = NULL;
+	
+	TAILQ_INIT(&cache->lru);
+	
+	cache->size = 0;
+	cache->capacity = capacity;
+	
+	return cache;
+}
+
+// Entries that are still referenced elsewhere are left for their holders to release
+void scache_destroy(struct scache_t* cache)
+{
+	if (cache == NULL)
+	{
+		return;
+	}
+	
+	while (!TAILQ_EMPTY(&cache->lru))
+	{
+		scache_evict(cache, TAILQ_FIRST(&cache->lru));
+	}
+	
+	free(cache);
+}
+
+// *********************************************************************
+// Lookup and insertion
+// *********************************************************************
+
+static inline bool scache_fresh(struct scache_entry_t* entry, const struct stat* statbuf)
+{
+	return entry->size == statbuf->st_size && entry->mtime.tv_sec == statbuf->st_mtim.tv_sec && entry->mtime.tv_nsec == statbuf->st_mtim.tv_nsec;
+}
+
+struct scache_entry_t* scache_get(struct scache_t* cache, const struct stat* statbuf)
+{
+	struct scache_entry_t* entry = scache_find(cache, statbuf->st_dev, statbuf->st_ino);
+	
+	if (entry == NULL)
+	{
+		return NULL;
+	}
+	
+	// The file changed since it was cached, so the entry is no good to anyone anymore
+	if (!scache_fresh(entry, statbuf))
+	{
+		scache_evict(cache, entry);
+		return NULL;
+	}
+	
+	// Move it to the front of the line for eviction purposes
+	TAILQ_REMOVE(&cache->lru, entry, lru);
+	TAILQ_INSERT_HEAD(&cache->lru, entry, lru);
+	
+	entry->refs++;
+	
+	return entry;
+}
+
+struct scache_entry_t* scache_wrap(char* data, size_t length)
+{
+	struct scache_entry_t* entry = malloc(sizeof(struct scache_entry_t));
+	
+	if (entry == NULL)
+	{
+		free(data);
+		return NULL;
+	}
+	
+	entry->dev = 0;
+	entry->ino = 0;
+	entry->mtime.tv_sec = 0;
+	entry->mtime.tv_nsec = 0;
+	entry->size = 0;
+	entry->data = data;
+	entry->length = length;
+	entry->deps = NULL;
+	
+	// One reference for the caller
+	entry->refs = 1;
+	entry->cached = false;
+	
+	return entry;
+}
+
+struct scache_entry_t* scache_put(struct scache_t* cache, const struct stat* statbuf, char* data, size_t length)
+{
+	struct scache_entry_t* entry = scache_wrap(data, length);
+	
+	if (entry == NULL)
+	{
+		return NULL;
+	}
+	
+	entry->dev = statbuf->st_dev;
+	entry->ino = statbuf->st_ino;
+	entry->mtime = statbuf->st_mtim;
+	entry->size = statbuf->st_size;
+	
+	// Too big to ever fit, so the caller gets to use it once and that's it
+	if (length > cache->capacity)
+	{
+		return entry;
+	}
+	
+	// Get rid of any older version
+	struct scache_entry_t* old = scache_find(cache, entry->dev, entry->ino);
+	
+	if (old != NULL)
+	{
+		scache_evict(cache, old);
+	}
+	
+	// Make room
+	while (cache->size + length > cache->capacity)
+	{
+		scache_evict(cache, TAILQ_LAST(&cache->lru, scache_lru_t));
+	}
+	
+	struct scache_entry_t** node = tsearch(entry, &cache->entries_tree, compare_entry_key);
+	
+	if (node == NULL)
+	{
+		return entry;
+	}
+	
+	// And one reference for the cache
+	TAILQ_INSERT_HEAD(&cache->lru, entry, lru);
+	
+	cache->size += length;
+	entry->cached = true;
+	entry->refs++;
+	
+	return entry;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+// bool
+#include <stdbool.h>
+
+// size_t
+#include <stddef.h>
+
+// Linked list macros
+#include <sys/queue.h>
+
+// struct stat, dev_t, ino_t
+#include <sys/stat.h>
+
+// Opaque structure for cache state
+struct scache_t;
+
+// A cached response. Entries are reference counted: the cache holds one reference for as long as the entry is in it,
+// and anything sending from the data holds another until it's done, so the data stays put even after the entry is
+// evicted or replaced by a newer version
+struct scache_entry_t
+{
+	// Key, identifying the file the response was made from
+	dev_t dev;
+	ino_t ino;
+	
+	// Version of the file the response was made from
+	struct timespec mtime;
+	off_t size;
+	
+	// Response data
+	char* data;
+	size_t length;
+	
+	// Anything else the response was made from, in one malloc'd block that's freed along with it, for whoever made it
+	// to check on
+	void* deps;
+	
+	// Reference count and whether the cache itself still holds one
+	unsigned int refs;
+	bool cached;
+	
+	// Least recently used list, most recent first
+	TAILQ_ENTRY(scache_entry_t) lru;
+};
+
+// Lifecycle management - creation and destruction
+struct scache_t* scache_create(size_t capacity);
+void scache_destroy(struct scache_t* cache);
+
+// Look up the response for a file, returning a new reference to it if it's up to date with the file's stats
+struct scache_entry_t* scache_get(struct scache_t* cache, const struct stat* statbuf);
+
+// Add a response for a file, taking ownership of the malloc'd data and returning a new reference to it
+struct scache_entry_t* scache_put(struct scache_t* cache, const struct stat* statbuf, char* data, size_t length);
+
+// Wrap a response that isn't made from a file and never goes in a cache, taking ownership of the malloc'd data and
+// returning the only reference to it
+struct scache_entry_t* scache_wrap(char* data, size_t length);
+
+// Take another reference to an entry, returning it
+struct scache_entry_t* scache_retain(struct scache_entry_t* entry);
+
+// Drop a reference obtained from scache_get, scache_put, scache_wrap or scache_retain
+void scache_release(struct scache_entry_t* entry);
@@ -0,0 +1,373 @@
+// For O_PATH
+#define _GNU_SOURCE
+
+// errno
+#include <errno.h>
+
+// openat
+#include <fcntl.h>
+
+// struct open_how, RESOLVE_BENEATH, RESOLVE_NO_MAGICLINKS
+#include <linux/openat2.h>
+
+// uint64_t
+#include <stdint.h>
+
+// malloc, free
+#include <stdlib.h>
+
+// memcpy, memcmp, strlen, strrchr
+#include <string.h>
+
+// fstat
+#include <sys/stat.h>
+
+// SYS_openat2
+#include <sys/syscall.h>
+
+// time
+#include <time.h>
+
+// close, syscall
+#include <unistd.h>
+
+// slog_hash
+#include "slog.h"
+
+// sdircache_t
+#include "sdircache.h"
+
+// Seconds a directory is used for before it's opened again
+#define SDIRCACHE_TTL 1
+
+struct sdircache_entry_t
+{
+	// -1 for an unused entry
+	int fd;
+	time_t opened;
+	
+	// Counter value when it was last used, the lowest of which is evicted
+	uint64_t used;
+	
+	uint64_t hash;
+	size_t length;
+	char path[SDIRCACHE_PATH_SIZE];
+};
+
+struct sdircache_t
+{
+	int root;
+	bool outside;
+	
+	// Set if the kernel turns out not to have openat2, in which case everything falls back to plain openat
+	bool noOpenat2;
+	
+	uint64_t counter;
+	
+	unsigned int size;
+	struct sdircache_entry_t entries[];
+};
+
+// *********************************************************************
+// Opening things
+// *********************************************************************
+static int resolve(struct sdircache_t* cache, int dirfd, const char* path, int flags)
+{
+	if (!cache->noOpenat2)
+	{
+		struct open_how how =
+		{
+			.flags = (unsigned int)flags,
+			.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS
+		};
+		
+		int fd = (int)syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+		
+		if (fd >= 0 || errno != ENOSYS)
+		{
+			return fd;
+		}
+		
+		cache->noOpenat2 = true;
+	}
+	
+	return openat(dirfd, path, flags);
+}
+
+// Open name in dirfd, or if it leads out of there, the full path from the top
+static int resolve_from(struct sdircache_t* cache, int dirfd, const char* name, const char* full, int flags)
+{
+	int fd = resolve(cache, dirfd, name, flags);
+	
+	if (fd < 0 && errno == EXDEV && dirfd != cache->root)
+	{
+		fd = resolve(cache, cache->root, full, flags);
+	}
+	
+	if (fd < 0 && errno == EXDEV && cache->outside)
+	{
+		fd = openat(cache->root, full, flags);
+	}
+	
+	return fd;
+}
+
+// *********************************************************************
+// Cached directories
+// *********************************************************************
+static struct sdircache_entry_t* find(struct sdircache_t* cache, const char* path, size_t length, uint64_t hash)
+{
+	for (unsigned int i = 0; i < cache->size; i++)
+	{
+		struct sdircache_entry_t* entry = &cache->entries[i];
+		
+		if (entry->fd >= 0 && entry->hash == hash && entry->length == length && memcmp(entry->path, path, length) == 0)
+		{
+			return entry;
+		}
+	}
+	
+	return NULL;
+}
+
+static inline bool fresh(const struct sdircache_entry_t* entry, time_t now)
+{
+	return entry != NULL && now - entry->opened < SDIRCACHE_TTL;
+}
+
+// Pick an entry for a new directory, which is an unused one if there is one and otherwise the least recently used
+static struct sdircache_entry_t* victim(struct sdircache_t* cache)
+{
+	struct sdircache_entry_t* oldest = &cache->entries[0];
+	
+	for (unsigned int i = 0; i < cache->size; i++)
+	{
+		struct sdircache_entry_t* entry = &cache->entries[i];
+		
+		if (entry->fd < 0)
+		{
+			return entry;
+		}
+		
+		if (entry->used < oldest->used)
+		{
+			oldest = entry;
+		}
+	}
+	
+	return oldest;
+}
+
+int sdircache_dir(struct sdircache_t* cache, const char* path, size_t length)
+{
+	if (length == 1 && path[0] == '.')
+	{
+		return cache->root;
+	}
+	
+	if (length >= SDIRCACHE_PATH_SIZE)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	
+	time_t now = time(NULL);
+	uint64_t hash = slog_hash(path, length);
+	
+	struct sdircache_entry_t* entry = find(cache, path, length, hash);
+	
+	if (fresh(entry, now))
+	{
+		entry->used = ++cache->counter;
+		return entry->fd;
+	}
+	
+	char buffer[SDIRCACHE_PATH_SIZE];
+	
+	memcpy(buffer, path, length);
+	buffer[length] = '\0';
+	
+	// Look for the closest directory above it that's open already, going up a slash at a time, and otherwise start
+	// from the top
+	int from = cache->root;
+	const char* rest = buffer;
+	
+	for (size_t end = length; end > 1; )
+	{
+		do
+		{
+			end--;
+		}
+		while (end > 0 && buffer[end] != '/');
+		
+		if (end <= 1)
+		{
+			break;
+		}
+		
+		struct sdircache_entry_t* ancestor = find(cache, buffer, end, slog_hash(buffer, end));
+		
+		if (fresh(ancestor, now))
+		{
+			from = ancestor->fd;
+			rest = buffer + end + 1;
+			break;
+		}
+	}
+	
+	int fd = resolve_from(cache, from, rest, buffer, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	
+	if (fd < 0)
+	{
+		// Whatever was there before isn't any more
+		if (entry != NULL)
+		{
+			close(entry->fd);
+			entry->fd = -1;
+		}
+		
+		return -1;
+	}
+	
+	if (entry == NULL)
+	{
+		entry = victim(cache);
+	}
+	
+	if (entry->fd >= 0)
+	{
+		close(entry->fd);
+	}
+	
+	entry->fd = fd;
+	entry->opened = now;
+	entry->used = ++cache->counter;
+	entry->hash = hash;
+	entry->length = length;
+	
+	memcpy(entry->path, path, length);
+	
+	return fd;
+}
+
+// *********************************************************************
+// Opening files
+// *********************************************************************
+int sdircache_open(struct sdircache_t* cache, const char* path, int flags)
+{
+	const char* slash = strrchr(path, '/');
+	
+	if (slash == NULL)
+	{
+		return resolve_from(cache, cache->root, path, path, flags);
+	}
+	
+	int dirfd = sdircache_dir(cache, path, (size_t)(slash - path));
+	
+	// Too long to cache is no reason not to serve it
+	if (dirfd < 0 && errno == ENAMETOOLONG)
+	{
+		return resolve_from(cache, cache->root, path, path, flags);
+	}
+	
+	if (dirfd < 0)
+	{
+		return -1;
+	}
+	
+	return resolve_from(cache, dirfd, slash + 1, path, flags);
+}
+
+int sdircache_openat(struct sdircache_t* cache, int dirfd, const char* directory, const char* name, int flags)
+{
+	size_t directoryLength = strlen(directory);
+	size_t nameLength = strlen(name);
+	
+	char full[SDIRCACHE_PATH_SIZE + 256];
+	
+	if (directoryLength + 1 + nameLength >= sizeof(full))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	
+	memcpy(full, directory, directoryLength);
+	full[directoryLength] = '/';
+	memcpy(full + directoryLength + 1, name, nameLength + 1);
+	
+	return resolve_from(cache, dirfd, name, full, flags);
+}
+
+// *********************************************************************
+// Looking at things
+//
+// There's no fstatat2, so these open what the path leads to with O_PATH,
+// which needs no permissions on it, and look at that instead.
+// *********************************************************************
+static int stat_fd(int fd, struct stat* statbuf)
+{
+	if (fd < 0)
+	{
+		return -1;
+	}
+	
+	int retval = fstat(fd, statbuf);
+	
+	close(fd);
+	
+	return retval;
+}
+
+int sdircache_stat(struct sdircache_t* cache, const char* path, struct stat* statbuf)
+{
+	return stat_fd(sdircache_open(cache, path, O_PATH | O_CLOEXEC), statbuf);
+}
+
+int sdircache_statat(struct sdircache_t* cache, int dirfd, const char* directory, const char* name, struct stat* statbuf)
+{
+	return stat_fd(sdircache_openat(cache, dirfd, directory, name, O_PATH | O_CLOEXEC), statbuf);
+}
+
+// *********************************************************************
+// Setup and cleanup
+// *********************************************************************
+struct sdircache_t* sdircache_create(int root, unsigned int size, bool outside)
+{
+	struct sdircache_t* cache = malloc(sizeof(struct sdircache_t) + size * sizeof(struct sdircache_entry_t));
+	
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+	
+	cache->root = root;
+	cache->outside = outside;
+	cache->noOpenat2 = false;
+	cache->counter = 0;
+	cache->size = size;
+	
+	for (unsigned int i = 0; i < size; i++)
+	{
+		cache->entries[i].fd = -1;
+	}
+	
+	return cache;
+}
+
+void sdircache_destroy(struct sdircache_t* cache)
+{
+	if (cache == NULL)
+	{
+		return;
+	}
+	
+	for (unsigned int i = 0; i < cache->size; i++)
+	{
+		if (cache->entries[i].fd >= 0)
+		{
+			close(cache->entries[i].fd);
+		}
+	}
+	
+	free(cache);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+// bool
+#include <stdbool.h>
+
+// size_t
+#include <stddef.h>
+
+// struct stat
+#include <sys/stat.h>
+
+// *********************************************************************
+// Path resolution
+//
+// Files are opened with openat2 and RESOLVE_BENEATH, so the kernel sees
+// to it that nothing, including a symlink, gets out of the content
+// directory, and RESOLVE_NO_MAGICLINKS, which keeps out the likes of
+// /proc/self/fd. Rather than walk the whole path from the top every
+// time, each worker keeps a few directories it's been asked for lately
+// open as O_PATH descriptors, so a file is opened from its directory if
+// that's one of them, or else from the closest one above it, which then
+// opens its directory to keep for next time. A symlink that leads out of
+// a cached directory but not out of the content directory is tried
+// again from the top. Directories are reopened if they were opened more
+// than a second ago, so one that's been moved or replaced isn't served
+// from for long.
+// *********************************************************************
+
+// Longest directory path that can be cached, which covers any that fits in a request
+#define SDIRCACHE_PATH_SIZE 520
+
+struct sdircache_t;
+
+// Create a cache of up to size directories under the open content directory root, and whether symlinks that lead out
+// of it are followed anyway, in which case they're opened the old way without any of the kernel's checks
+struct sdircache_t* sdircache_create(int root, unsigned int size, bool outside);
+
+// Close all of the directories and free the cache
+void sdircache_destroy(struct sdircache_t* cache);
+
+// Open a null-terminated path relative to the content directory, starting with ., with the given open flags. Fails
+// with EXDEV if it leads out of the content directory and ELOOP if it goes through a magic link.
+int sdircache_open(struct sdircache_t* cache, const char* path, int flags);
+
+// Open a file in a directory that's already open, where directory is its path, retrying from the top if it leads out
+int sdircache_openat(struct sdircache_t* cache, int dirfd, const char* directory, const char* name, int flags);
+
+// Get the status of what a path leads to, the same as fstatat would but under the same rules as opening it
+int sdircache_stat(struct sdircache_t* cache, const char* path, struct stat* statbuf);
+int sdircache_statat(struct sdircache_t* cache, int dirfd, const char* directory, const char* name, struct stat* statbuf);
+
+// Get a descriptor for the directory at the first length bytes of a path, which belongs to the cache and is only good
+// until the next call
+int sdircache_dir(struct sdircache_t* cache, const char* path, size_t length);
@@ -10,12 +10,21 @@
 // bool
 #include <stdbool.h>
 
+// snprintf
+#include <stdio.h>
+
 // malloc, calloc, reallocarray, free
 #include <stdlib.h>
 
-// epoll API
+// epoll API, and EPOLL_IOCSPARAMS where the C library is new enough to have it
 #include <sys/epoll.h>
 
+// ioctl
+#include <sys/ioctl.h>
+
+// clock_gettime
+#include <time.h>
+
 // Linked list macros
 #include <sys/queue.h>
 
@@ -25,6 +34,12 @@
 // sepoll_arg_t
 # include "sepoll.h"
 
+// tracepoints
+#include "sprobe.h"
+
+// Most waits to block for in a row after spinning keeps finding nothing, before trying it again
+#define SPIN_BACKOFF_LIMIT 64
+
 // *********************************************************************
 // Core definitions
 // *********************************************************************
@@ -46,6 +61,16 @@ struct sepoll_callback_t
 
 LIST_HEAD(sepoll_callback_list_t, sepoll_callback_t);
 
+TAILQ_HEAD(sepoll_task_queue_t, sepoll_task_t);
+
+// Queues a task can be on
+enum
+{
+	QUEUE_NONE,
+	QUEUE_DEFERRED,
+	QUEUE_IDLE
+};
+
 struct sepoll_t
 {
 	// Tree for active callbacks, sorted by file descriptor
@@ -59,10 +84,43 @@ struct sepoll_t
 	int epoll_events_size;
 	int epollfd;
 	
+	// Loop clock, updated every time epoll_wait returns
+	uint64_t time;
+	
+	// Longest to spin before blocking, and a moving average of how long it's been taking for events to turn up, both in
+	// nanoseconds
+	uint64_t spinLimit;
+	uint64_t gap;
+	
+	// Waits left to go straight to blocking, and how many to skip after the next spin that finds nothing, which doubles
+	// every time spinning keeps coming up empty
+	unsigned int spinSkip;
+	unsigned int spinBackoff;
+	
+	// Where to collect statistics, if anywhere
+	struct sepoll_stats_t* stats;
+	
+	// Tasks to run soon and when idle, in the order they were queued
+	struct sepoll_task_queue_t deferred;
+	struct sepoll_task_queue_t idle;
+	
 	// Set to false during looping to exit the loop
 	bool run;
 };
 
+// *********************************************************************
+// Sample the monotonic clock in nanoseconds
+// *********************************************************************
+
+static inline uint64_t sepoll_clock()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 // *********************************************************************
 // Functions for tree searching
 // *********************************************************************
@@ -137,6 +195,17 @@ struct sepoll_t* sepoll_create(int size, int flags)
 	
 	loop->epoll_events_size = size;
 	
+	loop->time = sepoll_clock();
+	loop->stats = NULL;
+	
+	loop->spinLimit = 0;
+	loop->gap = 0;
+	loop->spinSkip = 0;
+	loop->spinBackoff = 1;
+	
+	TAILQ_INIT(&loop->deferred);
+	TAILQ_INIT(&loop->idle);
+	
 	return loop;
 }
 
@@ -189,7 +258,7 @@ void sepoll_destroy(struct sepoll_t* loop)
 	while (callback != NULL)
 	{
 		struct sepoll_callback_t* next = LIST_NEXT(callback, entry);
-	
+		
 		free(callback);
 		
 		callback = next;
@@ -346,6 +415,283 @@ int sepoll_remove(struct sepoll_t* loop, int fd)
 	return epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, fd, NULL);
 }
 
+// *********************************************************************
+// Deferred work
+// *********************************************************************
+
+void sepoll_task_init(struct sepoll_task_t* task, void (*function)(union sepoll_arg_t, union sepoll_arg_t), union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	task->function = function;
+	task->userdata1 = userdata1;
+	task->userdata2 = userdata2;
+	task->queue = QUEUE_NONE;
+}
+
+void sepoll_cancel(struct sepoll_t* loop, struct sepoll_task_t* task)
+{
+	if (task->queue == QUEUE_DEFERRED)
+	{
+		TAILQ_REMOVE(&loop->deferred, task, entry);
+	}
+	else if (task->queue == QUEUE_IDLE)
+	{
+		TAILQ_REMOVE(&loop->idle, task, entry);
+	}
+	
+	task->queue = QUEUE_NONE;
+}
+
+void sepoll_defer(struct sepoll_t* loop, struct sepoll_task_t* task)
+{
+	if (task->queue == QUEUE_DEFERRED)
+	{
+		return;
+	}
+	
+	sepoll_cancel(loop, task);
+	
+	TAILQ_INSERT_TAIL(&loop->deferred, task, entry);
+	task->queue = QUEUE_DEFERRED;
+}
+
+void sepoll_idle(struct sepoll_t* loop, struct sepoll_task_t* task)
+{
+	if (task->queue != QUEUE_NONE)
+	{
+		return;
+	}
+	
+	TAILQ_INSERT_TAIL(&loop->idle, task, entry);
+	task->queue = QUEUE_IDLE;
+}
+
+// Take the first task off a queue and run it, returning false if there wasn't one
+static bool run_task(struct sepoll_task_queue_t* queue)
+{
+	struct sepoll_task_t* task = TAILQ_FIRST(queue);
+	
+	if (task == NULL)
+	{
+		return false;
+	}
+	
+	// Off the queue before it runs, so it can queue itself again
+	TAILQ_REMOVE(queue, task, entry);
+	task->queue = QUEUE_NONE;
+	
+	task->function(task->userdata1, task->userdata2);
+	
+	return true;
+}
+
+static void run_deferred(struct sepoll_t* loop)
+{
+	unsigned int count = 0;
+	
+	while (count < SEPOLL_DEFER_BUDGET && run_task(&loop->deferred))
+	{
+		count++;
+	}
+	
+	SPROBE1(sepoll, deferred, count);
+}
+
+static void run_idle(struct sepoll_t* loop)
+{
+	uint64_t start = sepoll_clock();
+	unsigned int count = 0;
+	
+	while (run_task(&loop->idle))
+	{
+		count++;
+		
+		// Something may have come up on the queue to run soon, which takes priority
+		if (!TAILQ_EMPTY(&loop->deferred) || sepoll_clock() - start >= SEPOLL_IDLE_BUDGET)
+		{
+			break;
+		}
+	}
+	
+	SPROBE1(sepoll, idle, count);
+}
+
+// *********************************************************************
+// Statistics collection
+// *********************************************************************
+
+static inline unsigned int stats_bucket(uint64_t value)
+{
+	// Number of significant bits, so 0 goes in bucket 0, 1 in bucket 1, 2-3 in bucket 2 and so on
+	unsigned int bucket = value == 0 ? 0 : 64 - (unsigned int)__builtin_clzll(value);
+	
+	return bucket < SEPOLL_STATS_BUCKETS ? bucket : SEPOLL_STATS_BUCKETS - 1;
+}
+
+static inline void stats_observe(struct sepoll_histogram_t* histogram, uint64_t bucketed, uint64_t summed)
+{
+	histogram->buckets[stats_bucket(bucketed)]++;
+	histogram->sum += summed;
+}
+
+static struct sepoll_callback_stats_t* stats_callback(struct sepoll_stats_t* stats, void (*function)(uint32_t, union sepoll_arg_t, union sepoll_arg_t))
+{
+	// There are only ever a handful of distinct callback functions so a linear search is plenty
+	for (unsigned int i = 0; i < stats->numCallbacks; i++)
+	{
+		if (stats->callbacks[i].function == function)
+		{
+			return &stats->callbacks[i];
+		}
+	}
+	
+	if (stats->numCallbacks == SEPOLL_STATS_CALLBACKS)
+	{
+		return &stats->callbacks[SEPOLL_STATS_CALLBACKS - 1];
+	}
+	
+	struct sepoll_callback_stats_t* callback = &stats->callbacks[stats->numCallbacks++];
+	
+	callback->function = function;
+	callback->name[0] = '\0';
+	
+	return callback;
+}
+
+static void stats_wakeup(struct sepoll_t* loop, int n)
+{
+	loop->stats->wakeups++;
+	
+	// A full array means there may have been more events ready than it could hold
+	if (n == loop->epoll_events_size)
+	{
+		loop->stats->full++;
+	}
+	
+	stats_observe(&loop->stats->events, (uint64_t)n, (uint64_t)n);
+}
+
+static void stats_dispatch(struct sepoll_t* loop, struct sepoll_callback_t* callback, uint32_t events)
+{
+	struct sepoll_callback_stats_t* stats = stats_callback(loop->stats, callback->function);
+	
+	uint64_t start = sepoll_clock();
+	
+	callback->function(events, callback->userdata1, callback->userdata2);
+	
+	uint64_t end = sepoll_clock();
+	
+	stats_observe(&loop->stats->lag, (start - loop->time) / 1000, start - loop->time);
+	stats_observe(&stats->time, (end - start) / 1000, end - start);
+}
+
+void sepoll_stats(struct sepoll_t* loop, struct sepoll_stats_t* stats)
+{
+	loop->stats = stats;
+}
+
+int sepoll_stats_name(struct sepoll_t* loop, void (*function)(uint32_t, union sepoll_arg_t, union sepoll_arg_t), const char* name)
+{
+	if (loop->stats == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	
+	struct sepoll_callback_stats_t* callback = stats_callback(loop->stats, function);
+	
+	snprintf(callback->name, SEPOLL_STATS_NAME, "%s", name);
+	
+	return 0;
+}
+
+// *********************************************************************
+// Busy polling
+// *********************************************************************
+
+int sepoll_busy_poll(struct sepoll_t* loop, unsigned int usecs)
+{
+	loop->spinLimit = (uint64_t)usecs * 1000;
+	loop->gap = 0;
+	loop->spinSkip = 0;
+	loop->spinBackoff = 1;
+
+#ifdef EPOLL_IOCSPARAMS
+	// A budget of 0 leaves it at the kernel's default, and this only does anything for sockets on a device with NAPI,
+	// so it's fine for it not to be supported
+	struct epoll_params params =
+	{
+		.busy_poll_usecs = usecs,
+		.busy_poll_budget = 0,
+		.prefer_busy_poll = 0
+	};
+	
+	if (ioctl(loop->epollfd, EPOLL_IOCSPARAMS, &params) < 0 && errno != ENOTTY && errno != EINVAL)
+	{
+		return -1;
+	}
+#endif
+	
+	return 0;
+}
+
+static int busy_wait(struct sepoll_t* loop, int timeout)
+{
+	uint64_t start = sepoll_clock();
+	
+	int n = 0;
+	
+	if (loop->spinSkip > 0)
+	{
+		loop->spinSkip--;
+	}
+	else if (loop->gap <= loop->spinLimit)
+	{
+		uint64_t budget = 2 * loop->gap < loop->spinLimit ? 2 * loop->gap : loop->spinLimit;
+		uint64_t now = start;
+		
+		while (n == 0 && now - start < budget)
+		{
+			n = epoll_wait(loop->epollfd, loop->epoll_events, loop->epoll_events_size, 0);
+			now = sepoll_clock();
+		}
+		
+		// Events that keep turning up just after giving up are better off waited for, as is everything when whatever
+		// is sending them needs the CPU that's spinning
+		if (n > 0)
+		{
+			loop->spinBackoff = 1;
+		}
+		else
+		{
+			loop->spinSkip = loop->spinBackoff;
+			
+			if (loop->spinBackoff < SPIN_BACKOFF_LIMIT)
+			{
+				loop->spinBackoff *= 2;
+			}
+		}
+		
+		if (loop->stats != NULL && budget > 0)
+		{
+			loop->stats->spins++;
+			loop->stats->spinHits += n > 0;
+			loop->stats->spinTime += now - start;
+		}
+	}
+	
+	if (n == 0)
+	{
+		n = epoll_wait(loop->epollfd, loop->epoll_events, loop->epoll_events_size, timeout);
+	}
+	
+	// A timeout counts as a gap as long as the timeout, which soon stops a loop that's gone quiet from spinning
+	uint64_t waited = sepoll_clock() - start;
+	
+	loop->gap = loop->gap - loop->gap / 8 + waited / 8;
+	
+	return n;
+}
+
 // *********************************************************************
 // Functions for entering the event loop
 // *********************************************************************
@@ -359,11 +705,32 @@ int sepoll_enter(struct sepoll_t* loop, int timeout, void (*function)(int, void*
 	
 	while (loop->run)
 	{
-		// Wait on epoll events or a timeout
-		int n = epoll_wait(loop->epollfd, loop->epoll_events, loop->epoll_events_size, timeout);
+		// Wait on epoll events or a timeout, or just check for events if there's anything queued to run
+		bool pending = !TAILQ_EMPTY(&loop->deferred) || !TAILQ_EMPTY(&loop->idle);
+		
+		int n;
+		
+		if (!pending && timeout != 0 && loop->spinLimit > 0)
+		{
+			n = busy_wait(loop, timeout);
+		}
+		else
+		{
+			n = epoll_wait(loop->epollfd, loop->epoll_events, loop->epoll_events_size, pending ? 0 : timeout);
+		}
+		
+		// Callbacks share one timestamp per wakeup instead of each reading the clock
+		loop->time = sepoll_clock();
+		
+		SPROBE1(sepoll, wakeup, n);
 		
 		if (n > 0)
 		{
+			if (loop->stats != NULL)
+			{
+				stats_wakeup(loop, n);
+			}
+			
 			// Iterate over returned events and call the callback functions
 			for (int i = 0; i < n; i++)
 			{
@@ -371,17 +738,38 @@ int sepoll_enter(struct sepoll_t* loop, int timeout, void (*function)(int, void*
 				
 				if (callback->function != NULL)
 				{
-					callback->function(loop->epoll_events[i].events, callback->userdata1, callback->userdata2);
+					SPROBE2(sepoll, dispatch_start, callback->fd, loop->epoll_events[i].events);
+					
+					if (loop->stats == NULL)
+					{
+						callback->function(loop->epoll_events[i].events, callback->userdata1, callback->userdata2);
+					}
+					else
+					{
+						stats_dispatch(loop, callback, loop->epoll_events[i].events);
+					}
+					
+					SPROBE1(sepoll, dispatch_end, callback->fd);
 				}
 			}
 		}
 		
+		// Then whatever was queued to run soon, and if there was nothing else to do, idle tasks
+		if (!TAILQ_EMPTY(&loop->deferred))
+		{
+			run_deferred(loop);
+		}
+		else if (n == 0 && !TAILQ_EMPTY(&loop->idle))
+		{
+			run_idle(loop);
+		}
+		
 		// Execute callback function if one was provided
 		if (function != NULL)
 		{
 			function(n, userdata);
 		}
-		else if (n == 0)
+		else if (n == 0 && !pending)
 		{
 			// Timeout occurred without a provided callback function
 			loop->run = false;
@@ -416,3 +804,9 @@ void sepoll_exit(struct sepoll_t* loop)
 {
 	loop->run = false;
 }
+
+// Get the loop clock
+uint64_t sepoll_time(struct sepoll_t* loop)
+{
+	return loop->time;
+}
@@ -3,6 +3,12 @@
 // For epoll event constants
 #include <sys/epoll.h>
 
+// Fixed-width integer types
+#include <stdint.h>
+
+// Linked list macros
+#include <sys/queue.h>
+
 // Opaque structure for event loop state
 struct sepoll_t;
 
@@ -31,3 +37,125 @@ int sepoll_remove(struct sepoll_t* loop, int fd);
 // Event loop management
 int sepoll_enter(struct sepoll_t* loop, int timeout, void (*function)(int, void*), void* userdata);
 void sepoll_exit(struct sepoll_t* loop);
+
+// Monotonic clock in nanoseconds, sampled each time epoll_wait returns
+uint64_t sepoll_time(struct sepoll_t* loop);
+
+// *********************************************************************
+// Busy polling
+//
+// Instead of going straight to sleep in epoll_wait, the loop can check
+// for events over and over for a little while first, which trades CPU
+// time for not having to be woken up when they turn up soon after. How
+// long it spins follows how long it's been waiting for events lately:
+// up to twice that, so it usually catches the next one, but not at all
+// once that's longer than the limit, so a loop that's gone quiet goes
+// back to blocking straight away. Spins that find nothing are backed
+// off from, skipping more waits each time up to 64, so spinning stops
+// once it isn't paying off. Where the kernel can busy poll the network
+// device itself, it's asked to for the same length of time.
+// *********************************************************************
+
+// Spin for up to this many microseconds before blocking, or 0 to always block, which is the default
+int sepoll_busy_poll(struct sepoll_t* loop, unsigned int usecs);
+
+// *********************************************************************
+// Deferred work
+//
+// A task can be queued to run soon, which is after the callbacks for the
+// events epoll_wait returned, or when idle, which is only when there are
+// no events to handle and nothing queued to run soon, so it would
+// otherwise have blocked. While anything is queued, epoll_wait doesn't
+// block, so queued work isn't held up by the timeout. Each trip around
+// the loop runs a limited number of tasks queued to run soon and spends
+// a limited time on idle ones, and leaves the rest for the next trip, so
+// ready connections never wait long behind housekeeping. Tasks belong to
+// the caller and can't fail to be queued. A task that's already queued
+// stays where it is, other than being moved up if it's queued to run
+// soon while it's waiting for the loop to be idle, and one with more to
+// do can just queue itself again.
+// *********************************************************************
+
+// Tasks queued to run soon that are run per trip around the loop
+#define SEPOLL_DEFER_BUDGET 64
+
+// Nanoseconds spent on idle tasks per trip around the loop, although at least one is always run
+#define SEPOLL_IDLE_BUDGET 500000
+
+struct sepoll_task_t
+{
+	void (*function)(union sepoll_arg_t, union sepoll_arg_t);
+	
+	union sepoll_arg_t userdata1;
+	union sepoll_arg_t userdata2;
+	
+	// Which queue it's on, if any, and its place on it
+	int queue;
+	TAILQ_ENTRY(sepoll_task_t) entry;
+};
+
+void sepoll_task_init(struct sepoll_task_t* task, void (*function)(union sepoll_arg_t, union sepoll_arg_t), union sepoll_arg_t userdata1, union sepoll_arg_t userdata2);
+
+// Queue a task to run soon or when idle, or take it off whichever queue it's on
+void sepoll_defer(struct sepoll_t* loop, struct sepoll_task_t* task);
+void sepoll_idle(struct sepoll_t* loop, struct sepoll_task_t* task);
+void sepoll_cancel(struct sepoll_t* loop, struct sepoll_task_t* task);
+
+// *********************************************************************
+// Statistics
+//
+// Collected into a structure provided by the caller, which can live in
+// shared memory, and only while one is provided. Histogram buckets go
+// by powers of two: bucket i counts values below 2^i, so bucket 0 is
+// exactly 0 and the last one takes everything too big for the others.
+// *********************************************************************
+
+#define SEPOLL_STATS_BUCKETS 20
+
+// Distinct callback functions tracked, with any past this lumped into the last one, and the space for their names
+#define SEPOLL_STATS_CALLBACKS 12
+#define SEPOLL_STATS_NAME 24
+
+struct sepoll_histogram_t
+{
+	uint64_t buckets[SEPOLL_STATS_BUCKETS];
+	uint64_t sum;
+};
+
+struct sepoll_callback_stats_t
+{
+	void (*function)(uint32_t, union sepoll_arg_t, union sepoll_arg_t);
+	
+	// Kept in the structure itself rather than pointed to, so it still makes sense to another process
+	char name[SEPOLL_STATS_NAME];
+	
+	// Time spent in the callback, bucketed in microseconds and summed in nanoseconds
+	struct sepoll_histogram_t time;
+};
+
+struct sepoll_stats_t
+{
+	// Number of times epoll_wait returned events, and how many of those times it filled the events array
+	uint64_t wakeups;
+	uint64_t full;
+	
+	// Events returned per wakeup
+	struct sepoll_histogram_t events;
+	
+	// Time between epoll_wait returning and each callback being called, bucketed in microseconds and summed in nanoseconds
+	struct sepoll_histogram_t lag;
+	
+	// Times the loop spun before waiting, how many of those it found events, and the nanoseconds spent spinning
+	uint64_t spins;
+	uint64_t spinHits;
+	uint64_t spinTime;
+	
+	unsigned int numCallbacks;
+	struct sepoll_callback_stats_t callbacks[SEPOLL_STATS_CALLBACKS];
+};
+
+// Start collecting statistics into the provided structure, or stop with NULL
+void sepoll_stats(struct sepoll_t* loop, struct sepoll_stats_t* stats);
+
+// Give a callback function a name in the statistics
+int sepoll_stats_name(struct sepoll_t* loop, void (*function)(uint32_t, union sepoll_arg_t, union sepoll_arg_t), const char* name);
@@ -1,4 +1,4 @@
-// For some especially non-standard things: memmem, mempcpy, accept4, O_PATH
+// For some especially non-standard things: accept4, O_PATH
 #define _GNU_SOURCE
 
 // All the internet shit
@@ -6,22 +6,34 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+// Zero-copy completion notifications
+#include <linux/errqueue.h>
+
 // errno
 #include <errno.h>
 
-// open, openat
+// open, readahead
 #include <fcntl.h>
 
+// PATH_MAX
+#include <limits.h>
+
 // sigaction, sigemptyset, sigaddset, sigprocmask
 #include <signal.h>
 
+// bool
+#include <stdbool.h>
+
+// uint64_t, UINT32_MAX, UINT64_MAX
+#include <stdint.h>
+
 // fprintf, snprintf, dprintf
 #include <stdio.h>
 
 // malloc, free, on_exit, exit
 #include <stdlib.h>
 
-// memchr, memmem, stpcpy, mempcpy, strrchr
+// stpcpy, strrchr
 #include <string.h>
 
 // pidfd_send_signal
@@ -42,21 +54,24 @@
 // signalfd
 #include <sys/signalfd.h>
 
-// socket, setsockopt, bind, listen, accept4, getsockopt
+// setsockopt, accept4, getsockopt, send, recvmsg, struct ucred
 #include <sys/socket.h>
 
 // fstat
 #include <sys/stat.h>
 
-// timerfd_create, timerfd_settime
+// timerfd_create, timerfd_settime, timerfd_gettime
 #include <sys/timerfd.h>
 
-// time
+// time, clock_gettime
 #include <time.h>
 
-// read, close, getpid, dup2, execve, fchdir, _exit
+// read, pread, close, getpid, dup2, execve, fchdir, _exit
 #include <unistd.h>
 
+// response cache
+#include "scache.h"
+
 // event loop functions
 #include "sepoll.h"
 
@@ -66,16 +81,59 @@
 // sfork
 #include "sfork.h"
 
+// access log
+#include "slog.h"
+
+// shared metrics
+#include "smetrics.h"
+
+// tracepoints
+#include "sprobe.h"
+
+// reverse proxy
+#include "sproxy.h"
+
+// hot selector counts
+#include "ssketch.h"
+
+// search
+#include "ssearch.h"
+
+// gophermap templates
+#include "stemplate.h"
+
+// request parsing
+#include "srequest.h"
+
+// path resolution
+#include "sdircache.h"
+
+// RFC 1436 text files
+#include "stext.h"
+
+// TLS sessions
+#include "stls.h"
+
+// stype_guess
+#include "stype.h"
+
 // *********************************************************************
 // Constants
 // *********************************************************************
 
-// File descriptors needed for the server: 3 standard, 5 for server core functions, 1 for incoming user
-#define FDS_SERVER (3 + 5 + 1)
+// File descriptors needed for the server: 3 standard and 8 for server core functions, not counting the listening sockets
+// or the directory cache
+#define FDS_SERVER (3 + 8)
+
+// Directories each worker keeps open to resolve paths from
+#define DIRCACHE_SIZE 64
 
 // File descriptors needed per client
 #define FDS_CLIENT 4
 
+// Longest the event loop sleeps without checking in with the supervisor, in milliseconds
+#define HEARTBEAT_INTERVAL 1000
+
 // Maximum incoming request size
 // Equal to twice the 255 bytes mandated by the gopher protocol plus 2 for the CRLF and 1 for a tab
 // This allows a full request to potentially contain a 255 character selector and 255 character query,
@@ -90,6 +148,9 @@
 // Arbitrary but generous, and if it's exceeded the string is truncated safely
 #define ENV_BUFFER_SIZE 1024
 
+// Room for rendered templates in each worker, for plain and TLS clients separately
+#define TEMPLATE_CACHE_SIZE (1 << 20)
+
 // Error messages plus a format string to make them into gopher menus
 #define ERROR_FORMAT "3%s\r\n.\r\n"
 
@@ -100,33 +161,137 @@
 #define ERROR_INTERNAL "500 Internal Server Error"
 #define ERROR_UNAVAILABLE "503 Service Unavailable"
 
+// What RFC 1436 says a gophermap ends with
+#define TERMINATOR ".\r\n"
+#define TERMINATOR_LENGTH (sizeof(TERMINATOR) - 1)
+
+// Seconds between halving the hot selector counts
+#define HOT_DECAY_INTERVAL 60
+
+// Seconds a draining worker keeps accepting on its TCP sockets, for connections that were on their way to them
+#define DRAIN_GRACE 1
+
+// Size of the readahead window for large file streaming, in bytes
+#define STREAM_WINDOW (2 * 1024 * 1024)
+
+// How much of a large file can be left to send for the rest of it to be corked, in bytes, which is about what one
+// write gets out
+#define STREAM_CORK_TAIL (64 * 1024)
+
+// Bandwidth shaper tick interval and token bucket depth, both in milliseconds
+// The bucket depth is how much transmission time a connection can bank while idle, which lets it absorb scheduling jitter
+#define SHAPER_INTERVAL 50
+#define SHAPER_BURST 250
+
+// Smallest bucket depth in bytes, one full-sized segment on Ethernet, so a slow rate can still send something whole
+#define SHAPER_DEPTH_MIN 1460
+
+// Most parked clients looked at each time the event loop gets around to waking them up, so a crowd of them is woken over
+// a few trips around it rather than holding up everyone else in one go
+#define SHAPER_RESUME_BATCH 64
+
 // *********************************************************************
 // Definitions
 // *********************************************************************
+struct bucket_t
+{
+	// Bytes available to send and when that was last topped up
+	uint64_t tokens;
+	uint64_t timestamp;
+};
+
+// Connection state lives in a slab of fixed-size slots allocated once per worker, so it's kept as small as reasonably possible
+// The socket is -1 for a slot that isn't in use
 struct client_t
 {
 	// Client session information
 	int socket;
-	char address[INET_ADDRSTRLEN];
+	struct in_addr address;
 	time_t timestamp;
 	
-	// Incoming request buffer
+	// TLS session, or NULL for a plain connection
+	struct stls_t* tls;
+	
+	// Hard limits on how long the client may take, independent of activity
+	// The deadline is for the request to arrive and then for the whole transfer, or 0 for none
+	time_t deadline;
+	time_t started;
+	
+	// Requests are normally read into the worker's scratch buffer, and only get a buffer of their own if they arrive in pieces
+	char* request;
 	size_t count;
-	char buffer[MAX_REQUEST_SIZE];
 	
 	// File being transmitted
 	int file;
-	off_t filesize;
-	off_t sentsize;
 	
 	// CGI
 	int dirfd;
 	int pidfd;
 	
-	LIST_ENTRY(client_t) entry;
+	// Bandwidth shaping
+	bool shaped;
+	bool parked;
+	
+	// Large file streaming, and whether the tail of it has been corked
+	bool streaming;
+	bool corked;
+	
+	// Zero-copy transmission
+	bool zerocopy;
+	
+	// Connected over a Unix socket, so there's no address and no TCP
+	bool local;
+	
+	// The last few bytes of the response are the gophermap terminator rather than part of the file
+	bool trailer;
+	
+	// Waiting on a response from an upstream server
+	bool proxied;
+	
+	// Passed on to the CGI pool, which has its own copy of the socket
+	bool handoff;
+	
+	// Status code for the access log
+	unsigned short status;
+	
+	// Response being transmitted, which is the file or, if this is set, the cached copy of it
+	// Sizes and offsets are the same either way
+	struct scache_entry_t* memory;
+	
+	off_t filesize;
+	off_t sentsize;
+	off_t readahead;
+	
+	// Number of zero-copy sends made and the number the kernel has reported as done with
+	unsigned int zcsent;
+	unsigned int zcdone;
+	
+	struct bucket_t bucket;
+	
+	// When the connection was accepted by the event loop clock, and its access log record if it has one yet
+	uint64_t accepted;
+	uint64_t logseq;
+	
+	// A slot is either waiting on the shaper or, if it's unused, on the free list
+	union
+	{
+		TAILQ_ENTRY(client_t) parkentry;
+		struct client_t* nextfree;
+	};
 };
 
-LIST_HEAD(client_list_t, client_t);
+TAILQ_HEAD(client_queue_t, client_t);
+
+// What a worker hands off to the CGI pool along with the client's socket, and the directory if the program is an index file
+struct handoff_t
+{
+	struct in_addr address;
+	bool local;
+	
+	size_t querySize;
+	char filename[MAX_FILENAME_SIZE];
+	char query[MAX_REQUEST_SIZE];
+};
 
 struct server_t
 {
@@ -135,699 +300,2787 @@ struct server_t
 	
 	// File descriptors
 	int directory;
-	int socket;
+	int textCache;
+	int* sockets;
+	unsigned int numSockets;
+	int* tlsSockets;
+	unsigned int numTlsSockets;
+	int* unixSockets;
+	unsigned int numUnixSockets;
 	int sigfd;
 	int timerfd;
+	int shaperfd;
+	
+	// Socket to the CGI pool, which is where this worker sends CGI requests, or gets them if it's in the pool, or -1
+	int cgiSocket;
 	
 	// Event loop
 	struct sepoll_t* loop;
 	
-	// Clients
+	// Client slab. Slots below the high water mark have been used at least once and the unused ones among them are on the
+	// free list, while the ones above it have never been touched, so memory is only committed up to peak concurrency
 	unsigned int numClients;
-	struct client_list_t clients;
+	unsigned int highWater;
+	struct client_t* clients;
+	struct client_t* freeClients;
+	
+	// Scratch buffer for incoming requests
+	char scratch[MAX_REQUEST_SIZE];
+	
+	// Buffer for files on their way through userspace to be encrypted, for TLS connections without kernel TLS
+	char* tlsBuffer;
+	
+	// Directories paths are resolved from
+	struct sdircache_t* dirs;
+	
+	// Small files held in memory
+	struct scache_t* cache;
+	
+	// Rendered templates, which differ in the port their links go to
+	struct scache_t* templates;
+	struct scache_t* tlsTemplates;
+	
+	// Search index, as of the last snapshot the supervisor wrote
+	struct ssearch_t* search;
+	
+	// Upstream servers and the responses fetched from them
+	struct sproxy_t* proxy;
+	
+	// Bandwidth shaping for the whole worker and the clients waiting on tokens, oldest first, along with how many of
+	// them there are and how many are still to be looked at since the last shaper tick
+	struct bucket_t bucket;
+	struct client_queue_t parked;
+	unsigned int numParked;
+	unsigned int resumeLeft;
+	struct sepoll_task_t resume;
+	
+	// Access log, and the offset from the event loop clock to the wall clock for its timestamps
+	struct slog_t* log;
+	uint64_t logEpoch;
+	
+	// This worker's counters in the shared metrics region
+	struct smetrics_worker_t* metrics;
+	
+	// Set once the worker has stopped accepting connections and is finishing up with the ones it has, with a
+	// time to give up on them or 0 to wait for as long as it takes
+	bool draining;
+	time_t drainDeadline;
+	
+	// When a draining worker stops accepting on its TCP sockets, or 0 once it has
+	time_t listenersClose;
+	
+	// For a CGI pool worker, set while it's too full to take handoffs and isn't waiting on the socket they come in on,
+	// and once every worker that could hand anything off has hung up, which is what a draining one waits for
+	bool handoffPaused;
+	bool handoffClosed;
+	
+	// When to next halve the hot selector counts, which is done when the worker has nothing better to do
+	time_t hotDecay;
+	struct sepoll_task_t decay;
 };
 
 // *********************************************************************
-// Disconnect a client from the server
+// Token bucket handling
+//
+// Buckets are refilled lazily from the event loop clock whenever they
+// are about to be used, so there is no per-connection timer. The refill
+// leaves the timestamp alone if less than a byte was earned so slow
+// rates don't lose their fractional bytes to rounding.
 // *********************************************************************
-static void client_disconnect(struct server_t* server, struct client_t* client)
+static inline uint64_t bucket_depth(unsigned int rate)
 {
-	// Deal with the open file, if any
-	if (client->file >= 0)
-	{
-		close(client->file);
-	}
+	uint64_t depth = (uint64_t)rate * SHAPER_BURST / 1000;
 	
-	// Deal with the open directory, if any
-	if (client->dirfd >= 0)
+	return depth > SHAPER_DEPTH_MIN ? depth : SHAPER_DEPTH_MIN;
+}
+
+static void bucket_fill(struct bucket_t* bucket, unsigned int rate, uint64_t now)
+{
+	bucket->tokens = bucket_depth(rate);
+	bucket->timestamp = now;
+}
+
+static void bucket_refill(struct bucket_t* bucket, unsigned int rate, uint64_t now)
+{
+	uint64_t elapsed = now - bucket->timestamp;
+	uint64_t depth = bucket_depth(rate);
+	
+	// Long enough to fill the bucket regardless, which also keeps the multiplication below from overflowing
+	if (elapsed >= depth * 1000000000 / rate)
 	{
-		close(client->dirfd);
+		bucket_fill(bucket, rate, now);
+		return;
 	}
 	
-	// Deal with the pidfd, if any
-	if (client->pidfd >= 0)
+	uint64_t earned = rate * elapsed / 1000000000;
+	
+	if (earned == 0)
 	{
-		sepoll_remove(server->loop, client->pidfd);
-		close(client->pidfd);
+		return;
 	}
 	
-	// Deal with the socket
-	sepoll_remove(server->loop, client->socket);
-	close(client->socket);
+	bucket->tokens += earned;
+	bucket->timestamp = now;
 	
-	// Get rid of the list entry
-	LIST_REMOVE(client, entry);
-	free(client);
+	if (bucket->tokens > depth)
+	{
+		bucket->tokens = depth;
+	}
+}
+
+static inline void bucket_take(struct bucket_t* bucket, uint64_t count)
+{
+	// There's normally never more sent than there were tokens for, but a TLS write that had to be retried can go over
+	bucket->tokens = count < bucket->tokens ? bucket->tokens - count : 0;
+}
+
+// *********************************************************************
+// Arm or disarm the shaper timer
+// *********************************************************************
+static void shaper_arm(struct server_t* server, bool arm)
+{
+	struct itimerspec timer =
+	{
+		.it_interval =
+		{
+			.tv_nsec = arm ? SHAPER_INTERVAL * 1000000 : 0
+		},
+		.it_value =
+		{
+			.tv_nsec = arm ? SHAPER_INTERVAL * 1000000 : 0
+		}
+	};
 	
-	// Update the client count
-	server->numClients--;
+	if (timerfd_settime(server->shaperfd, 0, &timer, NULL) < 0)
+	{
+		fprintf(stderr, "%i - Error: Cannot set shaper timerfd: %m\n", getpid());
+	}
 }
 
 // *********************************************************************
-// Send a kill signal to a pidfd and disconnect the client if it fails
+// Park a shaped client until the shaper timer gives it more tokens
 // *********************************************************************
-static inline void pidfd_kill_client(struct server_t* server, struct client_t* client)
+static void client_park(struct server_t* server, struct client_t* client)
 {
-	if (pidfd_send_signal(client->pidfd, SIGKILL, NULL, 0) < 0)
+	if (client->parked)
 	{
-		// This shouldn't fail unless something is deeply wrong
-		// In the event that it does, boot the client and pray for the best
-		fprintf(stderr, "%i - Error: Cannot send kill signal via pidfd: %m\n", getpid());
-		
-		client_disconnect(server, client);
+		return;
 	}
+	
+	// Stop listening for EPOLLOUT, otherwise every ACK that frees up send buffer space would wake us up for nothing
+	sepoll_mod_events(server->loop, client->socket, EPOLLET);
+	
+	if (TAILQ_EMPTY(&server->parked))
+	{
+		shaper_arm(server, true);
+	}
+	
+	TAILQ_INSERT_TAIL(&server->parked, client, parkentry);
+	client->parked = true;
+	server->numParked++;
 }
 
 // *********************************************************************
-// Handle event on pidfd
+// Take a client off the parked queue
 // *********************************************************************
-static void client_pidfd(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+static void client_unpark(struct server_t* server, struct client_t* client)
 {
-	struct server_t* server = userdata1.ptr;
-	struct client_t* client = userdata2.ptr;
+	TAILQ_REMOVE(&server->parked, client, parkentry);
+	client->parked = false;
+	server->numParked--;
 	
-	// Now that the process has ended we can disconnect the client
-	client_disconnect(server, client);
+	if (TAILQ_EMPTY(&server->parked))
+	{
+		shaper_arm(server, false);
+	}
 }
 
 // *********************************************************************
-// Handle event on a client socket
+// Access logging and metrics
+//
+// A record is claimed once there's a request to put in it and filled in
+// as the connection moves along, with the stage times taken from the
+// event loop clock so logging costs no extra syscalls. Connections that
+// never got as far as a request get their record when they close.
+// Metrics are counted at the same points.
 // *********************************************************************
-static void client_socket(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+
+// Error messages start with their status code
+static inline unsigned short error_status(const char* error)
 {
-	struct server_t* server = userdata1.ptr;
-	struct client_t* client = userdata2.ptr;
+	return (unsigned short)strtoul(error, NULL, 10);
+}
+
+// Microseconds since the client was accepted, which sticks at UINT32_MAX after about 71 minutes rather than wrapping
+static inline uint32_t client_elapsed(struct server_t* server, struct client_t* client)
+{
+	uint64_t micros = (sepoll_time(server->loop) - client->accepted) / 1000;
 	
-	if (events & EPOLLIN)
+	return micros < UINT32_MAX ? (uint32_t)micros : UINT32_MAX;
+}
+
+// Fill in who the client is, which for a Unix socket is whoever the kernel says is on the other end
+static void log_address(struct slog_record_t* record, int fd, bool local, struct in_addr address)
+{
+	if (local)
 	{
-		// Read socket into client's buffer until it is full or the read would block
-		do
-		{
-			ssize_t count = read(client->socket, client->buffer + client->count, MAX_REQUEST_SIZE - client->count);
-			
-			if (count < 0)
-			{
-				if (errno == EAGAIN)
-				{
-					break;
-				}
-				else if (errno == ECONNRESET)
-				{
-					client_disconnect(server, client);
-					return;
-				}
-				else
-				{
-					fprintf(stderr, "%i - Error: Cannot read from client: %m\n", getpid());
-					dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
-					client_disconnect(server, client);
-					return;
-				}
-			}
-			else if (count == 0)
-			{
-				client_disconnect(server, client);
-				return;
-			}
-			
-			client->count += (size_t)count;
-		}
-		while (client->count < MAX_REQUEST_SIZE);
-		
-		// Search for crlf sequence
-		char* crlf = memmem(client->buffer, client->count, "\r\n", 2);
+		struct ucred cred;
+		socklen_t length = sizeof(cred);
 		
-		// No patience if a valid request didn't arrive yet after we did 2+ reads from the socket already
-		if (crlf == NULL)
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == 0)
 		{
-			dprintf(client->socket, ERROR_FORMAT, ERROR_BAD);
-			client_disconnect(server, client);
-			return;
+			record->family = AF_UNIX;
+			memcpy(record->address, &cred, sizeof(cred));
 		}
+	}
+	else
+	{
+		record->family = AF_INET;
+		memcpy(record->address, &address, sizeof(struct in_addr));
+	}
+}
+
+// Get the client's record, claiming one if it doesn't have one yet
+static struct slog_record_t* client_log(struct server_t* server, struct client_t* client)
+{
+	if (server->log == NULL)
+	{
+		return NULL;
+	}
+	
+	if (client->logseq != UINT64_MAX)
+	{
+		// The ring could have lapped a connection that's been around long enough
+		return slog_lookup(server->log, client->logseq);
+	}
+	
+	struct slog_record_t* record = slog_reserve(server->log, &client->logseq);
+	
+	record->timestamp = client->accepted + server->logEpoch;
+	log_address(record, client->socket, client->local, client->address);
+	
+	return record;
+}
+
+// Log the request once it's in
+static void client_log_request(struct server_t* server, struct client_t* client, const char* selector, size_t length)
+{
+	struct slog_record_t* record = client_log(server, client);
+	
+	if (record == NULL)
+	{
+		return;
+	}
+	
+	record->requestTime = client_elapsed(server, client);
+	record->selectorHash = slog_hash(selector, length);
+	record->selectorLength = (uint16_t)length;
+	memcpy(record->selector, selector, length < SLOG_SELECTOR_SIZE ? length : SLOG_SELECTOR_SIZE);
+}
+
+// Note the first byte of the response going out
+static void client_first_byte(struct server_t* server, struct client_t* client)
+{
+	SPROBE1(sgopher, first_byte, client->socket);
+	
+	uint32_t elapsed = client_elapsed(server, client);
+	
+	smetrics_observe(&server->metrics->firstByte, elapsed);
+	
+	struct slog_record_t* record = client_log(server, client);
+	
+	if (record != NULL)
+	{
+		record->firstByteTime = elapsed;
+	}
+}
+
+// Finish off the record when the client goes away
+static void client_log_close(struct server_t* server, struct client_t* client)
+{
+	struct slog_record_t* record = client_log(server, client);
+	
+	if (record == NULL)
+	{
+		return;
+	}
+	
+	// CGI output goes straight from the process to the socket, so the byte count for those is always 0
+	uint32_t flags = 0;
+	
+	if (client->pidfd >= 0 || client->handoff)
+	{
+		flags |= SLOG_CGI;
+	}
+	
+	if (client->memory != NULL)
+	{
+		flags |= SLOG_CACHED;
+	}
+	
+	if (client->zerocopy)
+	{
+		flags |= SLOG_ZEROCOPY;
+	}
+	
+	if (client->streaming)
+	{
+		flags |= SLOG_STREAMED;
+	}
+	
+	if (client->shaped)
+	{
+		flags |= SLOG_SHAPED;
+	}
+	
+	if (client->tls != NULL)
+	{
+		flags |= stls_ktls(client->tls) ? SLOG_KTLS : SLOG_TLS;
+	}
+	
+	if (client->proxied)
+	{
+		flags |= SLOG_PROXIED;
+	}
+	
+	record->status = client->status;
+	record->flags = flags;
+	record->bytes = (uint64_t)client->sentsize;
+	record->closeTime = client_elapsed(server, client);
+	
+	slog_commit(record);
+}
+
+// *********************************************************************
+// Send an error message to a client
+// *********************************************************************
+static void client_error(struct client_t* client, const char* error)
+{
+	client->status = error_status(error);
+	
+	if (client->tls != NULL)
+	{
+		char buffer[64];
 		
-		// Selector and query position and size within the client buffer
-		// Selector will be at the beginning so it doesn't need a pointer
-		size_t selectorSize;
-		
-		char* query;
-		size_t querySize;
-		
-		// Search for a tab which indicates that the request contains a query
-		char* tab = memchr(client->buffer, '\t', client->count);
+		int length = snprintf(buffer, sizeof(buffer), ERROR_FORMAT, error);
 		
-		// Figure out the length of the provided selector and the query
-		if (tab != NULL && tab < crlf)
-		{
-			selectorSize = (size_t)(tab - client->buffer);
-			querySize = (size_t)(crlf - tab - 1);
-		}
-		else
-		{
-			selectorSize = (size_t)(crlf - client->buffer);
-			querySize = 0;
-		}
+		// The connection is about to be closed either way, so there's nothing to be done if it doesn't all fit
+		stls_write(client->tls, buffer, (size_t)length);
+		stls_shutdown(client->tls);
+	}
+	else
+	{
+		dprintf(client->socket, ERROR_FORMAT, error);
+	}
+}
+
+// *********************************************************************
+// Whether a draining worker is done
+//
+// A CGI pool worker can't go until the workers handing clients off to
+// it have, since they could still be finishing requests from before the
+// drain that turn out to be CGI programs.
+// *********************************************************************
+static inline bool server_drained(struct server_t* server)
+{
+	return server->numClients == 0 && server->listenersClose == 0 && (!server->params->cgiPool || server->handoffClosed);
+}
+
+static void server_handoff(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2);
+
+// *********************************************************************
+// Disconnect a client from the server
+// *********************************************************************
+static void client_disconnect(struct server_t* server, struct client_t* client)
+{
+	SPROBE3(sgopher, close, client->socket, client->status, client->sentsize);
+	
+	client_log_close(server, client);
+	
+	// The worker that handed a client off to the CGI pool has already counted them
+	if (!server->params->cgiPool)
+	{
+		server->metrics->status[smetrics_status(client->status)]++;
+		server->metrics->bytes += (uint64_t)client->sentsize;
+		smetrics_observe(&server->metrics->duration, client_elapsed(server, client));
+	}
+	
+	// Deal with the open file, if any
+	if (client->file >= 0)
+	{
+		// Whatever is left of a huge file in the page cache goes too, whether the transfer finished or was cut short
+		if (client->streaming && server->params->dropBehind > 0 && client->filesize >= (off_t)server->params->dropBehind)
+		{
+			posix_fadvise(client->file, 0, 0, POSIX_FADV_DONTNEED);
+		}
+		
+		close(client->file);
+	}
+	
+	// Deal with the open directory, if any
+	if (client->dirfd >= 0)
+	{
+		close(client->dirfd);
+	}
+	
+	// Deal with the pidfd, if any
+	if (client->pidfd >= 0)
+	{
+		sepoll_remove(server->loop, client->pidfd);
+		close(client->pidfd);
+	}
+	
+	// Deal with the shaper queue, if it's on it
+	if (client->parked)
+	{
+		client_unpark(server, client);
+	}
+	
+	// Deal with the upstream fetch, if it's waiting on one
+	if (client->memory == NULL && client->proxied)
+	{
+		sproxy_cancel(server->proxy, client);
+	}
+	
+	// Deal with the partial request buffer, if any
+	free(client->request);
+	
+	// Deal with the TLS session, if any
+	stls_destroy(client->tls);
+	
+	// Deal with the cached response, if any
+	if (client->memory != NULL)
+	{
+		// If the kernel might still be sending from our memory, reset the connection instead of letting it linger on
+		// in the background after we've given up our reference to the data
+		if (client->zcdone != client->zcsent)
+		{
+			struct linger linger =
+			{
+				.l_onoff = 1,
+				.l_linger = 0
+			};
+			
+			setsockopt(client->socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+		}
+		
+		scache_release(client->memory);
+	}
+	
+	// Deal with the socket
+	sepoll_remove(server->loop, client->socket);
+	close(client->socket);
+	
+	// Put the slot back on the free list
+	client->socket = -1;
+	client->nextfree = server->freeClients;
+	server->freeClients = client;
+	
+	// Update the client count
+	server->numClients--;
+	server->metrics->connections = server->numClients;
+	
+	// A CGI pool worker that was too full for handoffs has room again, and adding the socket back picks up any that
+	// are already waiting
+	if (server->handoffPaused)
+	{
+		server->handoffPaused = false;
+		sepoll_add(server->loop, server->cgiSocket, EPOLLIN | EPOLLET | EPOLLEXCLUSIVE, server_handoff, server, NULL);
+	}
+	
+	// A draining worker is done as soon as its last client is
+	if (server->draining && server_drained(server))
+	{
+		sepoll_exit(server->loop);
+	}
+}
+
+// *********************************************************************
+// Send a kill signal to a pidfd and disconnect the client if it fails
+// *********************************************************************
+static inline void pidfd_kill_client(struct server_t* server, struct client_t* client)
+{
+	if (pidfd_send_signal(client->pidfd, SIGKILL, NULL, 0) < 0)
+	{
+		// This shouldn't fail unless something is deeply wrong
+		// In the event that it does, boot the client and pray for the best
+		fprintf(stderr, "%i - Error: Cannot send kill signal via pidfd: %m\n", getpid());
+		
+		client_disconnect(server, client);
+	}
+}
+
+// *********************************************************************
+// Handle event on pidfd
+// *********************************************************************
+static void client_pidfd(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct server_t* server = userdata1.ptr;
+	struct client_t* client = userdata2.ptr;
+	
+	// The program finished on its own rather than being killed, so its output is complete
+	if (client->tls != NULL && client->status == 200)
+	{
+		stls_shutdown(client->tls);
+	}
+	
+	// Now that the process has ended we can disconnect the client
+	client_disconnect(server, client);
+}
+
+// *********************************************************************
+// Set up a large file transfer
+//
+// Rather than leaving it up to the kernel's defaults, large files are
+// read ahead in bounded windows just in front of the send cursor, and
+// the socket is told to only report writability once its unsent data
+// is nearly drained so that a fast sender doesn't pile up megabytes of
+// socket memory per connection. Files past the drop-behind size are
+// evicted from the page cache as they go so a one-off huge download
+// doesn't push out the small hot files everyone else is asking for.
+// *********************************************************************
+static void client_stream_start(struct server_t* server, struct client_t* client)
+{
+	client->streaming = true;
+	client->readahead = 0;
+	
+	posix_fadvise(client->file, 0, 0, POSIX_FADV_SEQUENTIAL);
+	
+	if (server->params->notsentLowat > 0 && !client->local)
+	{
+		int optval = (int)server->params->notsentLowat;
+		
+		if (setsockopt(client->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &optval, sizeof(optval)) < 0)
+		{
+			fprintf(stderr, "%i - Error: Cannot set unsent data low water mark on socket: %m\n", getpid());
+		}
+	}
+}
+
+// *********************************************************************
+// Keep the readahead window ahead of the send cursor, and the drop-behind
+// window behind it
+// *********************************************************************
+static void client_stream_advance(struct server_t* server, struct client_t* client)
+{
+	// Read ahead another window once the cursor is halfway into the current one
+	while (client->readahead < client->filesize && client->sentsize + STREAM_WINDOW / 2 >= client->readahead)
+	{
+		posix_fadvise(client->file, client->readahead, STREAM_WINDOW, POSIX_FADV_WILLNEED);
+		client->readahead += STREAM_WINDOW;
+		
+		// Drop the window that's now two behind the readahead mark, which is at least a whole window behind the cursor.
+		// Pages the socket is still holding on to aren't evicted anyway, so this can't lose data in flight.
+		if (server->params->dropBehind > 0 && client->filesize >= (off_t)server->params->dropBehind && client->readahead >= 3 * STREAM_WINDOW)
+		{
+			posix_fadvise(client->file, client->readahead - 3 * STREAM_WINDOW, STREAM_WINDOW, POSIX_FADV_DONTNEED);
+		}
+	}
+	
+	// Cork only the last write, and the trailer if there is one, so the last partial segments go out full-sized along
+	// with the FIN without holding up anything before them
+	if (server->params->cork && !client->corked && !client->local && client->filesize - client->sentsize <= STREAM_CORK_TAIL)
+	{
+		int optval = 1;
+		
+		setsockopt(client->socket, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval));
+		client->corked = true;
+	}
+}
+
+// *********************************************************************
+// Finish a large file transfer
+// *********************************************************************
+static void client_stream_finish(struct server_t* server, struct client_t* client)
+{
+	if (client->corked)
+	{
+		int optval = 0;
+		
+		setsockopt(client->socket, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval));
+		client->corked = false;
+	}
+}
+
+// *********************************************************************
+// Send part of a response from memory, advancing the client's position
+//
+// Zero-copy sends pin the pages and hand them to the network stack
+// directly, so the data must not go away until the kernel reports it
+// is done with them on the socket's error queue.
+// *********************************************************************
+static ssize_t client_send(struct client_t* client, off_t end)
+{
+	const char* data = client->memory->data + client->sentsize;
+	size_t length = (size_t)(end - client->sentsize);
+	
+	ssize_t n;
+	
+	if (client->tls != NULL)
+	{
+		n = stls_write(client->tls, data, length);
+	}
+	else if (client->zerocopy)
+	{
+		n = send(client->socket, data, length, MSG_ZEROCOPY);
+		
+		if (n > 0)
+		{
+			client->zcsent++;
+		}
+		else if (n < 0 && errno == ENOBUFS)
+		{
+			// Over the limit on pinned memory for the socket, so just copy this bit
+			n = send(client->socket, data, length, 0);
+		}
+	}
+	else
+	{
+		n = send(client->socket, data, length, 0);
+	}
+	
+	if (n > 0)
+	{
+		client->sentsize += n;
+	}
+	
+	return n;
+}
+
+// *********************************************************************
+// Send part of the gophermap terminator, which starts at the given
+// offset into the response, advancing the client's position
+// *********************************************************************
+static ssize_t client_send_trailer(struct client_t* client, off_t start)
+{
+	const char* data = TERMINATOR + (client->sentsize - start);
+	size_t length = (size_t)(client->filesize - client->sentsize);
+	
+	ssize_t n;
+	
+	if (client->tls != NULL)
+	{
+		n = stls_write(client->tls, data, length);
+	}
+	else
+	{
+		n = send(client->socket, data, length, 0);
+	}
+	
+	if (n > 0)
+	{
+		client->sentsize += n;
+	}
+	
+	return n;
+}
+
+// *********************************************************************
+// Collect zero-copy completion notifications from the socket's error
+// queue. Returns -1 if the client was disconnected in the process,
+// either because there was a real error or because the response is
+// now completely done with.
+// *********************************************************************
+static int client_reap(struct server_t* server, struct client_t* client)
+{
+	while (1)
+	{
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+		
+		struct msghdr msg =
+		{
+			.msg_control = control,
+			.msg_controllen = sizeof(control)
+		};
+		
+		if (recvmsg(client->socket, &msg, MSG_ERRQUEUE) < 0)
+		{
+			if (errno == EAGAIN)
+			{
+				break;
+			}
+			
+			client_disconnect(server, client);
+			return -1;
+		}
+		
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		
+		if (cmsg == NULL || cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+		{
+			continue;
+		}
+		
+		struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+		
+		// Each notification covers an inclusive range of sends
+		if (err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+		{
+			client->zcdone += err->ee_data - err->ee_info + 1;
+		}
+	}
+	
+	// The error queue isn't the only thing that raises EPOLLERR
+	int error = 0;
+	socklen_t length = sizeof(error);
+	
+	if (getsockopt(client->socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0)
+	{
+		client_disconnect(server, client);
+		return -1;
+	}
+	
+	if (client->sentsize >= client->filesize && client->zcdone == client->zcsent)
+	{
+		client_disconnect(server, client);
+		return -1;
+	}
+	
+	return 0;
+}
+
+// *********************************************************************
+// Load a small file into the response cache, or get it if it's already
+// there and up to date
+// *********************************************************************
+static struct scache_entry_t* server_cache_file(struct server_t* server, int file, const struct stat* statbuf)
+{
+	struct scache_entry_t* entry = scache_get(server->cache, statbuf);
+	
+	if (entry != NULL)
+	{
+		return entry;
+	}
+	
+	size_t length = (size_t)statbuf->st_size;
+	
+	// malloc(0) is allowed to return NULL so always ask for at least a byte
+	char* data = malloc(length > 0 ? length : 1);
+	
+	if (data == NULL)
+	{
+		return NULL;
+	}
+	
+	size_t count = 0;
+	
+	while (count < length)
+	{
+		ssize_t n = pread(file, data + count, length - count, (off_t)count);
+		
+		if (n <= 0)
+		{
+			free(data);
+			return NULL;
+		}
+		
+		count += (size_t)n;
+	}
+	
+	return scache_put(server->cache, statbuf, data, length);
+}
+
+// *********************************************************************
+// Render an index file as a template, or get it from the cache if
+// neither it nor anything it includes or lists has changed
+// *********************************************************************
+static struct scache_entry_t* server_template(struct server_t* server, bool tls, int file, const char* directory, const struct stat* statbuf)
+{
+	struct scache_t* cache = tls ? server->tlsTemplates : server->templates;
+	
+	struct scache_entry_t* entry = scache_get(cache, statbuf);
+	
+	if (entry != NULL)
+	{
+		if (stemplate_fresh(entry->deps, server->dirs, time(NULL)))
+		{
+			return entry;
+		}
+		
+		// Rendering it again replaces it in the cache
+		scache_release(entry);
+	}
+	
+	size_t length;
+	struct stemplate_deps_t* deps;
+	
+	char* data = stemplate_render(server->dirs, directory, file, server->params->hostname, tls ? server->params->tlsPort : server->params->port, &length, &deps);
+	
+	if (data == NULL)
+	{
+		return NULL;
+	}
+	
+	entry = scache_put(cache, statbuf, data, length);
+	
+	if (entry == NULL)
+	{
+		free(deps);
+		return NULL;
+	}
+	
+	entry->deps = deps;
+	
+	return entry;
+}
+
+// *********************************************************************
+// Whether the gophermap about to be sent already ends with a terminator
+// on a line of its own, looking at the cached copy if there is one or
+// the end of the file otherwise
+// *********************************************************************
+static bool client_terminated(struct client_t* client)
+{
+	// Enough for the terminator and the line ending before it
+	char tail[TERMINATOR_LENGTH + 2];
+	size_t length = client->filesize < (off_t)sizeof(tail) ? (size_t)client->filesize : sizeof(tail);
+	
+	if (client->memory != NULL)
+	{
+		memcpy(tail, client->memory->data + client->filesize - (off_t)length, length);
+	}
+	else if (pread(client->file, tail, length, client->filesize - (off_t)length) != (ssize_t)length)
+	{
+		// If it can't be read now it won't be sent either, so that can be dealt with when it comes to it
+		return true;
+	}
+	
+	// Allow for a bare LF on the terminator's line and the one before it, since the file is sent as it is otherwise
+	for (size_t i = 0; i < length; i++)
+	{
+		const char* line = tail + i;
+		size_t remaining = length - i;
+		
+		// The tail only starts at the beginning of a line if it's the whole file
+		if ((i == 0 ? (off_t)length == client->filesize : line[-1] == '\n') && ((remaining == 3 && memcmp(line, ".\r\n", 3) == 0) || (remaining == 2 && memcmp(line, ".\n", 2) == 0)))
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+// *********************************************************************
+// Send part of a file over TLS without kernel TLS, advancing the
+// client's position
+//
+// The file has to come up into userspace to be encrypted, so it's read
+// a record at a time into the worker's buffer. If the write has to be
+// retried, the same part of the file is just read again next time.
+// *********************************************************************
+static ssize_t client_tls_sendfile(struct server_t* server, struct client_t* client, off_t end)
+{
+	size_t length = (size_t)(end - client->sentsize);
+	
+	if (length > STLS_RECORD_SIZE)
+	{
+		length = STLS_RECORD_SIZE;
+	}
+	
+	ssize_t n = pread(client->file, server->tlsBuffer, length, client->sentsize);
+	
+	if (n <= 0)
+	{
+		// The file got shorter since it was opened
+		if (n == 0)
+		{
+			errno = EIO;
+		}
+		
+		return -1;
+	}
+	
+	n = stls_write(client->tls, server->tlsBuffer, (size_t)n);
+	
+	if (n > 0)
+	{
+		client->sentsize += n;
+	}
+	
+	return n;
+}
+
+// *********************************************************************
+// Send as much of the file as the socket and the shaper allow
+// Returns -1 if the client was disconnected in the process
+// *********************************************************************
+static int client_transmit(struct server_t* server, struct client_t* client)
+{
+	// Send everything that's left unless the shaper says otherwise
+	off_t end = client->filesize;
+	
+	if (client->shaped)
+	{
+		uint64_t now = sepoll_time(server->loop);
+		uint64_t tokens = UINT64_MAX;
+		
+		if (server->params->rateLimit > 0)
+		{
+			bucket_refill(&client->bucket, server->params->rateLimit, now);
+			tokens = client->bucket.tokens;
+		}
+		
+		if (server->params->workerRateLimit > 0)
+		{
+			bucket_refill(&server->bucket, server->params->workerRateLimit, now);
+			
+			if (server->bucket.tokens < tokens)
+			{
+				tokens = server->bucket.tokens;
+			}
+		}
+		
+		if (tokens == 0)
+		{
+			client_park(server, client);
+			return 0;
+		}
+		
+		if (tokens < (uint64_t)(end - client->sentsize))
+		{
+			end = client->sentsize + (off_t)tokens;
+		}
+	}
+	
+	// A TLS write that has to be retried can't get any shorter, even if the shaper would rather it did
+	if (client->tls != NULL && client->sentsize + (off_t)stls_pending(client->tls) > end)
+	{
+		end = client->sentsize + (off_t)stls_pending(client->tls);
+	}
+	
+	off_t start = client->sentsize;
+	
+	// Where the file ends and the terminator, if there is one, begins
+	off_t content = client->filesize - (client->trailer ? (off_t)TERMINATOR_LENGTH : 0);
+	
+	if (client->streaming)
+	{
+		client_stream_advance(server, client);
+	}
+	
+	// Do sendfile, or send from memory, until it would block or is complete
+	do
+	{
+		ssize_t n;
+		
+		off_t stop = end < content ? end : content;
+		
+		if (client->sentsize >= content)
+		{
+			n = client_send_trailer(client, content);
+		}
+		else if (client->memory != NULL)
+		{
+			n = client_send(client, stop);
+		}
+		else if (client->tls != NULL && !stls_ktls(client->tls))
+		{
+			n = client_tls_sendfile(server, client, stop);
+		}
+		else
+		{
+			// With kernel TLS this is still straight from the page cache, and the kernel encrypts it on the way out
+			n = sendfile(client->socket, client->file, &client->sentsize, (size_t)(stop - client->sentsize));
+		}
+		
+		if (n < 0)
+		{
+			if (errno == EAGAIN)
+			{
+				break;
+			}
+			else if (errno != EPIPE)
+			{
+				// Don't bother reporting it if it's a broken pipe because that had nothing to do with us
+				fprintf(stderr, "%i - Error: Problem sending file to client: %m\n", getpid());
+				
+				// Only send the error message if none of the file has been sent yet
+				if (client->sentsize == 0)
+				{
+					client_error(client, ERROR_INTERNAL);
+				}
+			}
+			
+			client_disconnect(server, client);
+			return -1;
+		}
+	}
+	while (client->sentsize < end);
+	
+	if (start == 0 && client->sentsize > 0)
+	{
+		client_first_byte(server, client);
+	}
+	
+	// See if transfer has not yet finished
+	if (client->sentsize >= client->filesize)
+	{
+		client->status = 200;
+		
+		if (client->streaming)
+		{
+			client_stream_finish(server, client);
+		}
+		
+		// Let the terminator go out along with the end of the gophermap
+		if (client->trailer && !client->local)
+		{
+			int optval = 0;
+			
+			setsockopt(client->socket, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval));
+		}
+		
+		// Zero-copy responses aren't done until the kernel says so, at which point client_reap finishes up
+		if (client->zcdone != client->zcsent)
+		{
+			sepoll_mod_events(server->loop, client->socket, EPOLLET);
+			return 0;
+		}
+		
+		if (client->tls != NULL)
+		{
+			stls_shutdown(client->tls);
+		}
+		
+		client_disconnect(server, client);
+		return -1;
+	}
+	
+	client->timestamp = time(NULL);
+	
+	if (client->streaming)
+	{
+		client_stream_advance(server, client);
+	}
+	
+	if (client->shaped)
+	{
+		uint64_t sent = (uint64_t)(client->sentsize - start);
+		
+		if (server->params->rateLimit > 0)
+		{
+			bucket_take(&client->bucket, sent);
+		}
+		
+		if (server->params->workerRateLimit > 0)
+		{
+			bucket_take(&server->bucket, sent);
+		}
+		
+		// Ran out of tokens rather than socket buffer space, so wait for the shaper
+		if (client->sentsize == end)
+		{
+			client_park(server, client);
+		}
+	}
+	
+	return 0;
+}
+
+// *********************************************************************
+// Start sending a response that was made in memory rather than read
+// from a file
+// *********************************************************************
+static void client_respond(struct server_t* server, struct client_t* client, struct scache_entry_t* entry)
+{
+	client->memory = entry;
+	client->filesize = (off_t)entry->length;
+	client->started = time(NULL);
+	client->deadline = server->params->deadline > 0 ? client->started + server->params->deadline : 0;
+	client->timestamp = client->started;
+	
+	sepoll_mod_events(server->loop, client->socket, EPOLLOUT | EPOLLET);
+}
+
+// *********************************************************************
+// Answer a search query with a menu of the results. Returns -1 if the
+// client was disconnected in the process.
+// *********************************************************************
+static int client_search(struct server_t* server, struct client_t* client, const char* query, size_t querySize)
+{
+	size_t length;
+	
+	char* data = ssearch_query(server->search, server->dirs, query, querySize, server->params->search, server->params->hostname, client->tls != NULL ? server->params->tlsPort : server->params->port, &length);
+	
+	struct scache_entry_t* entry = data != NULL ? scache_wrap(data, length) : NULL;
+	
+	if (entry == NULL)
+	{
+		fprintf(stderr, "%i - Error: Cannot search for %.*s: %m\n", getpid(), (int)querySize, query);
+		client_error(client, ERROR_INTERNAL);
+		client_disconnect(server, client);
+		return -1;
+	}
+	
+	server->metrics->searches++;
+	
+	client_respond(server, client, entry);
+	
+	return 0;
+}
+
+// *********************************************************************
+// Pass a request on to an upstream server. The response comes from the
+// proxy's cache straight away if it has it, otherwise the client waits
+// for client_upstream to be called. Returns -1 if the client was
+// disconnected in the process.
+// *********************************************************************
+static int client_proxy(struct server_t* server, struct client_t* client, const struct sproxy_route_t* route, const char* request, size_t length)
+{
+	struct scache_entry_t* entry;
+	
+	server->metrics->proxied++;
+	client->proxied = true;
+	
+	switch (sproxy_request(server->proxy, route, request, length, client->tls != NULL ? server->params->tlsPort : server->params->port, client, &entry))
+	{
+	case SPROXY_HIT:
+		server->metrics->cached++;
+		client_respond(server, client, entry);
+		return 0;
+	case SPROXY_FETCHING:
+		server->metrics->fetches++;
+		// Fall through
+	case SPROXY_JOINED:
+		// Nothing to do for the client until the response arrives, besides noticing if it goes away
+		client->deadline = 0;
+		sepoll_mod_events(server->loop, client->socket, EPOLLET);
+		return 0;
+	default:
+		fprintf(stderr, "%i - Error: Cannot pass %.*s on to upstream %s:%hu: %m\n", getpid(), (int)length, request, route->host, route->port);
+		client_error(client, SPROXY_BAD_GATEWAY);
+		client_disconnect(server, client);
+		return -1;
+	}
+}
+
+// *********************************************************************
+// An upstream fetch a client was waiting on is done, one way or another
+// *********************************************************************
+static void client_upstream(void* waiter, struct scache_entry_t* entry, const char* error, void* userdata)
+{
+	struct server_t* server = userdata;
+	struct client_t* client = waiter;
+	
+	if (entry == NULL)
+	{
+		client_error(client, error);
+		client_disconnect(server, client);
+		return;
+	}
+	
+	client_respond(server, client, entry);
+}
+
+// *********************************************************************
+// Carry on with a TLS client's handshake. Returns -1 if the client was
+// disconnected in the process, or 1 once the handshake is done.
+// *********************************************************************
+static int client_handshake(struct server_t* server, struct client_t* client)
+{
+	switch (stls_handshake(client->tls))
+	{
+	case STLS_WANT_READ:
+		return 0;
+	case STLS_WANT_WRITE:
+		// Keep waiting on the client too, since the handshake could go either way from here
+		sepoll_mod_events(server->loop, client->socket, EPOLLIN | EPOLLOUT | EPOLLET);
+		return 0;
+	case STLS_DONE:
+		break;
+	default:
+		server->metrics->tlsFailures++;
+		client_disconnect(server, client);
+		return -1;
+	}
+	
+	server->metrics->tlsHandshakes++;
+	
+	if (stls_ktls(client->tls))
+	{
+		server->metrics->ktls++;
+	}
+	
+	// Back to just waiting on the request, in case the handshake had to wait for the socket to be writable
+	sepoll_mod_events(server->loop, client->socket, EPOLLIN | EPOLLET);
+	
+	return 1;
+}
+
+// *********************************************************************
+// Run a CGI program for a client
+//
+// The program is executed from the directory it's in, with the socket
+// as its stdout, and the client is only watched for errors from then on
+// while the pidfd says when it's done. The filename is the processed
+// one, ending in a slash if it's the index file of the directory the
+// client's dirfd is open on, and otherwise the directory is usually one
+// the worker has open already.
+// *********************************************************************
+static int client_cgi(struct server_t* server, struct client_t* client, const char* filename, const char* query, size_t querySize)
+{
+	// First argument for fexecve
+	char* command;
+	
+	int dirfd = client->dirfd;
+	
+	if (dirfd < 0)
+	{
+		// The filename always starts with ./ so there's always a slash, and the command is whatever is after the last one
+		const char* filename_slash = strrchr(filename, '/');
+		
+		dirfd = sdircache_dir(server->dirs, filename, (size_t)(filename_slash - filename));
+		
+		if (dirfd < 0)
+		{
+			fprintf(stderr, "%i - Error: Cannot open directory of CGI program %s: %m\n", getpid(), filename);
+			client_error(client, ERROR_INTERNAL);
+			client_disconnect(server, client);
+			return -1;
+		}
+		
+		command = (char*)filename_slash + 1;
+	}
+	else
+	{
+		// Since we opened a directory to get here, that means we have opened a default file
+		command = (char*)server->params->indexfile;
+	}
+	
+	// This custom fork returns both a pid and pidfd with one syscall
+	pid_t pid = sfork(&client->pidfd, CLONE_CLEAR_SIGHAND | CLONE_VFORK);
+	
+	if (pid == 0)
+	{
+		// Change working directory to the location of the executable file
+		if (fchdir(dirfd) < 0)
+		{
+			dprintf(STDERR_FILENO, "%i (CGI process) - Error: Cannot fchdir: %m\n", getpid());
+			dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
+			_exit(EXIT_FAILURE);
+		}
+		
+		// Reset signal mask
+		sigset_t mask;
+		
+		sigemptyset(&mask);
+		
+		if (sigprocmask(SIG_SETMASK, &mask, NULL) < 0)
+		{
+			dprintf(STDERR_FILENO, "%i (CGI process) - Error: Cannot reset signal mask: %m\n", getpid());
+			dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
+			_exit(EXIT_FAILURE);
+		}
+		
+		// Replace the fork's stdout FD with the socket FD
+		if (dup2(client->socket, STDOUT_FILENO) < 0)
+		{
+			dprintf(STDERR_FILENO, "%i (CGI process) - Error: Cannot dup2 socket over stdout: %m\n", getpid());
+			dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
+			_exit(EXIT_FAILURE);
+		}
+		
+		// Command line arguments
+		char* const argv[] =
+		{
+			command,
+			NULL
+		};
+		
+		// Environment variables
+		char env_selector[ENV_BUFFER_SIZE];
+		snprintf(env_selector, ENV_BUFFER_SIZE, "SCRIPT_NAME=%s", filename + 1);
+		
+		char env_query[ENV_BUFFER_SIZE];
+		snprintf(env_query, ENV_BUFFER_SIZE, "QUERY_STRING=%.*s", (int)querySize, query);
+		
+		char env_hostname[ENV_BUFFER_SIZE];
+		snprintf(env_hostname, ENV_BUFFER_SIZE, "SERVER_NAME=%s", server->params->hostname);
+		
+		char env_port[ENV_BUFFER_SIZE];
+		snprintf(env_port, ENV_BUFFER_SIZE, "SERVER_PORT=%hu", client->tls != NULL ? server->params->tlsPort : server->params->port);
+		
+		char env_address[ENV_BUFFER_SIZE];
+		
+		if (client->local)
+		{
+			// A Unix socket has no address to speak of, but the kernel can vouch for the process on the other end
+			struct ucred cred;
+			socklen_t length = sizeof(cred);
+			
+			if (getsockopt(client->socket, SOL_SOCKET, SO_PEERCRED, &cred, &length) == 0)
+			{
+				snprintf(env_address, ENV_BUFFER_SIZE, "REMOTE_ADDR=unix:pid=%i/uid=%u", cred.pid, cred.uid);
+			}
+			else
+			{
+				snprintf(env_address, ENV_BUFFER_SIZE, "REMOTE_ADDR=unix");
+			}
+		}
+		else
+		{
+			char address[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &client->address, address, INET_ADDRSTRLEN);
+			
+			snprintf(env_address, ENV_BUFFER_SIZE, "REMOTE_ADDR=%s", address);
+		}
+		
+		char* envp[] =
+		{
+			env_selector,
+			env_query,
+			env_hostname,
+			env_port,
+			env_address,
+			NULL
+		};
+		
+		execve(command, argv, envp);
+		
+		// This is only reached if there was a problem with fexecve
+		dprintf(STDERR_FILENO, "%i (CGI process) - Error: Cannot execute file %s: %m\n", getpid(), filename);
+		dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
+		_exit(EXIT_FAILURE);
+	}
+	else if (pid < 0)
+	{
+		fprintf(stderr, "%i - Error: Cannot fork CGI process: %m\n", getpid());
+		client_error(client, ERROR_INTERNAL);
+		client_disconnect(server, client);
+		return -1;
+	}
+	
+	SPROBE2(sgopher, cgi, client->socket, pid);
+	
+	// There's no need for the client's file to be open at this point, if it was ever open here at all
+	if (client->file >= 0)
+	{
+		close(client->file);
+		client->file = -1;
+	}
+	
+	// CGI programs are only bound by the inactivity timeout
+	client->deadline = 0;
+	
+	// As far as the log and metrics are concerned, the response has started and it's up to the program how it goes from here
+	client->status = 200;
+	
+	server->metrics->cgi++;
+	
+	// Alter the events on the client socket to only handle errors
+	sepoll_mod_events(server->loop, client->socket, EPOLLET);
+	
+	// Add the pidfd to the event loop
+	sepoll_add(server->loop, client->pidfd, EPOLLIN, client_pidfd, server, client);
+	
+	return 0;
+}
+
+// *********************************************************************
+// Hand a client off to the CGI pool
+//
+// The socket and the directory go over SCM_RIGHTS along with everything
+// else the program needs, and then this worker's done with the client,
+// since closing our copy of the socket leaves the pool worker's open.
+// A pool with a full queue is as good as a full server.
+// *********************************************************************
+static void client_handoff(struct server_t* server, struct client_t* client, const char* filename, const char* query, size_t querySize)
+{
+	struct handoff_t handoff =
+	{
+		.address = client->address,
+		.local = client->local,
+		.querySize = querySize
+	};
+	
+	strcpy(handoff.filename, filename);
+	
+	if (querySize > 0)
+	{
+		memcpy(handoff.query, query, querySize);
+	}
+	
+	int fds[2] = {client->socket, client->dirfd};
+	size_t numFds = client->dirfd >= 0 ? 2 : 1;
+	
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	
+	struct iovec iov =
+	{
+		.iov_base = &handoff,
+		.iov_len = sizeof(handoff)
+	};
+	
+	struct msghdr msg =
+	{
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = CMSG_SPACE(numFds * sizeof(int))
+	};
+	
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+	
+	memcpy(CMSG_DATA(cmsg), fds, numFds * sizeof(int));
+	
+	if (sendmsg(server->cgiSocket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+	{
+		if (errno == EPIPE || errno == ECONNRESET || errno == ENOTCONN)
+		{
+			// The pool is gone, which shouldn't happen while we're still around but is no reason to turn anybody away
+			fprintf(stderr, "%i - Error: CGI pool is gone, running CGI programs here from now on\n", getpid());
+			
+			close(server->cgiSocket);
+			server->cgiSocket = -1;
+			
+			if (client_cgi(server, client, filename, query, querySize) == 0)
+			{
+				client_first_byte(server, client);
+			}
+			
+			return;
+		}
+		
+		if (errno == EAGAIN)
+		{
+			client_error(client, ERROR_UNAVAILABLE);
+		}
+		else
+		{
+			fprintf(stderr, "%i - Error: Cannot hand off CGI program %s: %m\n", getpid(), filename);
+			client_error(client, ERROR_INTERNAL);
+		}
+		
+		client_disconnect(server, client);
+		return;
+	}
+	
+	// The log and status counts have it as a CGI program started here, while the pool worker counts the program itself
+	client->handoff = true;
+	client->status = 200;
+	client_first_byte(server, client);
+	
+	client_disconnect(server, client);
+}
+
+// *********************************************************************
+// Handle event on a client socket
+// *********************************************************************
+static void client_socket(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct server_t* server = userdata1.ptr;
+	struct client_t* client = userdata2.ptr;
+	
+	// Zero-copy completion notifications arrive on the socket's error queue, which epoll reports as an error
+	if (events & EPOLLERR && client->zerocopy)
+	{
+		if (client_reap(server, client) < 0)
+		{
+			return;
+		}
+		
+		events &= ~(uint32_t)EPOLLERR;
+	}
+	
+	// A TLS client has to get through the handshake before there's any request to read
+	if (client->tls != NULL && !stls_established(client->tls))
+	{
+		if (client_handshake(server, client) <= 0)
+		{
+			return;
+		}
+		
+		// The request can come in along with the end of the handshake, so go and look for it
+		events = EPOLLIN;
+	}
+	
+	if (events & EPOLLIN)
+	{
+		// Pick up where the last read left off if part of the request arrived already, otherwise use the scratch buffer
+		char* buffer = client->request != NULL ? client->request : server->scratch;
+		size_t count = client->count;
+		
+		// Read socket into the buffer until it is full or the read would block
+		do
+		{
+			ssize_t n;
+			
+			if (client->tls != NULL)
+			{
+				n = stls_read(client->tls, buffer + count, MAX_REQUEST_SIZE - count);
+			}
+			else
+			{
+				n = read(client->socket, buffer + count, MAX_REQUEST_SIZE - count);
+			}
+			
+			if (n < 0)
+			{
+				if (errno == EAGAIN)
+				{
+					break;
+				}
+				else if (errno == ECONNRESET)
+				{
+					client_disconnect(server, client);
+					return;
+				}
+				else
+				{
+					fprintf(stderr, "%i - Error: Cannot read from client: %m\n", getpid());
+					client_error(client, ERROR_INTERNAL);
+					client_disconnect(server, client);
+					return;
+				}
+			}
+			else if (n == 0)
+			{
+				client_disconnect(server, client);
+				return;
+			}
+			
+			count += (size_t)n;
+		}
+		while (count < MAX_REQUEST_SIZE);
 		
-		// Query size could still have been zero even if there was a tab
-		if (querySize > 0)
+		// Look for the end of the request, and the tab before the query if there is one
+		struct srequest_t request;
+		
+		if (!srequest_parse(buffer, count, &request))
 		{
-			query = tab + 1;
+			// A full buffer without a CRLF can never become a valid request
+			if (count == MAX_REQUEST_SIZE)
+			{
+				client_error(client, ERROR_BAD);
+				client_disconnect(server, client);
+				return;
+			}
+			
+			// Otherwise wait for the rest of it, which the request deadline keeps from taking forever
+			// The scratch buffer will be reused by the next client so what we have so far needs to be kept somewhere else
+			if (client->request == NULL)
+			{
+				client->request = malloc(MAX_REQUEST_SIZE);
+				
+				if (client->request == NULL)
+				{
+					fprintf(stderr, "%i - Error: Cannot allocate memory for partial request: %m\n", getpid());
+					client_error(client, ERROR_INTERNAL);
+					client_disconnect(server, client);
+					return;
+				}
+				
+				memcpy(client->request, buffer, count);
+			}
+			
+			client->count = count;
+			
+			return;
 		}
-		else
+		
+		SPROBE3(sgopher, request, client->socket, buffer, request.selectorSize);
+		
+		client_log_request(server, client, buffer, request.selectorSize);
+		
+		server->metrics->requests++;
+		
+		// How many times this has been asked for lately, counting this time
+		uint32_t hits = ssketch_record(&server->metrics->hot, buffer, request.selectorSize);
+		
+		// Upstream servers get the request as it is, since their selectors needn't look anything like paths
+		if (server->proxy != NULL)
 		{
-			query = NULL;
+			const struct sproxy_route_t* route = sproxy_route(server->proxy, buffer, request.selectorSize);
+			
+			if (route != NULL)
+			{
+				client_proxy(server, client, route, buffer, request.length);
+				return;
+			}
 		}
 		
 		// Buffer for processed filename and pointer to last slash within it for determination of pathname and basename
 		char filename[MAX_FILENAME_SIZE];
 		
-		char* filename_end = stpcpy(filename, ".");
+		char* filename_end = srequest_path(buffer, request.selectorSize, filename);
+		
+		if (filename_end == NULL)
+		{
+			client_error(client, ERROR_FORBIDDEN);
+			client_disconnect(server, client);
+			return;
+		}
+		
+		// Searches are answered from the index rather than any file
+		if (server->search != NULL && strcmp(filename + 1, server->params->search) == 0)
+		{
+			client_search(server, client, request.query, request.querySize);
+			return;
+		}
+		
+		// Try to open the requested file
+		client->file = sdircache_open(server->dirs, filename, O_RDONLY | O_CLOEXEC);
+		
+		if (client->file < 0)
+		{
+			if (errno == ENOENT)
+			{
+				client_error(client, ERROR_NOTFOUND);
+			}
+			else if (errno == EACCES || errno == EXDEV || errno == ELOOP)
+			{
+				client_error(client, ERROR_FORBIDDEN);
+			}
+			else
+			{
+				fprintf(stderr, "%i - Error: Cannot open file %s: %m\n", getpid(), filename);
+				client_error(client, ERROR_INTERNAL);
+			}
+			
+			client_disconnect(server, client);
+			return;
+		}
+		
+		// Get file stats
+		struct stat statbuf;
+		
+		if (fstat(client->file, &statbuf) < 0)
+		{
+			fprintf(stderr, "%i - Error: Cannot fstat file %s: %m\n", getpid(), filename);
+			client_error(client, ERROR_INTERNAL);
+			client_disconnect(server, client);
+			return;
+		}
+		
+		// Make sure it's a regular file or a directory
+		if (S_ISREG(statbuf.st_mode))
+		{
+			// This space intentionally blank
+			// At this point we could process the filename string to determine the containing directory path,
+			// but since that's only relevant to CGI we wait until after the fork to do it to avoid doing it if we don't have to
+		}
+		else if (S_ISDIR(statbuf.st_mode))
+		{
+			// Keep track of the directory FD for CGI purposes
+			client->dirfd = client->file;
+			
+			// Try to open an index file in the directory
+			client->file = sdircache_openat(server->dirs, client->dirfd, filename, server->params->indexfile, O_RDONLY | O_CLOEXEC);
+			
+			if (client->file < 0)
+			{
+				if (errno == ENOENT)
+				{
+					client_error(client, ERROR_NOTFOUND);
+				}
+				else if (errno == EACCES || errno == EXDEV || errno == ELOOP)
+				{
+					client_error(client, ERROR_FORBIDDEN);
+				}
+				else
+				{
+					fprintf(stderr, "%i - Error: Cannot open file %s in directory %s: %m\n", getpid(), server->params->indexfile, filename);
+					client_error(client, ERROR_INTERNAL);
+				}
+				
+				client_disconnect(server, client);
+				return;
+			}
+			
+			// Now we need the stats of the index file
+			if (fstat(client->file, &statbuf) < 0)
+			{
+				fprintf(stderr, "%i - Error: Cannot fstat file %s in directory %s: %m\n", getpid(), server->params->indexfile, filename);
+				client_error(client, ERROR_INTERNAL);
+				client_disconnect(server, client);
+				return;
+			}
+			
+			// Make sure it's a regular file
+			if (!S_ISREG(statbuf.st_mode))
+			{
+				client_error(client, ERROR_FORBIDDEN);
+				client_disconnect(server, client);
+				return;
+			}
+			
+			// For the benefit of CGI programs, add a / to the end of the filename to indicate it was a directory
+			filename_end = stpcpy(filename_end, "/");
+		}
+		else
+		{
+			client_error(client, ERROR_FORBIDDEN);
+			client_disconnect(server, client);
+			return;
+		}
+		
+		SPROBE2(sgopher, open, client->socket, filename);
+		
+		if (server->log != NULL)
+		{
+			struct slog_record_t* record = client_log(server, client);
+			
+			if (record != NULL)
+			{
+				record->openTime = client_elapsed(server, client);
+			}
+		}
+		
+		// If the file is world executable, fork off a process and try to execute it
+		if (statbuf.st_mode & S_IXOTH)
+		{
+			// CGI programs write to the socket themselves, which only works over TLS once the kernel has taken over
+			if (client->tls != NULL && !stls_ktls(client->tls))
+			{
+				fprintf(stderr, "%i - Error: Cannot run CGI program %s over TLS without kernel TLS\n", getpid(), filename);
+				client_error(client, ERROR_INTERNAL);
+				client_disconnect(server, client);
+				return;
+			}
+			
+			// With a CGI pool, it's up to one of its workers, as long as the connection doesn't need us for the encryption
+			if (server->cgiSocket >= 0 && client->tls == NULL)
+			{
+				client_handoff(server, client, filename, request.query, request.querySize);
+				return;
+			}
+			
+			if (client_cgi(server, client, filename, request.query, request.querySize) == 0)
+			{
+				client_first_byte(server, client);
+			}
+		}
+		else
+		{
+			// Otherwise, transmit the file, or what it turns into as a template
+			if (server->templates != NULL && client->dirfd >= 0)
+			{
+				client->memory = server_template(server, client->tls != NULL, client->file, filename, &statbuf);
+				
+				if (client->memory == NULL)
+				{
+					fprintf(stderr, "%i - Error: Cannot render template %s%s: %m\n", getpid(), filename, server->params->indexfile);
+					client_error(client, ERROR_INTERNAL);
+					client_disconnect(server, client);
+					return;
+				}
+				
+				client->filesize = (off_t)client->memory->length;
+			}
+			else
+			{
+				// Text files are sent from a converted copy, which takes the original's place from here on
+				if (server->textCache >= 0 && client->dirfd < 0 && stype_guess(filename, S_IFREG | S_IROTH) == '0')
+				{
+					struct stat textbuf;
+					
+					int copy = stext_open(server->textCache, client->file, &statbuf, &textbuf);
+					
+					if (copy < 0)
+					{
+						fprintf(stderr, "%i - Error: Cannot convert text file %s: %m\n", getpid(), filename);
+						client_error(client, ERROR_INTERNAL);
+						client_disconnect(server, client);
+						return;
+					}
+					
+					close(client->file);
+					client->file = copy;
+					statbuf = textbuf;
+				}
+				
+				client->filesize = statbuf.st_size;
+			}
+			
+			client->started = time(NULL);
+			
+			// The transfer deadline grows with the file size so big downloads on slow links aren't cut off
+			if (server->params->deadline > 0)
+			{
+				client->deadline = client->started + server->params->deadline;
+				
+				if (server->params->deadlineRate > 0)
+				{
+					client->deadline += client->filesize / server->params->deadlineRate;
+				}
+			}
+			else
+			{
+				client->deadline = 0;
+			}
+			
+			// Gophermaps and small files skip the shaper so menus stay snappy while big downloads are throttled
+			if ((server->params->rateLimit > 0 || server->params->workerRateLimit > 0) && client->dirfd < 0 && client->filesize > server->params->priorityThreshold)
+			{
+				client->shaped = true;
+				bucket_fill(&client->bucket, server->params->rateLimit, sepoll_time(server->loop));
+			}
+			
+			// Small files are served from memory, but only put there once they've proven popular enough, so one-hit
+			// wonders don't push out the ones that are
+			if (server->cache != NULL && client->memory == NULL && client->filesize <= server->params->cacheFileSize)
+			{
+				if (hits >= server->params->cacheAdmit)
+				{
+					client->memory = server_cache_file(server, client->file, &statbuf);
+					
+					if (client->memory == NULL)
+					{
+						fprintf(stderr, "%i - Error: Cannot cache file %s, sending it from disk: %m\n", getpid(), filename);
+					}
+				}
+				else
+				{
+					client->memory = scache_get(server->cache, &statbuf);
+				}
+			}
+			
+			if (client->memory != NULL)
+			{
+				server->metrics->cached++;
+				
+				// The file itself isn't needed anymore
+				close(client->file);
+				client->file = -1;
+				
+				// Zero-copy only pays off for big enough responses, since pinning pages and handling the notification
+				// costs more than copying a few kilobytes
+				// TLS connections encrypt everything on the way out, so there's nothing to pin
+				if (server->params->zerocopy > 0 && client->tls == NULL && client->filesize >= server->params->zerocopy)
+				{
+					int optval = 1;
+					
+					if (setsockopt(client->socket, SOL_SOCKET, SO_ZEROCOPY, &optval, sizeof(optval)) == 0)
+					{
+						client->zerocopy = true;
+					}
+				}
+			}
+			else if (server->params->largeFile > 0 && client->filesize >= (off_t)server->params->largeFile)
+			{
+				client_stream_start(server, client);
+			}
+			
+			// Gophermaps are otherwise sent as they are, so one without a terminator gets it tacked on the end,
+			// corked so it goes out with the rest of it instead of in a tiny segment of its own
+			if (server->params->rfc1436 && client->dirfd >= 0 && server->templates == NULL && !client_terminated(client))
+			{
+				client->trailer = true;
+				client->filesize += (off_t)TERMINATOR_LENGTH;
+				
+				if (!client->local)
+				{
+					int optval = 1;
+					
+					setsockopt(client->socket, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval));
+				}
+			}
+			
+			sepoll_mod_events(server->loop, client->socket, EPOLLOUT | EPOLLET);
+		}
+		
+		// If we opened a directory, it's no longer needed now
+		if (client->dirfd >= 0)
+		{
+			close(client->dirfd);
+			client->dirfd = -1;
+		}
 		
-		// Inspect provided path for leading periods to prevent use of relative paths and access to hidden files
-		// While we're at it, let's remove redundant and trailing slashes as we copy it to the buffer
-		if (selectorSize > 0)
+		// Update timestamp
+		client->timestamp = time(NULL);
+	}
+	
+	if (events & EPOLLOUT)
+	{
+		if (client_transmit(server, client) < 0)
+		{
+			return;
+		}
+	}
+	
+	if (events & EPOLLERR || events & EPOLLHUP)
+	{
+		if (client->pidfd >= 0)
+		{
+			pidfd_kill_client(server, client);
+		}
+		else
+		{
+			client_disconnect(server, client);
+		}
+	}
+}
+
+// *********************************************************************
+// Set up a slot for a new client and add their socket to the watch list
+// *********************************************************************
+static struct client_t* server_client(struct server_t* server, int fd, struct in_addr address, struct stls_t* session, bool local)
+{
+	// Take a slot from the free list, or failing that a fresh one from the slab
+	// There must be one or the other since the slab has room for the maximum number of clients
+	struct client_t* client = server->freeClients;
+	
+	if (client != NULL)
+	{
+		server->freeClients = client->nextfree;
+	}
+	else
+	{
+		client = &server->clients[server->highWater++];
+	}
+	
+	// Initialize the client and add their socket FD to the watch list
+	client->socket = fd;
+	client->address = address;
+	client->timestamp = time(NULL);
+	client->tls = session;
+	client->deadline = server->params->requestTimeout > 0 ? client->timestamp + server->params->requestTimeout : 0;
+	client->request = NULL;
+	client->count = 0;
+	client->file = -1;
+	client->sentsize = 0;
+	client->shaped = false;
+	client->parked = false;
+	client->streaming = false;
+	client->corked = false;
+	client->zerocopy = false;
+	client->local = local;
+	client->trailer = false;
+	client->proxied = false;
+	client->handoff = false;
+	client->memory = NULL;
+	client->zcsent = 0;
+	client->zcdone = 0;
+	client->dirfd = -1;
+	client->pidfd = -1;
+	client->status = 0;
+	client->accepted = sepoll_time(server->loop);
+	client->logseq = UINT64_MAX;
+	
+	sepoll_add(server->loop, fd, EPOLLIN | EPOLLET, client_socket, server, client);
+	
+	server->numClients++;
+	server->metrics->connections = server->numClients;
+	
+	return client;
+}
+
+// *********************************************************************
+// Handle event on a listening socket, for plain, TLS or Unix connections
+// *********************************************************************
+static void server_accept(struct server_t* server, int sockfd, bool tls, bool local, uint32_t events)
+{
+	if (events & EPOLLIN)
+	{
+		// Accept incoming connections until it blocks. This is actually quite a bit faster than accepting one connection at a time before going back to do other things.
+		while (1)
 		{
-			char* str_pos = client->buffer;
+			// Accept the next incoming connection
+			// Unix clients are almost always unnamed, so there's nothing worth keeping from their address
+			struct sockaddr_in client_addr =
+			{
+				.sin_addr =
+				{
+					.s_addr = htonl(INADDR_ANY)
+				}
+			};
+			
+			socklen_t client_addr_len = sizeof(client_addr);
+			
+			int fd = accept4(sockfd, local ? NULL : (struct sockaddr*)&client_addr, local ? NULL : &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
 			
-			do
+			if (fd < 0)
 			{
-				size_t str_len = selectorSize - (size_t)(str_pos - client->buffer);
-				
-				char* str_slash = memchr(str_pos, '/', str_len);
-				
-				size_t substr_len;
-				
-				if (str_slash == NULL)
+				if (errno == EAGAIN)
 				{
-					substr_len = str_len;
+					break;
 				}
 				else
 				{
-					substr_len = (size_t)(str_slash - str_pos);
+					fprintf(stderr, "%i - Error: Cannot accept incoming connection: %m\n", getpid());
+					return;
+				}
+			}
+			
+			// Check if we have already hit the maximum number of clients
+			if (server->numClients == server->params->maxClients)
+			{
+				// Server's full, which a TLS client can only be told by hanging up on them
+				if (!tls)
+				{
+					dprintf(fd, ERROR_FORMAT, ERROR_UNAVAILABLE);
 				}
 				
-				if (substr_len > 0)
+				server->metrics->rejected++;
+				server->metrics->status[SMETRICS_STATUS_503]++;
+				
+				if (server->log != NULL)
 				{
-					if (*str_pos == '.')
-					{
-						dprintf(client->socket, ERROR_FORMAT, ERROR_FORBIDDEN);
-						client_disconnect(server, client);
-						return;
-					}
+					uint64_t sequence;
+					
+					struct slog_record_t* record = slog_reserve(server->log, &sequence);
+					
+					record->timestamp = sepoll_time(server->loop) + server->logEpoch;
+					log_address(record, fd, local, client_addr.sin_addr);
+					record->status = error_status(ERROR_UNAVAILABLE);
 					
-					filename_end = stpcpy(filename_end, "/");
-					filename_end = mempcpy(filename_end, str_pos, substr_len);
+					slog_commit(record);
 				}
 				
-				str_pos = str_slash;
+				close(fd);
+				
+				continue;
+			}
+			
+			struct stls_t* session = NULL;
+			
+			if (tls)
+			{
+				session = stls_create(server->params->tls, fd);
+				
+				if (session == NULL)
+				{
+					fprintf(stderr, "%i - Error: Cannot set up TLS session: %m\n", getpid());
+					close(fd);
+					continue;
+				}
 			}
-			while (str_pos++ != NULL);
 			
-			*filename_end = '\0';
+			struct client_t* client = server_client(server, fd, client_addr.sin_addr, session, local);
+			
+			SPROBE2(sgopher, accept, fd, client->address.s_addr);
+			
+			server->metrics->accepted++;
+		}
+	}
+	
+	if (events & EPOLLERR)
+	{
+		fprintf(stderr, "%i - Error reported by listening socket\n", getpid());
+	}
+	
+	if (events & EPOLLHUP)
+	{
+		fprintf(stderr, "%i - Hangup reported by listening socket\n", getpid());
+	}
+}
+
+static void server_socket(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	server_accept(userdata1.ptr, userdata2.fd, false, false, events);
+}
+
+static void server_tls_socket(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	server_accept(userdata1.ptr, userdata2.fd, true, false, events);
+}
+
+static void server_unix_socket(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	server_accept(userdata1.ptr, userdata2.fd, false, true, events);
+}
+
+// *********************************************************************
+// Handle event on the socket a CGI pool worker gets its clients from
+//
+// Every worker in the pool waits on the same socket with EPOLLEXCLUSIVE,
+// so a handoff only wakes up one of them. Each one comes with the
+// client's socket and maybe a directory, which are ours to close from
+// here on whatever happens. A worker that's full stops listening until
+// it has a slot again, leaving the rest to the others, since the worker
+// that handed them off has already logged them as started.
+// *********************************************************************
+static void server_handoff(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct server_t* server = userdata1.ptr;
+	
+	while (1)
+	{
+		if (server->numClients == server->params->maxClients)
+		{
+			sepoll_remove(server->loop, server->cgiSocket);
+			server->handoffPaused = true;
+			return;
 		}
 		
-		// Try to open the requested file
-		client->file = openat(server->directory, filename, O_RDONLY | O_CLOEXEC);
+		struct handoff_t handoff;
 		
-		if (client->file < 0)
+		union
 		{
-			if (errno == ENOENT)
+			char buffer[CMSG_SPACE(2 * sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		
+		struct iovec iov =
+		{
+			.iov_base = &handoff,
+			.iov_len = sizeof(handoff)
+		};
+		
+		struct msghdr msg =
+		{
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buffer,
+			.msg_controllen = sizeof(control.buffer)
+		};
+		
+		ssize_t n = recvmsg(server->cgiSocket, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		
+		if (n < 0)
+		{
+			if (errno != EAGAIN)
 			{
-				dprintf(client->socket, ERROR_FORMAT, ERROR_NOTFOUND);
+				fprintf(stderr, "%i - Error: Cannot receive CGI handoff: %m\n", getpid());
 			}
-			else if (errno == EACCES)
+			
+			return;
+		}
+		else if (n == 0)
+		{
+			// Every copy of the other end is closed, so there won't be any more
+			sepoll_remove(server->loop, server->cgiSocket);
+			server->handoffClosed = true;
+			
+			if (server->draining && server_drained(server))
 			{
-				dprintf(client->socket, ERROR_FORMAT, ERROR_FORBIDDEN);
+				sepoll_exit(server->loop);
 			}
-			else
+			
+			return;
+		}
+		
+		int fds[2] = {-1, -1};
+		
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		
+		if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			size_t numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			
+			memcpy(fds, CMSG_DATA(cmsg), (numFds < 2 ? numFds : 2) * sizeof(int));
+		}
+		
+		if (fds[0] < 0 || (size_t)n != sizeof(handoff) || msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC) || handoff.querySize > MAX_REQUEST_SIZE)
+		{
+			fprintf(stderr, "%i - Error: Received a malformed CGI handoff\n", getpid());
+		}
+		else
+		{
+			struct client_t* client = server_client(server, fds[0], handoff.address, NULL, handoff.local);
+			
+			client->dirfd = fds[1];
+			
+			handoff.filename[MAX_FILENAME_SIZE - 1] = '\0';
+			
+			client_cgi(server, client, handoff.filename, handoff.querySize > 0 ? handoff.query : NULL, handoff.querySize);
+			
+			continue;
+		}
+		
+		for (unsigned int i = 0; i < 2; i++)
+		{
+			if (fds[i] >= 0)
 			{
-				fprintf(stderr, "%i - Error: Cannot open file %s: %m\n", getpid(), filename);
-				dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
+				close(fds[i]);
 			}
+		}
+	}
+}
+
+// *********************************************************************
+// Stop accepting connections and exit once the current ones are done
+//
+// Closing our copies of the listening sockets doesn't close the sockets
+// themselves while the supervisor or a new set of workers still has
+// them open, so new connections are left for somebody else to accept
+// instead of being refused. That's all there is to it for an upgrade,
+// where the new workers share our sockets, but a worker that's retired
+// has its TCP sockets to itself, and anything left in their queues
+// would sit there until the slot is used again. By then the supervisor
+// has steered new connections away from them, so they're kept open for
+// a moment for any that were already on their way, and whatever is
+// queued is accepted before they're closed.
+// *********************************************************************
+static void server_close_listeners(struct server_t* server)
+{
+	for (unsigned int i = 0; i < server->numSockets; i++)
+	{
+		server_accept(server, server->sockets[i], false, false, EPOLLIN);
+		
+		sepoll_remove(server->loop, server->sockets[i]);
+		close(server->sockets[i]);
+		
+		server->sockets[i] = -1;
+	}
+	
+	for (unsigned int i = 0; i < server->numTlsSockets; i++)
+	{
+		server_accept(server, server->tlsSockets[i], true, false, EPOLLIN);
+		
+		sepoll_remove(server->loop, server->tlsSockets[i]);
+		close(server->tlsSockets[i]);
+		
+		server->tlsSockets[i] = -1;
+	}
+	
+	server->listenersClose = 0;
+}
+
+static void server_drain(struct server_t* server)
+{
+	for (unsigned int i = 0; i < server->numUnixSockets; i++)
+	{
+		sepoll_remove(server->loop, server->unixSockets[i]);
+		close(server->unixSockets[i]);
+		
+		server->unixSockets[i] = -1;
+	}
+	
+	server->draining = true;
+	server->drainDeadline = server->params->drainTime > 0 ? time(NULL) + server->params->drainTime : 0;
+	server->listenersClose = 0;
+	
+	if (server->numSockets + server->numTlsSockets > 0)
+	{
+		server->listenersClose = time(NULL) + DRAIN_GRACE;
+		
+		// The timer usually ticks a lot less often than that, so bring the next tick forward to when it's up
+		struct itimerspec timer;
+		
+		if (timerfd_gettime(server->timerfd, &timer) == 0)
+		{
+			timer.it_value.tv_sec = DRAIN_GRACE;
+			timer.it_value.tv_nsec = 0;
 			
-			client_disconnect(server, client);
-			return;
+			timerfd_settime(server->timerfd, 0, &timer, NULL);
 		}
+	}
+	
+	if (server_drained(server))
+	{
+		sepoll_exit(server->loop);
+	}
+}
+
+// *********************************************************************
+// signalfd event handler
+// *********************************************************************
+static void server_signal(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct server_t* server = userdata1.ptr;
+	
+	while (1)
+	{
+		struct signalfd_siginfo siginfo;
 		
-		// Get file stats
-		struct stat statbuf;
+		if (read(server->sigfd, &siginfo, sizeof(struct signalfd_siginfo)) != sizeof(struct signalfd_siginfo))
+		{
+			if (errno == EAGAIN)
+			{
+				break;
+			}
+			else
+			{
+				fprintf(stderr, "%i - Error: Cannot read from signalfd: %m\n", getpid());
+				return;
+			}
+		}
 		
-		if (fstat(client->file, &statbuf) < 0)
+		switch (siginfo.ssi_signo)
 		{
-			fprintf(stderr, "%i - Error: Cannot fstat file %s: %m\n", getpid(), filename);
-			dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
-			client_disconnect(server, client);
+		case SIGTERM:
+			fprintf(stderr, "%i - Received SIGTERM\n", getpid());
+			sepoll_exit(server->loop);
+			break;
+		case SIGQUIT:
+			if (!server->draining)
+			{
+				fprintf(stderr, "%i - Received SIGQUIT, finishing up with %u clients\n", getpid(), server->numClients);
+				server_drain(server);
+			}
+			
+			break;
+		}
+	}
+}
+
+// *********************************************************************
+// Check in with the supervisor once per trip around the event loop, so
+// it can tell a busy worker from a stuck one and how busy it is
+// *********************************************************************
+static void server_heartbeat(int n, void* userdata)
+{
+	struct server_t* server = userdata;
+	
+	if (n < 0 && errno != EINTR)
+	{
+		fprintf(stderr, "%i - Error: Cannot wait for events: %m\n", getpid());
+		sepoll_exit(server->loop);
+		return;
+	}
+	
+	// Everything since epoll_wait returned was spent on the events it returned, which is how the supervisor judges the load
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	uint64_t timestamp = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+	
+	__atomic_store_n(&server->metrics->busy, server->metrics->busy + timestamp - sepoll_time(server->loop), __ATOMIC_RELAXED);
+	__atomic_store_n(&server->metrics->heartbeat, timestamp, __ATOMIC_RELAXED);
+}
+
+// *********************************************************************
+// Halve the hot selector counts
+// *********************************************************************
+static void hot_decay(struct server_t* server)
+{
+	ssketch_decay(&server->metrics->hot);
+	server->hotDecay = time(NULL) + HOT_DECAY_INTERVAL;
+}
+
+static void server_decay(union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	hot_decay(userdata1.ptr);
+}
+
+// *********************************************************************
+// timerfd event handler
+// *********************************************************************
+static void server_timer(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct server_t* server = userdata1.ptr;
+	
+	// Have to read 8 bytes from the timer to reset it even if I don't care about the contents
+	uint64_t buffer;
+	
+	if (read(server->timerfd, &buffer, sizeof(uint64_t)) != sizeof(uint64_t))
+	{
+		fprintf(stderr, "%i - Error: Cannot read from timerfd: %m\n", getpid());
+	}
+	
+	// Check for connection timeout
+	time_t currentTime = time(NULL);
+	
+	// A worker that's never idle still has to decay its counts at some point, so it's done here if it's a whole interval late
+	if (currentTime >= server->hotDecay + HOT_DECAY_INTERVAL)
+	{
+		sepoll_cancel(server->loop, &server->decay);
+		hot_decay(server);
+	}
+	else if (currentTime >= server->hotDecay)
+	{
+		sepoll_idle(server->loop, &server->decay);
+	}
+	
+	// Give up on upstreams that have gone quiet, along with everybody waiting on them
+	if (server->proxy != NULL)
+	{
+		sproxy_expire(server->proxy, currentTime, server->params->timeout);
+	}
+	
+	// Give up on whoever is left once the drain time runs out
+	if (server->draining && server->drainDeadline > 0 && currentTime >= server->drainDeadline)
+	{
+		fprintf(stderr, "%i - Drain time is up, dropping %u clients\n", getpid(), server->numClients);
+		sepoll_exit(server->loop);
+		return;
+	}
+	
+	if (server->draining && server->listenersClose > 0 && currentTime >= server->listenersClose)
+	{
+		server_close_listeners(server);
+		
+		if (server_drained(server))
+		{
+			sepoll_exit(server->loop);
 			return;
 		}
+	}
+	
+	for (unsigned int i = 0; i < server->highWater; i++)
+	{
+		struct client_t* client = &server->clients[i];
+		
+		if (client->socket < 0)
+		{
+			continue;
+		}
 		
-		// Make sure it's a regular file or a directory
-		if (S_ISREG(statbuf.st_mode))
+		// Waiting on an upstream, whose fetch has a timeout of its own
+		if (client->proxied && client->memory == NULL)
 		{
-			// This space intentionally blank
-			// At this point we could process the filename string to determine the containing directory path,
-			// but since that's only relevant to CGI we wait until after the fork to do it to avoid doing it if we don't have to
+			continue;
 		}
-		else if (S_ISDIR(statbuf.st_mode))
+		
+		if (client->pidfd >= 0)
 		{
-			// Keep track of the directory FD for CGI purposes
-			client->dirfd = client->file;
-			
-			// Try to open an index file in the directory
-			client->file = openat(client->dirfd, server->params->indexfile, O_RDONLY | O_CLOEXEC);
-			
-			if (client->file < 0)
+			// There's no TCP_INFO for a Unix socket to tell whether it's idle, so a CGI program serving a local client
+			// runs for as long as it likes, much as it would if the client were the one holding things up
+			if (currentTime - client->timestamp >= server->params->timeout && !client->local)
 			{
-				if (errno == ENOENT)
-				{
-					dprintf(client->socket, ERROR_FORMAT, ERROR_NOTFOUND);
-				}
-				else if (errno == EACCES)
+				// The timestamp refers to when the CGI process was spawned,
+				// so we need to spy on the TCP connection information to find out if it's really idle
+				struct tcp_info tcp_info;
+				socklen_t tcp_info_length = sizeof(struct tcp_info);
+				
+				int retval = getsockopt(client->socket, SOL_TCP, TCP_INFO, &tcp_info, &tcp_info_length);
+				
+				if (retval < 0)
 				{
-					dprintf(client->socket, ERROR_FORMAT, ERROR_FORBIDDEN);
+					fprintf(stderr, "%i - Error: Cannot get TCP information from socket: %m\n", getpid());
 				}
-				else
+				
+				// Kill the child process if it hasn't used the socket for at least one timeout period
+				if (retval < 0 || tcp_info.tcpi_last_data_sent >= server->params->timeout * 1000)
 				{
-					fprintf(stderr, "%i - Error: Cannot open file %s in directory %s: %m\n", getpid(), server->params->indexfile, filename);
-					dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
+					server->metrics->evictions.idle++;
+					
+					// Like a file transfer that stalls, this doesn't count as having finished the response
+					client->status = error_status(ERROR_TIMEOUT);
+					pidfd_kill_client(server, client);
 				}
-				
-				client_disconnect(server, client);
-				return;
 			}
-			
-			// Now we need the stats of the index file
-			if (fstat(client->file, &statbuf) < 0)
+		}
+		else if (client->file < 0 && client->memory == NULL)
+		{
+			// Still waiting on the request
+			if (client->deadline > 0 && currentTime >= client->deadline)
 			{
-				fprintf(stderr, "%i - Error: Cannot fstat file %s in directory %s: %m\n", getpid(), server->params->indexfile, filename);
-				dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
+				server->metrics->evictions.request++;
+				client_error(client, ERROR_TIMEOUT);
 				client_disconnect(server, client);
-				return;
 			}
-			
-			// Make sure it's a regular file
-			if (!S_ISREG(statbuf.st_mode))
+			else if (currentTime - client->timestamp >= server->params->timeout)
 			{
-				dprintf(client->socket, ERROR_FORMAT, ERROR_FORBIDDEN);
+				server->metrics->evictions.idle++;
+				client_error(client, ERROR_TIMEOUT);
 				client_disconnect(server, client);
-				return;
 			}
-			
-			// For the benefit of CGI programs, add a / to the end of the filename to indicate it was a directory
-			filename_end = stpcpy(filename_end, "/");
 		}
 		else
 		{
-			dprintf(client->socket, ERROR_FORMAT, ERROR_FORBIDDEN);
-			client_disconnect(server, client);
-			return;
-		}
-		
-		// If the file is world executable, fork off a process and try to execute it
-		if (statbuf.st_mode & S_IXOTH)
-		{
-			// This custom fork returns both a pid and pidfd with one syscall
-			pid_t pid = sfork(&client->pidfd, CLONE_CLEAR_SIGHAND | CLONE_VFORK);
+			// Transferring a file. The inactivity check alone can be defeated by a client that reads a byte at a time,
+			// so also enforce the overall deadline and, once the client has had a full timeout period to get going, the average rate
+			time_t elapsed = currentTime - client->started;
+			
+			// A parked client is being held back by the shaper rather than sitting idle, so it isn't checked for inactivity
+			bool idle = !client->parked && currentTime - client->timestamp >= server->params->timeout;
 			
-			if (pid == 0)
+			if (client->deadline > 0 && currentTime >= client->deadline)
 			{
-				// First argument for fexecve
-				char* command;
-				
-				int dirfd = client->dirfd;
+				server->metrics->evictions.deadline++;
+				client->status = error_status(ERROR_TIMEOUT);
+				client_disconnect(server, client);
+			}
+			else if (server->params->minRate > 0 && elapsed >= server->params->timeout && client->sentsize / elapsed < server->params->minRate)
+			{
+				server->metrics->evictions.throughput++;
+				client->status = error_status(ERROR_TIMEOUT);
+				client_disconnect(server, client);
+			}
+			else if (idle)
+			{
+				server->metrics->evictions.idle++;
 				
-				// If we don't already have a file descriptor for the containing directory, we need to figure one out from the filename
-				if (dirfd < 0)
+				// Send timeout error if nothing has been sent yet
+				if (client->sentsize == 0)
 				{
-					// Buffer for pathname
-					char pathname[MAX_FILENAME_SIZE];
-					
-					// The filename should always contain a slash, but just in case...
-					char* filename_slash = strrchr(filename, '/');
-					
-					if (filename_slash == NULL)
-					{
-						dprintf(STDERR_FILENO, "%i (CGI process) - Error: Cannot find slash in filename %s\n", getpid(), filename);
-						dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
-						_exit(EXIT_FAILURE);
-					}
-					
-					// Extract everything up to the last slash as a string and make it into a null-terminated string
-					char* str_end = mempcpy(pathname, filename, (size_t)(filename_slash - filename));
-					*str_end = '\0';
-					
-					// Try to open the path
-					dirfd = openat(server->directory, pathname, O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_PATH);
-					
-					if (dirfd < 0)
-					{
-						dprintf(STDERR_FILENO, "%i (CGI process) - Error: Cannot openat %s: %m\n", getpid(), pathname);
-						dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
-						_exit(EXIT_FAILURE);
-					}
-					
-					// Command is whatever is after the slash
-					command = filename_slash + 1;
+					client_error(client, ERROR_TIMEOUT);
 				}
 				else
 				{
-					// Since we opened a directory to get here, that means we have opened a default file
-					command = (char*)server->params->indexfile;
-				}
-				
-				// Change working directory to the location of the executable file
-				if (fchdir(dirfd) < 0)
-				{
-					dprintf(STDERR_FILENO, "%i (CGI process) - Error: Cannot fchdir: %m\n", getpid());
-					dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
-					_exit(EXIT_FAILURE);
+					client->status = error_status(ERROR_TIMEOUT);
 				}
 				
-				// Reset signal mask
-				sigset_t mask;
-				
-				sigemptyset(&mask);
-				
-				if (sigprocmask(SIG_SETMASK, &mask, NULL) < 0)
-				{
-					dprintf(STDERR_FILENO, "%i (CGI process) - Error: Cannot reset signal mask: %m\n", getpid());
-					dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
-					_exit(EXIT_FAILURE);
-				}
-				
-				// Replace the fork's stdout FD with the socket FD
-				if (dup2(client->socket, STDOUT_FILENO) < 0)
-				{
-					dprintf(STDERR_FILENO, "%i (CGI process) - Error: Cannot dup2 socket over stdout: %m\n", getpid());
-					dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
-					_exit(EXIT_FAILURE);
-				}
-				
-				// Command line arguments
-				char* const argv[] =
-				{
-					command,
-					NULL
-				};
-				
-				// Environment variables
-				char env_selector[ENV_BUFFER_SIZE];
-				snprintf(env_selector, ENV_BUFFER_SIZE, "SCRIPT_NAME=%s", filename + 1);
-				
-				char env_query[ENV_BUFFER_SIZE];
-				snprintf(env_query, ENV_BUFFER_SIZE, "QUERY_STRING=%.*s", (int)querySize, query);
-				
-				char env_hostname[ENV_BUFFER_SIZE];
-				snprintf(env_hostname, ENV_BUFFER_SIZE, "SERVER_NAME=%s", server->params->hostname);
-				
-				char env_port[ENV_BUFFER_SIZE];
-				snprintf(env_port, ENV_BUFFER_SIZE, "SERVER_PORT=%hu", server->params->port);
-				
-				char env_address[ENV_BUFFER_SIZE];
-				snprintf(env_address, ENV_BUFFER_SIZE, "REMOTE_ADDR=%s", client->address);
-				
-				char* envp[] =
-				{
-					env_selector,
-					env_query,
-					env_hostname,
-					env_port,
-					env_address,
-					NULL
-				};
-				
-				execve(command, argv, envp);
-				
-				// This is only reached if there was a problem with fexecve
-				dprintf(STDERR_FILENO, "%i (CGI process) - Error: Cannot execute file %s: %m\n", getpid(), filename);
-				dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
-				_exit(EXIT_FAILURE);
-			}
-			else if (pid < 0)
-			{
-				fprintf(stderr, "%i - Error: Cannot fork CGI process: %m\n", getpid());
-				dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
 				client_disconnect(server, client);
-				return;
 			}
-			
-			// There's no need for the client's file to be open at this point
-			close(client->file);
-			client->file = -1;
-			
-			// Alter the events on the client socket to only handle errors
-			sepoll_mod_events(server->loop, client->socket, EPOLLET);
-			
-			// Add the pidfd to the event loop
-			sepoll_add(server->loop, client->pidfd, EPOLLIN, client_pidfd, server, client);
-		}
-		else
-		{
-			// Otherwise, transmit the file
-			client->filesize = statbuf.st_size;
-			sepoll_mod_events(server->loop, client->socket, EPOLLOUT | EPOLLET);
 		}
+	}
+}
+
+// *********************************************************************
+// Shaper timerfd event handler
+// *********************************************************************
+static void server_shaper(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct server_t* server = userdata1.ptr;
+	
+	// The timer is non-blocking because it may have been disarmed since the event was queued
+	uint64_t buffer;
+	
+	if (read(server->shaperfd, &buffer, sizeof(uint64_t)) != sizeof(uint64_t) && errno != EAGAIN)
+	{
+		fprintf(stderr, "%i - Error: Cannot read from shaper timerfd: %m\n", getpid());
+	}
+	
+	if (server->params->workerRateLimit > 0)
+	{
+		bucket_refill(&server->bucket, server->params->workerRateLimit, sepoll_time(server->loop));
+	}
+	
+	// Everyone parked gets looked at once, in batches after each round of events
+	server->resumeLeft = server->numParked;
+	
+	sepoll_defer(server->loop, &server->resume);
+}
+
+// *********************************************************************
+// Wake up parked clients in the order they were parked. Re-arming
+// EPOLLOUT makes epoll report the socket as writable again if it is, so
+// the actual sending happens through the usual path. Anyone who loses
+// the race for the worker's tokens goes back to the end of the queue,
+// as does anyone still out of tokens of their own.
+// *********************************************************************
+static void server_resume(union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct server_t* server = userdata1.ptr;
+	
+	uint64_t now = sepoll_time(server->loop);
+	
+	for (unsigned int i = 0; i < SHAPER_RESUME_BATCH && server->resumeLeft > 0; i++)
+	{
+		struct client_t* client = TAILQ_FIRST(&server->parked);
 		
-		// If we opened a directory, it's no longer needed now
-		if (client->dirfd >= 0)
+		if (client == NULL || (server->params->workerRateLimit > 0 && server->bucket.tokens == 0))
 		{
-			close(client->dirfd);
-			client->dirfd = -1;
+			server->resumeLeft = 0;
+			break;
 		}
 		
-		// Update timestamp
-		client->timestamp = time(NULL);
-	}
-	
-	if (events & EPOLLOUT)
-	{
-		// Do sendfile until it would block or is complete
-		do
+		server->resumeLeft--;
+		
+		if (server->params->rateLimit > 0)
 		{
-			ssize_t n = sendfile(client->socket, client->file, &client->sentsize, (size_t)(client->filesize - client->sentsize));
-			
-			if (n < 0)
-			{
-				if (errno == EAGAIN)
-				{
-					break;
-				}
-				else if (errno != EPIPE)
-				{
-					// Don't bother reporting it if it's a broken pipe because that had nothing to do with us
-					fprintf(stderr, "%i - Error: Problem sending file to client: %m\n", getpid());
-					
-					// Only send the error message if none of the file has been sent yet
-					if (client->sentsize == 0)
-					{
-						dprintf(client->socket, ERROR_FORMAT, ERROR_INTERNAL);
-					}
-				}
-				
-				client_disconnect(server, client);
-				return;
-			}
+			bucket_refill(&client->bucket, server->params->rateLimit, now);
 		}
-		while (client->sentsize < client->filesize);
 		
-		// See if transfer has not yet finished
-		if (client->sentsize < client->filesize)
+		if (server->params->rateLimit == 0 || client->bucket.tokens > 0)
 		{
+			client_unpark(server, client);
+			sepoll_mod_events(server->loop, client->socket, EPOLLOUT | EPOLLET);
+			
+			// The time spent waiting for tokens doesn't count against it for the inactivity timeout
 			client->timestamp = time(NULL);
 		}
 		else
 		{
-			client_disconnect(server, client);
-			return;
+			TAILQ_REMOVE(&server->parked, client, parkentry);
+			TAILQ_INSERT_TAIL(&server->parked, client, parkentry);
 		}
 	}
 	
-	if (events & EPOLLERR || events & EPOLLHUP)
+	if (server->resumeLeft > 0)
 	{
-		if (client->pidfd >= 0)
-		{
-			pidfd_kill_client(server, client);
-		}
-		else
-		{
-			client_disconnect(server, client);
-		}
+		sepoll_defer(server->loop, &server->resume);
 	}
 }
 
+// Current time on the monotonic clock in nanoseconds, which is the one the supervisor keeps time on too
+static inline uint64_t monotonic_time()
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
 // *********************************************************************
-// Handle event on the listening socket
+// Warm up the caches with the files behind a list of selectors before
+// accepting any connections, so the first clients after a restart or an
+// upgrade don't pay for looking them up and reading them from disk.
+// Small files are loaded into the response cache, index files rendered
+// as templates, text files converted, and anything else read ahead into
+// the page cache, up to the size of a streaming window. CGI programs,
+// searches and upstream selectors are left alone.
 // *********************************************************************
-static void server_socket(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+
+// Get one file into the caches, given the directory it's the index file of if it is one
+static int server_warm_file(struct server_t* server, int file, int dirfd, const char* filename, struct stat* statbuf)
 {
-	struct server_t* server = userdata1.ptr;
+	struct scache_entry_t* entry;
 	
-	if (events & EPOLLIN)
+	if (server->templates != NULL && dirfd >= 0)
 	{
-		// Accept incoming connections until it blocks. This is actually quite a bit faster than accepting one connection at a time before going back to do other things.
-		while (1)
+		// Both flavours, since they link to different ports
+		entry = server_template(server, false, file, filename, statbuf);
+		
+		if (entry == NULL)
 		{
-			// Accept the next incoming connection
-			struct sockaddr_in client_addr;
-			socklen_t client_addr_len = sizeof(client_addr);
-			
-			int fd = accept4(server->socket, (struct sockaddr*)&client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
-			
-			if (fd < 0)
-			{
-				if (errno == EAGAIN)
-				{
-					break;
-				}
-				else
-				{
-					fprintf(stderr, "%i - Error: Cannot accept incoming connection: %m\n", getpid());
-					return;
-				}
-			}
-			
-			// Check if we have already hit the maximum number of clients
-			if (server->numClients == server->params->maxClients)
-			{
-				// Server's full
-				dprintf(fd, ERROR_FORMAT, ERROR_UNAVAILABLE);
-				close(fd);
-				continue;
-			}
-			
-			// Allocate a new client data structure
-			struct client_t* client = malloc(sizeof(struct client_t));
+			return -1;
+		}
+		
+		scache_release(entry);
+		
+		if (server->tlsTemplates != NULL)
+		{
+			entry = server_template(server, true, file, filename, statbuf);
 			
-			if (client == NULL)
+			if (entry == NULL)
 			{
-				fprintf(stderr, "%i - Error: Cannot allocate memory for new client: %m\n", getpid());
-				dprintf(fd, ERROR_FORMAT, ERROR_INTERNAL);
-				close(fd);
-				continue;
+				return -1;
 			}
 			
-			// Initialize the client, add their socket FD to the watch list, and add the client to the list
-			client->socket = fd;
-			client->timestamp = time(NULL);
-			client->count = 0;
-			client->file = -1;
-			client->sentsize = 0;
-			client->dirfd = -1;
-			client->pidfd = -1;
-			
-			inet_ntop(AF_INET, &client_addr.sin_addr, client->address, INET_ADDRSTRLEN);
-			
-			sepoll_add(server->loop, fd, EPOLLIN | EPOLLET, client_socket, server, client);
-			
-			LIST_INSERT_HEAD(&server->clients, client, entry);
-			
-			server->numClients++;
+			scache_release(entry);
+		}
+		
+		return 0;
+	}
+	
+	int copy = -1;
+	
+	if (server->textCache >= 0 && dirfd < 0 && stype_guess(filename, S_IFREG | S_IROTH) == '0')
+	{
+		struct stat textbuf;
+		
+		copy = stext_open(server->textCache, file, statbuf, &textbuf);
+		
+		if (copy < 0)
+		{
+			return -1;
+		}
+		
+		// What gets sent is the copy, so that's what wants warming up
+		file = copy;
+		*statbuf = textbuf;
+	}
+	
+	int retval = 0;
+	
+	if (server->cache != NULL && statbuf->st_size <= server->params->cacheFileSize)
+	{
+		entry = server_cache_file(server, file, statbuf);
+		
+		if (entry == NULL)
+		{
+			retval = -1;
 		}
+		else
+		{
+			scache_release(entry);
+		}
+	}
+	else
+	{
+		readahead(file, 0, statbuf->st_size < STREAM_WINDOW ? (size_t)statbuf->st_size : STREAM_WINDOW);
+	}
+	
+	if (copy >= 0)
+	{
+		close(copy);
+	}
+	
+	return retval;
+}
+
+// Look up a selector the same way a request for it would be and warm up whatever it leads to
+static int server_warm(struct server_t* server, const char* selector)
+{
+	size_t length = strlen(selector);
+	
+	if (length > MAX_REQUEST_SIZE - 2)
+	{
+		return -1;
 	}
 	
-	if (events & EPOLLERR)
+	if (server->proxy != NULL && sproxy_route(server->proxy, selector, length) != NULL)
 	{
-		fprintf(stderr, "%i - Error reported by listening socket\n", getpid());
+		return -1;
 	}
-
-	if (events & EPOLLHUP)
+	
+	char filename[MAX_FILENAME_SIZE];
+	
+	char* filename_end = srequest_path(selector, length, filename);
+	
+	if (filename_end == NULL || (server->search != NULL && strcmp(filename + 1, server->params->search) == 0))
 	{
-		fprintf(stderr, "%i - Hangup reported by listening socket\n", getpid());
+		return -1;
 	}
-}
-
-// *********************************************************************
-// signalfd event handler
-// *********************************************************************
-static void server_signal(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
-{
-	struct server_t* server = userdata1.ptr;
 	
-	while (1)
+	int file = sdircache_open(server->dirs, filename, O_RDONLY | O_CLOEXEC);
+	
+	if (file < 0)
 	{
-		struct signalfd_siginfo siginfo;
+		return -1;
+	}
+	
+	int dirfd = -1;
+	int retval = -1;
+	
+	struct stat statbuf;
+	
+	if (fstat(file, &statbuf) == 0 && S_ISDIR(statbuf.st_mode))
+	{
+		dirfd = file;
+		file = sdircache_openat(server->dirs, dirfd, filename, server->params->indexfile, O_RDONLY | O_CLOEXEC);
 		
-		if (read(server->sigfd, &siginfo, sizeof(struct signalfd_siginfo)) != sizeof(struct signalfd_siginfo))
+		if (file >= 0 && fstat(file, &statbuf) < 0)
 		{
-			if (errno == EAGAIN)
-			{
-				break;
-			}
-			else
-			{
-				fprintf(stderr, "%i - Error: Cannot read from signalfd: %m\n", getpid());
-				return;
-			}
+			statbuf.st_mode = 0;
 		}
 		
-		switch (siginfo.ssi_signo)
-		{
-		case SIGTERM:
-			fprintf(stderr, "%i - Received SIGTERM\n", getpid());
-			sepoll_exit(server->loop);
-			break;
-		}
+		stpcpy(filename_end, "/");
 	}
-}
-
-// *********************************************************************
-// timerfd event handler
-// *********************************************************************
-static void server_timer(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
-{
-	struct server_t* server = userdata1.ptr;
 	
-	// Have to read 8 bytes from the timer to reset it even if I don't care about the contents
-	uint64_t buffer;
+	// CGI programs are left to warm up their own caches
+	if (file >= 0 && S_ISREG(statbuf.st_mode) && !(statbuf.st_mode & S_IXOTH))
+	{
+		retval = server_warm_file(server, file, dirfd, filename, &statbuf);
+	}
 	
-	if (read(server->timerfd, &buffer, sizeof(uint64_t)) != sizeof(uint64_t))
+	if (file >= 0)
 	{
-		fprintf(stderr, "%i - Error: Cannot read from timerfd: %m\n", getpid());
+		close(file);
 	}
 	
-	// Check for connection timeout
-	time_t currentTime = time(NULL);
+	if (dirfd >= 0)
+	{
+		close(dirfd);
+	}
+	
+	return retval;
+}
 
-	struct client_t* client = LIST_FIRST(&server->clients);
+static void server_warmup(struct server_t* server)
+{
+	const struct server_params_t* params = server->params;
+	
+	uint64_t start = monotonic_time();
+	uint64_t now = start;
 	
-	while (client != NULL)
+	unsigned int warmed = 0;
+	unsigned int i;
+	
+	for (i = 0; i < params->numWarmup; i++)
 	{
-		struct client_t* next = LIST_NEXT(client, entry);
+		if (params->warmupTime > 0 && now - start >= (uint64_t)params->warmupTime * 1000000000)
+		{
+			break;
+		}
 		
-		if (currentTime - client->timestamp >= server->params->timeout)
+		if (server_warm(server, params->warmup[i]) == 0)
 		{
-			if (client->pidfd >= 0)
-			{
-				// The timestamp refers to when the CGI process was spawned,
-				// so we need to spy on the TCP connection information to find out if it's really idle
-				struct tcp_info tcp_info;
-				socklen_t tcp_info_length = sizeof(struct tcp_info);
-				
-				int retval = getsockopt(client->socket, SOL_TCP, TCP_INFO, &tcp_info, &tcp_info_length);
-				
-				if (retval < 0)
-				{
-					fprintf(stderr, "%i - Error: Cannot get TCP information from socket: %m\n", getpid());
-				}
-				
-				// Kill the child process if it hasn't used the socket for at least one timeout period
-				if (retval < 0 || tcp_info.tcpi_last_data_sent >= server->params->timeout * 1000)
-				{
-					pidfd_kill_client(server, client);
-				}
-			}
-			else
-			{
-				// Send timeout error if nothing has been sent yet
-				if (client->sentsize == 0)
-				{
-					dprintf(client->socket, ERROR_FORMAT, ERROR_TIMEOUT);
-				}
-				
-				client_disconnect(server, client);
-			}
+			warmed++;
 		}
 		
-		client = next;
+		// A long list on a cold disk mustn't look like a stuck worker
+		now = monotonic_time();
+		
+		__atomic_store_n(&server->metrics->heartbeat, now, __ATOMIC_RELAXED);
 	}
+	
+	fprintf(stderr, "%i - Warmed up %u of %u selectors in %lu ms%s\n", getpid(), warmed, params->numWarmup, (unsigned long)((now - start) / 1000000), i < params->numWarmup ? " before running out of time" : "");
 }
 
 // *********************************************************************
@@ -901,67 +3154,6 @@ static int increasefdlimit(rlim_t inc)
 	return 0;
 }
 
-// *********************************************************************
-// Open the listening socket
-// *********************************************************************
-static int open_socket(unsigned short port)
-{
-	// Create socket
-	int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
-	
-	if (sockfd < 0)
-	{
-		fprintf(stderr, "%i - Error: Cannot create socket: %m\n", getpid());
-		return -1;
-	}
-	
-	// Allow for address reuse
-	int optval = 1;
-	
-	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
-	{
-		fprintf(stderr, "%i - Error: Cannot enable address reuse on socket: %m\n", getpid());
-		close(sockfd);
-		return -1;
-	}
-	
-	// Allow for port reuse
-	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)
-	{
-		fprintf(stderr, "%i - Error: Cannot enable port reuse on socket: %m\n", getpid());
-		close(sockfd);
-		return -1;
-	}
-	
-	// Bind address to socket
-	struct sockaddr_in addr = 
-	{
-		.sin_family = AF_INET,
-		.sin_port = htons(port),
-		.sin_addr =
-		{
-			.s_addr = htonl(INADDR_ANY)
-		}
-	};
-	
-	if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-	{
-		fprintf(stderr, "%i - Error: Cannot bind address to socket: %m\n", getpid());
-		close(sockfd);
-		return -1;
-	}
-	
-	// Set up socket to listen
-	if (listen(sockfd, 256) < 0)
-	{
-		fprintf(stderr, "%i - Error: Cannot listen on socket: %m\n", getpid());
-		close(sockfd);
-		return -1;
-	}
-	
-	return sockfd;
-}
-
 // *********************************************************************
 // Open a signalfd
 // *********************************************************************
@@ -972,6 +3164,7 @@ static int open_sigfd()
 	
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGQUIT);
 	
 	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
 	{
@@ -1043,11 +3236,14 @@ static void server_cleanup(int code, void* arg)
 	// Disconnect all clients
 	// This is a slightly faster variant of calling client_disconnect
 	// It frees all the resources and does none of the bookkeeping which no longer matters
-	struct client_t* client = LIST_FIRST(&server->clients);
-	
-	while (client != NULL)
+	for (unsigned int i = 0; i < server->highWater; i++)
 	{
-		struct client_t* next = LIST_NEXT(client, entry);
+		struct client_t* client = &server->clients[i];
+		
+		if (client->socket < 0)
+		{
+			continue;
+		}
 		
 		// Kill CGI process, if any
 		if (client->pidfd >= 0)
@@ -1071,15 +3267,48 @@ static void server_cleanup(int code, void* arg)
 		// Close the socket
 		close(client->socket);
 		
-		free(client);
-		
-		client = next;
+		free(client->request);
+		stls_destroy(client->tls);
+		scache_release(client->memory);
 	}
 	
+	free(server->clients);
+	free(server->tlsBuffer);
+	
+	sdircache_destroy(server->dirs);
+	
+	scache_destroy(server->cache);
+	scache_destroy(server->templates);
+	scache_destroy(server->tlsTemplates);
+	
+	ssearch_close(server->search);
+	sproxy_destroy(server->proxy);
+	
+	slog_close(server->log);
+	
 	// Close all the other FDs
-	if (server->socket >= 0)
+	for (unsigned int i = 0; i < server->numSockets; i++)
+	{
+		if (server->sockets[i] >= 0)
+		{
+			close(server->sockets[i]);
+		}
+	}
+	
+	for (unsigned int i = 0; i < server->numTlsSockets; i++)
+	{
+		if (server->tlsSockets[i] >= 0)
+		{
+			close(server->tlsSockets[i]);
+		}
+	}
+	
+	for (unsigned int i = 0; i < server->numUnixSockets; i++)
 	{
-		close(server->socket);
+		if (server->unixSockets[i] >= 0)
+		{
+			close(server->unixSockets[i]);
+		}
 	}
 	
 	if (server->timerfd >= 0)
@@ -1087,23 +3316,38 @@ static void server_cleanup(int code, void* arg)
 		close(server->timerfd);
 	}
 	
+	if (server->shaperfd >= 0)
+	{
+		close(server->shaperfd);
+	}
+	
 	if (server->sigfd >= 0)
 	{
 		close(server->sigfd);
 	}
 	
+	if (server->cgiSocket >= 0)
+	{
+		close(server->cgiSocket);
+	}
+	
 	if (server->directory >= 0)
 	{
 		close(server->directory);
 	}
 	
+	if (server->textCache >= 0)
+	{
+		close(server->textCache);
+	}
+	
 	free(server);
 }
 
 // *********************************************************************
 // Server setup and loop
 // *********************************************************************
-void server_process(struct server_params_t* params)
+void server_process(struct server_params_t* params, unsigned int worker, struct smetrics_worker_t* metrics)
 {
 	// Set up signals
 	if (setupsignals() < 0)
@@ -1112,7 +3356,7 @@ void server_process(struct server_params_t* params)
 	}
 	
 	// Increase open file descriptor limit if needed
-	if (increasefdlimit(FDS_SERVER + params->maxClients * FDS_CLIENT) < 0)
+	if (increasefdlimit(FDS_SERVER + DIRCACHE_SIZE + params->numSockets + params->numTlsSockets + params->numUnixSockets + params->maxClients * FDS_CLIENT) < 0)
 	{
 		exit(EXIT_FAILURE);
 	}
@@ -1128,18 +3372,128 @@ void server_process(struct server_params_t* params)
 	
 	server->params = params;
 	server->numClients = 0;
-	
-	LIST_INIT(&server->clients);
+	server->highWater = 0;
+	server->clients = NULL;
+	server->freeClients = NULL;
+	server->tlsBuffer = NULL;
+	server->dirs = NULL;
+	server->cache = NULL;
+	server->templates = NULL;
+	server->tlsTemplates = NULL;
+	server->search = NULL;
+	server->proxy = NULL;
+	server->log = NULL;
+	server->metrics = metrics;
+	server->draining = false;
+	server->drainDeadline = 0;
+	server->listenersClose = 0;
+	server->handoffPaused = false;
+	server->handoffClosed = false;
+	server->hotDecay = time(NULL) + HOT_DECAY_INTERVAL;
+	
+	TAILQ_INIT(&server->parked);
+	server->numParked = 0;
+	server->resumeLeft = 0;
+	
+	sepoll_task_init(&server->resume, server_resume, server, NULL);
+	sepoll_task_init(&server->decay, server_decay, server, NULL);
 	
 	server->directory = -1;
+	server->textCache = -1;
 	server->sigfd = -1;
 	server->timerfd = -1;
-	server->socket = -1;
+	server->shaperfd = -1;
+	
+	// The listening sockets, and the socket to the CGI pool, come already open from the supervisor
+	server->cgiSocket = params->cgiSocket;
+	server->sockets = params->sockets;
+	server->numSockets = params->numSockets;
+	server->tlsSockets = params->tlsSockets;
+	server->numTlsSockets = params->numTlsSockets;
+	server->unixSockets = params->unixSockets;
+	server->numUnixSockets = params->numUnixSockets;
 	
 	server->loop = NULL;
 	
 	on_exit(server_cleanup, server);
 	
+	// Allocate the client slab. calloc gets fresh pages from the kernel for anything this size, so untouched slots cost nothing
+	server->clients = calloc(params->maxClients, sizeof(struct client_t));
+	
+	if (server->clients == NULL)
+	{
+		fprintf(stderr, "%i - Error: Could not allocate memory for clients: %m\n", getpid());
+		exit(EXIT_FAILURE);
+	}
+	
+	if (params->tls != NULL)
+	{
+		server->tlsBuffer = malloc(STLS_RECORD_SIZE);
+		
+		if (server->tlsBuffer == NULL)
+		{
+			fprintf(stderr, "%i - Error: Could not allocate memory for TLS: %m\n", getpid());
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	// Create the response cache if there's room for one
+	if (params->cacheSize > 0)
+	{
+		server->cache = scache_create(params->cacheSize);
+		
+		if (server->cache == NULL)
+		{
+			fprintf(stderr, "%i - Error: Could not allocate memory for response cache: %m\n", getpid());
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	// Templates are always served from memory, so they get caches of their own
+	if (params->templates)
+	{
+		server->templates = scache_create(TEMPLATE_CACHE_SIZE);
+		server->tlsTemplates = params->tls != NULL ? scache_create(TEMPLATE_CACHE_SIZE) : NULL;
+		
+		if (server->templates == NULL || (params->tls != NULL && server->tlsTemplates == NULL))
+		{
+			fprintf(stderr, "%i - Error: Could not allocate memory for template cache: %m\n", getpid());
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	// The index itself is built by the supervisor, so this just keeps track of its snapshots
+	if (params->search != NULL)
+	{
+		server->search = ssearch_open(params->searchIndex);
+		
+		if (server->search == NULL)
+		{
+			fprintf(stderr, "%i - Error: Could not allocate memory for search: %m\n", getpid());
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	// Open this worker's access log
+	if (params->accessLog != NULL)
+	{
+		char path[PATH_MAX];
+		
+		if (snprintf(path, sizeof(path), "%s.%u", params->accessLog, worker) >= (int)sizeof(path))
+		{
+			fprintf(stderr, "%i - Error: Access log path is too long\n", getpid());
+			exit(EXIT_FAILURE);
+		}
+		
+		server->log = slog_open(path, worker, params->accessLogSize);
+		
+		if (server->log == NULL)
+		{
+			fprintf(stderr, "%i - Error: Could not open access log %s: %m\n", getpid(), path);
+			exit(EXIT_FAILURE);
+		}
+	}
+	
 	// Open content directory
 	server->directory = open(params->directory, O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_PATH);
 	
@@ -1149,6 +3503,26 @@ void server_process(struct server_params_t* params)
 		exit(EXIT_FAILURE);
 	}
 	
+	server->dirs = sdircache_create(server->directory, DIRCACHE_SIZE, params->outsideLinks);
+	
+	if (server->dirs == NULL)
+	{
+		fprintf(stderr, "%i - Error: Could not allocate memory for directory cache: %m\n", getpid());
+		exit(EXIT_FAILURE);
+	}
+	
+	// Open the directory converted text files are kept in
+	if (params->rfc1436 && params->textCache != NULL)
+	{
+		server->textCache = open(params->textCache, O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_PATH);
+		
+		if (server->textCache < 0)
+		{
+			fprintf(stderr, "%i - Error: Could not open text cache directory: %m\n", getpid());
+			exit(EXIT_FAILURE);
+		}
+	}
+	
 	// Open signalfd
 	server->sigfd = open_sigfd();
 	
@@ -1157,25 +3531,33 @@ void server_process(struct server_params_t* params)
 		exit(EXIT_FAILURE);
 	}
 	
-	// Open timerfd
-	server->timerfd = open_timerfd(params->timeout);
+	// Open timerfd, ticking often enough to enforce whichever of the timeouts is shortest
+	unsigned int interval = params->timeout;
+	
+	if (params->requestTimeout > 0 && params->requestTimeout < interval)
+	{
+		interval = params->requestTimeout;
+	}
+	
+	server->timerfd = open_timerfd(interval);
 	
 	if (server->timerfd < 0)
 	{
 		exit(EXIT_FAILURE);
 	}
 	
-	// Open socket
-	server->socket = open_socket(params->port);
+	// Open shaper timerfd, which stays disarmed until a client runs out of tokens
+	server->shaperfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
 	
-	if (server->socket < 0)
+	if (server->shaperfd < 0)
 	{
+		fprintf(stderr, "%i - Error: Cannot open shaper timerfd: %m\n", getpid());
 		exit(EXIT_FAILURE);
 	}
 	
 	// Set up epoll
 	// Strictly speaking it doesn't need to be this big but it lets it handle an event from each client plus core things in one loop
-	server->loop = sepoll_create((int)params->maxClients + 3, EPOLL_CLOEXEC);
+	server->loop = sepoll_create((int)(params->maxClients + 4 + params->numSockets + params->numTlsSockets + params->numUnixSockets), EPOLL_CLOEXEC);
 	
 	if (server->loop == NULL)
 	{
@@ -1183,15 +3565,90 @@ void server_process(struct server_params_t* params)
 		exit(EXIT_FAILURE);
 	}
 	
+	// Collect event loop statistics straight into the shared metrics
+	if (params->loopStats)
+	{
+		sepoll_stats(server->loop, &metrics->loop);
+		
+		sepoll_stats_name(server->loop, client_socket, "client_socket");
+		sepoll_stats_name(server->loop, client_pidfd, "client_pidfd");
+		sepoll_stats_name(server->loop, server_socket, "server_socket");
+		sepoll_stats_name(server->loop, server_tls_socket, "server_tls_socket");
+		sepoll_stats_name(server->loop, server_unix_socket, "server_unix_socket");
+		sepoll_stats_name(server->loop, server_handoff, "server_handoff");
+		sepoll_stats_name(server->loop, server_signal, "server_signal");
+		sepoll_stats_name(server->loop, server_timer, "server_timer");
+		sepoll_stats_name(server->loop, server_shaper, "server_shaper");
+	}
+	
+	if (params->busyPoll > 0 && sepoll_busy_poll(server->loop, params->busyPoll) < 0)
+	{
+		fprintf(stderr, "%i - Warning: Cannot set up kernel busy polling: %m\n", getpid());
+	}
+	
+	// Upstream fetches run from the event loop, so the proxy can't be set up until there is one
+	if (params->numProxyRoutes > 0)
+	{
+		server->proxy = sproxy_create(server->loop, params->proxyRoutes, params->numProxyRoutes, params->proxyCacheSize, params->proxyFileSize, params->proxyTtl, params->hostname, client_upstream, server);
+		
+		if (server->proxy == NULL)
+		{
+			fprintf(stderr, "%i - Error: Could not allocate memory for proxy: %m\n", getpid());
+			exit(EXIT_FAILURE);
+		}
+	}
+	
 	sepoll_add(server->loop, server->sigfd, EPOLLIN | EPOLLET, server_signal, server, NULL);
 	sepoll_add(server->loop, server->timerfd, EPOLLIN, server_timer, server, NULL);
-	sepoll_add(server->loop, server->socket, EPOLLIN | EPOLLET, server_socket, server, NULL);
+	sepoll_add(server->loop, server->shaperfd, EPOLLIN, server_shaper, server, NULL);
+	
+	// The listening sockets are left alone until this is done, so connections wait in the queue, or go to an old worker
+	// that hasn't been told to finish up yet, rather than to a worker with cold caches
+	if (params->numWarmup > 0)
+	{
+		server_warmup(server);
+	}
+	
+	for (unsigned int i = 0; i < server->numSockets; i++)
+	{
+		sepoll_add(server->loop, server->sockets[i], EPOLLIN | EPOLLET, server_socket, server, server->sockets[i]);
+	}
+	
+	for (unsigned int i = 0; i < server->numTlsSockets; i++)
+	{
+		sepoll_add(server->loop, server->tlsSockets[i], EPOLLIN | EPOLLET, server_tls_socket, server, server->tlsSockets[i]);
+	}
+	
+	// Every worker has the same Unix sockets, so only one of them is woken up for each new connection
+	for (unsigned int i = 0; i < server->numUnixSockets; i++)
+	{
+		sepoll_add(server->loop, server->unixSockets[i], EPOLLIN | EPOLLET | EPOLLEXCLUSIVE, server_unix_socket, server, server->unixSockets[i]);
+	}
+	
+	// The CGI pool has no listening sockets of its own, only the clients the other workers hand off to it
+	if (params->cgiPool)
+	{
+		sepoll_add(server->loop, server->cgiSocket, EPOLLIN | EPOLLET | EPOLLEXCLUSIVE, server_handoff, server, NULL);
+	}
 	
 	// Enter event loop
 	fprintf(stderr, "%i - Successfully started\n", getpid());
 	
-	sepoll_enter(server->loop, -1, NULL, NULL);
+	// Let the supervisor know, which it waits for before retiring the workers this one is taking over from
+	__atomic_store_n(&metrics->ready, monotonic_time(), __ATOMIC_RELAXED);
+	
+	bucket_fill(&server->bucket, params->workerRateLimit, sepoll_time(server->loop));
+	
+	// Access log timestamps are the event loop clock shifted onto the wall clock
+	struct timespec now;
+	
+	clock_gettime(CLOCK_REALTIME, &now);
+	
+	server->logEpoch = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec - sepoll_time(server->loop);
+	
+	sepoll_enter(server->loop, HEARTBEAT_INTERVAL, server_heartbeat, server);
 	
+	fprintf(stderr, "%i - Evicted %lu idle, %lu slow request, %lu past deadline, %lu below minimum rate\n", getpid(), (unsigned long)server->metrics->evictions.idle, (unsigned long)server->metrics->evictions.request, (unsigned long)server->metrics->evictions.deadline, (unsigned long)server->metrics->evictions.throughput);
 	fprintf(stderr, "%i - Exiting\n", getpid());
 	
 	exit(EXIT_SUCCESS);
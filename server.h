@@ -1,18 +1,116 @@
 #pragma once
 
+// smetrics_worker_t
+#include "smetrics.h"
+
+// sproxy_route_t
+#include "sproxy.h"
+
+// stls_context_t
+#include "stls.h"
+
 struct server_params_t
 {
-	// Network
+	// Network, with the listening sockets this worker accepts connections on already open
 	const char* hostname;
 	unsigned short port;
+	int* sockets;
+	unsigned int numSockets;
+	
+	// TLS, with its own port and listening sockets, and the certificate already loaded, or NULL if it's disabled
+	unsigned short tlsPort;
+	int* tlsSockets;
+	unsigned int numTlsSockets;
+	struct stls_context_t* tls;
+	
+	// Unix sockets, which every worker shares rather than having its own
+	int* unixSockets;
+	unsigned int numUnixSockets;
+	
+	// Socket to the CGI pool, or -1 without one, and whether this worker is in the pool, in which case it runs the CGI
+	// programs the other workers send it over the socket instead of accepting connections
+	int cgiSocket;
+	int cgiPool;
 	
 	// Client management
 	unsigned int maxClients;
 	unsigned int timeout;
 	
+	// Hard limits, with 0 disabling each: seconds for the request to arrive, base seconds for a whole transfer,
+	// the rate in bytes per second used to extend that deadline by file size, and the minimum average transfer rate
+	unsigned int requestTimeout;
+	unsigned int deadline;
+	unsigned int deadlineRate;
+	unsigned int minRate;
+	
+	// Bandwidth shaping, in bytes per second with 0 meaning unlimited
+	unsigned int rateLimit;
+	unsigned int workerRateLimit;
+	
+	// Files up to this size, and gophermaps, are never shaped
+	unsigned int priorityThreshold;
+	
+	// Large file streaming: size at which it kicks in, size past which files are dropped from the page cache as they're sent,
+	// the socket's unsent data low water mark in bytes, and whether to cork the tail end, with 0 disabling each
+	unsigned long largeFile;
+	unsigned long dropBehind;
+	unsigned int notsentLowat;
+	int cork;
+	
+	// Per-worker response cache size, the largest file it will take, and the smallest response worth sending with
+	// MSG_ZEROCOPY, all in bytes and with 0 disabling the cache or zero-copy, and how many times a file has to have been
+	// asked for lately to be let into the cache
+	unsigned long cacheSize;
+	unsigned int cacheFileSize;
+	unsigned int zerocopy;
+	unsigned int cacheAdmit;
+	
+	// Access log path, which each worker adds its number to, and the number of records each worker's log holds,
+	// with a NULL path disabling logging
+	const char* accessLog;
+	unsigned long accessLogSize;
+	
+	// Whether to collect event loop statistics into the metrics
+	int loopStats;
+	
+	// Longest the event loop spins waiting for events before blocking, in microseconds, or 0 to always block
+	unsigned int busyPoll;
+	
+	// Time in seconds to finish up with the current clients after being told to stop, or 0 for no limit
+	unsigned int drainTime;
+	
 	// Paths and files
 	const char* directory;
 	const char* indexfile;
+	
+	// Whether symlinks that lead out of the content directory are followed rather than refused
+	int outsideLinks;
+	
+	// Whether index files are filled in as templates
+	int templates;
+	
+	// Whether to follow RFC 1436 to the letter by adding a terminator to gophermaps that don't have one, and the directory
+	// to keep converted copies of text files in, or NULL to send text files as they are
+	int rfc1436;
+	const char* textCache;
+	
+	// Selector that answers search queries, or NULL for no search, and the file the supervisor keeps the index in
+	const char* search;
+	const char* searchIndex;
+	
+	// Selector prefixes passed on to upstream servers, how long their responses are kept in seconds, how much memory
+	// each worker keeps them in, and the biggest response taken from an upstream, both in bytes
+	const struct sproxy_route_t* proxyRoutes;
+	unsigned int numProxyRoutes;
+	unsigned int proxyTtl;
+	unsigned long proxyCacheSize;
+	unsigned long proxyFileSize;
+	
+	// Selectors to warm the caches up with before accepting any connections, and the most time in seconds to spend on
+	// it, with 0 meaning no limit
+	char** warmup;
+	unsigned int numWarmup;
+	unsigned int warmupTime;
 };
 
-__attribute__((noreturn)) void server_process(struct server_params_t* params);
+__attribute__((noreturn)) void server_process(struct server_params_t* params, unsigned int worker, struct smetrics_worker_t* metrics);
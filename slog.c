@@ -0,0 +1,210 @@
+// open
+#include <fcntl.h>
+
+// snprintf, rename
+#include <stdio.h>
+
+// malloc, free
+#include <stdlib.h>
+
+// memset, strlen
+#include <string.h>
+
+// mmap, munmap
+#include <sys/mman.h>
+
+// fstat
+#include <sys/stat.h>
+
+// ftruncate, close, getpid, unlink
+#include <unistd.h>
+
+// definitions
+#include "slog.h"
+
+// *********************************************************************
+// Core definitions
+// *********************************************************************
+
+struct slog_t
+{
+	// Mapping of the whole file
+	struct slog_header_t* header;
+	struct slog_record_t* records;
+	size_t length;
+};
+
+// *********************************************************************
+// Opening and closing
+//
+// A file that's already there is only ever written to as it is. If it
+// isn't a log we can carry on with, a new one is made next to it and
+// renamed into place, since the worker it belonged to could still have
+// it mapped, which it does for a while during an upgrade, and resizing
+// it or starting it over underneath that worker would have it writing
+// past the end of the file or into a ring that's been reset.
+// *********************************************************************
+
+// Map the log that's already at path, as long as it's the same shape as the one we want
+static struct slog_header_t* map_existing(const char* path, size_t length, uint64_t capacity)
+{
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	
+	struct stat statbuf;
+	
+	if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) || (size_t)statbuf.st_size != length)
+	{
+		close(fd);
+		return NULL;
+	}
+	
+	void* ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	
+	// The mapping keeps the file around
+	close(fd);
+	
+	if (ptr == MAP_FAILED)
+	{
+		return NULL;
+	}
+	
+	struct slog_header_t* header = ptr;
+	
+	if (header->magic != SLOG_MAGIC || header->version != SLOG_VERSION || header->recordSize != sizeof(struct slog_record_t) || header->capacity != capacity)
+	{
+		munmap(ptr, length);
+		return NULL;
+	}
+	
+	return header;
+}
+
+// Make an empty log and put it at path
+static struct slog_header_t* map_new(const char* path, size_t length, uint64_t capacity)
+{
+	size_t size = strlen(path) + 16;
+	char* temporary = malloc(size);
+	
+	if (temporary == NULL)
+	{
+		return NULL;
+	}
+	
+	snprintf(temporary, size, "%s.%i", path, getpid());
+	
+	int fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	
+	if (fd < 0)
+	{
+		free(temporary);
+		return NULL;
+	}
+	
+	// Size the file to fit, which leaves it sparse until the ring fills up
+	void* ptr = ftruncate(fd, (off_t)length) == 0 ? mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	
+	close(fd);
+	
+	if (ptr == MAP_FAILED)
+	{
+		unlink(temporary);
+		free(temporary);
+		return NULL;
+	}
+	
+	struct slog_header_t* header = ptr;
+	
+	header->magic = SLOG_MAGIC;
+	header->version = SLOG_VERSION;
+	header->recordSize = sizeof(struct slog_record_t);
+	header->capacity = capacity;
+	header->head = 0;
+	
+	if (rename(temporary, path) < 0)
+	{
+		munmap(ptr, length);
+		unlink(temporary);
+		free(temporary);
+		return NULL;
+	}
+	
+	free(temporary);
+	
+	return header;
+}
+
+struct slog_t* slog_open(const char* path, unsigned int worker, uint64_t capacity)
+{
+	struct slog_t* log = malloc(sizeof(struct slog_t));
+	
+	if (log == NULL)
+	{
+		return NULL;
+	}
+	
+	log->length = sizeof(struct slog_header_t) + capacity * sizeof(struct slog_record_t);
+	log->header = map_existing(path, log->length, capacity);
+	
+	// Start over if this isn't a log we can continue
+	if (log->header == NULL)
+	{
+		log->header = map_new(path, log->length, capacity);
+	}
+	
+	if (log->header == NULL)
+	{
+		free(log);
+		return NULL;
+	}
+	
+	log->records = (struct slog_record_t*)(log->header + 1);
+	log->header->worker = worker;
+	log->header->pid = (uint32_t)getpid();
+	
+	return log;
+}
+
+void slog_close(struct slog_t* log)
+{
+	if (log == NULL)
+	{
+		return;
+	}
+	
+	munmap(log->header, log->length);
+	
+	free(log);
+}
+
+// *********************************************************************
+// Record management
+// *********************************************************************
+
+struct slog_record_t* slog_reserve(struct slog_t* log, uint64_t* sequence)
+{
+	// The old and new workers write to the same log for a while during an upgrade, so slots have to be claimed atomically
+	uint64_t head = __atomic_fetch_add(&log->header->head, 1, __ATOMIC_ACQ_REL);
+	
+	struct slog_record_t* record = &log->records[head % log->header->capacity];
+	
+	memset(record, 0, sizeof(struct slog_record_t));
+	
+	*sequence = head;
+	
+	return record;
+}
+
+struct slog_record_t* slog_lookup(struct slog_t* log, uint64_t sequence)
+{
+	if (log->header->head - sequence > log->header->capacity)
+	{
+		return NULL;
+	}
+	
+	return &log->records[sequence % log->header->capacity];
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+// size_t
+#include <stddef.h>
+
+// Fixed-width integer types
+#include <stdint.h>
+
+// *********************************************************************
+// Binary access log
+//
+// Each worker appends fixed-size records to its own ring file, which is
+// mapped into memory so that writing a record is nothing more than
+// filling in a struct. During an upgrade the old and new worker with the
+// same number both write to the file, so slots are claimed with an
+// atomic add on the head, after which a record belongs to whoever
+// claimed it and needs no locking. The kernel takes care of getting the
+// pages to disk. gopherlog decodes, merges and filters the files.
+// *********************************************************************
+
+// "GOPHLOG1" when read as a little-endian integer
+#define SLOG_MAGIC 0x31474f4c48504f47ULL
+#define SLOG_VERSION 1
+
+// How much of the selector is kept in the record, in addition to a hash of all of it
+#define SLOG_SELECTOR_SIZE 62
+
+// Record flags
+#define SLOG_COMPLETE 0x01
+#define SLOG_CGI 0x02
+#define SLOG_CACHED 0x04
+#define SLOG_ZEROCOPY 0x08
+#define SLOG_STREAMED 0x10
+#define SLOG_SHAPED 0x20
+#define SLOG_TLS 0x40
+#define SLOG_KTLS 0x80
+#define SLOG_PROXIED 0x100
+
+// File header, which takes up exactly one cache line
+struct slog_header_t
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t recordSize;
+	
+	// Number of record slots in the file
+	uint64_t capacity;
+	
+	// Number of records ever written, so the next one goes in slot head % capacity
+	uint64_t head;
+	
+	// Worker that owns the file
+	uint32_t worker;
+	uint32_t pid;
+	
+	uint8_t reserved[24];
+};
+
+// A record, which takes up exactly two cache lines
+// Stage times are all measured from when the connection was accepted, or 0 if the stage was never reached
+struct slog_record_t
+{
+	// Wall clock time the connection was accepted, in nanoseconds since the epoch
+	uint64_t timestamp;
+	
+	// Address family and address of the client, which for a Unix socket is the struct ucred of the process on the other end
+	uint16_t family;
+	
+	// Status code, or 0 if the client went away before the response was complete
+	uint16_t status;
+	
+	uint32_t flags;
+	uint8_t address[16];
+	
+	// Selector
+	uint64_t selectorHash;
+	
+	// Bytes of the response sent
+	uint64_t bytes;
+	
+	// Microseconds until the request was in, the file was open, the first byte was sent, and the connection was closed,
+	// up to UINT32_MAX for anything that took longer
+	uint32_t requestTime;
+	uint32_t openTime;
+	uint32_t firstByteTime;
+	uint32_t closeTime;
+	
+	// Full length of the selector and as much of it as fits
+	uint16_t selectorLength;
+	char selector[SLOG_SELECTOR_SIZE];
+};
+
+_Static_assert(sizeof(struct slog_header_t) == 64, "access log header must be 64 bytes");
+_Static_assert(sizeof(struct slog_record_t) == 128, "access log record must be 128 bytes");
+
+// FNV-1a, which is plenty for telling selectors apart
+static inline uint64_t slog_hash(const char* str, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)str[i];
+		hash *= 0x100000001b3ULL;
+	}
+	
+	return hash;
+}
+
+// Opaque structure for an open log
+struct slog_t;
+
+// Open a ring file, picking up where it left off if it already exists with the same capacity
+struct slog_t* slog_open(const char* path, unsigned int worker, uint64_t capacity);
+void slog_close(struct slog_t* log);
+
+// Claim the next record, which comes back zeroed, and its sequence number
+struct slog_record_t* slog_reserve(struct slog_t* log, uint64_t* sequence);
+
+// Get a record claimed earlier, or NULL if the ring has since wrapped around over it
+struct slog_record_t* slog_lookup(struct slog_t* log, uint64_t sequence);
+
+// Mark a record as finished
+static inline void slog_commit(struct slog_record_t* record)
+{
+	__atomic_store_n(&record->flags, record->flags | SLOG_COMPLETE, __ATOMIC_RELEASE);
+}
@@ -7,12 +7,17 @@
 // mmap, munmap
 #include <sys/mman.h>
 
+// Space set aside in front of each allocation for its size
+#define SMALLOC_HEADER 64
+
 // *********************************************************************
 // Shared memory allocation functions
 //
 // smalloc asks for a little extra memory so it can prepend a size,
-// which is used by sfree when later being freed. scalloc is a wrapper
-// around smalloc which is for allocating an array.
+// which is used by sfree when later being freed. The size gets a whole
+// cache line to itself so that what's returned is still cache line
+// aligned, which matters for memory that different processes write to.
+// scalloc is a wrapper around smalloc which is for allocating an array.
 // *********************************************************************
 
 void* smalloc(size_t size)
@@ -23,19 +28,18 @@ void* smalloc(size_t size)
 		return NULL;
 	}
 	
-	size_t length = sizeof(size_t) + size;
+	size_t length = SMALLOC_HEADER + size;
 	
-	size_t* ptr = (size_t*)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	char* ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 	
 	if (ptr == MAP_FAILED)
 	{
 		return NULL;
 	}
 	
-	*ptr = length;
-	ptr++;
+	*(size_t*)ptr = length;
 	
-	return (void*)ptr;
+	return (void*)(ptr + SMALLOC_HEADER);
 }
 
 void* scalloc(size_t nmemb, size_t size)
@@ -64,8 +68,7 @@ void sfree(void* ptr)
 		return;
 	}
 	
-	size_t* base = (size_t*)ptr;
-	base--;
+	char* base = (char*)ptr - SMALLOC_HEADER;
 	
-	munmap((void*)base, *base);
+	munmap((void*)base, *(size_t*)base);
 }
@@ -0,0 +1,700 @@
+// bool
+#include <stdbool.h>
+
+// snprintf
+#include <stdio.h>
+
+// qsort, malloc, free
+#include <stdlib.h>
+
+// memset, stpcpy
+#include <string.h>
+
+// clock_gettime
+#include <time.h>
+
+// definitions
+#include "smetrics.h"
+
+// Room to leave in the buffer before each line, which is far more than any one line needs
+#define REPORT_LEFTOVER 512
+
+// Status codes in the same order as smetrics_status_t
+static const unsigned short status_codes[SMETRICS_STATUSES] = {0, 200, 400, 403, 404, 408, 500, 502, 503, 504};
+
+// *********************************************************************
+// Report formatting
+// *********************************************************************
+
+static int write_header(struct sbuffer_t* sbuffer, const char* name, const char* type, const char* help)
+{
+	int retval = sbuffer_checkflush(sbuffer, REPORT_LEFTOVER);
+	
+	if (retval < 0)
+	{
+		return retval;
+	}
+	
+	sbuffer_push(sbuffer, "# HELP sgopher_%s %s\n# TYPE sgopher_%s %s\n", name, help, name, type);
+	
+	return 0;
+}
+
+static int write_value(struct sbuffer_t* sbuffer, const char* name, const char* labels, uint64_t value)
+{
+	int retval = sbuffer_checkflush(sbuffer, REPORT_LEFTOVER);
+	
+	if (retval < 0)
+	{
+		return retval;
+	}
+	
+	sbuffer_push(sbuffer, "sgopher_%s%s %lu\n", name, labels, (unsigned long)value);
+	
+	return 0;
+}
+
+// Nanoseconds written as seconds to the millisecond
+static int write_seconds(struct sbuffer_t* sbuffer, const char* name, const char* labels, uint64_t nanoseconds)
+{
+	int retval = sbuffer_checkflush(sbuffer, REPORT_LEFTOVER);
+	
+	if (retval < 0)
+	{
+		return retval;
+	}
+	
+	sbuffer_push(sbuffer, "sgopher_%s%s %lu.%03lu\n", name, labels, (unsigned long)(nanoseconds / 1000000000), (unsigned long)(nanoseconds % 1000000000 / 1000000));
+	
+	return 0;
+}
+
+static int write_metric(struct sbuffer_t* sbuffer, const char* name, const char* type, const char* help, uint64_t value)
+{
+	int retval = write_header(sbuffer, name, type, help);
+	
+	if (retval < 0)
+	{
+		return retval;
+	}
+	
+	return write_value(sbuffer, name, "", value);
+}
+
+static int write_histogram(struct sbuffer_t* sbuffer, const char* name, const char* help, const struct smetrics_histogram_t* histogram)
+{
+	int retval = write_header(sbuffer, name, "histogram", help);
+	
+	if (retval < 0)
+	{
+		return retval;
+	}
+	
+	// Buckets are reported cumulatively
+	uint64_t count = 0;
+	
+	for (unsigned int i = 0; i < SMETRICS_BUCKETS; i++)
+	{
+		retval = sbuffer_checkflush(sbuffer, REPORT_LEFTOVER);
+		
+		if (retval < 0)
+		{
+			return retval;
+		}
+		
+		count += histogram->buckets[i];
+		
+		if (i < SMETRICS_BUCKETS - 1)
+		{
+			sbuffer_push(sbuffer, "sgopher_%s_bucket{le=\"%g\"} %lu\n", name, smetrics_bounds[i] / 1000000.0, (unsigned long)count);
+		}
+		else
+		{
+			sbuffer_push(sbuffer, "sgopher_%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)count);
+		}
+	}
+	
+	retval = sbuffer_checkflush(sbuffer, REPORT_LEFTOVER);
+	
+	if (retval < 0)
+	{
+		return retval;
+	}
+	
+	sbuffer_push(sbuffer, "sgopher_%s_sum %lu.%06lu\nsgopher_%s_count %lu\n", name, (unsigned long)(histogram->sum / 1000000), (unsigned long)(histogram->sum % 1000000), name, (unsigned long)count);
+	
+	return 0;
+}
+
+// Event loop histograms, which are per worker and bucketed by powers of two
+// Times are bucketed in microseconds and summed in nanoseconds, while other things are just counted
+static int write_loop_histogram(struct sbuffer_t* sbuffer, const char* name, const char* labels, const struct sepoll_histogram_t* histogram, bool time)
+{
+	uint64_t count = 0;
+	
+	for (unsigned int i = 0; i < SEPOLL_STATS_BUCKETS; i++)
+	{
+		int retval = sbuffer_checkflush(sbuffer, REPORT_LEFTOVER);
+		
+		if (retval < 0)
+		{
+			return retval;
+		}
+		
+		count += histogram->buckets[i];
+		
+		if (i == SEPOLL_STATS_BUCKETS - 1)
+		{
+			sbuffer_push(sbuffer, "sgopher_%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, (unsigned long)count);
+		}
+		else if (time)
+		{
+			sbuffer_push(sbuffer, "sgopher_%s_bucket{%s,le=\"%g\"} %lu\n", name, labels, (double)(1UL << i) / 1000000.0, (unsigned long)count);
+		}
+		else
+		{
+			sbuffer_push(sbuffer, "sgopher_%s_bucket{%s,le=\"%lu\"} %lu\n", name, labels, (1UL << i) - 1, (unsigned long)count);
+		}
+	}
+	
+	int retval = sbuffer_checkflush(sbuffer, REPORT_LEFTOVER);
+	
+	if (retval < 0)
+	{
+		return retval;
+	}
+	
+	if (time)
+	{
+		sbuffer_push(sbuffer, "sgopher_%s_sum{%s} %lu.%09lu\n", name, labels, (unsigned long)(histogram->sum / 1000000000), (unsigned long)(histogram->sum % 1000000000));
+	}
+	else
+	{
+		sbuffer_push(sbuffer, "sgopher_%s_sum{%s} %lu\n", name, labels, (unsigned long)histogram->sum);
+	}
+	
+	sbuffer_push(sbuffer, "sgopher_%s_count{%s} %lu\n", name, labels, (unsigned long)count);
+	
+	return 0;
+}
+
+// Event loop statistics for the workers collecting them
+static int write_loop(struct sbuffer_t* sbuffer, const struct smetrics_worker_t* workers, unsigned int numWorkers)
+{
+	char labels[128];
+	int retval;
+	
+	if ((retval = write_header(sbuffer, "loop_wakeups_total", "counter", "Times epoll_wait returned events")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		if (workers[i].loop.wakeups > 0 && (retval = write_value(sbuffer, "loop_wakeups_total", labels, workers[i].loop.wakeups)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "loop_full_total", "counter", "Times epoll_wait filled the events array, so more events may have been waiting")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		if (workers[i].loop.wakeups > 0 && (retval = write_value(sbuffer, "loop_full_total", labels, workers[i].loop.full)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "loop_spins_total", "counter", "Times the loop spun on epoll_wait before blocking, with --busypoll")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		if (workers[i].loop.wakeups > 0 && (retval = write_value(sbuffer, "loop_spins_total", labels, workers[i].loop.spins)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "loop_spin_hits_total", "counter", "Times spinning on epoll_wait found events before it had to block")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		if (workers[i].loop.wakeups > 0 && (retval = write_value(sbuffer, "loop_spin_hits_total", labels, workers[i].loop.spinHits)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "loop_spin_seconds_total", "counter", "Time spent spinning on epoll_wait, which is the CPU time --busypoll costs")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		if (workers[i].loop.wakeups > 0 && (retval = write_seconds(sbuffer, "loop_spin_seconds_total", labels, workers[i].loop.spinTime)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "loop_events", "histogram", "Events returned per wakeup")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "worker=\"%u\"", i);
+		
+		if (workers[i].loop.wakeups > 0 && (retval = write_loop_histogram(sbuffer, "loop_events", labels, &workers[i].loop.events, false)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "loop_lag_seconds", "histogram", "Time from epoll_wait returning to each callback being called")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "worker=\"%u\"", i);
+		
+		if (workers[i].loop.wakeups > 0 && (retval = write_loop_histogram(sbuffer, "loop_lag_seconds", labels, &workers[i].loop.lag, true)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "loop_callback_seconds", "histogram", "Time spent in each callback function")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		for (unsigned int j = 0; j < workers[i].loop.numCallbacks && j < SEPOLL_STATS_CALLBACKS; j++)
+		{
+			const struct sepoll_callback_stats_t* callback = &workers[i].loop.callbacks[j];
+			
+			if (callback->name[0] != '\0')
+			{
+				snprintf(labels, sizeof(labels), "worker=\"%u\",callback=\"%s\"", i, callback->name);
+			}
+			else
+			{
+				snprintf(labels, sizeof(labels), "worker=\"%u\",callback=\"%p\"", i, (void*)callback->function);
+			}
+			
+			if ((retval = write_loop_histogram(sbuffer, "loop_callback_seconds", labels, &callback->time, true)) < 0)
+			{
+				return retval;
+			}
+		}
+	}
+	
+	return 0;
+}
+
+// *********************************************************************
+// Hottest selectors across all the workers. Each worker only knows its
+// own share of the requests, so counts for the same selector are added
+// up before picking the hottest.
+// *********************************************************************
+
+static int compare_hashes(const void* pa, const void* pb)
+{
+	const struct ssketch_entry_t* a = pa;
+	const struct ssketch_entry_t* b = pb;
+	
+	if (a->hash != b->hash)
+	{
+		return a->hash < b->hash ? -1 : 1;
+	}
+	
+	return 0;
+}
+
+static int compare_counts(const void* pa, const void* pb)
+{
+	const struct ssketch_entry_t* a = pa;
+	const struct ssketch_entry_t* b = pb;
+	
+	if (a->count != b->count)
+	{
+		return a->count > b->count ? -1 : 1;
+	}
+	
+	return 0;
+}
+
+// Selectors can have anything in them, so they're escaped for use as a label value
+static void format_selector(char* buffer, const struct ssketch_entry_t* entry)
+{
+	size_t length = entry->selectorLength < SSKETCH_SELECTOR_SIZE ? entry->selectorLength : SSKETCH_SELECTOR_SIZE;
+	
+	for (size_t i = 0; i < length; i++)
+	{
+		char c = entry->selector[i];
+		
+		if (c == '\\' || c == '"')
+		{
+			*buffer++ = '\\';
+		}
+		else if ((unsigned char)c < 0x20 || c == 0x7f)
+		{
+			c = '?';
+		}
+		
+		*buffer++ = c;
+	}
+	
+	if (entry->selectorLength > SSKETCH_SELECTOR_SIZE)
+	{
+		buffer = stpcpy(buffer, "...");
+	}
+	
+	*buffer = '\0';
+}
+
+static int write_hot(struct sbuffer_t* sbuffer, const struct smetrics_worker_t* workers, unsigned int numWorkers)
+{
+	struct ssketch_entry_t* entries = malloc(numWorkers * SSKETCH_TOP * sizeof(struct ssketch_entry_t));
+	
+	// Not worth failing the whole report over
+	if (entries == NULL)
+	{
+		return 0;
+	}
+	
+	size_t count = 0;
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		count += ssketch_top(&workers[i].hot, entries + count);
+	}
+	
+	qsort(entries, count, sizeof(struct ssketch_entry_t), compare_hashes);
+	
+	size_t merged = 0;
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		if (merged > 0 && entries[merged - 1].hash == entries[i].hash)
+		{
+			entries[merged - 1].count += entries[i].count;
+		}
+		else
+		{
+			entries[merged++] = entries[i];
+		}
+	}
+	
+	qsort(entries, merged, sizeof(struct ssketch_entry_t), compare_counts);
+	
+	int retval = write_header(sbuffer, "hot_selector_requests", "gauge", "Estimated recent requests for the most requested selectors, halved every minute");
+	
+	// Every character might need escaping, and there might be an ellipsis on the end. Selectors that are cut short or have
+	// control characters in them can come out the same, so the hash goes in a label too to keep every series distinct.
+	char labels[2 * SSKETCH_SELECTOR_SIZE + 64];
+	
+	for (size_t i = 0; i < merged && i < SSKETCH_TOP && retval == 0; i++)
+	{
+		char selector[2 * SSKETCH_SELECTOR_SIZE + 4];
+		
+		format_selector(selector, &entries[i]);
+		
+		snprintf(labels, sizeof(labels), "{selector=\"%s\",hash=\"%016lx\"}", selector, (unsigned long)entries[i].hash);
+		
+		retval = write_value(sbuffer, "hot_selector_requests", labels, entries[i].count);
+	}
+	
+	free(entries);
+	
+	return retval;
+}
+
+// *********************************************************************
+// Aggregation
+// *********************************************************************
+
+static void add_histogram(struct smetrics_histogram_t* total, const struct smetrics_histogram_t* histogram)
+{
+	for (unsigned int i = 0; i < SMETRICS_BUCKETS; i++)
+	{
+		total->buckets[i] += histogram->buckets[i];
+	}
+	
+	total->sum += histogram->sum;
+}
+
+static void add_worker(struct smetrics_worker_t* total, const struct smetrics_worker_t* worker)
+{
+	total->connections += worker->connections;
+	total->accepted += worker->accepted;
+	total->rejected += worker->rejected;
+	total->requests += worker->requests;
+	total->cgi += worker->cgi;
+	total->cached += worker->cached;
+	total->searches += worker->searches;
+	total->proxied += worker->proxied;
+	total->fetches += worker->fetches;
+	total->bytes += worker->bytes;
+	
+	for (unsigned int i = 0; i < SMETRICS_STATUSES; i++)
+	{
+		total->status[i] += worker->status[i];
+	}
+	
+	total->evictions.idle += worker->evictions.idle;
+	total->evictions.request += worker->evictions.request;
+	total->evictions.deadline += worker->evictions.deadline;
+	total->evictions.throughput += worker->evictions.throughput;
+	
+	total->tlsHandshakes += worker->tlsHandshakes;
+	total->tlsFailures += worker->tlsFailures;
+	total->ktls += worker->ktls;
+	
+	add_histogram(&total->firstByte, &worker->firstByte);
+	add_histogram(&total->duration, &worker->duration);
+	
+	total->respawns += worker->respawns;
+}
+
+// *********************************************************************
+// Report for the whole server plus a per-worker breakdown of the load
+// *********************************************************************
+int smetrics_write(struct sbuffer_t* sbuffer, const struct smetrics_worker_t* workers, unsigned int numWorkers)
+{
+	// The workers keep on counting while this happens, so the totals are only as consistent as a scrape needs
+	struct smetrics_worker_t total;
+	
+	memset(&total, 0, sizeof(total));
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		add_worker(&total, &workers[i]);
+	}
+	
+	char labels[64];
+	int retval;
+	
+	if ((retval = write_metric(sbuffer, "connections", "gauge", "Connections currently open", total.connections)) < 0 ||
+		(retval = write_metric(sbuffer, "accepted_total", "counter", "Connections accepted", total.accepted)) < 0 ||
+		(retval = write_metric(sbuffer, "rejected_total", "counter", "Connections turned away because the worker was full", total.rejected)) < 0 ||
+		(retval = write_metric(sbuffer, "requests_total", "counter", "Requests received", total.requests)) < 0 ||
+		(retval = write_metric(sbuffer, "cgi_total", "counter", "Requests handled by CGI programs", total.cgi)) < 0 ||
+		(retval = write_metric(sbuffer, "cached_total", "counter", "Responses sent from the response cache", total.cached)) < 0 ||
+		(retval = write_metric(sbuffer, "searches_total", "counter", "Search queries answered", total.searches)) < 0 ||
+		(retval = write_metric(sbuffer, "proxied_total", "counter", "Requests passed on to an upstream server", total.proxied)) < 0 ||
+		(retval = write_metric(sbuffer, "upstream_fetches_total", "counter", "Requests that had to be fetched from an upstream server", total.fetches)) < 0 ||
+		(retval = write_metric(sbuffer, "sent_bytes_total", "counter", "Bytes of files sent, not counting CGI output", total.bytes)) < 0)
+	{
+		return retval;
+	}
+	
+	if ((retval = write_header(sbuffer, "responses_total", "counter", "Responses by status code, where 0 is a client that hung up first")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < SMETRICS_STATUSES; i++)
+	{
+		snprintf(labels, sizeof(labels), "{status=\"%u\"}", status_codes[i]);
+		
+		if ((retval = write_value(sbuffer, "responses_total", labels, total.status[i])) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "evictions_total", "counter", "Clients booted for taking too long, by reason")) < 0 ||
+		(retval = write_value(sbuffer, "evictions_total", "{reason=\"idle\"}", total.evictions.idle)) < 0 ||
+		(retval = write_value(sbuffer, "evictions_total", "{reason=\"request\"}", total.evictions.request)) < 0 ||
+		(retval = write_value(sbuffer, "evictions_total", "{reason=\"deadline\"}", total.evictions.deadline)) < 0 ||
+		(retval = write_value(sbuffer, "evictions_total", "{reason=\"throughput\"}", total.evictions.throughput)) < 0)
+	{
+		return retval;
+	}
+	
+	if ((retval = write_header(sbuffer, "tls_handshakes_total", "counter", "TLS handshakes, by whether they finished")) < 0 ||
+		(retval = write_value(sbuffer, "tls_handshakes_total", "{result=\"ok\"}", total.tlsHandshakes)) < 0 ||
+		(retval = write_value(sbuffer, "tls_handshakes_total", "{result=\"failed\"}", total.tlsFailures)) < 0 ||
+		(retval = write_metric(sbuffer, "ktls_total", "counter", "TLS sessions handed over to kernel TLS", total.ktls)) < 0)
+	{
+		return retval;
+	}
+	
+	if ((retval = write_histogram(sbuffer, "first_byte_seconds", "Time from accepting a connection to sending the first byte of the response", &total.firstByte)) < 0 ||
+		(retval = write_histogram(sbuffer, "duration_seconds", "Time from accepting a connection to closing it", &total.duration)) < 0)
+	{
+		return retval;
+	}
+	
+	// How evenly the kernel is spreading the load
+	if ((retval = write_header(sbuffer, "worker_connections", "gauge", "Connections currently open per worker")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		if ((retval = write_value(sbuffer, "worker_connections", labels, workers[i].connections)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "worker_requests_total", "counter", "Requests received per worker")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		if ((retval = write_value(sbuffer, "worker_requests_total", labels, workers[i].requests)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	// Worker health, as seen by the supervisor
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	uint64_t nanoseconds = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+	
+	if ((retval = write_metric(sbuffer, "respawns_total", "counter", "Workers replaced after dying or getting stuck", total.respawns)) < 0 ||
+		(retval = write_header(sbuffer, "worker_uptime_seconds", "gauge", "Time since each worker's current process was started, or 0 while it's waiting to be replaced")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		uint64_t started = workers[i].started;
+		
+		if ((retval = write_seconds(sbuffer, "worker_uptime_seconds", labels, started > 0 && nanoseconds > started ? nanoseconds - started : 0)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "worker_warmup_seconds", "gauge", "Time each worker's current process took to get ready to accept connections, or 0 while it isn't yet")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		uint64_t started = workers[i].started;
+		uint64_t ready = __atomic_load_n(&workers[i].ready, __ATOMIC_RELAXED);
+		
+		if ((retval = write_seconds(sbuffer, "worker_warmup_seconds", labels, started > 0 && ready > started ? ready - started : 0)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "worker_heartbeat_age_seconds", "gauge", "Time since each worker's current process last went around its event loop, or 0 if there isn't one")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		uint64_t started = workers[i].started;
+		uint64_t heartbeat = __atomic_load_n(&workers[i].heartbeat, __ATOMIC_RELAXED);
+		
+		// A slot that's never had a process, or whose process has died, has nothing to be late with
+		if ((retval = write_seconds(sbuffer, "worker_heartbeat_age_seconds", labels, started > 0 && nanoseconds > heartbeat ? nanoseconds - heartbeat : 0)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "worker_respawns_total", "counter", "Times each worker has been replaced")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		if ((retval = write_value(sbuffer, "worker_respawns_total", labels, workers[i].respawns)) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_header(sbuffer, "worker_busy_seconds_total", "counter", "Time each worker has spent handling events rather than waiting for them")) < 0)
+	{
+		return retval;
+	}
+	
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		snprintf(labels, sizeof(labels), "{worker=\"%u\"}", i);
+		
+		if ((retval = write_seconds(sbuffer, "worker_busy_seconds_total", labels, __atomic_load_n(&workers[i].busy, __ATOMIC_RELAXED))) < 0)
+		{
+			return retval;
+		}
+	}
+	
+	if ((retval = write_hot(sbuffer, workers, numWorkers)) < 0)
+	{
+		return retval;
+	}
+	
+	// Only bother with the event loop statistics if anybody is collecting them
+	for (unsigned int i = 0; i < numWorkers; i++)
+	{
+		if (workers[i].loop.wakeups > 0)
+		{
+			if ((retval = write_loop(sbuffer, workers, numWorkers)) < 0)
+			{
+				return retval;
+			}
+			
+			break;
+		}
+	}
+	
+	return sbuffer_flush(sbuffer);
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+// size_t, for sbuffer.h
+#include <stddef.h>
+
+// Fixed-width integer types
+#include <stdint.h>
+
+// sbuffer_t
+#include "sbuffer.h"
+
+// sepoll_stats_t
+#include "sepoll.h"
+
+// ssketch_t
+#include "ssketch.h"
+
+// *********************************************************************
+// Shared-memory metrics
+//
+// The supervisor allocates one block of counters per worker in shared
+// memory before forking. Each worker only ever writes its own block, so
+// the counters are bumped with plain increments, and every block takes
+// up whole cache lines so that workers never contend for one. The
+// supervisor reads them all whenever it's asked for a report.
+// *********************************************************************
+
+// Latency histogram buckets, by upper bound in microseconds, with one more on the end for everything slower
+#define SMETRICS_BUCKETS 14
+
+static const uint32_t smetrics_bounds[SMETRICS_BUCKETS - 1] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000};
+
+// Responses counted by status code, with 0 for a client that hung up before the response was done
+enum smetrics_status_t
+{
+	SMETRICS_STATUS_ABORTED,
+	SMETRICS_STATUS_200,
+	SMETRICS_STATUS_400,
+	SMETRICS_STATUS_403,
+	SMETRICS_STATUS_404,
+	SMETRICS_STATUS_408,
+	SMETRICS_STATUS_500,
+	SMETRICS_STATUS_502,
+	SMETRICS_STATUS_503,
+	SMETRICS_STATUS_504,
+	SMETRICS_STATUSES
+};
+
+struct smetrics_histogram_t
+{
+	uint64_t buckets[SMETRICS_BUCKETS];
+	
+	// Total of all the observations in microseconds
+	uint64_t sum;
+};
+
+// Counts of clients booted by the timer, by reason
+struct smetrics_evictions_t
+{
+	uint64_t idle;
+	uint64_t request;
+	uint64_t deadline;
+	uint64_t throughput;
+};
+
+struct smetrics_worker_t
+{
+	// Connections open right now
+	uint64_t connections;
+	
+	// Connections accepted, and turned away because the worker was full
+	uint64_t accepted;
+	uint64_t rejected;
+	
+	// Requests received, and how many of them went to CGI programs, were sent from the response cache, were searches or
+	// were for an upstream, and how many of those had to be fetched from it
+	uint64_t requests;
+	uint64_t cgi;
+	uint64_t cached;
+	uint64_t searches;
+	uint64_t proxied;
+	uint64_t fetches;
+	
+	// Bytes of files sent, not counting CGI output
+	uint64_t bytes;
+	
+	uint64_t status[SMETRICS_STATUSES];
+	
+	struct smetrics_evictions_t evictions;
+	
+	// TLS handshakes that finished and failed, and how many of the sessions were handed over to kernel TLS
+	uint64_t tlsHandshakes;
+	uint64_t tlsFailures;
+	uint64_t ktls;
+	
+	// Time from accepting a connection to the first byte of the response, and to closing it
+	struct smetrics_histogram_t firstByte;
+	struct smetrics_histogram_t duration;
+	
+	// Supervision, with times on the monotonic clock in nanoseconds: when this worker's current process was started or 0
+	// if it's dead, when it finished warming up and was ready to accept connections or 0 if it hasn't yet, when it last
+	// went around its event loop, and how many times it's been replaced
+	uint64_t started;
+	uint64_t ready;
+	uint64_t heartbeat;
+	uint64_t respawns;
+	
+	// Time spent handling events rather than waiting for them, in nanoseconds
+	uint64_t busy;
+	
+	// Event loop statistics, if the worker is collecting them
+	struct sepoll_stats_t loop;
+	
+	// Counts of the selectors asked for lately and the hottest of them
+	struct ssketch_t hot;
+} __attribute__((aligned(64)));
+
+static inline enum smetrics_status_t smetrics_status(unsigned short status)
+{
+	switch (status)
+	{
+	case 200:
+		return SMETRICS_STATUS_200;
+	case 400:
+		return SMETRICS_STATUS_400;
+	case 403:
+		return SMETRICS_STATUS_403;
+	case 404:
+		return SMETRICS_STATUS_404;
+	case 408:
+		return SMETRICS_STATUS_408;
+	case 500:
+		return SMETRICS_STATUS_500;
+	case 502:
+		return SMETRICS_STATUS_502;
+	case 503:
+		return SMETRICS_STATUS_503;
+	case 504:
+		return SMETRICS_STATUS_504;
+	default:
+		return SMETRICS_STATUS_ABORTED;
+	}
+}
+
+static inline void smetrics_observe(struct smetrics_histogram_t* histogram, uint32_t micros)
+{
+	unsigned int i = 0;
+	
+	while (i < SMETRICS_BUCKETS - 1 && micros > smetrics_bounds[i])
+	{
+		i++;
+	}
+	
+	histogram->buckets[i]++;
+	histogram->sum += micros;
+}
+
+// Write a report on all the workers in the Prometheus text format
+int smetrics_write(struct sbuffer_t* sbuffer, const struct smetrics_worker_t* workers, unsigned int numWorkers);
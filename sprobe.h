@@ -0,0 +1,35 @@
+#pragma once
+
+// *********************************************************************
+// Static tracepoints
+//
+// These are USDT probes, which compile down to a single nop plus a note
+// in the ELF file telling tracers like bpftrace where to find it, so
+// they cost nothing until something attaches to them. They need
+// sys/sdt.h, which comes with systemtap-sdt-dev on Debian; without it,
+// or with SPROBE_DISABLE defined, they compile to nothing at all.
+// *********************************************************************
+
+#if !defined(SPROBE_DISABLE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SPROBE_ENABLED
+#endif
+#endif
+
+#ifdef SPROBE_ENABLED
+
+#define SPROBE0(provider, name) DTRACE_PROBE(provider, name)
+#define SPROBE1(provider, name, a) DTRACE_PROBE1(provider, name, a)
+#define SPROBE2(provider, name, a, b) DTRACE_PROBE2(provider, name, a, b)
+#define SPROBE3(provider, name, a, b, c) DTRACE_PROBE3(provider, name, a, b, c)
+
+#else
+
+// Arguments are still evaluated so variables that only exist for a probe don't trigger unused warnings
+#define SPROBE0(provider, name) do {} while (0)
+#define SPROBE1(provider, name, a) do { (void)(a); } while (0)
+#define SPROBE2(provider, name, a, b) do { (void)(a); (void)(b); } while (0)
+#define SPROBE3(provider, name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+
+#endif
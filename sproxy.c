@@ -0,0 +1,791 @@
+// For mempcpy, tdestroy
+#define _GNU_SOURCE
+
+// errno
+#include <errno.h>
+
+// bool
+#include <stdbool.h>
+
+// fprintf, snprintf, sprintf
+#include <stdio.h>
+
+// malloc, realloc, free
+#include <stdlib.h>
+
+// memchr, memcmp, memcpy, memmove, mempcpy, strlen
+#include <string.h>
+
+// strncasecmp
+#include <strings.h>
+
+// Linked list macros
+#include <sys/queue.h>
+
+// socket, connect, getsockopt, send
+#include <sys/socket.h>
+
+// tsearch, tfind, tdelete, tdestroy
+#include <search.h>
+
+// time
+#include <time.h>
+
+// read, close, getpid
+#include <unistd.h>
+
+// sproxy functions
+#include "sproxy.h"
+
+// *********************************************************************
+// Constants
+// *********************************************************************
+
+// First size of the buffer a response is read into, which doubles from there as needed
+#define FETCH_BUFFER_SIZE 16384
+
+// Most clients that can wait on one fetch before the list of them has to grow, to start with
+#define FETCH_WAITERS 4
+
+// Room for the port and a tab in front of the request in a cache key
+#define KEY_PREFIX_SIZE 8
+
+// Room for a port number in a rewritten menu line
+#define PORT_SIZE 5
+
+// *********************************************************************
+// Definitions
+// *********************************************************************
+
+// A cached response, keyed by the port the client came in on, since that's what its links point to, and the request
+struct sproxy_item_t
+{
+	char* key;
+	size_t keyLength;
+	
+	struct scache_entry_t* entry;
+	time_t expires;
+	
+	// Least recently used list, most recent first
+	TAILQ_ENTRY(sproxy_item_t) lru;
+};
+
+// A fetch from an upstream, and the clients waiting on it
+struct sproxy_fetch_t
+{
+	const struct sproxy_route_t* route;
+	unsigned short port;
+	
+	// Cache key, which is owned by the cache once the response is in it
+	char* key;
+	size_t keyLength;
+	
+	int socket;
+	
+	// What to send once connected, and whether that's happened yet
+	char* request;
+	size_t requestLength;
+	bool sent;
+	
+	// Response so far, and when the upstream last did anything
+	char* data;
+	size_t length;
+	size_t size;
+	time_t timestamp;
+	
+	void** waiters;
+	unsigned int numWaiters;
+	unsigned int maxWaiters;
+	
+	LIST_ENTRY(sproxy_fetch_t) entries;
+};
+
+TAILQ_HEAD(sproxy_lru_t, sproxy_item_t);
+LIST_HEAD(sproxy_fetches_t, sproxy_fetch_t);
+
+struct sproxy_t
+{
+	struct sepoll_t* loop;
+	
+	const struct sproxy_route_t* routes;
+	unsigned int numRoutes;
+	
+	const char* hostname;
+	size_t hostnameLength;
+	
+	// Cache limits and how much of it is in use, in bytes
+	size_t capacity;
+	size_t fileSize;
+	size_t used;
+	unsigned int ttl;
+	
+	// Cached responses, in a tree by key and in order of use
+	void* items;
+	struct sproxy_lru_t lru;
+	
+	// Fetches in progress
+	struct sproxy_fetches_t fetches;
+	
+	// Who to tell when a fetch is done
+	void (*function)(void*, struct scache_entry_t*, const char*, void*);
+	void* userdata;
+};
+
+// *********************************************************************
+// Cache
+// *********************************************************************
+static int compare_item(const void* a, const void* b)
+{
+	const struct sproxy_item_t* x = a;
+	const struct sproxy_item_t* y = b;
+	
+	if (x->keyLength != y->keyLength)
+	{
+		return x->keyLength < y->keyLength ? -1 : 1;
+	}
+	
+	return memcmp(x->key, y->key, x->keyLength);
+}
+
+static void free_nothing(void* item)
+{
+	// The items are freed from the LRU list instead
+}
+
+static void item_evict(struct sproxy_t* proxy, struct sproxy_item_t* item)
+{
+	tdelete(item, &proxy->items, compare_item);
+	TAILQ_REMOVE(&proxy->lru, item, lru);
+	
+	proxy->used -= item->entry->length;
+	
+	scache_release(item->entry);
+	free(item->key);
+	free(item);
+}
+
+static struct sproxy_item_t* item_find(struct sproxy_t* proxy, char* key, size_t keyLength)
+{
+	struct sproxy_item_t search =
+	{
+		.key = key,
+		.keyLength = keyLength
+	};
+	
+	struct sproxy_item_t** node = tfind(&search, &proxy->items, compare_item);
+	
+	return node != NULL ? *node : NULL;
+}
+
+// Keep a response, taking ownership of the key if it's kept
+static void item_store(struct sproxy_t* proxy, struct sproxy_fetch_t* fetch, struct scache_entry_t* entry)
+{
+	if (proxy->ttl == 0 || entry->length > proxy->capacity)
+	{
+		return;
+	}
+	
+	struct sproxy_item_t* item = malloc(sizeof(struct sproxy_item_t));
+	
+	if (item == NULL)
+	{
+		return;
+	}
+	
+	item->key = fetch->key;
+	item->keyLength = fetch->keyLength;
+	item->entry = entry;
+	item->expires = time(NULL) + proxy->ttl;
+	
+	// Make room
+	while (proxy->used + entry->length > proxy->capacity)
+	{
+		item_evict(proxy, TAILQ_LAST(&proxy->lru, sproxy_lru_t));
+	}
+	
+	struct sproxy_item_t** node = tsearch(item, &proxy->items, compare_item);
+	
+	if (node == NULL || *node != item)
+	{
+		// Out of memory, or somehow there's one already, which is as good as this one
+		free(item);
+		return;
+	}
+	
+	TAILQ_INSERT_HEAD(&proxy->lru, item, lru);
+	
+	proxy->used += entry->length;
+	
+	scache_retain(entry);
+	fetch->key = NULL;
+}
+
+// *********************************************************************
+// Rewrite the menu lines in a response that link to the upstream so
+// they link to us under the route's prefix instead. Anything with a
+// null byte in it is binary and left alone. A line is only touched if
+// its host and port are exactly the upstream's, which is unlikely to
+// happen by accident in a text file that isn't a menu.
+// *********************************************************************
+static char* rewrite(struct sproxy_t* proxy, struct sproxy_fetch_t* fetch, size_t* length)
+{
+	const struct sproxy_route_t* route = fetch->route;
+	
+	const char* data = fetch->data;
+	const char* end = data + fetch->length;
+	
+	if (fetch->length > 0 && memchr(data, '\0', fetch->length) != NULL)
+	{
+		*length = fetch->length;
+		return fetch->data;
+	}
+	
+	// Each line can grow by at most the prefix, a slash, and our hostname and port in place of the upstream's, and
+	// sprintf needs room for a null on the end
+	size_t lines = 1;
+	
+	for (const char* c = data; (c = memchr(c, '\n', (size_t)(end - c))) != NULL; c++)
+	{
+		lines++;
+	}
+	
+	char* output = malloc(fetch->length + lines * (route->prefixLength + 1 + proxy->hostnameLength + PORT_SIZE) + 1);
+	
+	if (output == NULL)
+	{
+		return NULL;
+	}
+	
+	char* out = output;
+	
+	while (data < end)
+	{
+		const char* newline = memchr(data, '\n', (size_t)(end - data));
+		const char* next = newline != NULL ? newline + 1 : end;
+		
+		// The fields end at the line ending, whichever kind it is
+		const char* stop = newline != NULL ? newline : end;
+		
+		if (stop > data && stop[-1] == '\r')
+		{
+			stop--;
+		}
+		
+		// Display string, selector, host and port, then maybe Gopher+ stuff
+		const char* tabs[3];
+		const char* c = data;
+		unsigned int numTabs = 0;
+		
+		while (numTabs < 3 && (c = memchr(c, '\t', (size_t)(stop - c))) != NULL)
+		{
+			tabs[numTabs++] = c++;
+		}
+		
+		bool rewritten = false;
+		
+		if (numTabs == 3)
+		{
+			const char* host = tabs[1] + 1;
+			size_t hostLength = (size_t)(tabs[2] - host);
+			
+			const char* port = tabs[2] + 1;
+			const char* portEnd = memchr(port, '\t', (size_t)(stop - port));
+			
+			if (portEnd == NULL)
+			{
+				portEnd = stop;
+			}
+			
+			// Ports are compared as numbers, so a leading zero or trailing space doesn't make a difference
+			unsigned long number = 0;
+			bool valid = portEnd > port;
+			
+			for (const char* p = port; p < portEnd && valid; p++)
+			{
+				if (*p >= '0' && *p <= '9' && number < 65536)
+				{
+					number = number * 10 + (unsigned long)(*p - '0');
+				}
+				else if (*p != ' ')
+				{
+					valid = false;
+				}
+			}
+			
+			if (valid && number == route->port && hostLength == strlen(route->host) && strncasecmp(host, route->host, hostLength) == 0)
+			{
+				const char* selector = tabs[0] + 1;
+				size_t selectorLength = (size_t)(tabs[1] - selector);
+				
+				out = mempcpy(out, data, (size_t)(selector - data));
+				out = mempcpy(out, route->prefix, route->prefixLength);
+				
+				// Selectors that don't start with a slash can't be told apart from the prefix going on, so they get one
+				if (selectorLength > 0 && selector[0] != '/')
+				{
+					*out++ = '/';
+				}
+				
+				out = mempcpy(out, selector, selectorLength);
+				*out++ = '\t';
+				out = mempcpy(out, proxy->hostname, proxy->hostnameLength);
+				out += sprintf(out, "\t%hu", fetch->port);
+				out = mempcpy(out, portEnd, (size_t)(next - portEnd));
+				
+				rewritten = true;
+			}
+		}
+		
+		if (!rewritten)
+		{
+			out = mempcpy(out, data, (size_t)(next - data));
+		}
+		
+		data = next;
+	}
+	
+	*length = (size_t)(out - output);
+	
+	return output;
+}
+
+// *********************************************************************
+// Fetches
+// *********************************************************************
+
+// Tell everybody waiting on a fetch how it went and get rid of it
+static void fetch_finish(struct sproxy_t* proxy, struct sproxy_fetch_t* fetch, struct scache_entry_t* entry, const char* error)
+{
+	// Out of the list first, so the waiters can't be cancelled out from under us
+	LIST_REMOVE(fetch, entries);
+	
+	sepoll_remove(proxy->loop, fetch->socket);
+	close(fetch->socket);
+	
+	for (unsigned int i = 0; i < fetch->numWaiters; i++)
+	{
+		proxy->function(fetch->waiters[i], entry != NULL ? scache_retain(entry) : NULL, error, proxy->userdata);
+	}
+	
+	free(fetch->waiters);
+	free(fetch->data);
+	free(fetch->request);
+	free(fetch->key);
+	free(fetch);
+}
+
+static void fetch_fail(struct sproxy_t* proxy, struct sproxy_fetch_t* fetch, const char* message)
+{
+	fprintf(stderr, "%i - Error: %s upstream %s:%hu for %.*s: %m\n", getpid(), message, fetch->route->host, fetch->route->port, (int)(fetch->requestLength - 2), fetch->request);
+	
+	fetch_finish(proxy, fetch, NULL, SPROXY_BAD_GATEWAY);
+}
+
+static void fetch_complete(struct sproxy_t* proxy, struct sproxy_fetch_t* fetch)
+{
+	size_t length;
+	
+	char* data = rewrite(proxy, fetch, &length);
+	
+	if (data == NULL)
+	{
+		fetch_fail(proxy, fetch, "Cannot rewrite response from");
+		return;
+	}
+	
+	// The entry takes the data one way or another
+	if (data == fetch->data)
+	{
+		fetch->data = NULL;
+	}
+	
+	struct scache_entry_t* entry = scache_wrap(data, length);
+	
+	if (entry == NULL)
+	{
+		fetch_fail(proxy, fetch, "Cannot keep response from");
+		return;
+	}
+	
+	item_store(proxy, fetch, entry);
+	fetch_finish(proxy, fetch, entry, NULL);
+	
+	scache_release(entry);
+}
+
+static void fetch_event(uint32_t events, union sepoll_arg_t userdata1, union sepoll_arg_t userdata2)
+{
+	struct sproxy_t* proxy = userdata1.ptr;
+	struct sproxy_fetch_t* fetch = userdata2.ptr;
+	
+	// The first thing to happen is the connection going through or failing
+	if (!fetch->sent)
+	{
+		int error = 0;
+		socklen_t length = sizeof(error);
+		
+		if (getsockopt(fetch->socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0)
+		{
+			if (error != 0)
+			{
+				errno = error;
+			}
+			
+			fetch_fail(proxy, fetch, "Cannot connect to");
+			return;
+		}
+		
+		// The request is a few hundred bytes at most and the socket buffer is empty, so it goes in one piece
+		if (send(fetch->socket, fetch->request, fetch->requestLength, MSG_NOSIGNAL) != (ssize_t)fetch->requestLength)
+		{
+			fetch_fail(proxy, fetch, "Cannot send request to");
+			return;
+		}
+		
+		fetch->sent = true;
+		fetch->timestamp = time(NULL);
+		
+		sepoll_mod_events(proxy->loop, fetch->socket, EPOLLIN | EPOLLRDHUP);
+		
+		return;
+	}
+	
+	while (1)
+	{
+		if (fetch->length > proxy->fileSize)
+		{
+			errno = EFBIG;
+			fetch_fail(proxy, fetch, "Response too big from");
+			return;
+		}
+		
+		// One byte more than the limit is enough to know it's been passed
+		if (fetch->length == fetch->size)
+		{
+			size_t size = fetch->size > 0 ? fetch->size * 2 : FETCH_BUFFER_SIZE;
+			
+			if (size > proxy->fileSize + 1)
+			{
+				size = proxy->fileSize + 1;
+			}
+			
+			char* data = realloc(fetch->data, size);
+			
+			if (data == NULL)
+			{
+				fetch_fail(proxy, fetch, "Cannot allocate memory for response from");
+				return;
+			}
+			
+			fetch->data = data;
+			fetch->size = size;
+		}
+		
+		ssize_t n = read(fetch->socket, fetch->data + fetch->length, fetch->size - fetch->length);
+		
+		if (n < 0)
+		{
+			if (errno == EAGAIN)
+			{
+				break;
+			}
+			else if (errno == EINTR)
+			{
+				continue;
+			}
+			
+			fetch_fail(proxy, fetch, "Cannot read response from");
+			return;
+		}
+		else if (n == 0)
+		{
+			fetch_complete(proxy, fetch);
+			return;
+		}
+		
+		fetch->length += (size_t)n;
+		fetch->timestamp = time(NULL);
+	}
+}
+
+static struct sproxy_fetch_t* fetch_start(struct sproxy_t* proxy, const struct sproxy_route_t* route, const char* request, size_t length, unsigned short port, char* key, size_t keyLength)
+{
+	struct sproxy_fetch_t* fetch = malloc(sizeof(struct sproxy_fetch_t));
+	
+	if (fetch == NULL)
+	{
+		return NULL;
+	}
+	
+	fetch->route = route;
+	fetch->port = port;
+	fetch->key = key;
+	fetch->keyLength = keyLength;
+	fetch->sent = false;
+	fetch->data = NULL;
+	fetch->length = 0;
+	fetch->size = 0;
+	fetch->timestamp = time(NULL);
+	fetch->numWaiters = 0;
+	fetch->maxWaiters = FETCH_WAITERS;
+	
+	// The upstream gets the request with the prefix cut off
+	fetch->requestLength = length - route->prefixLength + 2;
+	fetch->request = malloc(fetch->requestLength);
+	fetch->waiters = malloc(FETCH_WAITERS * sizeof(void*));
+	
+	if (fetch->request == NULL || fetch->waiters == NULL)
+	{
+		goto error;
+	}
+	
+	memcpy(fetch->request, request + route->prefixLength, length - route->prefixLength);
+	memcpy(fetch->request + length - route->prefixLength, "\r\n", 2);
+	
+	fetch->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	
+	if (fetch->socket < 0)
+	{
+		goto error;
+	}
+	
+	if (connect(fetch->socket, (const struct sockaddr*)&route->address, sizeof(route->address)) < 0 && errno != EINPROGRESS)
+	{
+		goto error_socket;
+	}
+	
+	// Writable once it's connected
+	if (sepoll_add(proxy->loop, fetch->socket, EPOLLOUT, fetch_event, proxy, fetch) < 0)
+	{
+		goto error_socket;
+	}
+	
+	LIST_INSERT_HEAD(&proxy->fetches, fetch, entries);
+	
+	return fetch;
+
+error_socket:
+	{
+		int error = errno;
+		close(fetch->socket);
+		errno = error;
+	}
+
+error:
+	free(fetch->request);
+	free(fetch->waiters);
+	free(fetch);
+	
+	return NULL;
+}
+
+// *********************************************************************
+// Requests
+// *********************************************************************
+const struct sproxy_route_t* sproxy_route(struct sproxy_t* proxy, const char* selector, size_t length)
+{
+	const struct sproxy_route_t* found = NULL;
+	
+	// The longest prefix wins, so one upstream can be mounted inside another
+	for (unsigned int i = 0; i < proxy->numRoutes; i++)
+	{
+		const struct sproxy_route_t* route = &proxy->routes[i];
+		
+		if (length >= route->prefixLength && memcmp(selector, route->prefix, route->prefixLength) == 0 && (length == route->prefixLength || selector[route->prefixLength] == '/'))
+		{
+			if (found == NULL || route->prefixLength > found->prefixLength)
+			{
+				found = route;
+			}
+		}
+	}
+	
+	return found;
+}
+
+enum sproxy_result_t sproxy_request(struct sproxy_t* proxy, const struct sproxy_route_t* route, const char* request, size_t length, unsigned short port, void* waiter, struct scache_entry_t** entry)
+{
+	char* key = malloc(KEY_PREFIX_SIZE + length);
+	
+	if (key == NULL)
+	{
+		return SPROXY_ERROR;
+	}
+	
+	size_t keyLength = (size_t)snprintf(key, KEY_PREFIX_SIZE, "%hu\t", port);
+	
+	memcpy(key + keyLength, request, length);
+	keyLength += length;
+	
+	// Fresh from the cache
+	struct sproxy_item_t* item = item_find(proxy, key, keyLength);
+	
+	if (item != NULL)
+	{
+		if (time(NULL) < item->expires)
+		{
+			TAILQ_REMOVE(&proxy->lru, item, lru);
+			TAILQ_INSERT_HEAD(&proxy->lru, item, lru);
+			
+			free(key);
+			*entry = scache_retain(item->entry);
+			return SPROXY_HIT;
+		}
+		
+		item_evict(proxy, item);
+	}
+	
+	// Already on its way
+	struct sproxy_fetch_t* fetch;
+	enum sproxy_result_t result = SPROXY_JOINED;
+	
+	LIST_FOREACH(fetch, &proxy->fetches, entries)
+	{
+		if (fetch->keyLength == keyLength && memcmp(fetch->key, key, keyLength) == 0)
+		{
+			break;
+		}
+	}
+	
+	if (fetch != NULL)
+	{
+		free(key);
+	}
+	else
+	{
+		fetch = fetch_start(proxy, route, request, length, port, key, keyLength);
+		
+		if (fetch == NULL)
+		{
+			int error = errno;
+			free(key);
+			errno = error;
+			return SPROXY_ERROR;
+		}
+		
+		result = SPROXY_FETCHING;
+	}
+	
+	if (fetch->numWaiters == fetch->maxWaiters)
+	{
+		void** waiters = realloc(fetch->waiters, fetch->maxWaiters * 2 * sizeof(void*));
+		
+		if (waiters == NULL)
+		{
+			return SPROXY_ERROR;
+		}
+		
+		fetch->waiters = waiters;
+		fetch->maxWaiters *= 2;
+	}
+	
+	fetch->waiters[fetch->numWaiters++] = waiter;
+	
+	return result;
+}
+
+void sproxy_cancel(struct sproxy_t* proxy, void* waiter)
+{
+	struct sproxy_fetch_t* fetch;
+	
+	LIST_FOREACH(fetch, &proxy->fetches, entries)
+	{
+		for (unsigned int i = 0; i < fetch->numWaiters; i++)
+		{
+			if (fetch->waiters[i] == waiter)
+			{
+				fetch->numWaiters--;
+				memmove(&fetch->waiters[i], &fetch->waiters[i + 1], (fetch->numWaiters - i) * sizeof(void*));
+				return;
+			}
+		}
+	}
+}
+
+void sproxy_expire(struct sproxy_t* proxy, time_t now, unsigned int timeout)
+{
+	struct sproxy_fetch_t* fetch = LIST_FIRST(&proxy->fetches);
+	
+	while (fetch != NULL)
+	{
+		struct sproxy_fetch_t* next = LIST_NEXT(fetch, entries);
+		
+		if (now - fetch->timestamp >= timeout)
+		{
+			fprintf(stderr, "%i - Error: Upstream %s:%hu timed out for %.*s\n", getpid(), fetch->route->host, fetch->route->port, (int)(fetch->requestLength - 2), fetch->request);
+			fetch_finish(proxy, fetch, NULL, SPROXY_GATEWAY_TIMEOUT);
+		}
+		
+		fetch = next;
+	}
+}
+
+// *********************************************************************
+// Lifecycle management
+// *********************************************************************
+struct sproxy_t* sproxy_create(struct sepoll_t* loop, const struct sproxy_route_t* routes, unsigned int numRoutes, size_t capacity, size_t fileSize, unsigned int ttl, const char* hostname, void (*function)(void*, struct scache_entry_t*, const char*, void*), void* userdata)
+{
+	struct sproxy_t* proxy = malloc(sizeof(struct sproxy_t));
+	
+	if (proxy == NULL)
+	{
+		return NULL;
+	}
+	
+	proxy->loop = loop;
+	proxy->routes = routes;
+	proxy->numRoutes = numRoutes;
+	proxy->hostname = hostname;
+	proxy->hostnameLength = strlen(hostname);
+	proxy->capacity = capacity;
+	proxy->fileSize = fileSize;
+	proxy->used = 0;
+	proxy->ttl = ttl;
+	proxy->items = NULL;
+	proxy->function = function;
+	proxy->userdata = userdata;
+	
+	TAILQ_INIT(&proxy->lru);
+	LIST_INIT(&proxy->fetches);
+	
+	return proxy;
+}
+
+void sproxy_destroy(struct sproxy_t* proxy)
+{
+	if (proxy == NULL)
+	{
+		return;
+	}
+	
+	// The event loop is already gone by the time this happens, and so are the waiters
+	struct sproxy_fetch_t* fetch;
+	
+	while ((fetch = LIST_FIRST(&proxy->fetches)) != NULL)
+	{
+		LIST_REMOVE(fetch, entries);
+		
+		close(fetch->socket);
+		
+		free(fetch->waiters);
+		free(fetch->data);
+		free(fetch->request);
+		free(fetch->key);
+		free(fetch);
+	}
+	
+	struct sproxy_item_t* item;
+	
+	while ((item = TAILQ_FIRST(&proxy->lru)) != NULL)
+	{
+		TAILQ_REMOVE(&proxy->lru, item, lru);
+		
+		scache_release(item->entry);
+		free(item->key);
+		free(item);
+	}
+	
+	tdestroy(proxy->items, free_nothing);
+	
+	free(proxy);
+}
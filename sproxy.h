@@ -0,0 +1,76 @@
+#pragma once
+
+// struct sockaddr_in
+#include <netinet/in.h>
+
+// size_t
+#include <stddef.h>
+
+// time_t
+#include <time.h>
+
+// struct scache_entry_t
+#include "scache.h"
+
+// struct sepoll_t
+#include "sepoll.h"
+
+// *********************************************************************
+// Reverse proxy
+//
+// Selectors under a prefix can be passed on to another Gopher server.
+// Responses are fetched over non-blocking sockets from the worker's own
+// event loop and kept in memory for a while, so however many clients
+// ask for a selector, the upstream only sees it once per TTL, and a
+// client asking for one that's already on its way waits for that fetch
+// rather than starting another. Menu lines that link back to the
+// upstream are rewritten to link to us under the prefix instead.
+// *********************************************************************
+
+// Errors a fetch can end in, in the form the server sends errors in
+#define SPROXY_BAD_GATEWAY "502 Bad Gateway"
+#define SPROXY_GATEWAY_TIMEOUT "504 Gateway Timeout"
+
+struct sproxy_route_t
+{
+	// Selectors starting with this, followed by a slash or nothing at all, go to the upstream with it cut off
+	const char* prefix;
+	size_t prefixLength;
+	
+	// The upstream's name and port as they appear in its own menus, and the address to connect to
+	const char* host;
+	unsigned short port;
+	struct sockaddr_in address;
+};
+
+// How a request was taken care of
+enum sproxy_result_t
+{
+	SPROXY_ERROR = -1,
+	SPROXY_HIT,
+	SPROXY_JOINED,
+	SPROXY_FETCHING
+};
+
+// Opaque structure for proxy state
+struct sproxy_t;
+
+// Lifecycle management - creation and destruction. The function is called for each waiter once its fetch is done,
+// with a new reference to the response, or NULL and one of the errors above. Responses are kept for ttl seconds, or
+// not at all if it's 0, in a cache of capacity bytes, and any bigger than fileSize bytes are refused. Links are
+// rewritten to go to hostname on whichever port the waiter's request came in on.
+struct sproxy_t* sproxy_create(struct sepoll_t* loop, const struct sproxy_route_t* routes, unsigned int numRoutes, size_t capacity, size_t fileSize, unsigned int ttl, const char* hostname, void (*function)(void*, struct scache_entry_t*, const char*, void*), void* userdata);
+void sproxy_destroy(struct sproxy_t* proxy);
+
+// Find the route for a selector, or NULL if it isn't proxied
+const struct sproxy_route_t* sproxy_route(struct sproxy_t* proxy, const char* selector, size_t length);
+
+// Pass on a request, which is the selector and any tab and query without the CRLF, from a client connected to port.
+// A response that's already cached is returned straight away in entry, otherwise the waiter is called back later.
+enum sproxy_result_t sproxy_request(struct sproxy_t* proxy, const struct sproxy_route_t* route, const char* request, size_t length, unsigned short port, void* waiter, struct scache_entry_t** entry);
+
+// Stop waiting on behalf of a waiter that's gone away. The fetch carries on for the benefit of the cache.
+void sproxy_cancel(struct sproxy_t* proxy, void* waiter);
+
+// Give up on any fetch the upstream hasn't done anything with for timeout seconds
+void sproxy_expire(struct sproxy_t* proxy, time_t now, unsigned int timeout);
@@ -0,0 +1,213 @@
+// bool
+#include <stdbool.h>
+
+// uint32_t
+#include <stdint.h>
+
+// memcpy, memset
+#include <string.h>
+
+// SSE2 intrinsics
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// srequest_t
+#include "srequest.h"
+
+// Bytes looked at in one go
+#define BLOCK_SIZE 16
+
+// *********************************************************************
+// Finding delimiters a block at a time
+//
+// Each block is matched against a character to get a bitmask with a bit
+// set for every byte that's that character, and the set bits are then
+// walked with ctz. A block running off the end of the buffer is copied
+// into a zeroed spare one first, so nothing past the end is ever read,
+// and since none of the delimiters are nulls the padding never matches.
+// *********************************************************************
+static inline const char* block_at(const char* p, size_t remaining, char* spare)
+{
+	if (remaining >= BLOCK_SIZE)
+	{
+		return p;
+	}
+	
+	memset(spare, 0, BLOCK_SIZE);
+	memcpy(spare, p, remaining);
+	
+	return spare;
+}
+
+#ifdef __SSE2__
+
+typedef __m128i block_t;
+
+static inline block_t block_load(const char* p)
+{
+	return _mm_loadu_si128((const __m128i*)p);
+}
+
+static inline uint32_t block_match(block_t block, char c)
+{
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+#else
+
+typedef const char* block_t;
+
+static inline block_t block_load(const char* p)
+{
+	return p;
+}
+
+static inline uint32_t block_match(block_t block, char c)
+{
+	uint32_t mask = 0;
+	
+	for (uint32_t i = 0; i < BLOCK_SIZE; i++)
+	{
+		mask |= (uint32_t)(block[i] == c) << i;
+	}
+	
+	return mask;
+}
+
+#endif
+
+// *********************************************************************
+// Splitting up a request
+// *********************************************************************
+int srequest_parse(const char* buffer, size_t count, struct srequest_t* request)
+{
+	char spare[BLOCK_SIZE];
+	
+	// Only the first tab counts, and only if it comes before the CRLF, so any after it are part of the query
+	const char* tab = NULL;
+	
+	for (size_t i = 0; i < count; i += BLOCK_SIZE)
+	{
+		block_t block = block_load(block_at(buffer + i, count - i, spare));
+		
+		uint32_t tabs = block_match(block, '\t');
+		uint32_t crs = block_match(block, '\r');
+		uint32_t lfs = block_match(block, '\n');
+		
+		if (tab == NULL && tabs != 0)
+		{
+			tab = buffer + i + (size_t)__builtin_ctz(tabs);
+		}
+		
+		// A CR on its own is just part of the selector or query, so it only counts with an LF right after it, which
+		// for the last byte of the block is the first byte of the next one
+		uint32_t crlfs = crs & (lfs >> 1);
+		
+		if (crs & (1U << (BLOCK_SIZE - 1)) && i + BLOCK_SIZE < count && buffer[i + BLOCK_SIZE] == '\n')
+		{
+			crlfs |= 1U << (BLOCK_SIZE - 1);
+		}
+		
+		if (crlfs == 0)
+		{
+			continue;
+		}
+		
+		size_t cr = i + (size_t)__builtin_ctz(crlfs);
+		
+		if (tab != NULL && tab < buffer + cr)
+		{
+			request->selectorSize = (size_t)(tab - buffer);
+			request->querySize = cr - request->selectorSize - 1;
+		}
+		else
+		{
+			request->selectorSize = cr;
+			request->querySize = 0;
+		}
+		
+		request->query = request->querySize > 0 ? tab + 1 : NULL;
+		request->length = cr;
+		
+		return 1;
+	}
+	
+	return 0;
+}
+
+// *********************************************************************
+// Making a selector into a path
+// *********************************************************************
+char* srequest_path(const char* selector, size_t length, char* path)
+{
+	char spare[BLOCK_SIZE];
+	
+	char* end = path;
+	
+	*end++ = '.';
+	
+	// Whether we're between parts of the path or in one, and where the one we're in started
+	bool between = true;
+	size_t from = 0;
+	
+	for (size_t i = 0; i < length; i += BLOCK_SIZE)
+	{
+		size_t size = length - i < BLOCK_SIZE ? length - i : BLOCK_SIZE;
+		
+		uint32_t slashes = block_match(block_load(block_at(selector + i, length - i, spare)), '/');
+		uint32_t others = ~slashes & ((1U << size) - 1);
+		
+		// Hop from the start of one part to the slash at the end of it and so on, with a part only copied once it's
+		// known where it ends, so a long one is copied in one go however many blocks it spans
+		while (1)
+		{
+			if (between)
+			{
+				if (others == 0)
+				{
+					break;
+				}
+				
+				size_t j = (size_t)__builtin_ctz(others);
+				
+				if (selector[i + j] == '.')
+				{
+					return NULL;
+				}
+				
+				*end++ = '/';
+				
+				between = false;
+				from = i + j;
+				slashes &= ~((1U << j) - 1);
+			}
+			else
+			{
+				if (slashes == 0)
+				{
+					break;
+				}
+				
+				size_t j = (size_t)__builtin_ctz(slashes);
+				
+				memcpy(end, selector + from, i + j - from);
+				
+				end += i + j - from;
+				between = true;
+				others &= ~((2U << j) - 1);
+			}
+		}
+	}
+	
+	if (!between)
+	{
+		memcpy(end, selector + from, length - from);
+		
+		end += length - from;
+	}
+	
+	*end = '\0';
+	
+	return end;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// size_t
+#include <stddef.h>
+
+// *********************************************************************
+// Request parsing
+//
+// A request is a selector, maybe a tab and a query, and a CRLF. Finding
+// the end of it and the tab is done in one pass over the buffer, 16
+// bytes at a time with SSE2 where it's available, and the selector is
+// then made into a path relative to the content directory in another,
+// which skips from slash to slash the same way. Nothing is copied until
+// the path is built, and the selector and query are left where they are
+// in the buffer.
+// *********************************************************************
+
+struct srequest_t
+{
+	// The selector is at the start of the buffer, and the query, if there's a tab with something after it, is after the
+	// tab, otherwise NULL
+	size_t selectorSize;
+	const char* query;
+	size_t querySize;
+	
+	// The whole request without the CRLF
+	size_t length;
+};
+
+// Look for a complete request in the first count bytes of buffer, returning 1 and filling in the request if there is
+// one, or 0 if the CRLF hasn't arrived yet
+int srequest_parse(const char* buffer, size_t count, struct srequest_t* request);
+
+// Make a selector into a null-terminated path starting with . and without any redundant or trailing slashes, for which
+// path needs room for length + 3 bytes. Returns a pointer to the null at the end of the path, or NULL if any part of
+// the selector starts with a period, which keeps requests from going up a directory or getting at hidden files.
+char* srequest_path(const char* selector, size_t length, char* path);
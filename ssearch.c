@@ -0,0 +1,1694 @@
+// For fdopendir, memmem
+#define _GNU_SOURCE
+
+// opendir, readdir, closedir
+#include <dirent.h>
+
+// errno
+#include <errno.h>
+
+// open
+#include <fcntl.h>
+
+// PATH_MAX
+#include <limits.h>
+
+// va_list, va_start, va_end
+#include <stdarg.h>
+
+// bool
+#include <stdbool.h>
+
+// fprintf, snprintf, vsnprintf, rename
+#include <stdio.h>
+
+// malloc, calloc, realloc, free, qsort
+#include <stdlib.h>
+
+// memcmp, memcpy, memmem, memmove, memset, strcmp, strdup, strlen, strncmp, strpbrk, strrchr
+#include <string.h>
+
+// inotify_init1, inotify_add_watch, inotify_rm_watch
+#include <sys/inotify.h>
+
+// mmap, munmap
+#include <sys/mman.h>
+
+// Linked list macros
+#include <sys/queue.h>
+
+// fstat, stat
+#include <sys/stat.h>
+
+// tsearch, tfind, tdelete, tdestroy
+#include <search.h>
+
+// clock_gettime, time
+#include <time.h>
+
+// pread, read, write, close, unlink
+#include <unistd.h>
+
+// sdircache_create, sdircache_destroy, sdircache_open, sdircache_stat
+#include "sdircache.h"
+
+// ssearch functions
+#include "ssearch.h"
+
+// stype_guess
+#include "stype.h"
+
+// *********************************************************************
+// Constants
+// *********************************************************************
+
+// Most of a text file that's indexed and checked, in bytes
+#define SEARCH_FILE_MAX (1024 * 1024)
+
+// Chunks text files are read in while indexing
+#define SEARCH_CHUNK_SIZE 65536
+
+// Things have to have stayed the same for this long before a snapshot is written, in milliseconds
+#define SEARCH_SETTLE 1000
+
+// Most results listed for one query, and most bytes of files read to check them, which keeps a query to a few
+// milliseconds of the worker's time with the files in the page cache
+#define SEARCH_RESULTS_MAX 100
+#define SEARCH_CHECK_MAX (4 * 1024 * 1024)
+
+// Most words in a query, with any past this ignored
+#define SEARCH_WORDS_MAX 8
+
+// Directories the builder keeps open to find things from
+#define SEARCH_DIRCACHE_SIZE 64
+
+// Trigrams are three bytes, so there are this many of them, and a bitmap of them takes this many 64-bit words
+#define TRIGRAMS (1 << 24)
+#define TRIGRAM_WORDS (TRIGRAMS / 64)
+
+// Events that mean something in a directory needs another look
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR)
+
+// *********************************************************************
+// Snapshot format
+//
+// The header, then a record for each file, then the trigrams in order
+// with where their postings start and one more for where the last one's
+// end, then the postings, which are file numbers in order, then the
+// paths. Everything is in the native byte order since it's only ever
+// read by the same machine that wrote it.
+// *********************************************************************
+
+#define SNAPSHOT_MAGIC "sgsearch"
+
+struct ssearch_header_t
+{
+	char magic[8];
+	uint32_t numFiles;
+	uint32_t numTrigrams;
+	uint64_t numPostings;
+	uint64_t pathsLength;
+};
+
+struct ssearch_file_t
+{
+	// Offset of the path in the paths, which starts with ./ and doesn't end with anything, and where its name starts
+	uint32_t path;
+	uint16_t length;
+	uint16_t name;
+	
+	char type;
+	bool text;
+};
+
+struct ssearch_trigram_t
+{
+	uint32_t trigram;
+	uint32_t start;
+};
+
+// *********************************************************************
+// Builder definitions
+// *********************************************************************
+
+// Everything that's been indexed, with the trigrams of its name and contents in order
+struct ssearch_entry_t
+{
+	char* path;
+	
+	struct timespec mtime;
+	off_t size;
+	char type;
+	bool text;
+	
+	uint32_t* trigrams;
+	uint32_t numTrigrams;
+	
+	// Number in the snapshot being written
+	uint32_t id;
+	
+	TAILQ_ENTRY(ssearch_entry_t) list;
+};
+
+// Something that needs a look, whether it's new, changed or gone
+struct ssearch_job_t
+{
+	TAILQ_ENTRY(ssearch_job_t) queue;
+	char path[];
+};
+
+TAILQ_HEAD(ssearch_entry_list_t, ssearch_entry_t);
+TAILQ_HEAD(ssearch_job_queue_t, ssearch_job_t);
+
+struct ssearch_builder_t
+{
+	int root;
+	int inotify;
+	
+	// Everything is looked at through this, so symlinks out of the root are left out the same as the server does
+	struct sdircache_t* dirs;
+	const char* file;
+	
+	// Entries, in a tree by path and in a list to go through them in order
+	void* tree;
+	struct ssearch_entry_list_t entries;
+	unsigned int numEntries;
+	
+	// Path of each watched directory, by watch descriptor
+	char** watches;
+	unsigned int numWatches;
+	
+	struct ssearch_job_queue_t jobs;
+	
+	// Whether the index has changed since the last snapshot, and when it last did on the monotonic clock
+	bool dirty;
+	uint64_t changed;
+	
+	// Bitmap of trigrams, which is kept clear between uses, and the ones that have been set in it
+	uint64_t* bitmap;
+	uint32_t* touched;
+	uint32_t numTouched;
+	uint32_t maxTouched;
+	
+	char buffer[SEARCH_CHUNK_SIZE];
+};
+
+// *********************************************************************
+// Helpers
+// *********************************************************************
+
+static inline uint64_t monotonic_time()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Only ASCII is folded, since anything else could be half of a multibyte character
+static inline unsigned char fold(unsigned char c)
+{
+	return c >= 'A' && c <= 'Z' ? (unsigned char)(c - 'A' + 'a') : c;
+}
+
+static void fold_all(char* data, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		data[i] = (char)fold((unsigned char)data[i]);
+	}
+}
+
+// Words never have whitespace in them, so trigrams with any can't be searched for
+static inline bool blank(unsigned char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline uint32_t trigram(const unsigned char* data)
+{
+	return (uint32_t)fold(data[0]) << 16 | (uint32_t)fold(data[1]) << 8 | (uint32_t)fold(data[2]);
+}
+
+static int compare_uint32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	
+	return x < y ? -1 : x > y;
+}
+
+static int compare_entry_path(const void* a, const void* b)
+{
+	return strcmp(((const struct ssearch_entry_t*)a)->path, ((const struct ssearch_entry_t*)b)->path);
+}
+
+// The part of a path after the last slash
+static inline const char* path_name(const char* path)
+{
+	return strrchr(path, '/') + 1;
+}
+
+// Whether a path is the directory or inside it
+static inline bool path_under(const char* path, const char* directory, size_t length)
+{
+	return strncmp(path, directory, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+// *********************************************************************
+// Collecting trigrams
+// *********************************************************************
+
+static int add_trigrams(struct ssearch_builder_t* builder, const unsigned char* data, size_t length)
+{
+	for (size_t i = 0; i + 2 < length; i++)
+	{
+		if (blank(data[i]) || blank(data[i + 1]) || blank(data[i + 2]))
+		{
+			continue;
+		}
+		
+		uint32_t t = trigram(data + i);
+		uint64_t bit = (uint64_t)1 << (t % 64);
+		
+		if (builder->bitmap[t / 64] & bit)
+		{
+			continue;
+		}
+		
+		if (builder->numTouched == builder->maxTouched)
+		{
+			uint32_t size = builder->maxTouched > 0 ? builder->maxTouched * 2 : 4096;
+			uint32_t* resized = realloc(builder->touched, size * sizeof(uint32_t));
+			
+			if (resized == NULL)
+			{
+				return -1;
+			}
+			
+			builder->touched = resized;
+			builder->maxTouched = size;
+		}
+		
+		builder->bitmap[t / 64] |= bit;
+		builder->touched[builder->numTouched++] = t;
+	}
+	
+	return 0;
+}
+
+// Take the trigrams collected so far, sorted, leaving the bitmap clear again
+static uint32_t* take_trigrams(struct ssearch_builder_t* builder, uint32_t* count)
+{
+	for (uint32_t i = 0; i < builder->numTouched; i++)
+	{
+		builder->bitmap[builder->touched[i] / 64] = 0;
+	}
+	
+	*count = builder->numTouched;
+	builder->numTouched = 0;
+	
+	// malloc(0) is allowed to return NULL so always ask for at least one
+	uint32_t* trigrams = malloc((*count > 0 ? *count : 1) * sizeof(uint32_t));
+	
+	if (trigrams == NULL)
+	{
+		return NULL;
+	}
+	
+	memcpy(trigrams, builder->touched, *count * sizeof(uint32_t));
+	qsort(trigrams, *count, sizeof(uint32_t), compare_uint32);
+	
+	return trigrams;
+}
+
+// The start of a text file, read a chunk at a time, with the last two bytes of each chunk carried over to the next so
+// no trigram is missed
+static int add_contents(struct ssearch_builder_t* builder, const char* path)
+{
+	int file = sdircache_open(builder->dirs, path, O_RDONLY | O_CLOEXEC);
+	
+	if (file < 0)
+	{
+		return -1;
+	}
+	
+	unsigned char* buffer = (unsigned char*)builder->buffer;
+	size_t carried = 0;
+	off_t offset = 0;
+	
+	while (offset < SEARCH_FILE_MAX)
+	{
+		ssize_t n = pread(file, buffer + carried, SEARCH_CHUNK_SIZE - carried, offset);
+		
+		if (n <= 0)
+		{
+			break;
+		}
+		
+		offset += n;
+		
+		size_t length = carried + (size_t)n;
+		
+		if (add_trigrams(builder, buffer, length) < 0)
+		{
+			close(file);
+			return -1;
+		}
+		
+		carried = length < 2 ? length : 2;
+		memmove(buffer, buffer + length - carried, carried);
+	}
+	
+	close(file);
+	
+	return 0;
+}
+
+// *********************************************************************
+// Keeping the index up to date
+// *********************************************************************
+
+static void changed(struct ssearch_builder_t* builder)
+{
+	builder->dirty = true;
+	builder->changed = monotonic_time();
+}
+
+static int queue_job(struct ssearch_builder_t* builder, const char* path)
+{
+	size_t length = strlen(path) + 1;
+	
+	struct ssearch_job_t* job = malloc(sizeof(struct ssearch_job_t) + length);
+	
+	if (job == NULL)
+	{
+		return -1;
+	}
+	
+	memcpy(job->path, path, length);
+	
+	TAILQ_INSERT_TAIL(&builder->jobs, job, queue);
+	
+	return 0;
+}
+
+static void free_entry(struct ssearch_entry_t* entry)
+{
+	free(entry->trigrams);
+	free(entry->path);
+	free(entry);
+}
+
+static void free_node(void* entry)
+{
+	free_entry(entry);
+}
+
+static void remove_entry(struct ssearch_builder_t* builder, struct ssearch_entry_t* entry)
+{
+	tdelete(entry, &builder->tree, compare_entry_path);
+	TAILQ_REMOVE(&builder->entries, entry, list);
+	builder->numEntries--;
+	
+	free_entry(entry);
+}
+
+static struct ssearch_entry_t* find_entry(struct ssearch_builder_t* builder, const char* path)
+{
+	const struct ssearch_entry_t key =
+	{
+		.path = (char*)path
+	};
+	
+	struct ssearch_entry_t** node = tfind(&key, &builder->tree, compare_entry_path);
+	
+	return node != NULL ? *node : NULL;
+}
+
+// Something that's gone or can't be listed anymore, along with everything under it if it was a directory
+static void forget(struct ssearch_builder_t* builder, const char* path)
+{
+	size_t length = strlen(path);
+	
+	struct ssearch_entry_t* entry = find_entry(builder, path);
+	
+	if (entry == NULL)
+	{
+		return;
+	}
+	
+	bool directory = entry->type == '1';
+	
+	remove_entry(builder, entry);
+	changed(builder);
+	
+	if (!directory)
+	{
+		return;
+	}
+	
+	struct ssearch_entry_t* next;
+	
+	for (entry = TAILQ_FIRST(&builder->entries); entry != NULL; entry = next)
+	{
+		next = TAILQ_NEXT(entry, list);
+		
+		if (path_under(entry->path, path, length))
+		{
+			remove_entry(builder, entry);
+		}
+	}
+	
+	// If it was moved somewhere else the watches would still be there under the old names
+	for (unsigned int i = 0; i < builder->numWatches; i++)
+	{
+		if (builder->watches[i] != NULL && path_under(builder->watches[i], path, length))
+		{
+			inotify_rm_watch(builder->inotify, (int)i);
+			free(builder->watches[i]);
+			builder->watches[i] = NULL;
+		}
+	}
+}
+
+// Put something in the index, or update it if it's changed since it went in
+static int index_path(struct ssearch_builder_t* builder, const char* path, char type, const struct stat* statbuf)
+{
+	struct ssearch_entry_t* entry = find_entry(builder, path);
+	
+	if (entry != NULL && entry->type == type && entry->size == statbuf->st_size && entry->mtime.tv_sec == statbuf->st_mtim.tv_sec && entry->mtime.tv_nsec == statbuf->st_mtim.tv_nsec)
+	{
+		return 0;
+	}
+	
+	const char* name = path_name(path);
+	
+	bool text = type == '0';
+	
+	if (add_trigrams(builder, (const unsigned char*)name, strlen(name)) < 0 || (text && add_contents(builder, path) < 0))
+	{
+		// Leave the bitmap clear for next time
+		uint32_t count;
+		free(take_trigrams(builder, &count));
+		return -1;
+	}
+	
+	uint32_t count;
+	uint32_t* trigrams = take_trigrams(builder, &count);
+	
+	if (trigrams == NULL)
+	{
+		return -1;
+	}
+	
+	if (entry == NULL)
+	{
+		entry = malloc(sizeof(struct ssearch_entry_t));
+		
+		if (entry == NULL)
+		{
+			free(trigrams);
+			return -1;
+		}
+		
+		entry->path = strdup(path);
+		entry->trigrams = NULL;
+		
+		if (entry->path == NULL || tsearch(entry, &builder->tree, compare_entry_path) == NULL)
+		{
+			free(trigrams);
+			free_entry(entry);
+			return -1;
+		}
+		
+		TAILQ_INSERT_TAIL(&builder->entries, entry, list);
+		builder->numEntries++;
+	}
+	
+	free(entry->trigrams);
+	
+	entry->mtime = statbuf->st_mtim;
+	entry->size = statbuf->st_size;
+	entry->type = type;
+	entry->text = text;
+	entry->trigrams = trigrams;
+	entry->numTrigrams = count;
+	
+	changed(builder);
+	
+	return 0;
+}
+
+// Watch a directory and queue up everything in it
+static int scan(struct ssearch_builder_t* builder, const char* path)
+{
+	int dirfd = sdircache_open(builder->dirs, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	
+	if (dirfd < 0)
+	{
+		return -1;
+	}
+	
+	// inotify only takes paths, but the directory's file descriptor has one that's always right
+	char proc[64];
+	
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%i", dirfd);
+	
+	int wd = inotify_add_watch(builder->inotify, proc, WATCH_EVENTS);
+	
+	if (wd < 0)
+	{
+		close(dirfd);
+		return -1;
+	}
+	
+	if ((unsigned int)wd >= builder->numWatches)
+	{
+		unsigned int size = builder->numWatches > 0 ? builder->numWatches : 256;
+		
+		while (size <= (unsigned int)wd)
+		{
+			size *= 2;
+		}
+		
+		char** resized = realloc(builder->watches, size * sizeof(char*));
+		
+		if (resized == NULL)
+		{
+			close(dirfd);
+			return -1;
+		}
+		
+		memset(resized + builder->numWatches, 0, (size - builder->numWatches) * sizeof(char*));
+		
+		builder->watches = resized;
+		builder->numWatches = size;
+	}
+	
+	if (builder->watches[wd] == NULL)
+	{
+		builder->watches[wd] = strdup(path);
+		
+		if (builder->watches[wd] == NULL)
+		{
+			close(dirfd);
+			return -1;
+		}
+	}
+	else if (strcmp(builder->watches[wd], path) != 0)
+	{
+		// The same directory is already in the index by another name through a symlink, which could even be a loop
+		close(dirfd);
+		return 0;
+	}
+	
+	DIR* dir = fdopendir(dirfd);
+	
+	if (dir == NULL)
+	{
+		close(dirfd);
+		return -1;
+	}
+	
+	size_t length = strlen(path);
+	
+	struct dirent* dirent;
+	
+	while ((dirent = readdir(dir)) != NULL)
+	{
+		const char* name = dirent->d_name;
+		
+		// Hidden files are never served, and names that would break a menu line can't be listed
+		if (name[0] == '.' || strpbrk(name, "\t\r\n") != NULL || length + 1 + strlen(name) >= PATH_MAX)
+		{
+			continue;
+		}
+		
+		char child[PATH_MAX];
+		
+		snprintf(child, sizeof(child), "%s/%s", path, name);
+		
+		if (queue_job(builder, child) < 0)
+		{
+			closedir(dir);
+			return -1;
+		}
+	}
+	
+	closedir(dir);
+	
+	return 0;
+}
+
+// Take a look at something, under the same rules as a directory listing, and index it or forget it
+static int check(struct ssearch_builder_t* builder, const char* path)
+{
+	struct stat statbuf;
+	
+	// The root is always there, whatever its permissions
+	if (strcmp(path, ".") == 0)
+	{
+		return scan(builder, path);
+	}
+	
+	char type = 0;
+	
+	if (sdircache_stat(builder->dirs, path, &statbuf) == 0)
+	{
+		type = stype_guess(path_name(path), statbuf.st_mode);
+	}
+	
+	if (type == 0)
+	{
+		forget(builder, path);
+		return 0;
+	}
+	
+	if (index_path(builder, path, type, &statbuf) < 0)
+	{
+		return -1;
+	}
+	
+	if (type == '1')
+	{
+		return scan(builder, path);
+	}
+	
+	return 0;
+}
+
+// Throw everything away and start over, for when inotify lost track
+static void reset(struct ssearch_builder_t* builder)
+{
+	struct ssearch_entry_t* entry;
+	
+	while ((entry = TAILQ_FIRST(&builder->entries)) != NULL)
+	{
+		remove_entry(builder, entry);
+	}
+	
+	for (unsigned int i = 0; i < builder->numWatches; i++)
+	{
+		if (builder->watches[i] != NULL)
+		{
+			inotify_rm_watch(builder->inotify, (int)i);
+			free(builder->watches[i]);
+			builder->watches[i] = NULL;
+		}
+	}
+	
+	struct ssearch_job_t* job;
+	
+	while ((job = TAILQ_FIRST(&builder->jobs)) != NULL)
+	{
+		TAILQ_REMOVE(&builder->jobs, job, queue);
+		free(job);
+	}
+	
+	queue_job(builder, ".");
+	changed(builder);
+}
+
+// *********************************************************************
+// Writing snapshots
+// *********************************************************************
+
+struct ssearch_writer_t
+{
+	int fd;
+	bool failed;
+	size_t used;
+	char buffer[SEARCH_CHUNK_SIZE];
+};
+
+static void writer_flush(struct ssearch_writer_t* writer)
+{
+	const char* data = writer->buffer;
+	
+	while (writer->used > 0 && !writer->failed)
+	{
+		ssize_t n = write(writer->fd, data, writer->used);
+		
+		if (n < 0)
+		{
+			if (errno != EINTR)
+			{
+				writer->failed = true;
+			}
+			
+			continue;
+		}
+		
+		data += n;
+		writer->used -= (size_t)n;
+	}
+	
+	writer->used = 0;
+}
+
+static void writer_put(struct ssearch_writer_t* writer, const void* data, size_t length)
+{
+	while (length > 0)
+	{
+		size_t n = sizeof(writer->buffer) - writer->used;
+		
+		if (n > length)
+		{
+			n = length;
+		}
+		
+		memcpy(writer->buffer + writer->used, data, n);
+		writer->used += n;
+		data = (const char*)data + n;
+		length -= n;
+		
+		if (writer->used == sizeof(writer->buffer))
+		{
+			writer_flush(writer);
+		}
+	}
+}
+
+// The postings for each trigram are laid out in order of trigram, and the numbers for them are their ranks among
+// the trigrams in use, which a bitmap of them and the running count of set bits up to each word of it give directly
+static int write_snapshot(struct ssearch_builder_t* builder)
+{
+	uint32_t* ranks = malloc((TRIGRAM_WORDS + 1) * sizeof(uint32_t));
+	
+	if (ranks == NULL)
+	{
+		return -1;
+	}
+	
+	uint64_t numPostings = 0;
+	uint64_t pathsLength = 0;
+	uint32_t id = 0;
+	
+	struct ssearch_entry_t* entry;
+	
+	TAILQ_FOREACH(entry, &builder->entries, list)
+	{
+		entry->id = id++;
+		numPostings += entry->numTrigrams;
+		pathsLength += strlen(entry->path);
+		
+		for (uint32_t i = 0; i < entry->numTrigrams; i++)
+		{
+			builder->bitmap[entry->trigrams[i] / 64] |= (uint64_t)1 << (entry->trigrams[i] % 64);
+		}
+	}
+	
+	uint32_t numTrigrams = 0;
+	
+	for (uint32_t i = 0; i < TRIGRAM_WORDS; i++)
+	{
+		ranks[i] = numTrigrams;
+		numTrigrams += (uint32_t)__builtin_popcountll(builder->bitmap[i]);
+	}
+	
+	ranks[TRIGRAM_WORDS] = numTrigrams;
+	
+	struct ssearch_trigram_t* trigrams = calloc((size_t)numTrigrams + 1, sizeof(struct ssearch_trigram_t));
+	uint32_t* postings = malloc((numPostings > 0 ? numPostings : 1) * sizeof(uint32_t));
+	
+	if (trigrams == NULL || postings == NULL || numPostings > UINT32_MAX || pathsLength > UINT32_MAX)
+	{
+		memset(builder->bitmap, 0, TRIGRAM_WORDS * sizeof(uint64_t));
+		free(ranks);
+		free(trigrams);
+		free(postings);
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	// Count the postings for each trigram, then turn the counts into where each one's postings start
+	TAILQ_FOREACH(entry, &builder->entries, list)
+	{
+		for (uint32_t i = 0; i < entry->numTrigrams; i++)
+		{
+			uint32_t t = entry->trigrams[i];
+			uint32_t rank = ranks[t / 64] + (uint32_t)__builtin_popcountll(builder->bitmap[t / 64] & (((uint64_t)1 << (t % 64)) - 1));
+			
+			trigrams[rank].start++;
+		}
+	}
+	
+	uint32_t start = 0;
+	uint32_t rank = 0;
+	
+	for (uint32_t i = 0; i < TRIGRAM_WORDS; i++)
+	{
+		uint64_t word = builder->bitmap[i];
+		
+		while (word != 0)
+		{
+			uint32_t bit = (uint32_t)__builtin_ctzll(word);
+			uint32_t count = trigrams[rank].start;
+			
+			trigrams[rank].trigram = i * 64 + bit;
+			trigrams[rank].start = start;
+			
+			start += count;
+			rank++;
+			word &= word - 1;
+		}
+	}
+	
+	trigrams[numTrigrams].trigram = TRIGRAMS;
+	trigrams[numTrigrams].start = start;
+	
+	// Going through the entries in order leaves each trigram's postings in order too
+	TAILQ_FOREACH(entry, &builder->entries, list)
+	{
+		for (uint32_t i = 0; i < entry->numTrigrams; i++)
+		{
+			uint32_t t = entry->trigrams[i];
+			uint32_t r = ranks[t / 64] + (uint32_t)__builtin_popcountll(builder->bitmap[t / 64] & (((uint64_t)1 << (t % 64)) - 1));
+			
+			postings[trigrams[r].start++] = entry->id;
+		}
+	}
+	
+	// Filling them in moved each start up to where the next one starts, so put them back
+	for (uint32_t i = numTrigrams; i > 0; i--)
+	{
+		trigrams[i].start = trigrams[i - 1].start;
+	}
+	
+	trigrams[0].start = 0;
+	
+	memset(builder->bitmap, 0, TRIGRAM_WORDS * sizeof(uint64_t));
+	free(ranks);
+	
+	// Written next to where it's going and renamed into place, so the workers only ever see a complete one
+	char temporary[PATH_MAX];
+	
+	if (snprintf(temporary, sizeof(temporary), "%s.tmp", builder->file) >= (int)sizeof(temporary))
+	{
+		free(trigrams);
+		free(postings);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	
+	struct ssearch_writer_t* writer = malloc(sizeof(struct ssearch_writer_t));
+	
+	if (writer == NULL)
+	{
+		free(trigrams);
+		free(postings);
+		return -1;
+	}
+	
+	writer->fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	writer->failed = writer->fd < 0;
+	writer->used = 0;
+	
+	struct ssearch_header_t header =
+	{
+		.numFiles = builder->numEntries,
+		.numTrigrams = numTrigrams,
+		.numPostings = numPostings,
+		.pathsLength = pathsLength
+	};
+	
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	
+	writer_put(writer, &header, sizeof(header));
+	
+	uint32_t offset = 0;
+	
+	TAILQ_FOREACH(entry, &builder->entries, list)
+	{
+		size_t length = strlen(entry->path);
+		
+		struct ssearch_file_t file =
+		{
+			.path = offset,
+			.length = (uint16_t)length,
+			.name = (uint16_t)(path_name(entry->path) - entry->path),
+			.type = entry->type,
+			.text = entry->text
+		};
+		
+		writer_put(writer, &file, sizeof(file));
+		
+		offset += (uint32_t)length;
+	}
+	
+	writer_put(writer, trigrams, ((size_t)numTrigrams + 1) * sizeof(struct ssearch_trigram_t));
+	writer_put(writer, postings, numPostings * sizeof(uint32_t));
+	
+	TAILQ_FOREACH(entry, &builder->entries, list)
+	{
+		writer_put(writer, entry->path, strlen(entry->path));
+	}
+	
+	writer_flush(writer);
+	
+	free(trigrams);
+	free(postings);
+	
+	int error = errno;
+	bool failed = writer->failed;
+	
+	if (writer->fd >= 0 && close(writer->fd) < 0)
+	{
+		error = errno;
+		failed = true;
+	}
+	
+	free(writer);
+	
+	if (failed || rename(temporary, builder->file) < 0)
+	{
+		if (!failed)
+		{
+			error = errno;
+		}
+		
+		unlink(temporary);
+		errno = error;
+		return -1;
+	}
+	
+	return 0;
+}
+
+// *********************************************************************
+// Builder interface
+// *********************************************************************
+
+struct ssearch_builder_t* ssearch_builder_create(const char* directory, const char* file, bool outside)
+{
+	struct ssearch_builder_t* builder = malloc(sizeof(struct ssearch_builder_t));
+	
+	if (builder == NULL)
+	{
+		return NULL;
+	}
+	
+	builder->file = file;
+	builder->tree = NULL;
+	builder->numEntries = 0;
+	builder->watches = NULL;
+	builder->numWatches = 0;
+	builder->dirty = false;
+	builder->changed = 0;
+	builder->touched = NULL;
+	builder->numTouched = 0;
+	builder->maxTouched = 0;
+	
+	TAILQ_INIT(&builder->entries);
+	TAILQ_INIT(&builder->jobs);
+	
+	builder->bitmap = calloc(TRIGRAM_WORDS, sizeof(uint64_t));
+	builder->root = open(directory, O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_PATH);
+	builder->dirs = builder->root >= 0 ? sdircache_create(builder->root, SEARCH_DIRCACHE_SIZE, outside) : NULL;
+	builder->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	
+	if (builder->bitmap == NULL || builder->dirs == NULL || builder->inotify < 0 || queue_job(builder, ".") < 0)
+	{
+		int error = errno;
+		ssearch_builder_destroy(builder);
+		errno = error;
+		return NULL;
+	}
+	
+	// Even an empty tree gets a snapshot
+	builder->dirty = true;
+	
+	return builder;
+}
+
+void ssearch_builder_destroy(struct ssearch_builder_t* builder)
+{
+	if (builder == NULL)
+	{
+		return;
+	}
+	
+	tdestroy(builder->tree, free_node);
+	
+	struct ssearch_job_t* job;
+	
+	while ((job = TAILQ_FIRST(&builder->jobs)) != NULL)
+	{
+		TAILQ_REMOVE(&builder->jobs, job, queue);
+		free(job);
+	}
+	
+	for (unsigned int i = 0; i < builder->numWatches; i++)
+	{
+		free(builder->watches[i]);
+	}
+	
+	free(builder->watches);
+	free(builder->bitmap);
+	free(builder->touched);
+	
+	sdircache_destroy(builder->dirs);
+	
+	if (builder->root >= 0)
+	{
+		close(builder->root);
+	}
+	
+	if (builder->inotify >= 0)
+	{
+		close(builder->inotify);
+	}
+	
+	free(builder);
+}
+
+int ssearch_builder_fd(struct ssearch_builder_t* builder)
+{
+	return builder->inotify;
+}
+
+void ssearch_builder_notify(struct ssearch_builder_t* builder)
+{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	
+	while (1)
+	{
+		ssize_t n = read(builder->inotify, buffer, sizeof(buffer));
+		
+		if (n <= 0)
+		{
+			break;
+		}
+		
+		for (char* position = buffer; position < buffer + n; position += sizeof(struct inotify_event) + ((struct inotify_event*)position)->len)
+		{
+			const struct inotify_event* event = (const struct inotify_event*)position;
+			
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				reset(builder);
+				return;
+			}
+			
+			if (event->wd < 0 || (unsigned int)event->wd >= builder->numWatches || builder->watches[event->wd] == NULL)
+			{
+				continue;
+			}
+			
+			// The directory itself is gone, and its parent will have said so too
+			if (event->mask & IN_IGNORED)
+			{
+				free(builder->watches[event->wd]);
+				builder->watches[event->wd] = NULL;
+				continue;
+			}
+			
+			if (event->len == 0 || event->name[0] == '.')
+			{
+				continue;
+			}
+			
+			char path[PATH_MAX];
+			
+			if (snprintf(path, sizeof(path), "%s/%s", builder->watches[event->wd], event->name) < (int)sizeof(path))
+			{
+				queue_job(builder, path);
+			}
+		}
+	}
+}
+
+int ssearch_builder_work(struct ssearch_builder_t* builder, uint64_t budget)
+{
+	uint64_t start = monotonic_time();
+	
+	struct ssearch_job_t* job;
+	
+	while ((job = TAILQ_FIRST(&builder->jobs)) != NULL)
+	{
+		TAILQ_REMOVE(&builder->jobs, job, queue);
+		
+		if (check(builder, job->path) < 0 && errno != ENOENT)
+		{
+			fprintf(stderr, "S - Error: Cannot index %s: %m\n", job->path);
+		}
+		
+		free(job);
+		
+		if (monotonic_time() - start >= budget)
+		{
+			// Let everything else have a turn before carrying on
+			return 1;
+		}
+	}
+	
+	if (!builder->dirty)
+	{
+		return -1;
+	}
+	
+	uint64_t now = monotonic_time();
+	uint64_t settled = builder->changed + (uint64_t)SEARCH_SETTLE * 1000000;
+	
+	if (now < settled)
+	{
+		return (int)((settled - now) / 1000000) + 1;
+	}
+	
+	if (write_snapshot(builder) < 0)
+	{
+		fprintf(stderr, "S - Error: Cannot write search index to %s: %m\n", builder->file);
+		
+		// Try again later rather than straight away
+		builder->changed = now;
+		return SEARCH_SETTLE;
+	}
+	
+	fprintf(stderr, "S - Search index has %u files\n", builder->numEntries);
+	
+	builder->dirty = false;
+	
+	return -1;
+}
+
+// *********************************************************************
+// Searching
+// *********************************************************************
+
+struct ssearch_t
+{
+	const char* file;
+	
+	// The snapshot in use, or NULL if there isn't one yet, and which one it is
+	char* map;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	
+	const struct ssearch_header_t* header;
+	const struct ssearch_file_t* files;
+	const struct ssearch_trigram_t* trigrams;
+	const uint32_t* postings;
+	const char* paths;
+	
+	// When the file was last checked for a newer snapshot
+	time_t checked;
+	
+	// Candidates for a query, and the contents of one being checked
+	uint32_t* candidates;
+	char* contents;
+};
+
+// A menu being put together
+struct ssearch_menu_t
+{
+	char* data;
+	size_t length;
+	size_t size;
+};
+
+static int menu_printf(struct ssearch_menu_t* menu, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static int menu_printf(struct ssearch_menu_t* menu, const char* format, ...)
+{
+	while (1)
+	{
+		va_list args;
+		
+		va_start(args, format);
+		int n = vsnprintf(menu->data + menu->length, menu->size - menu->length, format, args);
+		va_end(args);
+		
+		if (n < 0)
+		{
+			return -1;
+		}
+		
+		if ((size_t)n < menu->size - menu->length)
+		{
+			menu->length += (size_t)n;
+			return 0;
+		}
+		
+		size_t size = menu->size * 2;
+		
+		while (size <= menu->length + (size_t)n)
+		{
+			size *= 2;
+		}
+		
+		char* resized = realloc(menu->data, size);
+		
+		if (resized == NULL)
+		{
+			return -1;
+		}
+		
+		menu->data = resized;
+		menu->size = size;
+	}
+}
+
+static void unload(struct ssearch_t* search)
+{
+	if (search->map != NULL)
+	{
+		munmap(search->map, search->size);
+		search->map = NULL;
+	}
+	
+	free(search->candidates);
+	search->candidates = NULL;
+}
+
+// Map a newer snapshot if there is one, making sure it all adds up first
+static void refresh(struct ssearch_t* search)
+{
+	time_t now = time(NULL);
+	
+	if (now == search->checked)
+	{
+		return;
+	}
+	
+	search->checked = now;
+	
+	struct stat statbuf;
+	
+	if (stat(search->file, &statbuf) < 0)
+	{
+		return;
+	}
+	
+	if (search->map != NULL && statbuf.st_dev == search->dev && statbuf.st_ino == search->ino && statbuf.st_mtim.tv_sec == search->mtime.tv_sec && statbuf.st_mtim.tv_nsec == search->mtime.tv_nsec)
+	{
+		return;
+	}
+	
+	int fd = open(search->file, O_RDONLY | O_CLOEXEC);
+	
+	if (fd < 0)
+	{
+		return;
+	}
+	
+	// It might have been replaced again since the stat
+	if (fstat(fd, &statbuf) < 0 || (size_t)statbuf.st_size < sizeof(struct ssearch_header_t))
+	{
+		close(fd);
+		return;
+	}
+	
+	size_t size = (size_t)statbuf.st_size;
+	
+	char* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	
+	close(fd);
+	
+	if (map == MAP_FAILED)
+	{
+		return;
+	}
+	
+	const struct ssearch_header_t* header = (const struct ssearch_header_t*)map;
+	
+	uint64_t expected = sizeof(struct ssearch_header_t) + (uint64_t)header->numFiles * sizeof(struct ssearch_file_t) + ((uint64_t)header->numTrigrams + 1) * sizeof(struct ssearch_trigram_t) + header->numPostings * sizeof(uint32_t) + header->pathsLength;
+	
+	uint32_t* candidates = malloc((header->numFiles > 0 ? header->numFiles : 1) * sizeof(uint32_t));
+	
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || expected != size || candidates == NULL)
+	{
+		munmap(map, size);
+		free(candidates);
+		return;
+	}
+	
+	unload(search);
+	
+	search->map = map;
+	search->size = size;
+	search->dev = statbuf.st_dev;
+	search->ino = statbuf.st_ino;
+	search->mtime = statbuf.st_mtim;
+	search->candidates = candidates;
+	
+	search->header = header;
+	search->files = (const struct ssearch_file_t*)(map + sizeof(struct ssearch_header_t));
+	search->trigrams = (const struct ssearch_trigram_t*)(search->files + header->numFiles);
+	search->postings = (const uint32_t*)(search->trigrams + header->numTrigrams + 1);
+	search->paths = (const char*)(search->postings + header->numPostings);
+}
+
+// Postings for a trigram, or none if nothing has it
+static const uint32_t* find_postings(struct ssearch_t* search, uint32_t t, uint32_t* count)
+{
+	uint32_t low = 0;
+	uint32_t high = search->header->numTrigrams;
+	
+	while (low < high)
+	{
+		uint32_t middle = low + (high - low) / 2;
+		
+		if (search->trigrams[middle].trigram < t)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	
+	if (low == search->header->numTrigrams || search->trigrams[low].trigram != t)
+	{
+		*count = 0;
+		return NULL;
+	}
+	
+	*count = search->trigrams[low + 1].start - search->trigrams[low].start;
+	
+	return search->postings + search->trigrams[low].start;
+}
+
+static bool contains(const uint32_t* list, uint32_t count, uint32_t id)
+{
+	uint32_t low = 0;
+	uint32_t high = count;
+	
+	while (low < high)
+	{
+		uint32_t middle = low + (high - low) / 2;
+		
+		if (list[middle] < id)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	
+	return low < count && list[low] == id;
+}
+
+// The files that have every trigram in the query, which starts from the shortest list of postings and narrows it down
+// with the others
+static uint32_t find_candidates(struct ssearch_t* search, char words[][256], size_t* lengths, unsigned int numWords)
+{
+	const uint32_t* shortest = NULL;
+	uint32_t shortestCount = 0;
+	bool any = false;
+	
+	for (unsigned int w = 0; w < numWords; w++)
+	{
+		for (size_t i = 0; i + 2 < lengths[w]; i++)
+		{
+			uint32_t count;
+			const uint32_t* postings = find_postings(search, trigram((const unsigned char*)words[w] + i), &count);
+			
+			if (count == 0)
+			{
+				return 0;
+			}
+			
+			if (!any || count < shortestCount)
+			{
+				shortest = postings;
+				shortestCount = count;
+				any = true;
+			}
+		}
+	}
+	
+	// Nothing long enough to have trigrams, so everything is a candidate
+	if (!any)
+	{
+		for (uint32_t i = 0; i < search->header->numFiles; i++)
+		{
+			search->candidates[i] = i;
+		}
+		
+		return search->header->numFiles;
+	}
+	
+	memcpy(search->candidates, shortest, shortestCount * sizeof(uint32_t));
+	
+	uint32_t numCandidates = shortestCount;
+	
+	for (unsigned int w = 0; w < numWords && numCandidates > 0; w++)
+	{
+		for (size_t i = 0; i + 2 < lengths[w] && numCandidates > 0; i++)
+		{
+			uint32_t count;
+			const uint32_t* postings = find_postings(search, trigram((const unsigned char*)words[w] + i), &count);
+			
+			if (postings == shortest)
+			{
+				continue;
+			}
+			
+			uint32_t kept = 0;
+			
+			for (uint32_t c = 0; c < numCandidates; c++)
+			{
+				if (contains(postings, count, search->candidates[c]))
+				{
+					search->candidates[kept++] = search->candidates[c];
+				}
+			}
+			
+			numCandidates = kept;
+		}
+	}
+	
+	return numCandidates;
+}
+
+struct ssearch_t* ssearch_open(const char* file)
+{
+	struct ssearch_t* search = malloc(sizeof(struct ssearch_t));
+	
+	if (search == NULL)
+	{
+		return NULL;
+	}
+	
+	search->file = file;
+	search->map = NULL;
+	search->candidates = NULL;
+	search->checked = 0;
+	search->contents = malloc(SEARCH_FILE_MAX);
+	
+	if (search->contents == NULL)
+	{
+		free(search);
+		return NULL;
+	}
+	
+	return search;
+}
+
+void ssearch_close(struct ssearch_t* search)
+{
+	if (search == NULL)
+	{
+		return;
+	}
+	
+	unload(search);
+	free(search->contents);
+	free(search);
+}
+
+char* ssearch_query(struct ssearch_t* search, struct sdircache_t* dirs, const char* query, size_t querySize, const char* selector, const char* hostname, unsigned short port, size_t* length)
+{
+	struct ssearch_menu_t menu =
+	{
+		.data = malloc(4096),
+		.length = 0,
+		.size = 4096
+	};
+	
+	if (menu.data == NULL)
+	{
+		return NULL;
+	}
+	
+	refresh(search);
+	
+	// Split the query up into words, folded the same way as the index
+	char words[SEARCH_WORDS_MAX][256];
+	size_t lengths[SEARCH_WORDS_MAX];
+	unsigned int numWords = 0;
+	
+	for (size_t i = 0; i < querySize && numWords < SEARCH_WORDS_MAX; )
+	{
+		while (i < querySize && blank((unsigned char)query[i]))
+		{
+			i++;
+		}
+		
+		size_t start = i;
+		
+		while (i < querySize && !blank((unsigned char)query[i]))
+		{
+			i++;
+		}
+		
+		if (i > start)
+		{
+			size_t size = i - start < sizeof(words[0]) ? i - start : sizeof(words[0]) - 1;
+			
+			memcpy(words[numWords], query + start, size);
+			fold_all(words[numWords], size);
+			lengths[numWords++] = size;
+		}
+	}
+	
+	int retval = 0;
+	
+	if (numWords == 0)
+	{
+		retval = menu_printf(&menu, "7Search %s\t%s\t%s\t%hu\r\n", hostname, selector, hostname, port);
+	}
+	else if (search->map == NULL)
+	{
+		retval = menu_printf(&menu, "3The search index isn't ready yet\t\t%s\t%hu\r\n", hostname, port);
+	}
+	else
+	{
+		size_t echo = menu.length + strlen("iSearch results for ");
+		
+		retval = menu_printf(&menu, "iSearch results for %.*s\r\ni\r\n", (int)querySize, query);
+		
+		// A tab or line break in the query would split the line up, so they're shown as spaces
+		for (size_t i = echo; retval == 0 && i + strlen("\r\ni\r\n") < menu.length; i++)
+		{
+			if (menu.data[i] == '\t' || menu.data[i] == '\r' || menu.data[i] == '\n')
+			{
+				menu.data[i] = ' ';
+			}
+		}
+		
+		uint32_t numCandidates = find_candidates(search, words, lengths, numWords);
+		unsigned int found = 0;
+		
+		// If there weren't any trigrams to go by, every file is a candidate and reading them all would take forever,
+		// so only names are searched
+		bool narrowed = false;
+		
+		for (unsigned int w = 0; w < numWords; w++)
+		{
+			narrowed |= lengths[w] >= 3;
+		}
+		
+		size_t budget = SEARCH_CHECK_MAX;
+		bool more = false;
+		bool unchecked = false;
+		
+		for (uint32_t c = 0; c < numCandidates && retval == 0; c++)
+		{
+			const struct ssearch_file_t* file = &search->files[search->candidates[c]];
+			const char* path = search->paths + file->path;
+			
+			// Names are short, so see if they have everything first
+			char name[PATH_MAX];
+			size_t nameLength = (size_t)(file->length - file->name);
+			
+			memcpy(name, path + file->name, nameLength);
+			fold_all(name, nameLength);
+			
+			bool match = true;
+			
+			for (unsigned int w = 0; w < numWords && match; w++)
+			{
+				match = memmem(name, nameLength, words[w], lengths[w]) != NULL;
+			}
+			
+			// Otherwise the rest has to be in the contents, which are only worth reading if the trigrams said so
+			if (!match && file->text && narrowed && budget == 0)
+			{
+				unchecked = true;
+			}
+			else if (!match && file->text && narrowed)
+			{
+				char relative[PATH_MAX];
+				
+				snprintf(relative, sizeof(relative), "%.*s", (int)file->length, path);
+				
+				int fd = sdircache_open(dirs, relative, O_RDONLY | O_CLOEXEC);
+				
+				if (fd >= 0)
+				{
+					ssize_t n = pread(fd, search->contents, budget < SEARCH_FILE_MAX ? budget : SEARCH_FILE_MAX, 0);
+					
+					close(fd);
+					
+					if (n > 0)
+					{
+						budget -= (size_t)n;
+						fold_all(search->contents, (size_t)n);
+						
+						match = true;
+						
+						for (unsigned int w = 0; w < numWords && match; w++)
+						{
+							match = memmem(name, nameLength, words[w], lengths[w]) != NULL || memmem(search->contents, (size_t)n, words[w], lengths[w]) != NULL;
+						}
+					}
+				}
+			}
+			
+			if (!match)
+			{
+				continue;
+			}
+			
+			if (found == SEARCH_RESULTS_MAX)
+			{
+				more = true;
+				break;
+			}
+			
+			// Paths start with a period, which the selector doesn't
+			retval = menu_printf(&menu, "%c%.*s\t%.*s\t%s\t%hu\r\n", file->type, (int)(file->length - 2), path + 2, (int)(file->length - 1), path + 1, hostname, port);
+			found++;
+		}
+		
+		if (retval == 0)
+		{
+			if (more)
+			{
+				retval = menu_printf(&menu, "i\r\niShowing the first %u files, try being more specific\r\n", found);
+			}
+			else
+			{
+				retval = menu_printf(&menu, "i\r\niFound %u file%s\r\n", found, found == 1 ? "" : "s");
+			}
+		}
+		
+		if (retval == 0 && unchecked)
+		{
+			retval = menu_printf(&menu, "iThere were too many files to look inside of them all, try being more specific\r\n");
+		}
+		
+		if (retval == 0)
+		{
+			retval = menu_printf(&menu, "7Search again\t%s\t%s\t%hu\r\n", selector, hostname, port);
+		}
+	}
+	
+	if (retval < 0 || menu_printf(&menu, ".\r\n") < 0)
+	{
+		free(menu.data);
+		return NULL;
+	}
+	
+	*length = menu.length;
+	
+	return menu.data;
+}
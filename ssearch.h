@@ -0,0 +1,58 @@
+#pragma once
+
+// bool
+#include <stdbool.h>
+
+// size_t
+#include <stddef.h>
+
+// uint64_t
+#include <stdint.h>
+
+// sdircache_t
+#include "sdircache.h"
+
+// *********************************************************************
+// Search
+//
+// The supervisor keeps an index of the trigrams in the names of every
+// file and directory that would show up in a directory listing, and in
+// the contents of the text files among them. It's built a slice at a
+// time from the supervisor's event loop and kept up to date with
+// inotify, and whenever it has changed and things have settled down, a
+// snapshot of it is written to a file and renamed into place. Workers
+// map the latest snapshot into memory and answer queries from it,
+// checking for a newer one at most once a second. Trigrams only say
+// that a file might match, so the candidates are checked against their
+// names, and their contents if need be, before they're listed.
+// *********************************************************************
+
+// Opaque structure for the index being built
+struct ssearch_builder_t;
+
+// Opaque structure for a worker's view of the index
+struct ssearch_t;
+
+// Start building an index of the directory at path into snapshots written to file, which doesn't happen until it's
+// given some time to work, and whether symlinks that lead out of the directory are followed
+struct ssearch_builder_t* ssearch_builder_create(const char* directory, const char* file, bool outside);
+void ssearch_builder_destroy(struct ssearch_builder_t* builder);
+
+// The inotify file descriptor, which becomes readable when something has changed
+int ssearch_builder_fd(struct ssearch_builder_t* builder);
+
+// Take in what inotify has to report
+void ssearch_builder_notify(struct ssearch_builder_t* builder);
+
+// Work on the index for about as long as the budget in nanoseconds. Returns how many milliseconds to wait before
+// working on it again, or -1 if there's nothing to do until something changes.
+int ssearch_builder_work(struct ssearch_builder_t* builder, uint64_t budget);
+
+// Open the snapshots written to file, which don't need to exist yet
+struct ssearch_t* ssearch_open(const char* file);
+void ssearch_close(struct ssearch_t* search);
+
+// Search for the files with every word of the query in their name or contents, the ones in the content directory of
+// dirs being checked if need be. Returns a malloc'd menu with links to the results, and to the search itself at selector,
+// on hostname and port.
+char* ssearch_query(struct ssearch_t* search, struct sdircache_t* dirs, const char* query, size_t querySize, const char* selector, const char* hostname, unsigned short port, size_t* length);
@@ -0,0 +1,214 @@
+// memcpy
+#include <string.h>
+
+// slog_hash
+#include "slog.h"
+
+// ssketch_t
+#include "ssketch.h"
+
+// Times to try copying the heap out before giving up on a worker that keeps changing it
+#define SSKETCH_ATTEMPTS 4
+
+// *********************************************************************
+// The heap of hottest selectors, with the coolest of them at the top
+// *********************************************************************
+
+static void swap_entries(struct ssketch_entry_t* a, struct ssketch_entry_t* b)
+{
+	struct ssketch_entry_t temp = *a;
+	*a = *b;
+	*b = temp;
+}
+
+static void sift_up(struct ssketch_t* sketch, uint32_t i)
+{
+	while (i > 0)
+	{
+		uint32_t parent = (i - 1) / 2;
+		
+		if (sketch->top[parent].count <= sketch->top[i].count)
+		{
+			break;
+		}
+		
+		swap_entries(&sketch->top[parent], &sketch->top[i]);
+		i = parent;
+	}
+}
+
+static void sift_down(struct ssketch_t* sketch, uint32_t i)
+{
+	while (1)
+	{
+		uint32_t smallest = i;
+		uint32_t left = 2 * i + 1;
+		uint32_t right = 2 * i + 2;
+		
+		if (left < sketch->numTop && sketch->top[left].count < sketch->top[smallest].count)
+		{
+			smallest = left;
+		}
+		
+		if (right < sketch->numTop && sketch->top[right].count < sketch->top[smallest].count)
+		{
+			smallest = right;
+		}
+		
+		if (smallest == i)
+		{
+			break;
+		}
+		
+		swap_entries(&sketch->top[smallest], &sketch->top[i]);
+		i = smallest;
+	}
+}
+
+// The supervisor reads the heap while it's being written, so changes are bracketed by bumps to the sequence number
+static inline void begin_change(struct ssketch_t* sketch)
+{
+	__atomic_store_n(&sketch->sequence, sketch->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void end_change(struct ssketch_t* sketch)
+{
+	__atomic_store_n(&sketch->sequence, sketch->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static void set_entry(struct ssketch_entry_t* entry, uint64_t hash, uint32_t count, const char* selector, size_t length)
+{
+	entry->hash = hash;
+	entry->count = count;
+	entry->selectorLength = length < UINT16_MAX ? (uint16_t)length : UINT16_MAX;
+	
+	memcpy(entry->selector, selector, length < SSKETCH_SELECTOR_SIZE ? length : SSKETCH_SELECTOR_SIZE);
+}
+
+// *********************************************************************
+// Counting
+// *********************************************************************
+uint32_t ssketch_record(struct ssketch_t* sketch, const char* selector, size_t length)
+{
+	uint64_t hash = slog_hash(selector, length);
+	
+	// Each row's column comes from the two halves of the hash, which is as good as a hash per row
+	uint32_t h1 = (uint32_t)hash;
+	uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+	
+	uint32_t* counters[SSKETCH_DEPTH];
+	uint32_t estimate = UINT32_MAX;
+	
+	for (uint32_t i = 0; i < SSKETCH_DEPTH; i++)
+	{
+		counters[i] = &sketch->counters[i][(h1 + i * h2) % SSKETCH_WIDTH];
+		
+		if (*counters[i] < estimate)
+		{
+			estimate = *counters[i];
+		}
+	}
+	
+	if (estimate == UINT32_MAX)
+	{
+		return estimate;
+	}
+	
+	// Only the counters at the minimum need to go up for the estimate to, which keeps the others from overcounting
+	for (uint32_t i = 0; i < SSKETCH_DEPTH; i++)
+	{
+		if (*counters[i] == estimate)
+		{
+			(*counters[i])++;
+		}
+	}
+	
+	estimate++;
+	
+	// Then see about the heap
+	for (uint32_t i = 0; i < sketch->numTop; i++)
+	{
+		if (sketch->top[i].hash == hash)
+		{
+			begin_change(sketch);
+			sketch->top[i].count = estimate;
+			sift_down(sketch, i);
+			end_change(sketch);
+			
+			return estimate;
+		}
+	}
+	
+	if (sketch->numTop < SSKETCH_TOP)
+	{
+		begin_change(sketch);
+		set_entry(&sketch->top[sketch->numTop], hash, estimate, selector, length);
+		sift_up(sketch, sketch->numTop++);
+		end_change(sketch);
+	}
+	else if (estimate > sketch->top[0].count)
+	{
+		begin_change(sketch);
+		set_entry(&sketch->top[0], hash, estimate, selector, length);
+		sift_down(sketch, 0);
+		end_change(sketch);
+	}
+	
+	return estimate;
+}
+
+void ssketch_decay(struct ssketch_t* sketch)
+{
+	for (uint32_t i = 0; i < SSKETCH_DEPTH; i++)
+	{
+		for (uint32_t j = 0; j < SSKETCH_WIDTH; j++)
+		{
+			sketch->counters[i][j] /= 2;
+		}
+	}
+	
+	// Halving every count keeps them in the same order, so the heap stays a heap
+	begin_change(sketch);
+	
+	for (uint32_t i = 0; i < sketch->numTop; i++)
+	{
+		sketch->top[i].count /= 2;
+	}
+	
+	end_change(sketch);
+}
+
+// *********************************************************************
+// Reading from the supervisor
+// *********************************************************************
+unsigned int ssketch_top(const struct ssketch_t* sketch, struct ssketch_entry_t* top)
+{
+	for (unsigned int attempt = 0; attempt < SSKETCH_ATTEMPTS; attempt++)
+	{
+		uint64_t sequence = __atomic_load_n(&sketch->sequence, __ATOMIC_ACQUIRE);
+		
+		if (sequence & 1)
+		{
+			continue;
+		}
+		
+		uint32_t numTop = __atomic_load_n(&sketch->numTop, __ATOMIC_RELAXED);
+		
+		if (numTop > SSKETCH_TOP)
+		{
+			numTop = SSKETCH_TOP;
+		}
+		
+		memcpy(top, sketch->top, numTop * sizeof(struct ssketch_entry_t));
+		
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		
+		if (__atomic_load_n(&sketch->sequence, __ATOMIC_RELAXED) == sequence)
+		{
+			return numTop;
+		}
+	}
+	
+	return 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+// size_t
+#include <stddef.h>
+
+// uint32_t, uint64_t
+#include <stdint.h>
+
+// *********************************************************************
+// Hot selectors
+//
+// Each worker counts the selectors it's asked for in a count-min sketch
+// in its block of shared memory. That's a few rows of counters, where a
+// selector bumps one counter in each row picked by its hash and its
+// count is the smallest of them, which can be too high if it shares all
+// of them with other selectors but never too low. It's the same size no
+// matter how many different selectors turn up, and counting one is a
+// hash and a handful of increments. Next to it is a small min-heap of
+// the selectors with the highest counts, which the supervisor merges
+// across the workers for the metrics. Everything is halved every so
+// often, so the counts follow what's been popular lately.
+// *********************************************************************
+
+// Rows and columns of counters
+#define SSKETCH_DEPTH 4
+#define SSKETCH_WIDTH 2048
+
+// How many of the hottest selectors are kept track of, and how much of each one is kept
+#define SSKETCH_TOP 32
+#define SSKETCH_SELECTOR_SIZE 62
+
+struct ssketch_entry_t
+{
+	uint64_t hash;
+	uint32_t count;
+	
+	// Full length of the selector and as much of it as fits
+	uint16_t selectorLength;
+	char selector[SSKETCH_SELECTOR_SIZE];
+};
+
+struct ssketch_t
+{
+	uint32_t counters[SSKETCH_DEPTH][SSKETCH_WIDTH];
+	
+	// Odd while the heap is being changed, so whoever is reading it can tell they need to try again
+	uint64_t sequence;
+	
+	uint32_t numTop;
+	struct ssketch_entry_t top[SSKETCH_TOP];
+};
+
+// Count a request for a selector, returning its estimated count including this one
+uint32_t ssketch_record(struct ssketch_t* sketch, const char* selector, size_t length);
+
+// Halve every count
+void ssketch_decay(struct ssketch_t* sketch);
+
+// Copy out the hottest selectors from another process, returning how many there are, or 0 if the worker kept changing
+// them out from under us
+unsigned int ssketch_top(const struct ssketch_t* sketch, struct ssketch_entry_t* top);
@@ -0,0 +1,696 @@
+// For scandirat, mempcpy
+#define _GNU_SOURCE
+
+// scandirat, alphasort
+#include <dirent.h>
+
+// errno
+#include <errno.h>
+
+// O_RDONLY, O_DIRECTORY, O_CLOEXEC
+#include <fcntl.h>
+
+// PATH_MAX
+#include <limits.h>
+
+// snprintf
+#include <stdio.h>
+
+// malloc, realloc, free
+#include <stdlib.h>
+
+// memchr, memcpy, mempcpy, stpcpy, strlen, strncmp, strpbrk
+#include <string.h>
+
+// fstat
+#include <sys/stat.h>
+
+// pread, close
+#include <unistd.h>
+
+// sdircache_open, sdircache_stat, sdircache_statat
+#include "sdircache.h"
+
+// stemplate functions
+#include "stemplate.h"
+
+// stype_guess
+#include "stype.h"
+
+// *********************************************************************
+// Core definitions
+// *********************************************************************
+
+// How deep includes can go, which mostly stops a file from including itself forever
+#define STEMPLATE_DEPTH_MAX 4
+
+// Something a template was rendered from, and the version of it that was used, with an inode of 0 for something that
+// didn't exist
+struct stemplate_dep_t
+{
+	// Offset of its path under the root in the paths after the array
+	size_t path;
+	
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+};
+
+struct stemplate_deps_t
+{
+	// When they were last checked
+	time_t checked;
+	
+	unsigned int count;
+	struct stemplate_dep_t deps[];
+};
+
+// A buffer that grows as it's added to
+struct stemplate_buffer_t
+{
+	char* data;
+	size_t length;
+	size_t size;
+};
+
+// Everything needed while rendering
+struct stemplate_render_t
+{
+	struct sdircache_t* dirs;
+	const char* hostname;
+	char port[8];
+	
+	struct stemplate_buffer_t output;
+	
+	// A line with the placeholders filled in
+	struct stemplate_buffer_t line;
+	
+	// What it depends on and the paths that go with them
+	struct stemplate_dep_t* deps;
+	unsigned int numDeps;
+	struct stemplate_buffer_t paths;
+};
+
+// *********************************************************************
+// Helpers
+// *********************************************************************
+
+static int buffer_append(struct stemplate_buffer_t* buffer, const void* data, size_t length)
+{
+	if (buffer->length + length > buffer->size)
+	{
+		size_t size = buffer->size > 0 ? buffer->size : 1024;
+		
+		while (size < buffer->length + length)
+		{
+			size *= 2;
+		}
+		
+		char* resized = realloc(buffer->data, size);
+		
+		if (resized == NULL)
+		{
+			return -1;
+		}
+		
+		buffer->data = resized;
+		buffer->size = size;
+	}
+	
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	
+	return 0;
+}
+
+static inline int buffer_string(struct stemplate_buffer_t* buffer, const char* string)
+{
+	return buffer_append(buffer, string, strlen(string));
+}
+
+// Build the path of something under the root from a path relative to a directory, or to the root with a leading slash,
+// with the same rules as selectors: nothing starting with a period, and redundant slashes removed
+static int resolve(const char* directory, const char* path, size_t length, char* resolved)
+{
+	char* end = resolved;
+	char* limit = resolved + PATH_MAX - 1;
+	
+	if (length > 0 && path[0] == '/')
+	{
+		end = stpcpy(end, ".");
+	}
+	else
+	{
+		end = stpcpy(end, directory);
+	}
+	
+	const char* position = path;
+	const char* last = path + length;
+	
+	while (position < last)
+	{
+		const char* slash = memchr(position, '/', (size_t)(last - position));
+		
+		if (slash == NULL)
+		{
+			slash = last;
+		}
+		
+		size_t size = (size_t)(slash - position);
+		
+		if (size > 0)
+		{
+			if (*position == '.' || end + 1 + size > limit)
+			{
+				return -1;
+			}
+			
+			*end++ = '/';
+			end = mempcpy(end, position, size);
+		}
+		
+		position = slash + 1;
+	}
+	
+	*end = '\0';
+	
+	return 0;
+}
+
+// Remember what something was like when it went into the template, or that it wasn't there at all
+static int depend(struct stemplate_render_t* render, const char* path, const struct stat* statbuf)
+{
+	struct stemplate_dep_t* resized = realloc(render->deps, (render->numDeps + 1) * sizeof(struct stemplate_dep_t));
+	
+	if (resized == NULL)
+	{
+		return -1;
+	}
+	
+	render->deps = resized;
+	
+	struct stemplate_dep_t* dep = &render->deps[render->numDeps++];
+	
+	dep->path = render->paths.length;
+	
+	if (statbuf != NULL)
+	{
+		dep->dev = statbuf->st_dev;
+		dep->ino = statbuf->st_ino;
+		dep->mtime = statbuf->st_mtim;
+		dep->size = statbuf->st_size;
+	}
+	else
+	{
+		dep->dev = 0;
+		dep->ino = 0;
+		dep->mtime.tv_sec = 0;
+		dep->mtime.tv_nsec = 0;
+		dep->size = 0;
+	}
+	
+	return buffer_append(&render->paths, path, strlen(path) + 1);
+}
+
+// An error line in place of something that couldn't be included or listed
+static int render_error(struct stemplate_render_t* render, const char* what, const char* path, size_t length)
+{
+	char line[PATH_MAX + 64];
+	
+	int n = snprintf(line, sizeof(line), "3Cannot %s %.*s\t\t%s\t%s\r\n", what, (int)length, path, render->hostname, render->port);
+	
+	return buffer_append(&render->output, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+// *********************************************************************
+// Rendering
+// *********************************************************************
+
+static int render_file(struct stemplate_render_t* render, const char* directory, int file, unsigned int depth);
+
+static int skip_hidden(const struct dirent* entry)
+{
+	return entry->d_name[0] != '.';
+}
+
+// A menu line for each file in a directory that could be served
+static int render_listing(struct stemplate_render_t* render, const char* directory, const char* path, size_t length)
+{
+	char resolved[PATH_MAX];
+	
+	if (resolve(directory, path, length, resolved) < 0)
+	{
+		return render_error(render, "list", path, length);
+	}
+	
+	int dirfd = sdircache_open(render->dirs, resolved, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	
+	struct stat statbuf;
+	
+	if (dirfd < 0 || fstat(dirfd, &statbuf) < 0)
+	{
+		if (dirfd >= 0)
+		{
+			close(dirfd);
+		}
+		
+		if (depend(render, resolved, NULL) < 0)
+		{
+			return -1;
+		}
+		
+		return render_error(render, "list", path, length);
+	}
+	
+	// Files coming and going change the directory, although files inside it changing their modes doesn't
+	if (depend(render, resolved, &statbuf) < 0)
+	{
+		close(dirfd);
+		return -1;
+	}
+	
+	struct dirent** names;
+	
+	int count = scandirat(dirfd, ".", &names, skip_hidden, alphasort);
+	
+	if (count < 0)
+	{
+		close(dirfd);
+		return render_error(render, "list", path, length);
+	}
+	
+	int retval = 0;
+	
+	for (int i = 0; i < count; i++)
+	{
+		const char* name = names[i]->d_name;
+		
+		// A name that would break the menu line can't be listed, and neither can a symlink that leads out of the root
+		if (retval == 0 && strpbrk(name, "\t\r\n") == NULL && sdircache_statat(render->dirs, dirfd, resolved, name, &statbuf) == 0)
+		{
+			char type = stype_guess(name, statbuf.st_mode);
+			
+			if (type != 0)
+			{
+				char line[PATH_MAX * 2 + 512];
+				
+				int n = snprintf(line, sizeof(line), "%c%s\t%s/%s\t%s\t%s\r\n", type, name, resolved + 1, name, render->hostname, render->port);
+				
+				if ((size_t)n < sizeof(line))
+				{
+					retval = buffer_append(&render->output, line, (size_t)n);
+				}
+			}
+		}
+		
+		free(names[i]);
+	}
+	
+	free(names);
+	close(dirfd);
+	
+	return retval;
+}
+
+// Another file rendered in place
+static int render_include(struct stemplate_render_t* render, const char* directory, const char* path, size_t length, unsigned int depth)
+{
+	char resolved[PATH_MAX];
+	
+	if (depth >= STEMPLATE_DEPTH_MAX || resolve(directory, path, length, resolved) < 0)
+	{
+		return render_error(render, "include", path, length);
+	}
+	
+	int file = sdircache_open(render->dirs, resolved, O_RDONLY | O_CLOEXEC);
+	
+	struct stat statbuf;
+	
+	if (file < 0 || fstat(file, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+	{
+		bool exists = file >= 0;
+		
+		if (file >= 0)
+		{
+			close(file);
+		}
+		
+		if (depend(render, resolved, exists ? &statbuf : NULL) < 0)
+		{
+			return -1;
+		}
+		
+		return render_error(render, "include", path, length);
+	}
+	
+	if (depend(render, resolved, &statbuf) < 0)
+	{
+		close(file);
+		return -1;
+	}
+	
+	int retval = render_file(render, directory, file, depth + 1);
+	
+	close(file);
+	
+	return retval < 0 ? -1 : 0;
+}
+
+// Fill in the placeholders in a line
+static int render_placeholders(struct stemplate_render_t* render, const char* line, size_t length)
+{
+	render->line.length = 0;
+	
+	const char* position = line;
+	const char* last = line + length;
+	
+	while (position < last)
+	{
+		const char* brace = memchr(position, '{', (size_t)(last - position));
+		
+		if (brace == NULL)
+		{
+			break;
+		}
+		
+		const char* value = NULL;
+		size_t size = 0;
+		
+		if ((size_t)(last - brace) >= 6 && strncmp(brace, "{host}", 6) == 0)
+		{
+			value = render->hostname;
+			size = 6;
+		}
+		else if ((size_t)(last - brace) >= 6 && strncmp(brace, "{port}", 6) == 0)
+		{
+			value = render->port;
+			size = 6;
+		}
+		
+		if (value == NULL)
+		{
+			if (buffer_append(&render->line, position, (size_t)(brace - position) + 1) < 0)
+			{
+				return -1;
+			}
+			
+			position = brace + 1;
+			continue;
+		}
+		
+		if (buffer_append(&render->line, position, (size_t)(brace - position)) < 0 || buffer_string(&render->line, value) < 0)
+		{
+			return -1;
+		}
+		
+		position = brace + size;
+	}
+	
+	return buffer_append(&render->line, position, (size_t)(last - position));
+}
+
+// A menu line, with the gaps filled in and relative selectors made absolute
+static int render_item(struct stemplate_render_t* render, const char* directory, const char* line, size_t length)
+{
+	const char* last = line + length;
+	
+	// Split out the display string, selector, host and port, leaving anything after that alone
+	const char* fields[4];
+	size_t sizes[4];
+	unsigned int count = 0;
+	
+	const char* position = line;
+	
+	while (count < 4)
+	{
+		const char* tab = memchr(position, '\t', (size_t)(last - position));
+		
+		fields[count] = position;
+		sizes[count] = (size_t)((tab != NULL ? tab : last) - position);
+		count++;
+		
+		if (tab == NULL)
+		{
+			break;
+		}
+		
+		position = tab + 1;
+	}
+	
+	const char* rest = fields[count - 1] + sizes[count - 1];
+	
+	// The display string and the tab after it
+	if (buffer_append(&render->output, fields[0], sizes[0]) < 0 || buffer_append(&render->output, "\t", 1) < 0)
+	{
+		return -1;
+	}
+	
+	// Relative selectors start from the gophermap's directory, which is already a selector without the leading period
+	if (sizes[1] > 0 && fields[1][0] != '/' && !(sizes[1] >= 4 && strncmp(fields[1], "URL:", 4) == 0))
+	{
+		if (buffer_string(&render->output, directory + 1) < 0 || buffer_append(&render->output, "/", 1) < 0)
+		{
+			return -1;
+		}
+	}
+	
+	if (buffer_append(&render->output, fields[1], sizes[1]) < 0 || buffer_append(&render->output, "\t", 1) < 0)
+	{
+		return -1;
+	}
+	
+	if (count > 2 && sizes[2] > 0)
+	{
+		if (buffer_append(&render->output, fields[2], sizes[2]) < 0)
+		{
+			return -1;
+		}
+	}
+	else if (buffer_string(&render->output, render->hostname) < 0)
+	{
+		return -1;
+	}
+	
+	if (buffer_append(&render->output, "\t", 1) < 0)
+	{
+		return -1;
+	}
+	
+	if (count > 3 && sizes[3] > 0)
+	{
+		if (buffer_append(&render->output, fields[3], sizes[3]) < 0)
+		{
+			return -1;
+		}
+	}
+	else if (buffer_string(&render->output, render->port) < 0)
+	{
+		return -1;
+	}
+	
+	if (buffer_append(&render->output, rest, (size_t)(last - rest)) < 0 || buffer_append(&render->output, "\r\n", 2) < 0)
+	{
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Returns 1 if the file ended with a period line, which for the template itself is the end of the menu
+static int render_file(struct stemplate_render_t* render, const char* directory, int file, unsigned int depth)
+{
+	struct stat statbuf;
+	
+	if (fstat(file, &statbuf) < 0)
+	{
+		return -1;
+	}
+	
+	size_t length = (size_t)statbuf.st_size;
+	
+	// malloc(0) is allowed to return NULL so always ask for at least a byte
+	char* data = malloc(length > 0 ? length : 1);
+	
+	if (data == NULL)
+	{
+		return -1;
+	}
+	
+	size_t count = 0;
+	
+	while (count < length)
+	{
+		ssize_t n = pread(file, data + count, length - count, (off_t)count);
+		
+		if (n < 0)
+		{
+			free(data);
+			return -1;
+		}
+		
+		// The file got shorter since it was looked at, so go with what there is
+		if (n == 0)
+		{
+			break;
+		}
+		
+		count += (size_t)n;
+	}
+	
+	int retval = 0;
+	
+	const char* position = data;
+	const char* last = data + count;
+	
+	while (position < last && retval == 0)
+	{
+		const char* newline = memchr(position, '\n', (size_t)(last - position));
+		const char* next = newline != NULL ? newline + 1 : last;
+		const char* end = newline != NULL ? newline : last;
+		
+		// Gophermaps could have been written with either line ending
+		if (end > position && end[-1] == '\r')
+		{
+			end--;
+		}
+		
+		size_t size = (size_t)(end - position);
+		
+		if (size == 1 && position[0] == '.')
+		{
+			retval = 1;
+		}
+		else if (size > 0 && position[0] == '=')
+		{
+			retval = render_include(render, directory, position + 1, size - 1, depth);
+		}
+		else if (size > 0 && position[0] == '%')
+		{
+			retval = render_listing(render, directory, position + 1, size - 1);
+		}
+		else if (render_placeholders(render, position, size) < 0)
+		{
+			retval = -1;
+		}
+		else if (memchr(render->line.data, '\t', render->line.length) != NULL)
+		{
+			retval = render_item(render, directory, render->line.data, render->line.length);
+		}
+		else if (buffer_append(&render->output, render->line.data, render->line.length) < 0 || buffer_append(&render->output, "\r\n", 2) < 0)
+		{
+			retval = -1;
+		}
+		
+		position = next;
+	}
+	
+	free(data);
+	
+	return retval;
+}
+
+char* stemplate_render(struct sdircache_t* dirs, const char* path, int file, const char* hostname, unsigned short port, size_t* length, struct stemplate_deps_t** deps)
+{
+	struct stemplate_render_t render =
+	{
+		.dirs = dirs,
+		.hostname = hostname,
+		.deps = NULL,
+		.numDeps = 0
+	};
+	
+	snprintf(render.port, sizeof(render.port), "%hu", port);
+	
+	// The directory without a trailing slash, so that it's . for the root and its selector is everything after that
+	char directory[PATH_MAX];
+	
+	if (resolve(".", path + 1, strlen(path + 1), directory) < 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	
+	int retval = render_file(&render, directory, file, 0);
+	
+	if (retval >= 0)
+	{
+		retval = buffer_append(&render.output, ".\r\n", 3);
+	}
+	
+	*deps = NULL;
+	
+	if (retval >= 0 && render.numDeps > 0)
+	{
+		size_t size = sizeof(struct stemplate_deps_t) + render.numDeps * sizeof(struct stemplate_dep_t);
+		
+		*deps = malloc(size + render.paths.length);
+		
+		if (*deps == NULL)
+		{
+			retval = -1;
+		}
+		else
+		{
+			(*deps)->checked = time(NULL);
+			(*deps)->count = render.numDeps;
+			
+			memcpy((*deps)->deps, render.deps, render.numDeps * sizeof(struct stemplate_dep_t));
+			memcpy((char*)*deps + size, render.paths.data, render.paths.length);
+		}
+	}
+	
+	free(render.line.data);
+	free(render.deps);
+	free(render.paths.data);
+	
+	if (retval < 0)
+	{
+		free(render.output.data);
+		return NULL;
+	}
+	
+	*length = render.output.length;
+	
+	return render.output.data;
+}
+
+// *********************************************************************
+// Checking for changes
+// *********************************************************************
+
+bool stemplate_fresh(struct stemplate_deps_t* deps, struct sdircache_t* dirs, time_t now)
+{
+	if (deps == NULL || deps->checked == now)
+	{
+		return true;
+	}
+	
+	deps->checked = now;
+	
+	const char* paths = (const char*)&deps->deps[deps->count];
+	
+	for (unsigned int i = 0; i < deps->count; i++)
+	{
+		const struct stemplate_dep_t* dep = &deps->deps[i];
+		
+		struct stat statbuf;
+		
+		if (sdircache_stat(dirs, paths + dep->path, &statbuf) < 0)
+		{
+			if (dep->ino != 0)
+			{
+				return false;
+			}
+			
+			continue;
+		}
+		
+		if (dep->ino != statbuf.st_ino || dep->dev != statbuf.st_dev || dep->size != statbuf.st_size || dep->mtime.tv_sec != statbuf.st_mtim.tv_sec || dep->mtime.tv_nsec != statbuf.st_mtim.tv_nsec)
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
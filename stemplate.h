@@ -0,0 +1,50 @@
+#pragma once
+
+// bool
+#include <stdbool.h>
+
+// size_t
+#include <stddef.h>
+
+// time_t
+#include <time.h>
+
+// sdircache_t
+#include "sdircache.h"
+
+// *********************************************************************
+// Gophermap templates
+//
+// A template is a gophermap that's filled in when it's loaded rather
+// than taken as it is:
+//
+// - {host} and {port} anywhere are replaced by the server's hostname
+//   and port
+// - A menu line with no host or port, or empty ones, gets the server's
+// - A menu line whose selector doesn't start with / or URL: is taken
+//   to be relative to the gophermap's directory
+// - A line starting with = includes another file there, rendered the
+//   same way, given relative to the gophermap's directory or to the
+//   root with a leading /
+// - A line starting with % lists the files in the gophermap's
+//   directory there, or another directory given the same way
+// - A line with just a period ends the menu, and one is added if it
+//   doesn't have one
+//
+// The result depends on the files and directories that were included
+// or listed as well as the gophermap, so those are kept track of too.
+// Everything is opened through the worker's directory cache, so the
+// same symlinks are off limits as for requests.
+// *********************************************************************
+
+// Opaque structure for what went into a rendered template besides the template itself, allocated in one piece
+struct stemplate_deps_t;
+
+// Render the template open as file, which is in the directory at path under the content directory of dirs, given as
+// for openat with a leading ./ and optionally a trailing slash. Returns a malloc'd buffer and sets deps to what else went into it, or NULL if
+// there were none.
+char* stemplate_render(struct sdircache_t* dirs, const char* path, int file, const char* hostname, unsigned short port, size_t* length, struct stemplate_deps_t** deps);
+
+// Whether everything besides the template itself is the same as when it was rendered, which is only actually checked
+// once a second
+bool stemplate_fresh(struct stemplate_deps_t* deps, struct sdircache_t* dirs, time_t now);
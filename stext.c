@@ -0,0 +1,246 @@
+// For O_TMPFILE
+#define _GNU_SOURCE
+
+// errno
+#include <errno.h>
+
+// openat, O_TMPFILE, AT_FDCWD, AT_SYMLINK_FOLLOW
+#include <fcntl.h>
+
+// bool
+#include <stdbool.h>
+
+// snprintf, renameat
+#include <stdio.h>
+
+// fstat, futimens
+#include <sys/stat.h>
+
+// pread, write, close, getpid, linkat, unlinkat
+#include <unistd.h>
+
+// stext_open
+#include "stext.h"
+
+// *********************************************************************
+// Constants
+// *********************************************************************
+
+// Size of the chunks the original is read in. Every byte comes out as at most two, and the terminator goes on the end.
+#define TEXT_CHUNK_SIZE 32768
+#define TEXT_OUTPUT_SIZE (2 * TEXT_CHUNK_SIZE + 3)
+
+// Room for the name of a converted copy, which is the device and inode in hex, and for a temporary one with a PID on the end
+#define TEXT_NAME_SIZE 40
+#define TEXT_TEMPORARY_SIZE (TEXT_NAME_SIZE + 12)
+
+// *********************************************************************
+// Write all of a buffer
+// *********************************************************************
+static int write_all(int fd, const char* data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t n = write(fd, data, length);
+		
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			
+			return -1;
+		}
+		
+		data += n;
+		length -= (size_t)n;
+	}
+	
+	return 0;
+}
+
+// *********************************************************************
+// Convert the original into the copy. Line endings are LF or CRLF on
+// the way in and always CRLF on the way out, and a lone CR is left as
+// it is, except at the very end where it's taken as a line ending.
+// *********************************************************************
+static int convert(int file, int copy)
+{
+	char input[TEXT_CHUNK_SIZE];
+	char output[TEXT_OUTPUT_SIZE];
+	
+	bool linestart = true;
+	bool cr = false;
+	
+	off_t offset = 0;
+	
+	while (1)
+	{
+		ssize_t n = pread(file, input, TEXT_CHUNK_SIZE, offset);
+		
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			
+			return -1;
+		}
+		else if (n == 0)
+		{
+			break;
+		}
+		
+		offset += n;
+		
+		char* out = output;
+		
+		for (ssize_t i = 0; i < n; i++)
+		{
+			char c = input[i];
+			
+			// A CR only turns out to be part of a line ending once we see what comes after it
+			if (cr)
+			{
+				cr = false;
+				
+				if (c != '\n')
+				{
+					*out++ = '\r';
+					linestart = false;
+				}
+			}
+			
+			if (c == '\r')
+			{
+				cr = true;
+				continue;
+			}
+			
+			if (c == '\n')
+			{
+				*out++ = '\r';
+				*out++ = '\n';
+				linestart = true;
+				continue;
+			}
+			
+			if (linestart && c == '.')
+			{
+				*out++ = '.';
+			}
+			
+			*out++ = c;
+			linestart = false;
+		}
+		
+		if (write_all(copy, output, (size_t)(out - output)) < 0)
+		{
+			return -1;
+		}
+	}
+	
+	// Finish off the last line if it didn't have an ending, then the terminator
+	char* out = output;
+	
+	if (cr || !linestart)
+	{
+		*out++ = '\r';
+		*out++ = '\n';
+	}
+	
+	*out++ = '.';
+	*out++ = '\r';
+	*out++ = '\n';
+	
+	return write_all(copy, output, (size_t)(out - output));
+}
+
+// *********************************************************************
+// Make a new converted copy and put it in place of any old one
+//
+// The copy is written to an anonymous file first and only given a name
+// once it's complete, so nobody else can open a half-written one, and
+// renaming it over the old one means anybody still sending that keeps
+// the version they have. If two workers convert the same file at the
+// same time, whichever renames it last wins and both copies are fine.
+// *********************************************************************
+static int create(int cache, int file, const struct stat* statbuf, const char* name, struct stat* converted)
+{
+	int copy = openat(cache, ".", O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+	
+	if (copy < 0)
+	{
+		return -1;
+	}
+	
+	// The copy's modification time is the original's so it can be told apart from a copy of an older version
+	const struct timespec times[2] =
+	{
+		statbuf->st_atim,
+		statbuf->st_mtim
+	};
+	
+	if (convert(file, copy) < 0 || futimens(copy, times) < 0 || fstat(copy, converted) < 0)
+	{
+		int error = errno;
+		close(copy);
+		errno = error;
+		return -1;
+	}
+	
+	char proc[TEXT_NAME_SIZE];
+	char temporary[TEXT_TEMPORARY_SIZE];
+	
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%i", copy);
+	snprintf(temporary, sizeof(temporary), "%s.%i", name, getpid());
+	
+	// An earlier attempt that died between the two steps would have left this behind
+	unlinkat(cache, temporary, 0);
+	
+	if (linkat(AT_FDCWD, proc, cache, temporary, AT_SYMLINK_FOLLOW) < 0)
+	{
+		int error = errno;
+		close(copy);
+		errno = error;
+		return -1;
+	}
+	
+	if (renameat(cache, temporary, cache, name) < 0)
+	{
+		int error = errno;
+		unlinkat(cache, temporary, 0);
+		close(copy);
+		errno = error;
+		return -1;
+	}
+	
+	return copy;
+}
+
+int stext_open(int cache, int file, const struct stat* statbuf, struct stat* converted)
+{
+	char name[TEXT_NAME_SIZE];
+	
+	snprintf(name, sizeof(name), "%lx-%lx", (unsigned long)statbuf->st_dev, (unsigned long)statbuf->st_ino);
+	
+	int copy = openat(cache, name, O_RDONLY | O_CLOEXEC);
+	
+	if (copy >= 0)
+	{
+		if (fstat(copy, converted) == 0 && S_ISREG(converted->st_mode) && converted->st_mtim.tv_sec == statbuf->st_mtim.tv_sec && converted->st_mtim.tv_nsec == statbuf->st_mtim.tv_nsec)
+		{
+			return copy;
+		}
+		
+		close(copy);
+	}
+	else if (errno != ENOENT)
+	{
+		return -1;
+	}
+	
+	return create(cache, file, statbuf, name, converted);
+}
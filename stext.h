@@ -0,0 +1,21 @@
+#pragma once
+
+// struct stat
+#include <sys/stat.h>
+
+// *********************************************************************
+// RFC 1436 text files
+//
+// RFC 1436 wants text sent with CRLF line endings, lines starting with
+// a period escaped with another one, and a line with just a period at
+// the end. Doing that on the way out would mean giving up sendfile, so
+// instead each file is converted once into a directory of its own and
+// the converted copy is sent in its place. Copies are named for the
+// device and inode of the original and carry its modification time, so
+// an edited file is converted again the next time it's asked for.
+// *********************************************************************
+
+// Open the converted copy of the text file open as file with the stats in statbuf, kept in the directory open as cache,
+// converting it first if there's no up to date copy. Returns a file descriptor and fills in converted with its stats,
+// or -1 with errno set.
+int stext_open(int cache, int file, const struct stat* statbuf, struct stat* converted);
@@ -0,0 +1,367 @@
+// errno
+#include <errno.h>
+
+// malloc, free
+#include <stdlib.h>
+
+// stls functions
+#include "stls.h"
+
+#ifdef SGOPHER_TLS
+
+// TLS_TX_ZEROCOPY_RO
+#include <linux/tls.h>
+
+// SSL_*, ERR_*
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+// setsockopt, SOL_TLS
+#include <sys/socket.h>
+
+// *********************************************************************
+// Core definitions
+// *********************************************************************
+struct stls_context_t
+{
+	SSL_CTX* ctx;
+	bool zerocopy;
+};
+
+struct stls_t
+{
+	SSL* ssl;
+	int fd;
+	bool zerocopy;
+	
+	bool established;
+	bool ktls;
+	
+	// Length of a write that's waiting to be retried
+	size_t pending;
+};
+
+static char error[256];
+
+// *********************************************************************
+// Context
+// *********************************************************************
+bool stls_available()
+{
+	return true;
+}
+
+const char* stls_error()
+{
+	unsigned long code = ERR_peek_last_error();
+	
+	if (code == 0)
+	{
+		return "Unknown error";
+	}
+	
+	ERR_error_string_n(code, error, sizeof(error));
+	ERR_clear_error();
+	
+	return error;
+}
+
+struct stls_context_t* stls_context_create(const char* cert, const char* key, bool zerocopy)
+{
+	struct stls_context_t* context = malloc(sizeof(struct stls_context_t));
+	
+	if (context == NULL)
+	{
+		return NULL;
+	}
+	
+	context->ctx = SSL_CTX_new(TLS_server_method());
+	context->zerocopy = zerocopy;
+	
+	if (context->ctx == NULL)
+	{
+		free(context);
+		return NULL;
+	}
+	
+	// Writes are made a record at a time from wherever the data happens to be, so a retry can come from a different
+	// buffer as long as it has the same contents
+	SSL_CTX_set_mode(context->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+	SSL_CTX_set_options(context->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+	SSL_CTX_set_min_proto_version(context->ctx, TLS1_2_VERSION);
+	
+	// Every connection is a single request so resumption is worth a lot, and since the context is made before the workers
+	// are forked they all share the ticket keys. One ticket is plenty for one connection's worth of reuse.
+	SSL_CTX_set_num_tickets(context->ctx, 1);
+	
+	if (SSL_CTX_use_certificate_chain_file(context->ctx, cert) != 1 || SSL_CTX_use_PrivateKey_file(context->ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(context->ctx) != 1)
+	{
+		SSL_CTX_free(context->ctx);
+		free(context);
+		return NULL;
+	}
+	
+	return context;
+}
+
+void stls_context_destroy(struct stls_context_t* context)
+{
+	if (context == NULL)
+	{
+		return;
+	}
+	
+	SSL_CTX_free(context->ctx);
+	free(context);
+}
+
+// *********************************************************************
+// Sessions
+// *********************************************************************
+struct stls_t* stls_create(struct stls_context_t* context, int fd)
+{
+	struct stls_t* tls = malloc(sizeof(struct stls_t));
+	
+	if (tls == NULL)
+	{
+		return NULL;
+	}
+	
+	tls->ssl = SSL_new(context->ctx);
+	
+	if (tls->ssl == NULL || SSL_set_fd(tls->ssl, fd) != 1)
+	{
+		SSL_free(tls->ssl);
+		free(tls);
+		ERR_clear_error();
+		errno = ENOMEM;
+		return NULL;
+	}
+	
+	SSL_set_accept_state(tls->ssl);
+	
+	tls->fd = fd;
+	tls->zerocopy = context->zerocopy;
+	tls->established = false;
+	tls->ktls = false;
+	tls->pending = 0;
+	
+	return tls;
+}
+
+void stls_destroy(struct stls_t* tls)
+{
+	if (tls == NULL)
+	{
+		return;
+	}
+	
+	SSL_free(tls->ssl);
+	free(tls);
+}
+
+// Work out what an SSL call that didn't succeed is waiting on
+static enum stls_status_t stls_status(struct stls_t* tls, int retval)
+{
+	switch (SSL_get_error(tls->ssl, retval))
+	{
+	case SSL_ERROR_WANT_READ:
+		return STLS_WANT_READ;
+	case SSL_ERROR_WANT_WRITE:
+		return STLS_WANT_WRITE;
+	case SSL_ERROR_ZERO_RETURN:
+		return STLS_DONE;
+	default:
+		// Don't leave anything lying around in the error queue for the next connection to trip over
+		ERR_clear_error();
+		return STLS_ERROR;
+	}
+}
+
+enum stls_status_t stls_handshake(struct stls_t* tls)
+{
+	int retval = SSL_do_handshake(tls->ssl);
+	
+	if (retval != 1)
+	{
+		enum stls_status_t status = stls_status(tls, retval);
+		
+		return status == STLS_DONE ? STLS_ERROR : status;
+	}
+	
+	tls->established = true;
+	
+	// OpenSSL hands the keys to the kernel on its own if it can, so this is just finding out whether it did
+	tls->ktls = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) > 0;
+
+#ifdef TLS_TX_ZEROCOPY_RO
+	if (tls->ktls && tls->zerocopy)
+	{
+		int optval = 1;
+		
+		// Not every kernel with kernel TLS can do this, and it's only an optimization anyway
+		setsockopt(tls->fd, SOL_TLS, TLS_TX_ZEROCOPY_RO, &optval, sizeof(optval));
+	}
+#endif
+	
+	return STLS_DONE;
+}
+
+bool stls_established(const struct stls_t* tls)
+{
+	return tls->established;
+}
+
+bool stls_ktls(const struct stls_t* tls)
+{
+	return tls->ktls;
+}
+
+ssize_t stls_read(struct stls_t* tls, void* buffer, size_t length)
+{
+	size_t count;
+	
+	int retval = SSL_read_ex(tls->ssl, buffer, length, &count);
+	
+	if (retval == 1)
+	{
+		return (ssize_t)count;
+	}
+	
+	switch (stls_status(tls, retval))
+	{
+	case STLS_WANT_READ:
+	case STLS_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	case STLS_DONE:
+		return 0;
+	default:
+		errno = ECONNRESET;
+		return -1;
+	}
+}
+
+ssize_t stls_write(struct stls_t* tls, const void* buffer, size_t length)
+{
+	if (!tls->established)
+	{
+		errno = ENOTCONN;
+		return -1;
+	}
+	
+	size_t count;
+	
+	int retval = SSL_write_ex(tls->ssl, buffer, length, &count);
+	
+	if (retval == 1)
+	{
+		tls->pending = 0;
+		return (ssize_t)count;
+	}
+	
+	switch (stls_status(tls, retval))
+	{
+	case STLS_WANT_READ:
+	case STLS_WANT_WRITE:
+		// Partial writes go a record at a time, so that's the most that can be stuck in OpenSSL's buffer
+		tls->pending = length < STLS_RECORD_SIZE ? length : STLS_RECORD_SIZE;
+		errno = EAGAIN;
+		return -1;
+	default:
+		errno = EPIPE;
+		return -1;
+	}
+}
+
+size_t stls_pending(const struct stls_t* tls)
+{
+	return tls->pending;
+}
+
+void stls_shutdown(struct stls_t* tls)
+{
+	if (!tls->established)
+	{
+		return;
+	}
+	
+	// Only the one call, since there's no point waiting around for the client's close_notify when we're about to close
+	if (SSL_shutdown(tls->ssl) < 0)
+	{
+		ERR_clear_error();
+	}
+}
+
+#else
+
+// *********************************************************************
+// Stand-ins for a build without TLS, which never get as far as a session
+// *********************************************************************
+bool stls_available()
+{
+	return false;
+}
+
+const char* stls_error()
+{
+	return "Built without TLS support";
+}
+
+struct stls_context_t* stls_context_create(const char* cert, const char* key, bool zerocopy)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+
+void stls_context_destroy(struct stls_context_t* context)
+{
+}
+
+struct stls_t* stls_create(struct stls_context_t* context, int fd)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+
+void stls_destroy(struct stls_t* tls)
+{
+}
+
+enum stls_status_t stls_handshake(struct stls_t* tls)
+{
+	return STLS_ERROR;
+}
+
+bool stls_established(const struct stls_t* tls)
+{
+	return false;
+}
+
+bool stls_ktls(const struct stls_t* tls)
+{
+	return false;
+}
+
+ssize_t stls_read(struct stls_t* tls, void* buffer, size_t length)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t stls_write(struct stls_t* tls, const void* buffer, size_t length)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+size_t stls_pending(const struct stls_t* tls)
+{
+	return 0;
+}
+
+void stls_shutdown(struct stls_t* tls)
+{
+}
+
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+
+// bool
+#include <stdbool.h>
+
+// size_t, ssize_t
+#include <sys/types.h>
+
+// *********************************************************************
+// TLS sessions
+//
+// A thin layer over OpenSSL for the handful of things the server needs.
+// Once the handshake is done the session is handed over to kernel TLS
+// if the kernel and the cipher allow it, after which anything written
+// to the socket directly, including by sendfile and CGI programs, is
+// encrypted by the kernel. Otherwise reads and writes have to go
+// through here. Without SGOPHER_TLS defined, every attempt to set up a
+// context fails, so the rest of the server doesn't need to care.
+// *********************************************************************
+
+// Plaintext in one TLS record, and so the most a write through here sends at once
+#define STLS_RECORD_SIZE 16384
+
+// Opaque structures for the shared configuration and for each connection
+struct stls_context_t;
+struct stls_t;
+
+enum stls_status_t
+{
+	STLS_DONE,
+	STLS_WANT_READ,
+	STLS_WANT_WRITE,
+	STLS_ERROR
+};
+
+// Whether TLS support was built in at all
+bool stls_available();
+
+// Description of the last thing that went wrong setting up a context
+const char* stls_error();
+
+// Lifecycle management for the context, which holds the certificate and is shared by every session made from it.
+// Zero-copy has the kernel encrypt files straight out of the page cache, which is only safe if they aren't modified
+// while they're being sent.
+struct stls_context_t* stls_context_create(const char* cert, const char* key, bool zerocopy);
+void stls_context_destroy(struct stls_context_t* context);
+
+// Lifecycle management for a session on a connected, non-blocking socket, which stays the caller's to close
+struct stls_t* stls_create(struct stls_context_t* context, int fd);
+void stls_destroy(struct stls_t* tls);
+
+// Carry on with the handshake, returning what it's waiting on if it isn't done
+enum stls_status_t stls_handshake(struct stls_t* tls);
+
+// Whether the handshake is done, and whether the kernel has taken over sending since then
+bool stls_established(const struct stls_t* tls);
+bool stls_ktls(const struct stls_t* tls);
+
+// Read and write like read and send, with errno set to EAGAIN when the socket isn't ready. A write that fails with
+// EAGAIN has to be retried with the same data, and at least as much of it as stls_pending says.
+ssize_t stls_read(struct stls_t* tls, void* buffer, size_t length);
+ssize_t stls_write(struct stls_t* tls, const void* buffer, size_t length);
+size_t stls_pending(const struct stls_t* tls);
+
+// Tell the other end that the response is complete, so it can tell that apart from the connection being cut off
+void stls_shutdown(struct stls_t* tls);
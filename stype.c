@@ -0,0 +1,101 @@
+// bsearch
+#include <stdlib.h>
+
+// strcmp, strrchr
+#include <string.h>
+
+// S_ISREG, S_ISDIR, S_IROTH, S_IXOTH
+#include <sys/stat.h>
+
+// stype_guess
+#include "stype.h"
+
+// Mapping of extension to selector type
+// Not comprehensive but at least an assortment of common and period-accurate stuff
+// This must be pre-sorted according to strcmp rules for bsearch
+// Default for a non-executable, non-directory file is 9 so anything of that type should not be here
+struct ext_entry_t
+{
+	const char* ext;
+	const char type;
+};
+
+static const struct ext_entry_t ext_table[] =
+{
+	{"bmp", 'I'},
+	{"c", '0'},
+	{"cpp", '0'},
+	{"gif", 'g'},
+	{"h", '0'},
+	{"htm", 'h'},
+	{"html", 'h'},
+	{"jpeg", 'I'},
+	{"jpg", 'I'},
+	{"mp3", 's'},
+	{"ogg", 's'},
+	{"pcx", 'I'},
+	{"png", 'I'},
+	{"tif", 'I'},
+	{"tiff", 'I'},
+	{"txt", '0'},
+	{"wav", 's'}
+};
+
+// Comparison function for the file extension list
+static int compare_ext_entry(const void* pa, const void* pb)
+{
+	const struct ext_entry_t* entry1 = pa;
+	const struct ext_entry_t* entry2 = pb;
+	
+	return strcmp(entry1->ext, entry2->ext);
+}
+
+char stype_guess(const char* filename, mode_t mode)
+{
+	if (!(mode & S_IROTH))
+	{
+		return 0;
+	}
+	
+	if (S_ISDIR(mode))
+	{
+		// Treat directories as being submenus
+		// You did put a gophermap in it, right?
+		return mode & S_IXOTH ? '1' : 0;
+	}
+	
+	if (!S_ISREG(mode))
+	{
+		// Skip other types of files
+		return 0;
+	}
+	
+	// Treat executables as a query menu
+	// This is probably as good a guess as any, but if it's meant to be downloaded it shouldn't be +x
+	if (mode & S_IXOTH)
+	{
+		return '7';
+	}
+	
+	// If the file has an extension, inspect it for further context
+	const char* extension = strrchr(filename, '.');
+	
+	if (extension != NULL)
+	{
+		// Search the table for a match, past the period
+		const struct ext_entry_t key =
+		{
+			.ext = extension + 1
+		};
+		
+		const struct ext_entry_t* found = bsearch(&key, ext_table, sizeof(ext_table)/sizeof(struct ext_entry_t), sizeof(struct ext_entry_t), compare_ext_entry);
+		
+		if (found != NULL)
+		{
+			return found->type;
+		}
+	}
+	
+	// Default behavior for regular non-executable files with no or an unknown extension is to download as a binary file
+	return '9';
+}
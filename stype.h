@@ -0,0 +1,8 @@
+#pragma once
+
+// mode_t
+#include <sys/types.h>
+
+// Guess the menu type for a file in a directory listing from its mode and extension, or 0 if it shouldn't be listed
+// because it couldn't be served: it has to be world-readable, and a directory has to be world-searchable too
+char stype_guess(const char* filename, mode_t mode);